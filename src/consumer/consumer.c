@@ -19,14 +19,20 @@
 
 #include "consumer.h"
 #include "../shared/buffer.h"
-
-#define ERROR_LIMIT 10 /**< Number of sdcard writes before notifying server */
+#include "../shared/crc32c.h"
+#include "../shared/fault.h"
+#include "../shared/spool.h"
+#include "../shared/trace.h"
 
 static size_t get_read_size(Consumer *c);
+static uint64_t first_id();
+static void consumer_configure(Consumer *c);
+static size_t write_data(void* buffer, size_t size, size_t nmemb, void* userp);
 static int notify_server(Consumer *c);
 
-Consumer* consumer_init(Buffer *b, char *server_url, char *data_source,
-    char *ext_dump, int verbose) {
+Consumer* consumer_init(Buffer *b, Occupancy *occ, Config *config,
+    SpoolStats *spool_stats, char *data_source, char *ext_dump,
+    Decimator *decimator, Recorder *recorder, int verbose) {
   Consumer *c;
   int fd;
 
@@ -40,17 +46,29 @@ Consumer* consumer_init(Buffer *b, char *server_url, char *data_source,
   c = (Consumer*) malloc(sizeof(struct consumer_st));
 
   c->buffers = b;
+  c->occupancy = occ;
+  c->shared_config = config;
+  config_read(config, &c->config);
   c->err_count = 0;
   c->data_fd = fd;
+  c->decimator = decimator;
+  c->recorder = recorder;
   c->verbose = verbose;
   c->buf_idx = 0;
-  c->server_url = server_url;
+  c->next_id = first_id();
+  c->staging = (char*) malloc(CONFIG_READ_MAX); /* the read size may grow */
 
   /* +2 for optional slash */
   c->dump_path = (char*) malloc(strlen(ext_dump) + 2);
   strcpy(c->dump_path, ext_dump);
   if (ext_dump[strlen(ext_dump) - 1] != '/')
     strcat(c->dump_path, "/");
+  if ((c->spool = spool_init(c->dump_path, spool_stats)) == NULL ) {
+    fprintf(stderr, "[C] spool: init failed\n");
+    return NULL ;
+  }
+  spool_configure(c->spool, c->config.spool_sync, c->config.spool_sync_ms,
+      c->config.spool_group);
 
   /* Curl initialization */
   CURL* curl;
@@ -63,10 +81,13 @@ Consumer* consumer_init(Buffer *b, char *server_url, char *data_source,
     return NULL ;
   }
 
-  curl_easy_setopt(curl, CURLOPT_URL, c->server_url);
+  curl_easy_setopt(curl, CURLOPT_URL, c->config.server);
   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
   c->curl = curl;
 
+  if (verbose && decimator != NULL )
+    printf("[C] Decimating by %d with %d taps\n", decimator->factor,
+        decimator->taps);
   if (verbose)
     printf("[C] Consumer initialized!\n");
 
@@ -76,99 +97,138 @@ Consumer* consumer_init(Buffer *b, char *server_url, char *data_source,
 int consumer_process(Consumer *c) {
   ssize_t amount_read;
   size_t amount_to_read = get_read_size(c);
-  char* tmp_buf = (char*) malloc(amount_to_read);
+  char* tmp_buf = c->staging;
+
+  if (config_changed(c->shared_config, &c->config)) {
+    consumer_configure(c);
+    amount_to_read = get_read_size(c);
+  }
+  spool_tick(c->spool);
 
   Buffer* cur_buf = &c->buffers[c->buf_idx];
+  /* A new capacity applies from the next buffer started */
+  if (cur_buf->size == 0)
+    cur_buf->capacity = c->config.capacity;
   size_t buf_remaining = cur_buf->capacity - cur_buf->size;
   char* dest = cur_buf->data + cur_buf->size;
-  int verbose = c->verbose;
+  size_t held = c->buffers[0].size + c->buffers[1].size;
 
   /* Step 1: read from data source */
   /* TODO: Switch to USB tty when figured out */
-  if (verbose)
-    printf("[C] Reading %zu bytes\n", amount_to_read);
-
   while ((amount_read = read(c->data_fd, tmp_buf, amount_to_read)) < 0) {
-    if (errno == EAGAIN || errno == EINTR)
+    if (errno == EAGAIN)
       continue;
+    if (errno == EINTR)
+      return 0; /* the driver may have a stop or reload to act on */
 
     perror("read");
-    free(tmp_buf);
     return -1;
   }
+  TRACE(TRACE_READ, amount_read, cur_buf->size);
+
+  /* Capture exactly what the source gave us, before any processing */
+  if (c->recorder != NULL
+      && recorder_add(c->recorder, tmp_buf, amount_read) < 0) {
+    fprintf(stderr, "[C] Capture write failed, capture stopped\n");
+    recorder_cleanup(&c->recorder);
+  }
+
+  /* Decimate before buffering, so everything downstream sees less data */
+  if (c->decimator != NULL )
+    amount_read = decimator_process(c->decimator, tmp_buf, amount_read);
+  size_t added = amount_read;
 
   /* Step 2: check if buffer can fit */
   if (amount_read <= buf_remaining) {
     /* Can fit? Fill buffer */
+    if (cur_buf->size == 0 && amount_read > 0)
+      cur_buf->id = c->next_id++; /* a new buffer, or one the relay emptied */
     memcpy(dest, tmp_buf, amount_read);
+    /* The relay may have emptied this buffer since the last read */
+    cur_buf->crc = crc32c(cur_buf->size == 0 ? 0 : cur_buf->crc, tmp_buf,
+        amount_read);
+    /* The data and checksum must be visible before the buffer is full */
+    __sync_synchronize();
     cur_buf->size += amount_read;
   } else {
     if (buf_remaining > 0) {
       /* Partially fits? Fill buffer then... */
       amount_read -= buf_remaining;
       memcpy(dest, tmp_buf, buf_remaining);
+      cur_buf->crc = crc32c(cur_buf->size == 0 ? 0 : cur_buf->crc, tmp_buf,
+          buf_remaining);
+      FAULT_DELAY(FAULT_FILL_DELAY);
+      __sync_synchronize();
       cur_buf->size = cur_buf->capacity; /* buffer is now full */
+      tmp_buf += buf_remaining; /* the rest starts the next buffer */
     }
 
-    if (verbose)
-      printf("[C] Switching buffers\n");
-
     /* Check if other buffer is empty */
     cur_buf = &c->buffers[c->buf_idx ^ 1];
 
     if (cur_buf->size == cur_buf->capacity) {
-      int dump_fd;
-      struct timeval tv;
-      struct tm *timeinfo;
-      char fmt_str[80];
-      char time_str[80];
       /* Still full. Write cur buf to SD, incremement error counter */
-      fprintf(stderr,
-          "[C] WARNING: Buffer %d still full! Dumping current buffer\n",
-          c->buf_idx ^ 1);
-
-      gettimeofday(&tv, NULL );
-      timeinfo = localtime(&tv.tv_sec);
-      strftime(fmt_str, sizeof fmt_str, "client-dump_%s%%06u.dat", timeinfo);
-      snprintf(time_str, sizeof time_str, fmt_str, tv.tv_usec);
-      char *dump_file = (char*) malloc(
-          strlen(c->dump_path) + strlen(time_str) + 1);
-      strcpy(dump_file, c->dump_path);
-      strcat(dump_file, time_str);
-      if ((dump_fd = open(dump_file, O_CREAT | O_EXCL | O_WRONLY)) < 0) {
-        fprintf(stderr, "[C] ERROR: Error writing to \"%s\"\n", dump_file);
-        perror("[C] ");
+      if (c->buffers[c->buf_idx].size != c->buffers[c->buf_idx].capacity) {
+        /* The relay took it after all, so nothing is dumped */
+      } else {
+        fprintf(stderr,
+            "[C] WARNING: Buffer %d still full! Dumping current buffer\n",
+            c->buf_idx ^ 1);
+        if (!spool_has_room(c->occupancy->spool_files,
+            c->config.spool_quota_mb)) {
+          fprintf(stderr, "[C] WARNING: Spool over quota! Dropping buffer\n");
+          __sync_fetch_and_add(&c->occupancy->dropped, 1);
+        } else if (spool_write(c->spool, &c->buffers[c->buf_idx]) < 0) {
+          /* Stopping would lose every buffer after this one as well */
+          fprintf(stderr,
+              "[C] ERROR: Error writing to \"%s\", dropping buffer\n",
+              c->dump_path);
+          perror("[C] write");
+          __sync_fetch_and_add(&c->occupancy->dropped, 1);
+        } else {
+          __sync_fetch_and_add(&c->occupancy->dumps, 1);
+          __sync_fetch_and_add(&c->occupancy->spool_files, 1);
+        }
+        ++c->err_count;
+        TRACE(TRACE_DUMP, c->buf_idx, c->err_count);
+        if (c->err_count >= c->config.error_limit) {
+          fprintf(stderr, "[C] Error limit reached!\n");
+          if (notify_server(c) == 0)
+            c->err_count = 0;
+        }
       }
 
-      while (write(dump_fd, &c->buffers[c->buf_idx], sizeof(Buffer)) < 0) {
-        if (errno == EAGAIN || errno == EINTR)
-          continue;
-
-        perror("[C] write");
-        close(dump_fd);
-        free(tmp_buf);
-        return -1;
-      }
-      close(dump_fd);
-      c->buffers[c->buf_idx].size = 0;
-      ++c->err_count;
-
-      if (c->err_count >= ERROR_LIMIT) {
-        fprintf(stderr, "[C] Error limit reached!\n");
-        if (notify_server(c) == 0)
-          c->err_count = 0;
-      }
+      /* The rest of the read starts the dumped buffer afresh */
+      cur_buf = &c->buffers[c->buf_idx];
+      cur_buf->size = 0;
+      cur_buf->capacity = c->config.capacity;
+      cur_buf->id = c->next_id++;
+      /* A relay copying it meanwhile sees the new id and lets it go */
+      __sync_synchronize();
+      memcpy(cur_buf->data, tmp_buf, amount_read);
+      cur_buf->crc = crc32c(0, tmp_buf, amount_read);
+      __sync_synchronize();
+      cur_buf->size = amount_read;
     } else {
       /* Empty. Switch buffers and begin filling. */
-      if (verbose)
-        printf("[C] Fits in buffer %d\n", c->buf_idx ^ 1);
       c->buf_idx ^= 1;
+      TRACE(TRACE_SWITCH, c->buf_idx, amount_read);
+      cur_buf->capacity = c->config.capacity;
+      cur_buf->id = c->next_id++;
       dest = cur_buf->data;
       memcpy(dest, tmp_buf, amount_read);
+      cur_buf->crc = crc32c(0, tmp_buf, amount_read);
       cur_buf->size = amount_read;
     }
   }
-  free(tmp_buf);
+
+  if (occupancy_update(c->occupancy, held,
+      c->buffers[0].size + c->buffers[1].size, added,
+      c->buffers[0].capacity + c->buffers[1].capacity)) {
+    fprintf(stderr, "[C] WARNING: Buffers projected to overflow in %d ms\n",
+        c->occupancy->overflow_ms);
+    TRACE(TRACE_OVERFLOW_WARN, c->occupancy->overflow_ms, c->occupancy->held);
+  }
   return 0;
 }
 
@@ -183,7 +243,17 @@ void consumer_cleanup(Consumer **c) {
 
   curl_easy_cleanup((*c)->curl);
   curl_global_cleanup();
+  spool_cleanup(&(*c)->spool);
   free((*c)->dump_path);
+  free((*c)->staging);
+  if ((*c)->decimator != NULL )
+    decimator_cleanup(&(*c)->decimator);
+  if ((*c)->recorder != NULL ) {
+    if ((*c)->verbose)
+      printf("[C] Captured %lu reads, %llu bytes\n", (*c)->recorder->records,
+          (*c)->recorder->bytes);
+    recorder_cleanup(&(*c)->recorder);
+  }
 
   if ((*c)->verbose)
     printf("[C] Consumer destroyed!\n");
@@ -197,7 +267,38 @@ void consumer_cleanup(Consumer **c) {
  * @param c the consumer handle to look up the data source
  */
 static size_t get_read_size(Consumer *c) {
-  return 1024;
+  return c->config.read_size;
+}
+
+/**
+ * Picks the id of the first buffer of this run: a random number in the upper
+ * 32 bits, from the kernel if it will give one, and a count of 1 below.
+ */
+static uint64_t first_id() {
+  struct timeval tv;
+  uint32_t run = 0;
+  int fd;
+
+  if ((fd = open("/dev/urandom", O_RDONLY)) >= 0) {
+    if (read(fd, &run, sizeof run) != sizeof run)
+      run = 0;
+    close(fd);
+  }
+  if (run == 0) {
+    gettimeofday(&tv, NULL );
+    run = (uint32_t) (tv.tv_sec ^ tv.tv_usec << 12 ^ getpid() << 20);
+  }
+  return (uint64_t) run << 32 | 1;
+}
+
+/** Applies a changed configuration. */
+static void consumer_configure(Consumer *c) {
+  config_read(c->shared_config, &c->config);
+  curl_easy_setopt(c->curl, CURLOPT_URL, c->config.server);
+  spool_configure(c->spool, c->config.spool_sync, c->config.spool_sync_ms,
+      c->config.spool_group);
+  if (c->verbose)
+    printf("[C] Configuration %u applied\n", c->config.generation / 2);
 }
 
 /** Notifies the server that the consumer had to dump a buffer. */
@@ -210,3 +311,8 @@ static int notify_server(Consumer *c) {
   }
   return 0;
 }
+
+/** Discards the server's reply to a notify. */
+static size_t write_data(void* buffer, size_t size, size_t nmemb, void* userp) {
+  return size * nmemb; /* Do not print to stdout */
+}
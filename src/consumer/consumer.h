@@ -22,16 +22,30 @@
 
 /* This is the public header file, all interface related details belong here */
 
+#include <curl/curl.h>
+
 #include "../shared/buffer.h"
+#include "../shared/config.h"
+#include "../shared/occupancy.h"
+#include "../shared/spool.h"
+#include "decimate.h"
+#include "recorder.h"
 
 struct consumer_st {
   /* Any operational parameters go here */
   Buffer *buffers; /**< A pointer to two buffers that make the double buffer */
-  CURL *curl; /**< Server notify curl */
-  char *server_url;
+  Occupancy *occupancy; /**< Telemetry of the double buffer, shared */
+  Config *shared_config; /**< The live configuration, shared */
+  Config config; /**< The configuration being applied */
+  CURL *curl; /**< Server notify curl, pointed at the configured server */
   char *dump_path; /**< The path to the external buffer dump */
+  Spool *spool; /**< Writes buffers to dump files in dump_path */
   int buf_idx; /**< The current buffer in use by the consumer */
+  uint64_t next_id; /**< Id of the next buffer started (see buffer.h) */
   int data_fd; /**< A file descriptor for the source of data */
+  char *staging; /**< Where each read lands, allocated once */
+  Decimator *decimator; /**< Applied to data before buffering, or NULL */
+  Recorder *recorder; /**< Captures the raw data read, or NULL */
   int err_count; /**< A count of the times consumer has written to ext_fd */
   int verbose; /**< A flag to enable verbose console output */
 };
@@ -48,10 +62,20 @@ typedef struct consumer_st Consumer;
  * Returns NULL in the event of initialization failure.
  *
  * @param b A pointer to the shared double buffer.
+ * @param occ The shared occupancy telemetry of the double buffer, which the
+ * consumer keeps up to date.
+ * @param config The shared configuration, whose server is notified of
+ * dumps. Changes to it are applied at the start of the next
+ * #consumer_process.
+ * @param spool_stats The shared counts of spool writes and flushes.
  * @param data_source A string of a valid URI to the source of data for the
  * consumer to read from. 
  * @param ext_dump A string of a valid URI to the location the consumer will
  * use in the case that it needs to dump one or more buffers
+ * @param decimator A decimator to apply to the data before it is buffered, or
+ * NULL to buffer data at the full rate. The consumer takes ownership of it.
+ * @param recorder A recorder to capture the raw data read into, or NULL. The
+ * consumer takes ownership of it.
  * @param verbose Enable verbose output from consumer
  *
  * @return A malloc'd handle to be used for all future calls to to the consumer
@@ -60,8 +84,9 @@ typedef struct consumer_st Consumer;
  * caller's responsibility to free the Consumer handler by calling
  * #consumer_cleanup.
  */
-Consumer* consumer_init(Buffer* b, char *server_url, char* data_source,
-    char* ext_dump, int verbose);
+Consumer* consumer_init(Buffer* b, Occupancy *occ, Config *config,
+    SpoolStats *spool_stats, char* data_source, char* ext_dump,
+    Decimator *decimator, Recorder *recorder, int verbose);
 
 /**
  * Perform one unit of work.
@@ -78,7 +103,9 @@ Consumer* consumer_init(Buffer* b, char *server_url, char* data_source,
  * consumer_cleanup(&handle);
  * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
  * Only performing one "unit" of work allows for the driver to interrupt the
- * process for whatever reason, or cleanup in the event of a failure.
+ * process for whatever reason, or cleanup in the event of a failure. A read
+ * interrupted by a signal returns having done nothing, so that a source that
+ * has gone quiet does not hold up a stop.
  * 
  * @param handle The handle containing all necessary configuration to perform
  * the consumer's task. Caller must call #consumer_init before this function.
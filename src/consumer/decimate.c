@@ -0,0 +1,184 @@
+/**
+ * @file decimate.c
+ * Implementation of the consumer's decimation stage
+ * @see decimate.h
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__SSE2__) && !defined(DECIMATE_SCALAR)
+#include <emmintrin.h>
+#endif
+
+#include "decimate.h"
+#include "../shared/config.h"
+
+/** Input samples a read can hold, counting one completed by a pending byte */
+#define BLOCK_SAMPLES (CONFIG_READ_MAX / sizeof(int16_t) + 1)
+
+static void design_lowpass(int factor, int taps, double *coef);
+static int32_t dot(const int16_t *coef, const int16_t *x, int n);
+
+/**
+ * Creates a decimator
+ * @see decimate.h
+ */
+Decimator* decimator_init(int factor, const double *coef, int taps) {
+  double design[DECIMATE_TAPS_MAX];
+  Decimator *d;
+  long gain = 0;
+  int k;
+
+  /* Odd, so the design is symmetric about its middle tap */
+  if (coef == NULL && taps == 0)
+    taps = factor * DECIMATE_TAPS_PER_FACTOR + 1 < DECIMATE_TAPS_MAX ?
+        factor * DECIMATE_TAPS_PER_FACTOR + 1 : DECIMATE_TAPS_MAX - 1;
+  if (factor < 1 || factor > DECIMATE_FACTOR_MAX || taps < 1
+      || taps > DECIMATE_TAPS_MAX)
+    return NULL ;
+  if (coef == NULL ) {
+    design_lowpass(factor, taps, design);
+    coef = design;
+  }
+
+  if ((d = (Decimator*) malloc(sizeof(Decimator))) == NULL )
+    return NULL ;
+  d->factor = factor;
+  d->taps = taps;
+  d->padded = (taps + 7) & ~7;
+  d->skip = 0;
+  d->pending = -1;
+  d->coef = (int16_t*) calloc(d->padded, sizeof(int16_t));
+  /* Sized for the largest read, so that no read size a reload sets makes
+   * the consumer allocate */
+  d->hist = (int16_t*) calloc(d->padded - 1 + BLOCK_SAMPLES, sizeof(int16_t));
+  if (d->coef == NULL || d->hist == NULL ) {
+    decimator_cleanup(&d);
+    return NULL ;
+  }
+
+  /* Reversed so that the newest sample meets the first tap */
+  for (k = 0; k < taps; ++k) {
+    long q = lrint(coef[k] * 32768);
+    if (q > 32767)
+      q = 32767;
+    else if (q < -32768)
+      q = -32768;
+    d->coef[d->padded - 1 - k] = q;
+    gain += q < 0 ? -q : q;
+  }
+  /* Keeps the worst case sum of products within the 32-bit accumulator */
+  if (gain >= 65536) {
+    fprintf(stderr, "[C] Decimation taps have too much gain\n");
+    decimator_cleanup(&d);
+    return NULL ;
+  }
+  return d;
+}
+
+/**
+ * Loads filter taps from a file
+ * @see decimate.h
+ */
+int decimator_load_taps(const char *path, double *coef) {
+  FILE *f;
+  int taps = 0;
+
+  if ((f = fopen(path, "r")) == NULL )
+    return -1;
+  while (taps < DECIMATE_TAPS_MAX && fscanf(f, "%lf", &coef[taps]) == 1)
+    ++taps;
+  fclose(f);
+  return taps > 0 ? taps : -1;
+}
+
+/**
+ * Decimates a block of the input stream
+ * @see decimate.h
+ */
+size_t decimator_process(Decimator *d, char *data, size_t len) {
+  const unsigned char *in = (const unsigned char*) data;
+  size_t n = 0, i = 0, k, out = 0;
+  int16_t *x;
+
+  x = d->hist + d->padded - 1;
+
+  /* Unpack the input behind the history before any output is written */
+  if (d->pending >= 0 && len > 0) {
+    x[n++] = (int16_t) (d->pending | in[i++] << 8);
+    d->pending = -1;
+  }
+  for (; i + 1 < len; i += 2)
+    x[n++] = (int16_t) (in[i] | in[i + 1] << 8);
+  if (i < len)
+    d->pending = in[i];
+
+  for (k = d->skip; k < n; k += d->factor) {
+    int32_t acc = dot(d->coef, d->hist + k, d->padded);
+    int32_t y = (acc + (1 << 14)) >> 15;
+    if (y > 32767)
+      y = 32767;
+    else if (y < -32768)
+      y = -32768;
+    data[out++] = y & 0xff;
+    data[out++] = (y >> 8) & 0xff;
+  }
+  d->skip = k - n;
+
+  memmove(d->hist, d->hist + n, (d->padded - 1) * sizeof(int16_t));
+  return out;
+}
+
+/**
+ * Frees the decimator
+ * @see decimate.h
+ */
+void decimator_cleanup(Decimator **d) {
+  free((*d)->coef);
+  free((*d)->hist);
+  free(*d);
+  *d = NULL;
+}
+
+/**
+ * Designs a Hamming windowed sinc low-pass with unity gain at DC, cutting off
+ * at the Nyquist frequency of the decimated stream.
+ */
+static void design_lowpass(int factor, int taps, double *coef) {
+  double mid = (taps - 1) / 2.0;
+  double sum = 0;
+  int k;
+
+  for (k = 0; k < taps; ++k) {
+    double t = (k - mid) / factor;
+    double w = taps == 1 ? 1 : 0.54 - 0.46 * cos(2 * M_PI * k / (taps - 1));
+    coef[k] = (t == 0 ? 1 : sin(M_PI * t) / (M_PI * t)) * w;
+    sum += coef[k];
+  }
+  for (k = 0; k < taps; ++k)
+    coef[k] /= sum;
+}
+
+/** Dot product of n Q15 taps with n samples; n is a multiple of eight. */
+static int32_t dot(const int16_t *coef, const int16_t *x, int n) {
+  int32_t acc = 0;
+  int j;
+#if defined(__SSE2__) && !defined(DECIMATE_SCALAR)
+  __m128i sum = _mm_setzero_si128();
+  for (j = 0; j < n; j += 8)
+    sum = _mm_add_epi32(sum,
+        _mm_madd_epi16(_mm_loadu_si128((const __m128i*) (x + j)),
+            _mm_loadu_si128((const __m128i*) (coef + j))));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+  acc = _mm_cvtsi128_si32(sum);
+#else
+  for (j = 0; j < n; j += 2)
+    acc += (int32_t) coef[j] * x[j] + (int32_t) coef[j + 1] * x[j + 1];
+#endif
+  return acc;
+}
@@ -0,0 +1,96 @@
+/**
+ * @file decimate.h
+ * Decimation stage applied by the consumer before data enters the buffers
+ *
+ * Some deployments only need a fraction of the Firefly's sample rate. With a
+ * decimator configured, the consumer low-pass filters the stream and keeps
+ * every factor'th sample before copying it into the shared buffer, so buffer
+ * occupancy, SD card dumps and upload bytes all shrink by the same factor.
+ *
+ * The filter is a polyphase FIR: only the outputs that are kept are computed,
+ * each as one dot product of the taps with the most recent input samples.
+ * Arithmetic is fixed-point, with Q15 taps and a 32-bit accumulator, which
+ * suits the Carambola's MIPS core; on x86 builds the dot product uses SSE2
+ * and gives the same results, unless DECIMATE_SCALAR is defined so that the
+ * tests can run the board's code. The filter history, the position of the next
+ * output and any half-read sample are carried across calls, so the output is
+ * the same however the input is split into reads.
+ *
+ * Samples are taken to be little-endian signed 16-bit values.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#ifndef _CONSUMER_DECIMATE_H
+#define _CONSUMER_DECIMATE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/** Largest supported decimation factor */
+#define DECIMATE_FACTOR_MAX 64
+/** Largest supported number of taps */
+#define DECIMATE_TAPS_MAX 512
+/** Taps per decimation factor of the default low-pass design */
+#define DECIMATE_TAPS_PER_FACTOR 8
+
+/**
+ * The state of a decimation filter.
+ */
+struct decimator_st {
+  int factor; /**< One output is kept per factor input samples */
+  int taps; /**< Number of filter taps */
+  int padded; /**< taps rounded up to a multiple of eight */
+  /** Q15 taps in reverse order, zero padded to padded taps */
+  int16_t *coef;
+  /** The last padded - 1 input samples followed by room for the samples of
+   * the largest read, #CONFIG_READ_MAX bytes and a pending byte */
+  int16_t *hist;
+  size_t skip; /**< Input samples to take before the next output */
+  int pending; /**< The low byte of a half-read sample, or -1 */
+};
+
+typedef struct decimator_st Decimator;
+
+/**
+ * Creates a decimator.
+ *
+ * @param factor The decimation factor, from 1 to #DECIMATE_FACTOR_MAX
+ * @param coef The filter taps, or NULL for a Hamming windowed sinc low-pass
+ * with a cutoff at the decimated Nyquist frequency
+ * @param taps The number of taps, up to #DECIMATE_TAPS_MAX, or 0 for
+ * factor * #DECIMATE_TAPS_PER_FACTOR + 1, or #DECIMATE_TAPS_MAX - 1 if that
+ * is fewer, when coef is NULL. The absolute values of the taps must sum to
+ * less than 2.
+ * @return A malloc'd handle to be freed with #decimator_cleanup, or NULL if
+ * the parameters are out of range
+ */
+Decimator* decimator_init(int factor, const double *coef, int taps);
+
+/**
+ * Loads filter taps from a file of whitespace separated numbers.
+ *
+ * @param path The file to read
+ * @param coef Where to store the taps; must hold #DECIMATE_TAPS_MAX values
+ * @return The number of taps read, or -1 if the file could not be read or
+ * holds no taps
+ */
+int decimator_load_taps(const char *path, double *coef);
+
+/**
+ * Decimates a block of the input stream in place.
+ *
+ * @param d The decimator
+ * @param data The input bytes, overwritten with the output bytes
+ * @param len The number of input bytes, at most #CONFIG_READ_MAX
+ * @return The number of output bytes, always a whole number of samples
+ */
+size_t decimator_process(Decimator *d, char *data, size_t len);
+
+/**
+ * Frees the decimator. The specified handle will be NULL after this function
+ * returns.
+ */
+void decimator_cleanup(Decimator **d);
+
+#endif
@@ -0,0 +1,115 @@
+/**
+ * @file recorder.c
+ * Implementation of input stream capture
+ * @see recorder.h
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "recorder.h"
+
+static size_t put_varint(unsigned char *out, uint64_t v);
+static void put_le(unsigned char *out, uint64_t v, int bytes);
+
+/**
+ * Creates a capture file
+ * @see recorder.h
+ */
+Recorder* recorder_init(const char *path) {
+  unsigned char hdr[sizeof(CaptureHeader)];
+  Recorder *r;
+
+  if ((r = (Recorder*) malloc(sizeof(Recorder))) == NULL )
+    return NULL ;
+  if ((r->out = fopen(path, "wb")) == NULL ) {
+    free(r);
+    return NULL ;
+  }
+  setvbuf(r->out, NULL, _IOFBF, RECORDER_BUFFER);
+
+  put_le(hdr, CAPTURE_MAGIC, 4);
+  put_le(hdr + 4, CAPTURE_VERSION, 2);
+  put_le(hdr + 6, 0, 2);
+  put_le(hdr + 8, time(NULL ), 8);
+  if (fwrite(hdr, sizeof hdr, 1, r->out) != 1) {
+    fclose(r->out);
+    free(r);
+    return NULL ;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &r->last);
+  r->flushed = r->last.tv_sec;
+  r->records = 0;
+  r->bytes = 0;
+  return r;
+}
+
+/**
+ * Records one read
+ * @see recorder.h
+ */
+int recorder_add(Recorder *r, const char *data, size_t len) {
+  unsigned char prefix[2 * CAPTURE_VARINT_MAX];
+  struct timespec now;
+  int64_t delta;
+  size_t n;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (len > 0) {
+    delta = (int64_t) (now.tv_sec - r->last.tv_sec) * 1000000000
+        + (now.tv_nsec - r->last.tv_nsec);
+    n = put_varint(prefix, delta / 1000);
+    n += put_varint(prefix + n, len);
+    /* Advance by whole microseconds so rounding does not accumulate */
+    r->last = now;
+    r->last.tv_nsec -= delta % 1000;
+    if (r->last.tv_nsec < 0) {
+      r->last.tv_nsec += 1000000000;
+      --r->last.tv_sec;
+    }
+
+    if (fwrite(prefix, 1, n, r->out) != n
+        || fwrite(data, 1, len, r->out) != len)
+      return -1;
+    ++r->records;
+    r->bytes += len;
+  }
+
+  if (now.tv_sec != r->flushed) {
+    r->flushed = now.tv_sec;
+    if (fflush(r->out) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+/**
+ * Closes the capture file
+ * @see recorder.h
+ */
+void recorder_cleanup(Recorder **r) {
+  fclose((*r)->out);
+  free(*r);
+  *r = NULL;
+}
+
+/** Writes v as a varint, returning the number of bytes written. */
+static size_t put_varint(unsigned char *out, uint64_t v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    out[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  out[n++] = v;
+  return n;
+}
+
+/** Writes the low bytes of v, little-endian. */
+static void put_le(unsigned char *out, uint64_t v, int bytes) {
+  int i;
+  for (i = 0; i < bytes; ++i)
+    out[i] = (v >> (8 * i)) & 0xff;
+}
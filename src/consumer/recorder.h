@@ -0,0 +1,64 @@
+/**
+ * @file recorder.h
+ * Capture of the consumer's raw input stream
+ *
+ * With a capture file configured, the consumer hands every read from its data
+ * source to a recorder before doing anything else with it. The recorder
+ * timestamps the read and appends it to the capture file in the format
+ * described in capture.h. Output is buffered and flushed about once a second,
+ * so that recording costs the consumer little more than a copy; a capture cut
+ * short by killing the client may lose its last second.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#ifndef _CONSUMER_RECORDER_H
+#define _CONSUMER_RECORDER_H
+
+#include <stdio.h>
+#include <time.h>
+
+#include "../shared/capture.h"
+
+/** Size of the recorder's output buffer */
+#define RECORDER_BUFFER 65536
+
+/**
+ * The state of a capture in progress.
+ */
+struct recorder_st {
+  FILE *out; /**< The capture file */
+  struct timespec last; /**< When the previous read was recorded */
+  time_t flushed; /**< When the capture file was last flushed */
+  unsigned long records; /**< Reads recorded */
+  unsigned long long bytes; /**< Bytes recorded */
+};
+
+typedef struct recorder_st Recorder;
+
+/**
+ * Creates a capture file and writes its header.
+ *
+ * @param path The capture file, which is replaced if it exists
+ * @return A malloc'd handle to be freed with #recorder_cleanup, or NULL if the
+ * file could not be created
+ */
+Recorder* recorder_init(const char *path);
+
+/**
+ * Records one read. Empty reads are not recorded, but still let the capture
+ * file be flushed on time.
+ *
+ * @param data The bytes read
+ * @param len The number of bytes read
+ * @return 0 if successful, -1 if the capture file could not be written
+ */
+int recorder_add(Recorder *r, const char *data, size_t len);
+
+/**
+ * Flushes and closes the capture file. The specified handle will be NULL
+ * after this function returns.
+ */
+void recorder_cleanup(Recorder **r);
+
+#endif
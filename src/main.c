@@ -14,7 +14,11 @@
  * - Stores read data in larger double buffers for relay to read and send
  * - Incorporates error handling response to save data to SD card or other
  *   storage
- * - In case of relay (child process) dying, can refork() and restart relay
+ * - In case of relay (child process) dying, can refork() and restart relay,
+ *   or with --standby promote the standby relay it keeps forked
+ * - On SIGTERM, SIGINT or SIGPWR, stops reading and has the relay drain
+ *   everything buffered to the server or the SD card before exiting
+ * - On SIGHUP, reloads the config file and publishes it to the relay
  *
  * Relay
  * -----
@@ -34,29 +38,72 @@
 #include <sys/shm.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "consumer/consumer.h"
 #include "relay/relay.h"
+#include "shared/alloc.h"
 #include "shared/buffer.h"
+#include "shared/config.h"
+#include "shared/drain.h"
+#include "shared/failover.h"
+#include "shared/spool.h"
+#include "shared/trace.h"
 #include <sys/stat.h>
 
 /**
  * The options available for invoking the program from the command line.
  * - *server-path*: 
  *       A valid URI pointing to the local network server for the relay
- *       to communicate with.
+ *       to communicate with. Several servers may be given as a comma
+ *       separated list, in which case uploads are spread across them.
  * - *data-source*:
  *       A valid URI pointing to the data source for the collector to grab
  *       measured data from.
+ * - *metrics-file*:
+ *       A file the relay periodically writes a snapshot of its metrics to.
+ * - *features*:
+ *       What the relay uploads for each buffer: "raw" data (the default),
+ *       only its "spectra", "spectra+raw" for spectra and decimated data, or
+ *       only the "changes" from the steady state.
+ * - *decimate*:
+ *       FACTOR[:TAPS] to low-pass filter the data and keep one sample in
+ *       FACTOR before it is buffered. TAPS is either the number of taps of
+ *       the default filter or a file of filter taps.
+ * - *packets*:
+ *       A flag saying the data source sends the Firefly's sample packets
+ *       rather than a bare stream of samples; the relay unpacks them (see
+ *       firefly.h).
+ * - *capture*:
+ *       A file the consumer records everything it reads from the data source
+ *       into, with the time of each read, for later replay.
+ * - *trace*:
+ *       A file both processes record binary trace events into, to be decoded
+ *       with the tracedump tool.
+ * - *standby*:
+ *       A flag to keep a second, initialized relay waiting to take over the
+ *       moment the relay dies (see failover.h).
+ * - *drain-deadline*:
+ *       Milliseconds the relay has on shutdown to upload what it holds
+ *       before spooling the rest (see drain.h).
+ * - *config*:
+ *       A file of tunables overriding the defaults and the options above,
+ *       reloaded on SIGHUP (see config.h).
  * - *verbose*:
  *       A flag to increase the frequency and detail of logging by the program.
  *       Useful for debugging.
  */
 static struct option long_options[] = { { "server-path", required_argument,
     NULL, 's' }, { "data-source", required_argument, NULL, 'd' }, {
-    "external-dir", required_argument, NULL, 'e' }, { "help", no_argument, NULL,
-    'h' }, { "verbose", no_argument, NULL, 'v' } };
+    "external-dir", required_argument, NULL, 'e' }, { "metrics-file",
+    required_argument, NULL, 'm' }, { "features", required_argument, NULL,
+    'f' }, { "decimate", required_argument, NULL, 'D' }, { "capture",
+    required_argument, NULL, 'c' }, { "trace", required_argument, NULL, 't' }, {
+    "standby", no_argument, NULL, 'S' }, { "packets", no_argument, NULL, 'P' },
+    { "drain-deadline", required_argument, NULL, 'w' }, { "config",
+    required_argument, NULL, 'C' }, { "help", no_argument, NULL, 'h' }, {
+    "verbose", no_argument, NULL, 'v' }, { NULL, 0, NULL, 0 } };
 
 /**
  * A flag to enable/disable verbose debugging output at runtime.
@@ -80,42 +127,146 @@ static int pid;
  * A flag used when the relay process dies and the consumer needs to refork the
  * process.
  */
-static int relay_needs_refork;
+static volatile sig_atomic_t relay_needs_refork;
+
+/**
+ * A flag to keep a standby relay forked and initialized.
+ */
+static int standby;
+
+/**
+ * Set in a relay process forked as the standby.
+ */
+static int relay_is_standby;
+
+/**
+ * Which relay is in charge, in shared memory.
+ */
+static Failover *failover;
+
+/**
+ * A flag set by a shutdown signal, to stop the consumer.
+ */
+static volatile sig_atomic_t stop_requested;
+
+/**
+ * The consumer's shutdown request to the relay, in shared memory.
+ */
+static Drain *drain;
+
+/**
+ * A flag set by SIGHUP, to have the consumer reload the config file.
+ */
+static volatile sig_atomic_t reload_requested;
 
 static void usage();
 
+static int fork_relay(void);
+
+static void drain_relays(Spool* spool, Buffer* buffers, Seal* seals,
+    Occupancy* occupancy, int buf_idx, unsigned drain_ms);
+
+static Decimator* get_decimator(char* spec);
+
 static void get_args(int argc, char** argv, char** data_source,
-    char** server_path, char** external_dir, int* verbose);
+    char** server_path, char** external_dir, char** metrics_file,
+    int* features, char** decimate, char** capture, char** trace,
+    int* standby, int* packets, unsigned* drain_ms, char** config_file,
+    int* verbose);
 
 void handle_relay_death(int sig);
 
+void handle_stop(int sig);
+
+void handle_reload(int sig);
+
 /**
  * Main entrypoint into the carambola client program.
  * @see main.c
  */
 int main(int argc, char* argv[]) {
   int shmid; /* shared memory id */
-  size_t shm_size = sizeof(Buffer) * 2; /* shared memory size */
+  /* shared memory size: the double buffer, its telemetry, which relay is in
+   * charge, the shutdown request, the tunables, the buffers sealed into
+   * the relay's pipeline and the counts of spool writes */
+  size_t shm_size = sizeof(Buffer) * 2 + sizeof(Occupancy) + sizeof(Failover)
+      + sizeof(Drain) + sizeof(Config) + sizeof(Seal) * PIPELINE_SLOTS
+      + sizeof(SpoolStats);
   Buffer* buffers; /* shared memory buffers */
+  Occupancy* occupancy; /* shared telemetry of the buffers */
+  Config* config; /* shared tunables */
+  Config base; /* tunables from the defaults and command line */
+  Config loaded; /* base overridden by the config file */
+  Seal* seals; /* shared pipeline slots */
+  SpoolStats* spool_stats; /* shared counts of spool writes and flushes */
+  pid_t consumer_pid; /* for a standby relay to notice the consumer exit */
+  sigset_t wake; /* signal promoting a standby relay */
+  unsigned drain_ms = DRAIN_DEADLINE_MS; /* time the relay has to drain */
+  int stop_signals[] = { SIGTERM, SIGINT, SIGPWR };
+  int relay_ignores[] = { SIGTERM, SIGINT, SIGPWR, SIGHUP };
+  int i;
   char* data_source = NULL; /* data source for consumer */
   char* server_path = NULL; /* server path for relay */
   char* external_dir = NULL; /* external dir for consumer */
+  char* metrics_file = NULL; /* metrics snapshot file for relay */
+  int features = RELAY_FEATURES_RAW; /* what the relay uploads */
+  int packets = 0; /* whether the data source sends Firefly packets */
+  char* decimate = NULL; /* decimation applied by consumer */
+  char* capture = NULL; /* capture file for consumer */
+  char* trace = NULL; /* trace file for both processes */
+  char* config_file = NULL; /* tunables for both processes */
   verbose = 0; /* Verbosity level: 0 = not verbose, 2+ = very verbose */
   struct sigaction act; /* Used to add the relay death signal handler */
   relay_needs_refork = 0;
 
-  get_args(argc, argv, &data_source, &server_path, &external_dir, &verbose);
-  if (data_source == NULL || server_path == NULL ) {
+  standby = 0;
+  relay_is_standby = 0;
+  stop_requested = 0;
+  reload_requested = 0;
+
+  get_args(argc, argv, &data_source, &server_path, &external_dir,
+      &metrics_file, &features, &decimate, &capture,
+      &trace, &standby, &packets, &drain_ms, &config_file, &verbose);
+  config_defaults(&base);
+  base.drain_ms = drain_ms;
+  if (server_path != NULL ) {
+    if (strlen(server_path) >= sizeof base.server) {
+      fprintf(stderr, "[C] Server path is too long\n");
+      exit(EXIT_FAILURE);
+    }
+    strcpy(base.server, server_path);
+  }
+  loaded = base;
+  if (config_file != NULL && config_load(&loaded, config_file) < 0)
+    exit(EXIT_FAILURE);
+  if (data_source == NULL || loaded.server[0] == '\0') {
     usage();
     exit(EXIT_FAILURE);
   }
+  if (packets && decimate != NULL ) {
+    /* The consumer would filter packet headers as if they were samples */
+    fprintf(stderr, "[C] Decimation needs a bare stream of samples\n");
+    exit(EXIT_FAILURE);
+  }
   if (verbose) /* print config */
     printf("Configuration:\n"
         "  verbosity:    %s\n"
         "  data source:  %s\n"
         "  ext. dump:    %s\n"
-        "  server path:  %s\n\n", (verbose > 1 ? "HIGH" : "LOW"), data_source,
-        external_dir, server_path);
+        "  server path:  %s\n"
+        "  metrics file: %s\n"
+        "  decimation:   %s\n"
+        "  packets:      %s\n"
+        "  capture file: %s\n"
+        "  trace file:   %s\n"
+        "  standby:      %s\n"
+        "  drain:        %u ms\n"
+        "  config file:  %s\n\n", (verbose > 1 ? "HIGH" : "LOW"), data_source,
+        external_dir, loaded.server, metrics_file ? metrics_file : "(none)",
+        decimate ? decimate : "(none)", packets ? "yes" : "no",
+        capture ? capture : "(none)",
+        trace ? trace : "(none)", standby ? "yes" : "no", loaded.drain_ms,
+        config_file ? config_file : "(none)");
 
   /* Check if path exists */
   struct stat dump_stat;
@@ -153,10 +304,28 @@ int main(int argc, char* argv[]) {
   }
   buffers[0].capacity = __BUFFER_CAPACITY;
   buffers[1].capacity = __BUFFER_CAPACITY;
+  occupancy = (Occupancy*) (buffers + 2);
+  occupancy_init(occupancy);
+  failover = (Failover*) (occupancy + 1);
+  failover_init(failover);
+  drain = (Drain*) (failover + 1);
+  drain_init(drain);
+  config = (Config*) (drain + 1);
+  config_publish(config, &loaded);
+  seals = (Seal*) (config + 1); /* zeroed by shmget: every slot is free */
+  spool_stats = (SpoolStats*) (seals + PIPELINE_SLOTS);
+  spool_stats_init(spool_stats);
   if (verbose) {
     printf("  attached. (addr  = %p)\nShared memory setup done!\n\n", buffers);
   }
 
+  /* Map the trace before forking so both processes share it */
+  if (trace != NULL && trace_open(trace) < 0) {
+    fprintf(stderr, "[C] Could not create trace file \"%s\"\n", trace);
+    perror("[C] trace");
+    exit(EXIT_FAILURE);
+  }
+
   /* fork */
   if (verbose) {
     printf("[C] Forking relay as child process...");
@@ -164,33 +333,79 @@ int main(int argc, char* argv[]) {
     fflush(stdout);
   }
   act.sa_handler = &handle_relay_death;
+  sigemptyset(&act.sa_mask);
   act.sa_flags = SA_NOCLDSTOP;
   if (sigaction(SIGCHLD, &act, NULL ) < 0) {
     printf("FAILURE!\n");
     perror("signal");
     exit(EXIT_FAILURE);
   }
-  if ((pid = fork()) < 0) {
+  /* Blocked in every process, so a standby only ever takes it in sigtimedwait */
+  sigemptyset(&wake);
+  sigaddset(&wake, SIGUSR1);
+  sigprocmask(SIG_BLOCK, &wake, NULL );
+  act.sa_handler = &handle_stop;
+  act.sa_flags = 0;
+  for (i = 0; i < sizeof stop_signals / sizeof stop_signals[0]; ++i)
+    if (sigaction(stop_signals[i], &act, NULL ) < 0) {
+      printf("FAILURE!\n");
+      perror("signal");
+      exit(EXIT_FAILURE);
+    }
+  act.sa_handler = &handle_reload;
+  if (sigaction(SIGHUP, &act, NULL ) < 0) {
+    printf("FAILURE!\n");
+    perror("signal");
+    exit(EXIT_FAILURE);
+  }
+  consumer_pid = getpid();
+  if ((pid = fork_relay()) < 0) {
     printf("FAILURE!\n");
     perror("fork");
     exit(EXIT_FAILURE);
   }
   if ((pid != 0) && verbose)
     printf("done! (pid = %d)\n", pid);
+  relay_needs_refork = standby; /* the consumer forks the standby */
 
   relay_start: if (pid == 0) { /* relay code */
     Relay *r;
-    if ((r = relay_init(buffers, server_path, external_dir, (verbose - 1) > 0))
-        == NULL ) {
+    /* Shutdown and reloads go through the consumer */
+    for (i = 0; i < sizeof relay_ignores / sizeof relay_ignores[0]; ++i)
+      signal(relay_ignores[i], SIG_IGN );
+    if ((r = relay_init(buffers, occupancy, failover, drain, seals,
+        config, spool_stats, external_dir, metrics_file, features, packets,
+        (verbose - 1) > 0)) == NULL ) {
       fprintf(stderr, "[R] Relay init failed!\n");
       exit(EXIT_FAILURE);
     }
 
+    /* A standby waits, initialized, until the consumer promotes it */
+    if (relay_is_standby) {
+      struct timespec poll = { 1, 0 };
+      if (verbose)
+        printf("[R] Standing by...\n");
+      while (failover->active != getpid()) {
+        if (getppid() != consumer_pid) /* the consumer is gone */
+          exit(EXIT_SUCCESS);
+        sigtimedwait(&wake, NULL, &poll);
+      }
+    }
+    relay_activate(r);
+
     while (1) {
+      ALLOC_CHECK("[R]");
+      /* Drain when the consumer asks, or on our own if it is gone */
+      if (drain->requested || getppid() != consumer_pid) {
+        if (!drain->requested)
+          drain_start(drain, r->config.drain_ms);
+        relay_drain(r);
+        break;
+      }
       int res = relay_process(r);
       if (res < 0) {
         if (res == RELAYE_SERV) {
-          sleep(1);
+          usleep(r->config.retry_wait_ms * 1000U);
           continue;
         }
         break;
@@ -200,37 +415,70 @@ int main(int argc, char* argv[]) {
     relay_cleanup(&r);
   } else { /* consumer code */
     Consumer *c;
-    if ((c = consumer_init(buffers, data_source, external_dir,
-        (verbose - 1 > 0))) == NULL ) {
+    Decimator *d = NULL;
+    if (decimate != NULL && (d = get_decimator(decimate)) == NULL ) {
+      fprintf(stderr, "[C] Invalid decimation \"%s\"\n", decimate);
+      exit(EXIT_FAILURE);
+    }
+    Recorder *rec = NULL;
+    if (capture != NULL && (rec = recorder_init(capture)) == NULL ) {
+      fprintf(stderr, "[C] Could not create capture file \"%s\"\n", capture);
+      exit(EXIT_FAILURE);
+    }
+    if ((c = consumer_init(buffers, occupancy, config, spool_stats,
+        data_source, external_dir, d, rec, (verbose - 1 > 0))) == NULL ) {
       fprintf(stderr, "[C] Consumer init failed!\n");
       exit(EXIT_FAILURE);
     }
 
-    while (1) {
+    while (!stop_requested) {
+      ALLOC_CHECK("[C]");
       if (consumer_process(c) < 0)
         break;
 
-      if (relay_needs_refork) {
-        fprintf(stderr, "[C] Attempting to restart relay process...");
-        /* Needed to prevent fork from copying buffers & printing 2x */
-        fflush(stderr);
-
-        if ((pid = fork()) < 0) {
-          fprintf(stderr, "FAILURE!\n");
-          perror("fork");
-          exit(EXIT_FAILURE);
+      if (reload_requested) {
+        reload_requested = 0;
+        loaded = base;
+        if (config_file == NULL)
+          fprintf(stderr, "[C] No config file to reload\n");
+        else if (config_load(&loaded, config_file) < 0)
+          fprintf(stderr, "[C] Keeping the current configuration\n");
+        else {
+          config_publish(config, &loaded);
+          fprintf(stderr, "[C] Configuration reloaded from %s\n",
+              config_file);
         }
+      }
+
+      if (relay_needs_refork) {
         relay_needs_refork = 0;
-        if (pid != 0)
-          fprintf(stderr, "done! (pid = %d)\n", pid);
-        if (pid == 0)
-          goto relay_start;
+        if (failover->active == 0 || (standby && failover->standby == 0)) {
+          fprintf(stderr, "[C] Attempting to %s relay process...",
+              failover->active == 0 ? "restart" : "start standby");
+          /* Needed to prevent fork from copying buffers & printing 2x */
+          fflush(stderr);
+
+          if ((pid = fork_relay()) < 0) {
+            fprintf(stderr, "FAILURE!\n");
+            perror("fork");
+            exit(EXIT_FAILURE);
+          }
+          if (pid != 0)
+            fprintf(stderr, "done! (pid = %d)\n", pid);
+          if (pid == 0)
+            goto relay_start;
+          /* Both relays died: follow the new one with a standby */
+          if (standby && failover->standby == 0)
+            relay_needs_refork = 1;
+        }
       } else {
-        /* Wait for 1/100th of a second to simulate slow data collection */
-        usleep(10000U);
+        /* Wait between reads to simulate slow data collection */
+        usleep(c->config.read_wait_us);
       }
     }
 
+    drain_relays(c->spool, buffers, seals, occupancy, c->buf_idx,
+        config->drain_ms);
     consumer_cleanup(&c);
   }
 
@@ -282,9 +530,34 @@ static void usage() {
   fprintf(stderr,
       "  -e, --external-dir=PATH sets the dump path for the consumer\n");
   fprintf(stderr,
-      "  -s, --server-path=PATH  sets the server uri for the relay\n");
+      "  -s, --server-path=PATH  sets the server uri for the relay. Separate\n"
+      "                          several uris with commas to spread uploads\n");
   fprintf(stderr, "\n");
   fprintf(stderr, "OPTIONAL:\n");
+  fprintf(stderr,
+      "  -m, --metrics-file=PATH periodically write relay metrics to PATH\n");
+  fprintf(stderr,
+      "  -f, --features=MODE     upload raw (default), spectra, spectra+raw or\n"
+      "                          changes\n");
+  fprintf(stderr,
+      "  -D, --decimate=N[:TAPS] keep one sample in N after low-pass filtering\n"
+      "                          with TAPS taps, or the taps listed in file TAPS\n");
+  fprintf(stderr,
+      "  -P, --packets           the data source sends Firefly packets, which\n"
+      "                          the relay unpacks\n");
+  fprintf(stderr,
+      "  -c, --capture=PATH      record the raw data read, with timing, to PATH\n");
+  fprintf(stderr,
+      "  -t, --trace=PATH        record binary trace events to PATH\n");
+  fprintf(stderr,
+      "  -S, --standby           keep a standby relay ready to take over\n");
+  fprintf(stderr,
+      "  -w, --drain-deadline=MS give the relay MS milliseconds on shutdown to\n"
+      "                          upload before spooling (default %d)\n",
+      DRAIN_DEADLINE_MS);
+  fprintf(stderr,
+      "  -C, --config=PATH       read tunables, and the server path, from PATH\n"
+      "                          and reload them on SIGHUP\n");
   fprintf(stderr, "      --help     display this help and exit\n");
   fprintf(stderr,
       "  -v, --verbose  increase program output. Use twice for more output\n");
@@ -292,9 +565,14 @@ static void usage() {
 
 /** Get all args from the command line */
 static void get_args(int argc, char** argv, char** data_source,
-    char** server_path, char** external_dir, int* verbose) {
+    char** server_path, char** external_dir, char** metrics_file,
+    int* features, char** decimate, char** capture, char** trace,
+    int* standby, int* packets, unsigned* drain_ms, char** config_file,
+    int* verbose) {
   int c;
-  while ((c = getopt_long(argc, argv, "d:s:ve:", long_options, NULL ))) {
+  char* end;
+  while ((c = getopt_long(argc, argv, "d:s:ve:m:f:D:Pc:t:Sw:C:", long_options,
+      NULL ))) {
     if (c == -1)
       break; /* Done processing optargs */
 
@@ -316,6 +594,57 @@ static void get_args(int argc, char** argv, char** data_source,
       *server_path = optarg;
       break;
 
+    case 'm': /* Metrics file option */
+      *metrics_file = optarg;
+      break;
+
+    case 'f': /* Feature extraction option */
+      if (strcmp(optarg, "raw") == 0)
+        *features = RELAY_FEATURES_RAW;
+      else if (strcmp(optarg, "spectra") == 0)
+        *features = RELAY_FEATURES_SPECTRA;
+      else if (strcmp(optarg, "spectra+raw") == 0)
+        *features = RELAY_FEATURES_BOTH;
+      else if (strcmp(optarg, "changes") == 0)
+        *features = RELAY_FEATURES_CHANGES;
+      else {
+        usage();
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+    case 'D': /* Decimation option */
+      *decimate = optarg;
+      break;
+
+    case 'P': /* Packets flag */
+      *packets = 1;
+      break;
+
+    case 'c': /* Capture option */
+      *capture = optarg;
+      break;
+
+    case 't': /* Trace option */
+      *trace = optarg;
+      break;
+
+    case 'S': /* Standby flag */
+      *standby = 1;
+      break;
+
+    case 'w': /* Drain deadline option */
+      *drain_ms = strtoul(optarg, &end, 10);
+      if (end == optarg || *end != '\0') {
+        usage();
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+    case 'C': /* Config file option */
+      *config_file = optarg;
+      break;
+
     case 'v': /* verbose flag */
       ++(*verbose);
       break;
@@ -330,19 +659,165 @@ static void get_args(int argc, char** argv, char** data_source,
   }
 }
 
+/**
+ * Create the consumer's decimator from a FACTOR[:TAPS] specification, where
+ * TAPS is a number of taps or a file of taps.
+ */
+static Decimator* get_decimator(char* spec) {
+  double coef[DECIMATE_TAPS_MAX];
+  char* end;
+  int factor = strtol(spec, &end, 10);
+  int taps = 0;
+
+  if (end == spec || (*end != '\0' && *end != ':'))
+    return NULL ;
+  if (*end == ':') {
+    char* taps_spec = end + 1;
+    taps = strtol(taps_spec, &end, 10);
+    if (end == taps_spec || *end != '\0') {
+      if ((taps = decimator_load_taps(taps_spec, coef)) < 0)
+        return NULL ;
+      return decimator_init(factor, coef, taps);
+    }
+    if (taps <= 0)
+      return NULL ;
+  }
+  return decimator_init(factor, NULL, taps);
+}
+
+/**
+ * Fork a relay: the active relay if there is none, the standby otherwise.
+ * The child's role is recorded before a death can be handled.
+ *
+ * @return As fork()
+ */
+static int fork_relay(void) {
+  sigset_t chld, old;
+  int child;
+
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld, &old);
+  relay_is_standby = failover->active != 0;
+  if ((child = fork()) > 0) {
+    if (relay_is_standby)
+      failover->standby = child;
+    else
+      failover->active = child;
+  }
+  sigprocmask(SIG_SETMASK, &old, NULL );
+  return child;
+}
+
+/**
+ * Drain the relay before the consumer exits: stop the standby, have the
+ * active relay drain within the deadline, and spool whatever a relay that
+ * died or overran the deadline left behind, oldest first. A buffer that will
+ * not spool is left where it is and counted as dropped.
+ */
+static void drain_relays(Spool* spool, Buffer* buffers, Seal* seals,
+    Occupancy* occupancy, int buf_idx, unsigned drain_ms) {
+  struct timespec tick = { 0, 10000000 };
+  char tried[PIPELINE_SLOTS] = { 0 };
+  int spooled = 0, dropped = 0, i, pass;
+
+  fprintf(stderr, "[C] Draining relay within %u ms...\n", drain_ms);
+  if (failover->standby != 0)
+    kill(failover->standby, SIGKILL);
+  drain_start(drain, drain_ms);
+
+  /* The relay exits once drained, and the SIGCHLD handler clears active */
+  while (failover->active != 0 && drain_left_ms(drain) > 0)
+    nanosleep(&tick, NULL );
+  for (i = 0; failover->active != 0 && i < DRAIN_GRACE_MS / 10; ++i)
+    nanosleep(&tick, NULL );
+  if (failover->active != 0) {
+    fprintf(stderr, "[C] Relay overran its drain, killing it\n");
+    kill(failover->active, SIGKILL);
+    for (i = 0; failover->active != 0 && i < DRAIN_GRACE_MS / 10; ++i)
+      nanosleep(&tick, NULL );
+  }
+
+  /* Buffers the relay sealed but did not deliver */
+  while (1) {
+    int oldest = -1;
+    for (i = 0; i < PIPELINE_SLOTS; ++i)
+      if (!tried[i] && pipeline_undelivered(&seals[i], buffers)
+          && (oldest < 0 || seals[i].seq < seals[oldest].seq))
+        oldest = i;
+    if (oldest < 0)
+      break;
+    tried[oldest] = 1;
+    /* A slot is only freed once its buffer is safe */
+    if (spool_write(spool, &seals[oldest].buffer) == 0) {
+      seals[oldest].owner = 0;
+      ++spooled;
+    } else {
+      perror("[C] spool");
+      ++dropped;
+    }
+  }
+  /* Then the shared buffers, the one being filled last */
+  for (pass = 0; pass < 2; ++pass)
+    for (i = 1; i >= 0; --i) {
+      Buffer* b = &buffers[buf_idx ^ i];
+      if (b->size == 0 || (pass == 0 && b->size != b->capacity))
+        continue;
+      if (spool_write(spool, b) == 0) {
+        ++spooled;
+        b->size = 0;
+      } else {
+        perror("[C] spool");
+        ++dropped;
+      }
+    }
+
+  spool_flush(spool); /* whatever the policy, nothing follows */
+
+  drain->spooled += spooled;
+  __sync_fetch_and_add(&occupancy->dropped, dropped);
+  fprintf(stderr, "[C] Drained: %u buffers uploaded, %u spooled, "
+      "%d dropped\n", drain->uploaded, drain->spooled, dropped);
+}
+
+/**
+ * Handle a shutdown signal by stopping the consumer, which then drains the
+ * relay.
+ */
+void handle_stop(int sig) {
+  stop_requested = 1;
+}
+
+/**
+ * Handle SIGHUP by having the consumer reload the config file between reads.
+ */
+void handle_reload(int sig) {
+  reload_requested = 1;
+}
+
 /**
  * Handle the death of a child process.
  *
  * If the child process exits abnormally, or exits with an error code, then
- * make an attempt to respawn the process.
+ * make an attempt to respawn the process. If it was the active relay, the
+ * standby, if any, is promoted and woken at once.
  */
 void handle_relay_death(int sig) {
   int status;
+  pid_t dead;
 
   if (verbose)
     printf("[C] Received child death signal\n");
 
-  if (waitpid(-1, &status, WNOHANG) > 0) {
+  while ((dead = waitpid(-1, &status, WNOHANG)) > 0) {
+    if (dead == failover->active) {
+      failover_died(failover);
+      failover->active = failover->standby;
+      failover->standby = 0;
+      if (failover->active != 0)
+        kill(failover->active, SIGUSR1);
+    } else if (dead == failover->standby)
+      failover->standby = 0;
 
     if (WIFEXITED(status)) {
       printf("[C] Relay exited normally with status: %d\n",
@@ -0,0 +1,171 @@
+/**
+ * @file adapt.c
+ * Implementation of the codec controller
+ * @see adapt.h
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "adapt.h"
+#include "../shared/trace.h"
+
+static void sample_cpu(Adapt *a);
+static void change(Adapt *a, int level, uint32_t demand);
+
+/** Guesses of each codec's ratio, until it has been used */
+static const double ratio_guess[CODEC_LEVELS] = { 1.0, 0.75, 0.65 };
+
+/**
+ * Allocates a controller
+ * @see adapt.h
+ */
+Adapt* adapt_init() {
+  Adapt *a;
+  int i;
+
+  if ((a = (Adapt*) calloc(1, sizeof(Adapt))) == NULL )
+    return NULL ;
+  pthread_mutex_init(&a->lock, NULL );
+  for (i = 0; i < CODEC_LEVELS; ++i)
+    a->ratio[i] = ratio_guess[i];
+  a->idle = 1;
+  return a;
+}
+
+/**
+ * Chooses a codec
+ * @see adapt.h
+ */
+int adapt_choose(Adapt *a, const Occupancy *occ, int in_flight, int limit) {
+  uint32_t demand = occ->fill_rate;
+  int pressure = occupancy_at_risk(occ) || (limit > 1 && in_flight >= limit);
+  int level;
+
+  pthread_mutex_lock(&a->lock);
+  sample_cpu(a);
+  level = a->level;
+  if (a->throughput > 0) {
+    int up = level + 1, down = level - 1;
+
+    if (up < CODEC_LEVELS && a->dwell >= ADAPT_DWELL_UP
+        && a->idle >= ADAPT_CPU_RESERVE && a->ratio[up] < a->ratio[level]
+        && (pressure || demand * a->ratio[level] * ADAPT_UP > a->throughput))
+      change(a, up, demand);
+    else if (down >= 0 && a->dwell >= ADAPT_DWELL_UP
+        && a->idle < ADAPT_CPU_RESERVE
+        && demand * a->ratio[down] * ADAPT_UP < a->throughput)
+      change(a, down, demand); /* short of CPU, and the link has room */
+    else if (down >= 0 && a->dwell >= ADAPT_DWELL_DOWN && !pressure
+        && (demand * a->ratio[down] * ADAPT_DOWN < a->throughput
+            || a->ratio[level] >= a->ratio[down]))
+      change(a, down, demand);
+  }
+  ++a->dwell;
+  level = a->level;
+  pthread_mutex_unlock(&a->lock);
+  return level;
+}
+
+/**
+ * Records an encoded buffer
+ * @see adapt.h
+ */
+void adapt_encoded(Adapt *a, int codec, size_t in, size_t out,
+    double seconds) {
+  if (in == 0)
+    return;
+  pthread_mutex_lock(&a->lock);
+  ++a->chosen[codec];
+  a->ratio[codec] += ADAPT_ALPHA * ((double) out / in - a->ratio[codec]);
+  a->cost[codec] += ADAPT_ALPHA * (seconds - a->cost[codec]);
+  pthread_mutex_unlock(&a->lock);
+}
+
+/**
+ * Records an upload
+ * @see adapt.h
+ */
+void adapt_sent(Adapt *a, size_t bytes, double seconds) {
+  double rate;
+
+  if (seconds <= 0)
+    return;
+  rate = bytes / seconds;
+  pthread_mutex_lock(&a->lock);
+  a->throughput = a->throughput == 0 ? rate :
+      a->throughput + ADAPT_ALPHA * (rate - a->throughput);
+  pthread_mutex_unlock(&a->lock);
+}
+
+/**
+ * Writes controller statistics
+ * @see adapt.h
+ */
+void adapt_print(Adapt *a, FILE *out) {
+  pthread_mutex_lock(&a->lock);
+  fprintf(out, "adapt codec=%d changes=%lu raw=%lu delta=%lu best=%lu "
+      "throughput=%.0f idle=%.2f delta_ratio=%.3f best_ratio=%.3f "
+      "delta_ms=%.2f best_ms=%.2f\n", a->level, a->changes,
+      a->chosen[CODEC_RAW], a->chosen[CODEC_DELTA], a->chosen[CODEC_BEST],
+      a->throughput, a->idle, a->ratio[CODEC_DELTA], a->ratio[CODEC_BEST],
+      a->cost[CODEC_DELTA] * 1000, a->cost[CODEC_BEST] * 1000);
+  pthread_mutex_unlock(&a->lock);
+}
+
+/**
+ * Frees the controller
+ * @see adapt.h
+ */
+void adapt_cleanup(Adapt **a) {
+  pthread_mutex_destroy(&(*a)->lock);
+  free(*a);
+  *a = NULL;
+}
+
+/**
+ * Updates the idle share of the CPU from the first line of /proc/stat, at
+ * most every #ADAPT_CPU_INTERVAL seconds. Where it cannot be read the CPU is
+ * taken to be idle, leaving the choice to the link alone.
+ */
+static void sample_cpu(Adapt *a) {
+  unsigned long long v[8] = { 0 }, idle, total = 0;
+  char line[256], *p = line;
+  time_t now = time(NULL );
+  ssize_t n;
+  int fd, i;
+
+  if (now - a->cpu_at < ADAPT_CPU_INTERVAL)
+    return;
+  a->cpu_at = now;
+  if ((fd = open("/proc/stat", O_RDONLY)) < 0)
+    return;
+  n = read(fd, line, sizeof line - 1);
+  close(fd);
+  if (n < 5)
+    return;
+  line[n] = '\0';
+
+  /* cpu user nice system idle iowait irq softirq steal */
+  p += 3;
+  for (i = 0; i < 8; ++i) {
+    v[i] = strtoull(p, &p, 10);
+    total += v[i];
+  }
+  idle = v[3] + v[4];
+  if (a->cpu_total != 0 && total > a->cpu_total)
+    a->idle = (double) (idle - a->cpu_idle) / (total - a->cpu_total);
+  a->cpu_idle = idle;
+  a->cpu_total = total;
+}
+
+/** Moves to another codec */
+static void change(Adapt *a, int level, uint32_t demand) {
+  TRACE(TRACE_CODEC, level, demand);
+  a->level = level;
+  a->dwell = 0;
+  ++a->changes;
+}
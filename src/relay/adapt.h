@@ -0,0 +1,122 @@
+/**
+ * @file adapt.h
+ * Choice of the codec for live buffers, per buffer
+ *
+ * No one codec suits every site: encoding a buffer the link could carry as
+ * is wastes CPU time the board is short of, while sending a buffer raw over
+ * a congested link leaves the ring to fill up and spill to the SD card. With
+ * live_codec set to #CODEC_LEVELS (see config.h), the relay's encode stage
+ * asks the controller which codec (see codec.h) to encode each buffer with.
+ *
+ * The controller keeps smoothed estimates of the upload throughput, of the
+ * bytes each codec sends per byte buffered, and of the share of the CPU left
+ * idle. The link is asked to carry the fill rate of the double buffer (see
+ * occupancy.h) times the current codec's ratio. The controller steps up to
+ * the next codec when that comes within #ADAPT_UP of the throughput, or when
+ * buffers back up: the pipeline has every slot in use, or overflow is near
+ * enough that the relay would spool them (see occupancy.h). It only does so while at least #ADAPT_CPU_RESERVE of
+ * the CPU is idle. It steps down to the cheaper codec once the link could
+ * carry #ADAPT_DOWN times what that codec would send, or straight away if the
+ * CPU is short and the cheaper codec still fits. A change is only made after
+ * a few buffers at the current codec, more to step down than up, so that
+ * the estimates settle and the codec does not flap at a threshold.
+ *
+ * The estimates are updated by the encode and transmit stages, which run on
+ * threads of their own; a lock guards them.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#ifndef _RELAY_ADAPT_H
+#define _RELAY_ADAPT_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "../shared/codec.h"
+#include "../shared/occupancy.h"
+
+/** Margin of throughput over demand below which a dearer codec is used */
+#define ADAPT_UP 1.25
+/** Margin of throughput over demand above which a cheaper codec is used */
+#define ADAPT_DOWN 2.0
+/** Buffers encoded at a codec before stepping up from it */
+#define ADAPT_DWELL_UP 2
+/** Buffers encoded at a codec before stepping down from it */
+#define ADAPT_DWELL_DOWN 8
+/** Share of the CPU that must stay idle for a dearer codec */
+#define ADAPT_CPU_RESERVE 0.2
+/** Weight of a new measurement in the smoothed estimates */
+#define ADAPT_ALPHA 0.2
+/** Seconds between samples of the CPU's idle time */
+#define ADAPT_CPU_INTERVAL 1
+
+/**
+ * The controller.
+ */
+struct adapt_st {
+  pthread_mutex_t lock; /**< Guards everything below */
+  int level; /**< Codec of the next buffer */
+  int dwell; /**< Buffers encoded since the last change */
+  double ratio[CODEC_LEVELS]; /**< Bytes sent per byte buffered, per codec */
+  double cost[CODEC_LEVELS]; /**< Seconds of encoding per buffer, per codec */
+  double throughput; /**< Bytes per second uploads ran at, 0 until known */
+  double idle; /**< Share of the CPU left idle */
+  unsigned long long cpu_idle; /**< Idle jiffies at the last sample */
+  unsigned long long cpu_total; /**< Jiffies at the last sample */
+  time_t cpu_at; /**< When the CPU was last sampled */
+  unsigned long changes; /**< Times the codec changed */
+  unsigned long chosen[CODEC_LEVELS]; /**< Buffers encoded with each codec */
+};
+
+typedef struct adapt_st Adapt;
+
+/**
+ * Allocates a controller, starting with raw buffers.
+ *
+ * @return A malloc'd handle to be freed with #adapt_cleanup, or NULL
+ */
+Adapt* adapt_init();
+
+/**
+ * Chooses the codec of the next buffer.
+ *
+ * @param occ The shared occupancy telemetry of the double buffer
+ * @param in_flight Pipeline slots in use, the buffer being encoded included
+ * @param limit Pipeline slots that may be in use
+ * @return One of the CODEC_* values
+ */
+int adapt_choose(Adapt *a, const Occupancy *occ, int in_flight, int limit);
+
+/**
+ * Records how a buffer encoded, whether or not the encoding was sent.
+ *
+ * @param codec The codec it was encoded with
+ * @param in Bytes buffered
+ * @param out Bytes the codec made of them
+ * @param seconds Time taken to encode
+ */
+void adapt_encoded(Adapt *a, int codec, size_t in, size_t out,
+    double seconds);
+
+/**
+ * Records an upload that succeeded.
+ *
+ * @param bytes Bytes uploaded
+ * @param seconds Time the request took
+ */
+void adapt_sent(Adapt *a, size_t bytes, double seconds);
+
+/**
+ * Writes a line of statistics.
+ */
+void adapt_print(Adapt *a, FILE *out);
+
+/**
+ * Frees the controller. The specified handle will be NULL after this
+ * function returns.
+ */
+void adapt_cleanup(Adapt **a);
+
+#endif
@@ -0,0 +1,173 @@
+/**
+ * @file batch.c
+ * Implementation of the live batch controller
+ * @see batch.h
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#include "batch.h"
+#include "../shared/trace.h"
+
+static double measure_rtt(CURL *curl);
+
+/**
+ * Allocates a controller
+ * @see batch.h
+ */
+Batch* batch_init() {
+  Batch *b;
+
+  if ((b = (Batch*) calloc(1, sizeof(Batch))) == NULL )
+    return NULL ;
+  pthread_mutex_init(&b->lock, NULL );
+  b->target = 1;
+  return b;
+}
+
+/**
+ * Chooses the buffers of the next request
+ * @see batch.h
+ */
+int batch_target(Batch *b, const Config *c, int limit) {
+  int lo = c->batch_min, hi = c->batch_max, n;
+
+  if (hi == 0 || hi > limit)
+    hi = limit;
+  if (lo > hi)
+    lo = hi;
+  pthread_mutex_lock(&b->lock);
+  n = lo;
+  if (b->rtt > 0 && b->rate > 0 && b->per_buffer > 0) {
+    double share = c->batch_efficiency / 100.0;
+    double need = share / (1 - share) * b->rtt * b->rate / b->per_buffer;
+    if (need >= hi)
+      n = hi;
+    else if (need > lo)
+      n = (int) need + ((int) need < need);
+    if (n < b->target && b->target <= hi && need > (b->target - 1) * BATCH_DOWN)
+      n = b->target;
+  }
+  if (n != b->target) {
+    TRACE(TRACE_BATCH_SIZE, n, (uint64_t) (b->rtt * 1000000));
+    b->target = n;
+    ++b->changes;
+  }
+  pthread_mutex_unlock(&b->lock);
+  return n;
+}
+
+/**
+ * Checks whether to wait for more buffers
+ * @see batch.h
+ */
+int batch_hold(Batch *b, const Config *c, int have, double interval) {
+  int hold = (uint32_t) have < c->batch_min;
+
+  pthread_mutex_lock(&b->lock);
+  if (!hold && interval > 0 && b->rate > 0)
+    hold = b->rtt + have * b->per_buffer / b->rate
+        > have * interval * BATCH_HEADROOM;
+  if (hold)
+    ++b->holds;
+  pthread_mutex_unlock(&b->lock);
+  return hold;
+}
+
+/**
+ * Records a request
+ * @see batch.h
+ */
+void batch_sent(Batch *b, CURL *curl, int buffers, size_t bytes,
+    double seconds, double waited) {
+  double rtt = measure_rtt(curl);
+
+  if (buffers < 1 || seconds <= 0)
+    return;
+  pthread_mutex_lock(&b->lock);
+  if (rtt > 0)
+    b->rtt = b->rtt == 0 ? rtt : b->rtt + BATCH_ALPHA * (rtt - b->rtt);
+  /* Only a request that outlasted the round trip says how fast bytes go */
+  if (b->rtt > 0 && seconds > b->rtt) {
+    double rate = bytes / (seconds - b->rtt);
+    b->rate = b->rate == 0 ? rate : b->rate + BATCH_ALPHA * (rate - b->rate);
+  }
+  b->per_buffer = b->per_buffer == 0 ? (double) bytes / buffers :
+      b->per_buffer + BATCH_ALPHA * ((double) bytes / buffers - b->per_buffer);
+  b->efficiency += BATCH_ALPHA * ((seconds > b->rtt ?
+      (seconds - b->rtt) / seconds : 0) - b->efficiency);
+  b->waited += waited;
+  ++b->requests;
+  b->buffers += buffers;
+  ++b->sizes[(buffers < PIPELINE_SLOTS ? buffers : PIPELINE_SLOTS) - 1];
+  if (buffers < b->target)
+    ++b->short_waits;
+  pthread_mutex_unlock(&b->lock);
+}
+
+/**
+ * Writes controller statistics
+ * @see batch.h
+ */
+void batch_print(Batch *b, FILE *out) {
+  int i;
+
+  pthread_mutex_lock(&b->lock);
+  fprintf(out, "batch target=%d changes=%lu requests=%lu buffers=%lu "
+      "holds=%lu short=%lu rtt_ms=%.2f rate=%.0f efficiency=%.2f "
+      "wait_ms=%.1f", b->target, b->changes, b->requests, b->buffers,
+      b->holds, b->short_waits, b->rtt * 1000, b->rate, b->efficiency,
+      b->waited * 1000);
+  for (i = 0; i < PIPELINE_SLOTS; ++i)
+    fprintf(out, " of%d=%lu", i + 1, b->sizes[i]);
+  fputc('\n', out);
+  pthread_mutex_unlock(&b->lock);
+}
+
+/**
+ * Frees the controller
+ * @see batch.h
+ */
+void batch_cleanup(Batch **b) {
+  pthread_mutex_destroy(&(*b)->lock);
+  free(*b);
+  *b = NULL;
+}
+
+/**
+ * Reads the kernel's smoothed round trip time of the connection a request
+ * was made on. Where the connection cannot be asked, a request that had to
+ * connect gives one round trip in the time the handshake took.
+ *
+ * @return Seconds, or 0 if unknown
+ */
+static double measure_rtt(CURL *curl) {
+  struct tcp_info info;
+  socklen_t len = sizeof info;
+  double connect = 0, lookup = 0;
+#if LIBCURL_VERSION_NUM >= 0x072d00
+  curl_socket_t sock = CURL_SOCKET_BAD;
+
+  if (curl_easy_getinfo(curl, CURLINFO_ACTIVESOCKET, &sock) == CURLE_OK
+      && sock != CURL_SOCKET_BAD
+      && getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0
+      && info.tcpi_rtt > 0)
+    return info.tcpi_rtt / 1e6;
+#else
+  long sock = -1;
+
+  if (curl_easy_getinfo(curl, CURLINFO_LASTSOCKET, &sock) == CURLE_OK
+      && sock >= 0
+      && getsockopt((int) sock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0
+      && info.tcpi_rtt > 0)
+    return info.tcpi_rtt / 1e6;
+#endif
+  curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &connect);
+  curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME, &lookup);
+  return connect > lookup ? connect - lookup : 0;
+}
@@ -0,0 +1,128 @@
+/**
+ * @file batch.h
+ * Choice of how many live buffers go in one upload
+ *
+ * Each live upload over HTTP costs a round trip on top of the time its bytes
+ * take. On the same switch as the server that is nothing, and one buffer per
+ * request keeps latency down; across a slow WAN link the round trip can
+ * take longer than sending a buffer, and the transmit stage spends most of
+ * its time waiting. The transmit stage asks the controller how many sealed
+ * buffers to send in the next request, and gathers them from the pipeline
+ * (see pipeline.h).
+ *
+ * The controller keeps smoothed estimates of the round trip time, read from
+ * the kernel's TCP state for the connection, of the rate bytes went at once a
+ * request was under way, and of the payload bytes per buffer. Sending n
+ * buffers keeps the link busy for n * bytes per buffer / rate of each
+ * request's time; the controller picks the fewest buffers for that share to
+ * reach batch_efficiency percent (see config.h), between batch_min and
+ * batch_max and no more than the pipeline has slots for.
+ *
+ * A request takes as many of those as are already waiting to be sent, which
+ * costs no latency. It only waits for the rest if it holds fewer than
+ * batch_min, or if requests of the buffers it holds take longer than
+ * #BATCH_HEADROOM of the time the consumer takes to fill them, so that
+ * sending them as they come would fall behind. It waits batch_wait_ms at
+ * most: whatever has been sealed by then is sent, so the latency a buffer
+ * gains is bounded however far the link is.
+ *
+ * A request is never less than a buffer: a site where one buffer takes too
+ * long should lower buffer_capacity instead.
+ *
+ * The estimates are updated by the transmit stage and read for the metrics
+ * snapshot by the relay; a lock guards them.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#ifndef _RELAY_BATCH_H
+#define _RELAY_BATCH_H
+
+#include <curl/curl.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#include "pipeline.h"
+#include "../shared/config.h"
+
+/** Weight of a new measurement in the smoothed estimates */
+#define BATCH_ALPHA 0.2
+/** Share of the time buffers take to fill that requests may take to send
+ * them before a request waits for more */
+#define BATCH_HEADROOM 0.8
+/** Share of one buffer fewer that the buffers needed must fall to before the
+ * target drops, so that it does not flap at a threshold */
+#define BATCH_DOWN 0.8
+
+/**
+ * The controller.
+ */
+struct batch_st {
+  pthread_mutex_t lock; /**< Guards everything below */
+  int target; /**< Buffers wanted in the next request */
+  double rtt; /**< Seconds of a round trip, 0 until known */
+  double rate; /**< Bytes per second requests sent at, 0 until known */
+  double per_buffer; /**< Payload bytes per buffer */
+  double efficiency; /**< Share of request time spent sending payload */
+  double waited; /**< Seconds requests spent gathering buffers */
+  unsigned long requests; /**< Requests sent */
+  unsigned long buffers; /**< Buffers sent in them */
+  unsigned long sizes[PIPELINE_SLOTS]; /**< Requests sent, by buffers - 1 */
+  unsigned long holds; /**< Requests that waited for more buffers */
+  unsigned long short_waits; /**< Requests sent short of the target */
+  unsigned long changes; /**< Times the target changed */
+};
+
+typedef struct batch_st Batch;
+
+/**
+ * Allocates a controller, starting with one buffer per request.
+ *
+ * @return A malloc'd handle to be freed with #batch_cleanup, or NULL
+ */
+Batch* batch_init();
+
+/**
+ * Chooses how many buffers to send in the next request.
+ *
+ * @param c The configuration, for its batch_* bounds
+ * @param limit Pipeline slots that may be in use
+ * @return The number of buffers, from 1 to limit
+ */
+int batch_target(Batch *b, const Config *c, int limit);
+
+/**
+ * Checks whether a request should wait for more buffers than it holds.
+ *
+ * @param c The configuration, for batch_min
+ * @param have Buffers the request holds
+ * @param interval Seconds the consumer takes to fill a buffer, 0 if unknown
+ * @return Non-zero if it should wait
+ */
+int batch_hold(Batch *b, const Config *c, int have, double interval);
+
+/**
+ * Records a request that succeeded, measuring its round trip from the
+ * connection it was made on.
+ *
+ * @param curl The handle the request was made with
+ * @param buffers Buffers it sent
+ * @param bytes Payload bytes it sent
+ * @param seconds Time the request took
+ * @param waited Seconds spent gathering its buffers
+ */
+void batch_sent(Batch *b, CURL *curl, int buffers, size_t bytes,
+    double seconds, double waited);
+
+/**
+ * Writes a line of statistics.
+ */
+void batch_print(Batch *b, FILE *out);
+
+/**
+ * Frees the controller. The specified handle will be NULL after this
+ * function returns.
+ */
+void batch_cleanup(Batch **b);
+
+#endif
@@ -0,0 +1,422 @@
+/**
+ * @file compact.c
+ * Implementation of the spool compactor
+ * @see compact.h
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compact.h"
+#include "segment.h"
+#include "../shared/crc32c.h"
+#include "../shared/trace.h"
+
+/* From linux/ioprio.h, which not every toolchain ships */
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+static void *compact_main(void *arg);
+static void compact_recover(Compactor *cp);
+static int compact_list(Compactor *cp, int *total);
+static int compact_pack(Compactor *cp, int n);
+static int compact_read(Compactor *cp, uint64_t stamp);
+static int write_all(int fd, const void *data, size_t len);
+static int sync_dir(const char *dir);
+static int stopping(Compactor *cp);
+
+/**
+ * Allocates the compactor
+ * @see compact.h
+ */
+Compactor* compactor_init(const char *dir, const Config *config, int verbose) {
+  Compactor *cp;
+
+  if ((cp = (Compactor*) calloc(1, sizeof(Compactor))) == NULL )
+    return NULL ;
+  pthread_mutex_init(&cp->spool, NULL );
+  pthread_mutex_init(&cp->lock, NULL );
+  pthread_cond_init(&cp->wake, NULL );
+  cp->dir = dir;
+  cp->config = config;
+  cp->verbose = verbose;
+  cp->in = (Buffer*) malloc(sizeof(Buffer));
+  cp->out = (char*) malloc(PACK_RECORD_MAX);
+  if (cp->in == NULL || cp->out == NULL ) {
+    compactor_cleanup(&cp);
+    return NULL ;
+  }
+  return cp;
+}
+
+/**
+ * Starts the thread
+ * @see compact.h
+ */
+int compactor_start(Compactor *cp) {
+  if (pthread_create(&cp->thread, NULL, &compact_main, cp) != 0)
+    return -1;
+  cp->started = 1;
+  return 0;
+}
+
+/**
+ * Keeps the compactor off the spool
+ * @see compact.h
+ */
+int compactor_hold(Compactor *cp) {
+  if (cp == NULL )
+    return 0;
+  return pthread_mutex_trylock(&cp->spool) == 0 ? 0 : -1;
+}
+
+/**
+ * Lets the compactor back
+ * @see compact.h
+ */
+void compactor_release(Compactor *cp) {
+  if (cp != NULL )
+    pthread_mutex_unlock(&cp->spool);
+}
+
+/**
+ * Writes statistics
+ * @see compact.h
+ */
+void compactor_print(Compactor *cp, FILE *out) {
+  fprintf(out, "compact packs=%lu dumps=%lu bytes_in=%llu bytes_out=%llu "
+      "recovered=%lu\n", cp->packs, cp->dumps, cp->bytes_in, cp->bytes_out,
+      cp->recovered);
+}
+
+/**
+ * Stops and frees the compactor
+ * @see compact.h
+ */
+void compactor_cleanup(Compactor **cp) {
+  if ((*cp)->started) {
+    pthread_mutex_lock(&(*cp)->lock);
+    (*cp)->stop = 1;
+    pthread_cond_signal(&(*cp)->wake);
+    pthread_mutex_unlock(&(*cp)->lock);
+    pthread_join((*cp)->thread, NULL );
+  }
+  pthread_mutex_destroy(&(*cp)->spool);
+  pthread_mutex_destroy(&(*cp)->lock);
+  pthread_cond_destroy(&(*cp)->wake);
+  if ((*cp)->dirp != NULL )
+    closedir((*cp)->dirp);
+  free((*cp)->in);
+  free((*cp)->out);
+  free(*cp);
+  *cp = NULL;
+}
+
+/**
+ * Runs the compactor: recover, then pack the oldest dump files whenever
+ * there are enough of them.
+ */
+static void *compact_main(void *arg) {
+  Compactor *cp = (Compactor*) arg;
+  pid_t tid = syscall(SYS_gettid);
+  struct timespec until;
+  int n, total, packed = 0;
+
+  /* Only use the card and CPU when nothing else wants them */
+  if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid,
+      IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) < 0 && cp->verbose)
+    perror("[R] ioprio_set");
+  setpriority(PRIO_PROCESS, tid, COMPACT_NICE);
+
+  pthread_mutex_lock(&cp->spool);
+  compact_recover(cp);
+  pthread_mutex_unlock(&cp->spool);
+
+  while (1) {
+    /* Carry straight on while there is a backlog */
+    pthread_mutex_lock(&cp->lock);
+    if (!packed && !cp->stop) {
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_sec += COMPACT_INTERVAL;
+      pthread_cond_timedwait(&cp->wake, &cp->lock, &until);
+    }
+    pthread_mutex_unlock(&cp->lock);
+    if (stopping(cp))
+      break;
+
+    packed = 0;
+    if (cp->config->compact_files == 0)
+      continue;
+    pthread_mutex_lock(&cp->spool);
+    if ((n = compact_list(cp, &total)) > 0
+        && total >= (int) cp->config->compact_files)
+      packed = compact_pack(cp, n) > 0;
+    pthread_mutex_unlock(&cp->spool);
+  }
+  return NULL ;
+}
+
+/**
+ * Finishes what a relay that died while compacting left: deletes temporary
+ * packs, and the dump files of packs that were renamed into place.
+ */
+static void compact_recover(Compactor *cp) {
+  struct dirent *entry;
+  char path[256], name[PACK_NAME_MAX];
+  Segment seg;
+  PackEntry e;
+  DIR *dirp;
+  int records, i;
+
+  if ((dirp = opendir(cp->dir)) == NULL ) {
+    perror("[R] compact");
+    return;
+  }
+  while ((entry = readdir(dirp)) != NULL ) {
+    snprintf(path, sizeof path, "%s%s", cp->dir, entry->d_name);
+    if (strncmp(entry->d_name, "tmp-pack_", 9) == 0) {
+      unlink(path);
+      continue;
+    }
+    if (strncmp(entry->d_name, "client-pack_", 12) != 0
+        || segment_open(&seg, path) < 0)
+      continue;
+    /* A pack that does not check out is set aside when it is uploaded */
+    records = pack_verify(seg.data, seg.size);
+    for (i = 0; i < records; ++i) {
+      pack_entry(seg.data, seg.size, i, &e);
+      pack_name(name, "client-dump_", e.stamp);
+      snprintf(path, sizeof path, "%s%s", cp->dir, name);
+      if (unlink(path) == 0)
+        ++cp->recovered;
+    }
+    segment_close(&seg);
+  }
+  closedir(dirp);
+  if (cp->recovered > 0)
+    fprintf(stderr, "[R] Deleted %lu dump files already packed\n",
+        cp->recovered);
+}
+
+/**
+ * Lists the oldest dump files old enough to pack, up to #PACK_RECORDS_MAX
+ * of them, into cp->stamps.
+ *
+ * @param total Set to the number of dump files old enough to pack
+ * @return The number listed, or -1 if the directory cannot be read
+ */
+static int compact_list(Compactor *cp, int *total) {
+  struct dirent *entry;
+  struct timeval now;
+  uint64_t newest, stamp;
+  int n = 0, i;
+
+  if (cp->dirp == NULL && (cp->dirp = opendir(cp->dir)) == NULL ) {
+    perror("[R] compact");
+    return -1;
+  }
+  rewinddir(cp->dirp);
+  gettimeofday(&now, NULL );
+  newest = ((uint64_t) now.tv_sec - COMPACT_MIN_AGE) * 1000000 + now.tv_usec;
+
+  *total = 0;
+  while ((entry = readdir(cp->dirp)) != NULL ) {
+    if (strncmp(entry->d_name, "client-dump_", 12) != 0
+        || (stamp = pack_stamp(entry->d_name)) == 0 || stamp > newest)
+      continue;
+    ++*total;
+    if (n == PACK_RECORDS_MAX && stamp >= cp->stamps[n - 1])
+      continue;
+    /* Insert in order, dropping the newest if need be */
+    i = n < PACK_RECORDS_MAX ? n++ : n - 1;
+    for (; i > 0 && cp->stamps[i - 1] > stamp; --i)
+      cp->stamps[i] = cp->stamps[i - 1];
+    cp->stamps[i] = stamp;
+  }
+  return n;
+}
+
+/**
+ * Packs the listed dump files: writes the pack under a temporary name,
+ * flushes it, renames it into place, flushes the directory and deletes the
+ * dump files. Dump files that cannot be read or fail their checksum are
+ * left for the relay to deal with, and all of them are kept if the directory
+ * cannot be flushed.
+ *
+ * @return The number of dump files packed, 0 if none, or -1 on error
+ */
+static int compact_pack(Compactor *cp, int n) {
+  char tmp[256], path[256], name[PACK_NAME_MAX];
+  PackHeader h = { PACK_MAGIC, PACK_VERSION };
+  PackTrailer t;
+  uint32_t crc, offset;
+  size_t len;
+  int fd, records = 0, i;
+
+  pack_name(name, "tmp-pack_", cp->stamps[0]);
+  snprintf(tmp, sizeof tmp, "%s%s", cp->dir, name);
+  if ((fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0) {
+    perror("[R] compact");
+    return -1;
+  }
+  if (write_all(fd, &h, sizeof h) < 0)
+    goto fail;
+  crc = crc32c(0, &h, sizeof h);
+  offset = sizeof h;
+
+  for (i = 0; i < n; ++i) {
+    if (stopping(cp))
+      goto abandon;
+    if (compact_read(cp, cp->stamps[i]) < 0)
+      continue;
+    len = pack_record(cp->in, cp->stamps[i], cp->out);
+    if (write_all(fd, cp->out, len) < 0)
+      goto fail;
+    crc = crc32c(crc, cp->out, len);
+    cp->index[records].stamp = cp->stamps[i];
+    cp->index[records].offset = offset;
+    cp->index[records].length = len;
+    cp->taken[records++] = i;
+    offset += len;
+  }
+  if (records == 0) {
+    close(fd);
+    unlink(tmp);
+    return 0;
+  }
+
+  len = sizeof(PackEntry) * records;
+  t.index = offset;
+  t.records = records;
+  t.crc = crc32c(crc, cp->index, len);
+  t.magic = PACK_MAGIC;
+  if (write_all(fd, cp->index, len) < 0 || write_all(fd, &t, sizeof t) < 0
+      || fdatasync(fd) < 0)
+    goto fail;
+  close(fd);
+
+  /* Durable before any dump file goes */
+  pack_name(name, "client-pack_", cp->stamps[0]);
+  snprintf(path, sizeof path, "%s%s", cp->dir, name);
+  if (rename(tmp, path) < 0) {
+    perror("[R] compact");
+    unlink(tmp);
+    return -1;
+  }
+  /* Until the rename is on the card, the dump files are the only copy;
+   * compact_recover deletes them once the pack is known to have stuck */
+  if (sync_dir(cp->dir) < 0) {
+    perror("[R] compact");
+    return -1;
+  }
+  for (i = 0; i < records; ++i) {
+    pack_name(name, "client-dump_", cp->stamps[cp->taken[i]]);
+    snprintf(path, sizeof path, "%s%s", cp->dir, name);
+    if (unlink(path) < 0)
+      perror("[R] compact");
+  }
+
+  ++cp->packs;
+  cp->dumps += records;
+  cp->bytes_in += (unsigned long long) records * sizeof(Buffer);
+  cp->bytes_out += offset + len + sizeof t;
+  TRACE(TRACE_COMPACT, records, offset + len + sizeof t);
+  if (cp->verbose)
+    printf("[R] Packed %d dump files into %u bytes\n", records,
+        (unsigned) (offset + len + sizeof t));
+  return records;
+
+  fail: perror("[R] compact");
+  abandon: close(fd);
+  unlink(tmp);
+  return -1;
+}
+
+/**
+ * Reads a dump file into cp->in and checks it.
+ *
+ * @return 0 if it may be packed, -1 otherwise
+ */
+static int compact_read(Compactor *cp, uint64_t stamp) {
+  char name[PACK_NAME_MAX], path[256];
+  char *data = (char*) cp->in;
+  size_t left = sizeof(Buffer);
+  struct stat dump_stat;
+  ssize_t got;
+  int fd;
+
+  pack_name(name, "client-dump_", stamp);
+  snprintf(path, sizeof path, "%s%s", cp->dir, name);
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return -1;
+  /* Dump files of another size are cut short; the relay sets them aside */
+  if (fstat(fd, &dump_stat) < 0 || dump_stat.st_size != sizeof(Buffer)) {
+    close(fd);
+    return -1;
+  }
+  while (left > 0 && (got = read(fd, data, left)) != 0) {
+    if (got < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    data += got;
+    left -= got;
+  }
+  /* Keep the dump files out of the page cache once read */
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+
+  return left == 0 && cp->in->id != 0 && cp->in->capacity != 0
+      && cp->in->size <= cp->in->capacity
+      && cp->in->capacity <= __BUFFER_CAPACITY
+      && crc32c(0, cp->in->data, cp->in->size) == cp->in->crc ? 0 : -1;
+}
+
+/** Writes all of data, or returns -1 */
+static int write_all(int fd, const void *data, size_t len) {
+  const char *p = (const char*) data;
+  ssize_t n;
+
+  while (len > 0) {
+    if ((n = write(fd, p, len)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/** Flushes a directory, so that renames and new files in it are durable */
+static int sync_dir(const char *dir) {
+  int fd, ret;
+
+  if ((fd = open(dir, O_RDONLY)) < 0)
+    return -1;
+  ret = fsync(fd);
+  close(fd);
+  return ret;
+}
+
+/** Checks whether the compactor is to stop */
+static int stopping(Compactor *cp) {
+  int stop;
+  pthread_mutex_lock(&cp->lock);
+  stop = cp->stop;
+  pthread_mutex_unlock(&cp->lock);
+  return stop;
+}
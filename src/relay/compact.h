@@ -0,0 +1,117 @@
+/**
+ * @file compact.h
+ * Background compaction of dump files into packs
+ *
+ * While the relay is in charge, a compactor thread looks at the spool every
+ * #COMPACT_INTERVAL seconds. Once it holds at least the configured number of
+ * dump files (see config.h), the oldest are merged, in time order, into a
+ * pack (see pack.h) of up to #PACK_RECORDS_MAX of them at a time, until
+ * fewer than that are left. The thread runs at idle I/O priority and the
+ * lowest CPU priority, so it only uses the SD card and CPU when nothing else
+ * wants them.
+ *
+ * A pack is written under a temporary name, flushed to the card, renamed
+ * into place and the directory flushed, and only then are the dump files it
+ * holds deleted. If the power goes in between, the compactor finds the pack
+ * when it starts again and deletes the dump files it lists; a temporary
+ * pack is simply deleted, since its dump files are all still there.
+ *
+ * The relay uploads dump files and packs alike, and holds the compactor off
+ * while it does, so a dump file is never both uploaded and packed. The
+ * relay never waits for the compactor: it leaves the spool for the next pass
+ * if the compactor has it.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#ifndef _RELAY_COMPACT_H
+#define _RELAY_COMPACT_H
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "../shared/buffer.h"
+#include "../shared/config.h"
+#include "../shared/pack.h"
+
+/** Seconds between looks at the spool */
+#define COMPACT_INTERVAL 5
+/** Seconds a dump file is left alone after it was written */
+#define COMPACT_MIN_AGE 2
+/** CPU niceness of the compactor thread */
+#define COMPACT_NICE 19
+
+/**
+ * The compactor.
+ */
+struct compactor_st {
+  pthread_t thread;
+  pthread_mutex_t spool; /**< Held while packing, or by the relay uploading */
+  pthread_mutex_t lock; /**< Guards stop */
+  pthread_cond_t wake; /**< Signalled to stop the thread */
+  int started; /**< Set once the thread runs */
+  int stop; /**< Set to stop the thread */
+  const char *dir; /**< The spool directory, ending in a slash */
+  const Config *config; /**< The relay's configuration */
+  DIR *dirp; /**< The spool directory, kept open */
+  uint64_t stamps[PACK_RECORDS_MAX]; /**< Oldest dump files, sorted */
+  int taken[PACK_RECORDS_MAX]; /**< Which of them went into the pack */
+  PackEntry index[PACK_RECORDS_MAX]; /**< Index of the pack being written */
+  Buffer *in; /**< The dump file being packed */
+  char *out; /**< Its record */
+  unsigned long packs; /**< Packs written */
+  unsigned long dumps; /**< Dump files packed */
+  unsigned long long bytes_in; /**< Bytes of dump files packed */
+  unsigned long long bytes_out; /**< Bytes of packs written */
+  unsigned long recovered; /**< Dump files deleted after a crash */
+  int verbose;
+};
+
+typedef struct compactor_st Compactor;
+
+/**
+ * Allocates a compactor for a spool directory. The thread is only started
+ * by #compactor_start, once the relay is in charge.
+ *
+ * @param dir The spool directory, ending in a slash
+ * @param config The relay's configuration, read for compact_files
+ * @return A malloc'd compactor to be freed with #compactor_cleanup, or NULL
+ */
+Compactor* compactor_init(const char *dir, const Config *config, int verbose);
+
+/**
+ * Starts the compactor thread, which first finishes any compaction a
+ * previous relay left half done.
+ *
+ * @return 0 if successful, -1 otherwise
+ */
+int compactor_start(Compactor *cp);
+
+/**
+ * Keeps the compactor off the spool, without waiting for it.
+ *
+ * @param cp The compactor, or NULL if there is none
+ * @return 0 if the spool is the caller's until #compactor_release, -1 if
+ * the compactor has it
+ */
+int compactor_hold(Compactor *cp);
+
+/**
+ * Lets the compactor back onto the spool after #compactor_hold.
+ */
+void compactor_release(Compactor *cp);
+
+/**
+ * Writes a line of statistics.
+ */
+void compactor_print(Compactor *cp, FILE *out);
+
+/**
+ * Stops the thread, abandoning any pack half written, and frees the
+ * compactor. The specified handle will be NULL after this function returns.
+ */
+void compactor_cleanup(Compactor **cp);
+
+#endif
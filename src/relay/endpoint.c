@@ -0,0 +1,199 @@
+/**
+ * @file endpoint.c
+ * Implementation of endpoint selection and health checking
+ * @see endpoint.h
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "endpoint.h"
+
+/**
+ * Dump files and live buffers are uploaded from different threads (see
+ * pipeline.h), so the endpoints are only touched with this held.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t discard(void* buffer, size_t size, size_t nmemb, void* userp);
+static void endpoint_probe(Endpoints *e, Endpoint *ep, time_t now);
+static int parse(Endpoint *ep, const char *list);
+
+/**
+ * Parses the endpoint list
+ * @see endpoint.h
+ */
+int endpoints_init(Endpoints *e, const char *list) {
+  e->next = 0;
+  if ((e->count = parse(e->ep, list)) == 0)
+    return -1;
+
+  if ((e->probe = curl_easy_init()) == NULL )
+    return -1;
+  curl_easy_setopt(e->probe, CURLOPT_WRITEFUNCTION, discard);
+  curl_easy_setopt(e->probe, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(e->probe, CURLOPT_TIMEOUT, (long) ENDPOINT_PROBE_TIMEOUT);
+  curl_easy_setopt(e->probe, CURLOPT_NOSIGNAL, 1L);
+  return 0;
+}
+
+/**
+ * Replaces the endpoint list
+ * @see endpoint.h
+ */
+int endpoints_update(Endpoints *e, const char *list) {
+  Endpoint next[ENDPOINT_MAX];
+  int count, i, j;
+
+  if ((count = parse(next, list)) == 0)
+    return -1;
+  pthread_mutex_lock(&lock);
+  for (i = 0; i < count; ++i)
+    for (j = 0; j < e->count; ++j)
+      if (strcmp(next[i].url, e->ep[j].url) == 0) {
+        next[i] = e->ep[j];
+        break;
+      }
+  memcpy(e->ep, next, sizeof(Endpoint) * count);
+  e->count = count;
+  e->next = 0;
+  pthread_mutex_unlock(&lock);
+  return 0;
+}
+
+/**
+ * Chooses the next endpoint
+ * @see endpoint.h
+ */
+Endpoint* endpoints_pick(Endpoints *e) {
+  Endpoint *picked = NULL;
+  time_t now = time(NULL );
+  int i;
+
+  pthread_mutex_lock(&lock);
+  for (i = 0; i < e->count; ++i)
+    if (!e->ep[i].healthy && now >= e->ep[i].probe_at)
+      endpoint_probe(e, &e->ep[i], now);
+
+  for (i = 0; i < e->count; ++i) {
+    Endpoint *ep = &e->ep[(e->next + i) % e->count];
+    if (ep->healthy) {
+      e->next = (e->next + i + 1) % e->count;
+      picked = ep;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return picked;
+}
+
+/**
+ * Points a curl handle at an endpoint
+ * @see endpoint.h
+ */
+void endpoint_aim(Endpoint *ep, CURL *curl) {
+  pthread_mutex_lock(&lock);
+  curl_easy_setopt(curl, CURLOPT_URL, ep->url);
+  pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Records the outcome of a request
+ * @see endpoint.h
+ */
+void endpoint_report(Endpoint *ep, int ok, double secs, size_t bytes) {
+  pthread_mutex_lock(&lock);
+  ++ep->requests;
+  if (!ok) {
+    ++ep->errors;
+    if (ep->healthy)
+      fprintf(stderr, "[R] Endpoint %s is down, failing over\n", ep->url);
+    ep->healthy = 0;
+    ep->probe_at = time(NULL ) + ep->backoff;
+  } else {
+    ep->bytes += bytes;
+    /* Moving average over roughly the last eight requests */
+    ep->latency = ep->requests == 1 + ep->errors ?
+        secs : ep->latency + (secs - ep->latency) / 8;
+    if (secs > ep->latency_max)
+      ep->latency_max = secs;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Writes endpoint statistics
+ * @see endpoint.h
+ */
+void endpoints_print(Endpoints *e, FILE *out) {
+  int i;
+  pthread_mutex_lock(&lock);
+  for (i = 0; i < e->count; ++i) {
+    Endpoint *ep = &e->ep[i];
+    fprintf(out, "endpoint %s healthy=%d requests=%lu errors=%lu bytes=%llu "
+        "latency_ms=%.1f latency_max_ms=%.1f\n", ep->url, ep->healthy,
+        ep->requests, ep->errors, ep->bytes, ep->latency * 1000,
+        ep->latency_max * 1000);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Frees the endpoint list
+ * @see endpoint.h
+ */
+void endpoints_cleanup(Endpoints *e) {
+  curl_easy_cleanup(e->probe);
+  e->count = 0;
+}
+
+static size_t discard(void* buffer, size_t size, size_t nmemb, void* userp) {
+  return size * nmemb;
+}
+
+/**
+ * Health-checks an unhealthy endpoint with a GET, returning it to rotation if
+ * it answers and doubling its backoff otherwise.
+ */
+static void endpoint_probe(Endpoints *e, Endpoint *ep, time_t now) {
+  curl_easy_setopt(e->probe, CURLOPT_URL, ep->url);
+  if (curl_easy_perform(e->probe) == CURLE_OK) {
+    fprintf(stderr, "[R] Endpoint %s is back up\n", ep->url);
+    ep->healthy = 1;
+    ep->backoff = ENDPOINT_BACKOFF_MIN;
+    return;
+  }
+  ep->backoff *= 2;
+  if (ep->backoff > ENDPOINT_BACKOFF_MAX)
+    ep->backoff = ENDPOINT_BACKOFF_MAX;
+  ep->probe_at = now + ep->backoff;
+}
+
+/**
+ * Parses a comma separated list of URLs into healthy endpoints, skipping any
+ * too long to keep.
+ *
+ * @return The number of endpoints parsed
+ */
+static int parse(Endpoint *ep, const char *list) {
+  const char *start = list;
+  int count = 0;
+
+  while (*start != '\0' && count < ENDPOINT_MAX) {
+    size_t len = strcspn(start, ",");
+    if (len > 0 && len < ENDPOINT_URL_MAX) {
+      memset(&ep[count], 0, sizeof(Endpoint));
+      memcpy(ep[count].url, start, len);
+      ep[count].healthy = 1;
+      ep[count].backoff = ENDPOINT_BACKOFF_MIN;
+      ++count;
+    }
+    start += len;
+    if (*start == ',')
+      ++start;
+  }
+  return count;
+}
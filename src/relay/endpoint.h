@@ -0,0 +1,121 @@
+/**
+ * @file endpoint.h
+ * Ingest server endpoints for the relay
+ *
+ * The relay may be given several ingest servers as a comma separated list of
+ * URLs. Uploads are spread round-robin across the endpoints that are healthy.
+ * An endpoint that fails a request is marked unhealthy at once, so the relay
+ * can move on to the next one without retrying the same host. Unhealthy
+ * endpoints are health-checked with a lightweight GET once their backoff
+ * expires, and rejoin the rotation when they answer.
+ *
+ * Per-endpoint request counts, errors, bytes and latency are kept for the
+ * relay's metrics snapshot. The endpoints may be used from several threads,
+ * and the list may be replaced while they are (see config.h); an endpoint
+ * kept across the change keeps its statistics.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#ifndef _RELAY_ENDPOINT_H
+#define _RELAY_ENDPOINT_H
+
+#include <curl/curl.h>
+#include <stdio.h>
+#include <time.h>
+
+/** Maximum number of endpoints the relay can be given */
+#define ENDPOINT_MAX 8
+/** Room for the URL of an endpoint */
+#define ENDPOINT_URL_MAX 256
+
+/** Seconds before a failed endpoint is first health-checked */
+#define ENDPOINT_BACKOFF_MIN 2
+/** Upper bound on the time between health checks of a failed endpoint */
+#define ENDPOINT_BACKOFF_MAX 60
+/** Seconds a health check may take */
+#define ENDPOINT_PROBE_TIMEOUT 2
+
+/**
+ * One ingest server and its statistics.
+ */
+struct endpoint_st {
+  char url[ENDPOINT_URL_MAX]; /**< The server's URL */
+  int healthy; /**< Set while the endpoint is in the upload rotation */
+  time_t probe_at; /**< When an unhealthy endpoint is next health-checked */
+  int backoff; /**< Current seconds between health checks */
+  unsigned long requests; /**< Requests attempted */
+  unsigned long errors; /**< Requests that failed */
+  unsigned long long bytes; /**< Bytes uploaded successfully */
+  double latency; /**< Moving average of request time, in seconds */
+  double latency_max; /**< Longest successful request, in seconds */
+};
+
+typedef struct endpoint_st Endpoint;
+
+/**
+ * The set of endpoints the relay uploads to.
+ */
+struct endpoints_st {
+  Endpoint ep[ENDPOINT_MAX];
+  int count; /**< Number of endpoints in ep */
+  int next; /**< Index at which the round-robin search starts */
+  CURL *probe; /**< Handle used for health checks */
+};
+
+typedef struct endpoints_st Endpoints;
+
+/**
+ * Parses a comma separated list of URLs into a set of endpoints, all
+ * initially healthy.
+ *
+ * @return 0 if successful, -1 if the list is empty or curl failed
+ */
+int endpoints_init(Endpoints *e, const char *list);
+
+/**
+ * Replaces the endpoints with a new comma separated list of URLs. Endpoints
+ * on both lists keep their health and statistics, new ones start healthy.
+ * Requests under way finish against the endpoint they picked.
+ *
+ * @return 0 if successful, -1 if the list is empty, leaving the endpoints
+ * as they were
+ */
+int endpoints_update(Endpoints *e, const char *list);
+
+/**
+ * Chooses the endpoint for the next upload. Any unhealthy endpoint whose
+ * backoff has expired is health-checked first.
+ *
+ * @return The next healthy endpoint in rotation, or NULL if none is healthy
+ */
+Endpoint* endpoints_pick(Endpoints *e);
+
+/**
+ * Points a curl handle at an endpoint. This copies the URL under the lock,
+ * so #endpoints_update cannot change it halfway.
+ */
+void endpoint_aim(Endpoint *ep, CURL *curl);
+
+/**
+ * Records the outcome of a request made to an endpoint. A failure takes the
+ * endpoint out of rotation until it passes a health check.
+ *
+ * @param ep The endpoint the request was made to
+ * @param ok Non-zero if the request succeeded
+ * @param secs How long the request took
+ * @param bytes How many bytes were uploaded
+ */
+void endpoint_report(Endpoint *ep, int ok, double secs, size_t bytes);
+
+/**
+ * Writes one line of statistics per endpoint.
+ */
+void endpoints_print(Endpoints *e, FILE *out);
+
+/**
+ * Frees the endpoints' health check handle.
+ */
+void endpoints_cleanup(Endpoints *e);
+
+#endif
@@ -0,0 +1,180 @@
+/**
+ * @file firefly.c
+ * Implementation of Firefly packet framing and unpacking
+ * @see firefly.h
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <string.h>
+
+#include "firefly.h"
+#include "../shared/trace.h"
+
+static size_t parse_one(Firefly *f, const uint8_t *p, size_t avail,
+    int16_t *out, size_t *n);
+static void skip(Firefly *f, size_t bytes);
+
+/**
+ * Allocates a packet parser
+ * @see firefly.h
+ */
+Firefly* firefly_init() {
+  Firefly *f;
+
+  if ((f = (Firefly*) calloc(1, sizeof(Firefly))) == NULL )
+    return NULL ;
+  f->seq = -1;
+  return f;
+}
+
+/**
+ * Unpacks the packets in a block
+ * @see firefly.h
+ */
+size_t firefly_parse(Firefly *f, const char *in, size_t len, int16_t *out) {
+  const uint8_t *p = (const uint8_t*) in;
+  size_t n = 0, at = 0, used;
+
+  /* Finish with the bytes held over, joined to the start of this block. A
+   * packet starting in them ends within FIREFLY_PACKET_MAX bytes. */
+  if (f->held > 0) {
+    size_t take = len < FIREFLY_PACKET_MAX ? len : FIREFLY_PACKET_MAX;
+    size_t end = f->held + take;
+
+    memcpy(f->join + f->held, p, take);
+    while (at < f->held
+        && (used = parse_one(f, f->join + at, end - at, out, &n)) > 0)
+      at += used;
+    if (at < f->held) {
+      /* The whole block was too short to finish the packet */
+      memmove(f->join, f->join + at, end - at);
+      f->held = end - at;
+      return n;
+    }
+    at -= f->held;
+    f->held = 0;
+  }
+
+  while ((used = parse_one(f, p + at, len - at, out, &n)) > 0)
+    at += used;
+  /* What is left is the start of a packet, shorter than any packet */
+  memcpy(f->join, p + at, len - at);
+  f->held = len - at;
+  return n;
+}
+
+/**
+ * Unpacks 12-bit samples
+ * @see firefly.h
+ */
+void firefly_unpack(const uint8_t *in, size_t pairs, int16_t *out) {
+  /* Each 12-bit field is moved into a 16-bit lane with its top four bits
+   * clear. Flipping bit 11 turns the offset binary value into a 12-bit two's
+   * complement one, and the shift by four then moves every lane's sign bit
+   * to bit 15 without carrying into the next lane. */
+#if defined(__x86_64__) && !defined(FIREFLY_SCALAR)
+  for (; pairs >= 2; pairs -= 2, in += 6, out += 4) {
+    uint64_t x = 0, y;
+    memcpy(&x, in, 6);
+    y = (x & 0xfffULL) | (x << 4 & 0xfff0000ULL) | (x << 8 & 0xfff00000000ULL)
+        | (x << 12 & 0xfff000000000000ULL);
+    y = (y ^ 0x0800080008000800ULL) << 4;
+    memcpy(out, &y, sizeof y);
+  }
+#endif
+  for (; pairs > 0; --pairs, in += 3, out += 2) {
+    uint32_t x = in[0] | in[1] << 8 | in[2] << 16, y;
+    y = (x & 0xfff) | (x << 4 & 0xfff0000);
+    y = (y ^ 0x08000800) << 4;
+    memcpy(out, &y, sizeof y);
+  }
+}
+
+/**
+ * Writes a line of statistics
+ * @see firefly.h
+ */
+void firefly_print(Firefly *f, FILE *out) {
+  fprintf(out, "firefly packets=%lu samples=%llu resyncs=%lu skipped=%llu "
+      "bad=%lu lost=%lu\n", f->packets, f->samples, f->resyncs, f->skipped,
+      f->bad, f->lost);
+}
+
+/**
+ * Frees a packet parser
+ * @see firefly.h
+ */
+void firefly_cleanup(Firefly **f) {
+  free(*f);
+  *f = NULL;
+}
+
+/**
+ * Parses what starts at p: a packet, whose samples are written to out + *n,
+ * or bytes that cannot start one.
+ *
+ * @param avail Bytes available at p
+ * @param n Samples in out, increased by those of a packet
+ * @return Bytes consumed, or 0 if p holds the start of a packet that is cut
+ * off
+ */
+static size_t parse_one(Firefly *f, const uint8_t *p, size_t avail,
+    int16_t *out, size_t *n) {
+  const uint8_t *sync;
+  uint32_t sum1 = 0, sum2 = 0;
+  size_t count, len, i;
+
+  if (avail == 0)
+    return 0;
+  if (p[0] != FIREFLY_SYNC0) {
+    sync = (const uint8_t*) memchr(p + 1, FIREFLY_SYNC0, avail - 1);
+    skip(f, sync != NULL ? (size_t) (sync - p) : avail);
+    return sync != NULL ? (size_t) (sync - p) : avail;
+  }
+  if (avail >= 2 && p[1] != FIREFLY_SYNC1) {
+    skip(f, 1);
+    return 1;
+  }
+  if (avail < 4)
+    return 0;
+  count = p[3];
+  if (count == 0 || (count & 1) || count > FIREFLY_SAMPLES_MAX) {
+    skip(f, 1);
+    return 1;
+  }
+  len = FIREFLY_OVERHEAD + count / 2 * 3;
+  if (avail < len)
+    return 0;
+
+  /* Fletcher-16, reduced once: the sums cannot overflow a packet this short */
+  for (i = 2; i < len - 2; ++i) {
+    sum1 += p[i];
+    sum2 += sum1;
+  }
+  if (sum1 % 255 != p[len - 2] || sum2 % 255 != p[len - 1]) {
+    ++f->bad;
+    skip(f, 1);
+    return 1;
+  }
+
+  if (f->seq >= 0 && p[2] != ((f->seq + 1) & 0xff))
+    f->lost += (uint8_t) (p[2] - f->seq - 1);
+  f->seq = p[2];
+  f->synced = 1;
+  firefly_unpack(p + 4, count / 2, out + *n);
+  *n += count;
+  ++f->packets;
+  f->samples += count;
+  return len;
+}
+
+/** Counts bytes that are not part of a packet */
+static void skip(Firefly *f, size_t bytes) {
+  if (f->synced) {
+    ++f->resyncs;
+    TRACE(TRACE_RESYNC, f->seq, f->packets);
+  }
+  f->synced = 0;
+  f->skipped += bytes;
+}
@@ -0,0 +1,118 @@
+/**
+ * @file firefly.h
+ * Framing and unpacking of the Firefly's sample packets
+ *
+ * With packet framing enabled in its firmware, the Firefly sends its ADC
+ * samples in small packets instead of as a bare stream, so that a byte lost
+ * or garbled on the serial line costs one packet rather than shifting every
+ * sample after it. The consumer still moves the bytes as read; the relay
+ * finds the packets in each sealed buffer, off the consumer's realtime path,
+ * and unpacks their samples into an aligned array of signed 16-bit values
+ * for the encoders and the server.
+ *
+ * Packet format
+ * -------------
+ * A packet is #FIREFLY_SYNC0 and #FIREFLY_SYNC1, a sequence number that
+ * counts up by one per packet, the number of samples (even, from 2 to
+ * #FIREFLY_SAMPLES_MAX), the samples, and a Fletcher-16 checksum of the
+ * sequence number, count and samples (sum1, then sum2). Samples are unsigned
+ * 12-bit values packed two to three bytes, the first in the low 12 bits of
+ * the little-endian 24-bit group. They are unpacked to (value - 2048) * 16,
+ * so that full scale of the ADC is full scale of an int16_t.
+ *
+ * Resynchronization
+ * -----------------
+ * A packet that does not start with the sync bytes, has an impossible count
+ * or fails its checksum is skipped one byte at a time until the next valid
+ * packet, so a sync pattern inside sample data cannot hold the parser for
+ * long. Packets may straddle buffers: the bytes of a packet cut off at the
+ * end of one buffer are held over and joined to the start of the next. Gaps
+ * in the sequence numbers count the packets lost on the line.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#ifndef _RELAY_FIREFLY_H
+#define _RELAY_FIREFLY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/** First byte of every packet */
+#define FIREFLY_SYNC0 0xa5
+/** Second byte of every packet */
+#define FIREFLY_SYNC1 0x5a
+/** Largest number of samples in a packet */
+#define FIREFLY_SAMPLES_MAX 64
+/** Bytes of a packet besides its samples: sync, sequence, count, checksum */
+#define FIREFLY_OVERHEAD 6
+/** Largest packet */
+#define FIREFLY_PACKET_MAX (FIREFLY_OVERHEAD + FIREFLY_SAMPLES_MAX / 2 * 3)
+/** Most samples found in len bytes, with a packet held over before them */
+#define FIREFLY_SAMPLES_BOUND(len) (((len) + FIREFLY_PACKET_MAX) / 3 * 2)
+
+/**
+ * The state of the packet parser.
+ */
+struct firefly_st {
+  /** Bytes held over from the last block, then the start of the next */
+  uint8_t join[2 * FIREFLY_PACKET_MAX];
+  size_t held; /**< Bytes held over in join */
+  int seq; /**< Sequence number of the last packet, or -1 before the first */
+  int synced; /**< Set while packets follow each other without a gap */
+  unsigned long packets; /**< Valid packets */
+  unsigned long long samples; /**< Samples unpacked */
+  unsigned long resyncs; /**< Times the parser lost the packets */
+  unsigned long long skipped; /**< Bytes skipped looking for a packet */
+  unsigned long bad; /**< Packets that failed their checksum */
+  unsigned long lost; /**< Packets missing from the sequence */
+};
+
+typedef struct firefly_st Firefly;
+
+/**
+ * Allocates a packet parser.
+ *
+ * @return A malloc'd handle to be freed with #firefly_cleanup, or NULL
+ */
+Firefly* firefly_init();
+
+/**
+ * Finds the packets in the next block of the stream and unpacks their
+ * samples. The end of a packet cut off by the end of the block is held over
+ * for the next call.
+ *
+ * @param f The parser
+ * @param in The block
+ * @param len Bytes in the block
+ * @param out Where to write the samples; must hold
+ * #FIREFLY_SAMPLES_BOUND(len) of them
+ * @return The number of samples written to out
+ */
+size_t firefly_parse(Firefly *f, const char *in, size_t len, int16_t *out);
+
+/**
+ * Unpacks pairs of 12-bit samples, three bytes to each pair, into signed
+ * 16-bit samples. Works on whole 24-bit groups at a time, and on x86-64
+ * builds on two groups in one 64-bit word, unless FIREFLY_SCALAR is defined
+ * to keep to one group at a time as the board does.
+ *
+ * @param in The packed samples
+ * @param pairs The number of pairs
+ * @param out Where to write 2 * pairs samples
+ */
+void firefly_unpack(const uint8_t *in, size_t pairs, int16_t *out);
+
+/**
+ * Writes a line of statistics.
+ */
+void firefly_print(Firefly *f, FILE *out);
+
+/**
+ * Frees the parser. The specified handle will be NULL after this function
+ * returns.
+ */
+void firefly_cleanup(Firefly **f);
+
+#endif
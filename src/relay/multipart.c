@@ -0,0 +1,153 @@
+/**
+ * @file multipart.c
+ * Implementation of preallocated multipart request bodies
+ * @see multipart.h
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "multipart.h"
+
+/** Ends the body */
+static const char closing[] = "\r\n--" MULTIPART_BOUNDARY "--\r\n";
+
+/**
+ * Sets up the request headers
+ * @see multipart.h
+ */
+void multipart_init(Multipart *m) {
+  m->headers[0].data = (char*) "Expect:";
+  m->headers[0].next = &m->headers[1];
+  m->headers[1].data = (char*) "Content-Type: multipart/form-data; "
+      "boundary=" MULTIPART_BOUNDARY;
+  m->headers[1].next = NULL;
+  multipart_reset(m);
+}
+
+/**
+ * Empties the body
+ * @see multipart.h
+ */
+void multipart_reset(Multipart *m) {
+  m->count = 0;
+  m->total = sizeof closing - 1;
+  m->part = 0;
+  m->off = 0;
+}
+
+/**
+ * Adds a part
+ * @see multipart.h
+ */
+int multipart_add(Multipart *m, const char *filename, const char *headers,
+    const char *data, Segment *seg, size_t len) {
+  Part *p;
+  int n;
+
+  if (m->count == MULTIPART_PARTS)
+    return -1;
+  p = &m->parts[m->count];
+  /* Every part but the first follows the line break ending the one before */
+  n = snprintf(p->head, sizeof p->head, "%s--" MULTIPART_BOUNDARY "\r\n"
+      "Content-Disposition: form-data; name=\"sendfile\"; filename=\"%s\"\r\n"
+      "Content-Type: application/octet-stream\r\n%s\r\n",
+      m->count > 0 ? "\r\n" : "", filename, headers);
+  if (n < 0 || (size_t) n >= sizeof p->head)
+    return -1;
+  p->head_len = n;
+  p->data = data;
+  p->seg = seg;
+  p->seg_start = seg != NULL ? seg->pos : 0;
+  p->len = len;
+  m->total += p->head_len + len;
+  ++m->count;
+  return 0;
+}
+
+/**
+ * Configures a handle to POST the body
+ * @see multipart.h
+ */
+void multipart_post(Multipart *m, CURL *curl) {
+  multipart_seek(m, 0, SEEK_SET);
+  curl_easy_setopt(curl, CURLOPT_POST, 1L);
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, m->headers);
+  curl_easy_setopt(curl, CURLOPT_READFUNCTION, multipart_read);
+  curl_easy_setopt(curl, CURLOPT_READDATA, m);
+  curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, multipart_seek);
+  curl_easy_setopt(curl, CURLOPT_SEEKDATA, m);
+  curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) m->total);
+}
+
+/**
+ * Copies the next bytes of the body
+ * @see multipart.h
+ */
+size_t multipart_read(char *dest, size_t size, size_t nmemb, void *userp) {
+  Multipart *m = (Multipart*) userp;
+  size_t room = size * nmemb;
+  size_t done = 0;
+  size_t n;
+
+  while (done < room && m->part <= m->count) {
+    const char *from;
+    size_t have;
+
+    if (m->part == m->count) { /* the closing delimiter */
+      from = closing + m->off;
+      have = sizeof closing - 1 - m->off;
+    } else if (m->off < m->parts[m->part].head_len) {
+      from = m->parts[m->part].head + m->off;
+      have = m->parts[m->part].head_len - m->off;
+    } else {
+      Part *p = &m->parts[m->part];
+      size_t at = m->off - p->head_len;
+      have = p->len - at;
+      if (have > 0 && p->data == NULL ) {
+        /* Through the segment, which reads ahead and releases sent pages */
+        n = segment_read(dest + done, 1, room - done < have ? room - done :
+            have, p->seg);
+        if (n == 0)
+          return done; /* the segment ended early; curl fails the request */
+        done += n;
+        m->off += n;
+        continue;
+      }
+      from = p->data + at;
+    }
+
+    if (have == 0) {
+      ++m->part;
+      m->off = 0;
+      continue;
+    }
+    n = room - done < have ? room - done : have;
+    memcpy(dest + done, from, n);
+    done += n;
+    m->off += n;
+  }
+  return done;
+}
+
+/**
+ * Rewinds the body
+ * @see multipart.h
+ */
+int multipart_seek(void *userp, curl_off_t offset, int origin) {
+  Multipart *m = (Multipart*) userp;
+  int i;
+
+  if (offset != 0 || origin != SEEK_SET)
+    return CURL_SEEKFUNC_CANTSEEK;
+  /* Part of a spool segment has gone: the caller resumes it instead */
+  for (i = 0; i < m->count; ++i)
+    if (m->parts[i].seg != NULL
+        && m->parts[i].seg->pos != m->parts[i].seg_start)
+      return CURL_SEEKFUNC_CANTSEEK;
+  m->part = 0;
+  m->off = 0;
+  return CURL_SEEKFUNC_OK;
+}
@@ -0,0 +1,115 @@
+/**
+ * @file multipart.h
+ * Allocation-free multipart/form-data request bodies for the relay
+ *
+ * Building a curl form allocates every part, its headers and the request's
+ * header list, and all of it is freed again after the request; the relay did
+ * this for every buffer and every batch of dump files. A Multipart is
+ * allocated once with the relay instead. Each upload resets it, adds its
+ * parts, whose delimiters and headers are formatted into the preallocated
+ * part descriptors, and hands it to curl, which reads the body through
+ * #multipart_read: part headers from the descriptor, part data from memory or
+ * straight out of a mapped spool segment.
+ *
+ * The body is the same as a curl form with one "sendfile" part per file, so
+ * the server sees no difference.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#ifndef _RELAY_MULTIPART_H
+#define _RELAY_MULTIPART_H
+
+#include <curl/curl.h>
+#include <stdlib.h>
+
+#include "segment.h"
+
+/** Maximum number of parts in one request */
+#define MULTIPART_PARTS 64
+/** Room for the delimiter and headers of one part */
+#define MULTIPART_HEAD_MAX 512
+/** Delimits the parts; long enough never to turn up in sampled data */
+#define MULTIPART_BOUNDARY "------------------------electrisense5f0e3c9a7d41"
+
+/**
+ * One part of the body.
+ */
+struct multipart_part_st {
+  char head[MULTIPART_HEAD_MAX]; /**< Delimiter and part headers */
+  size_t head_len; /**< Bytes of head in use */
+  const char *data; /**< The part's data, or NULL to read it from seg */
+  Segment *seg; /**< Spool segment to read the data from otherwise */
+  size_t seg_start; /**< Position of seg when the part was added */
+  size_t len; /**< Bytes of data */
+};
+
+typedef struct multipart_part_st Part;
+
+/**
+ * A request body and the position curl has read up to.
+ */
+struct multipart_st {
+  Part parts[MULTIPART_PARTS];
+  int count; /**< Number of parts added */
+  size_t total; /**< Bytes in the whole body */
+  int part; /**< Part being read, count for the closing delimiter */
+  size_t off; /**< Bytes of that part read */
+  struct curl_slist headers[2]; /**< Request headers, linked in place */
+};
+
+typedef struct multipart_st Multipart;
+
+/**
+ * Sets up the request headers of a body. Only needed once.
+ */
+void multipart_init(Multipart *m);
+
+/**
+ * Empties a body for the next request.
+ */
+void multipart_reset(Multipart *m);
+
+/**
+ * Adds a part to the body.
+ *
+ * @param filename The file name the server stores the part under
+ * @param headers Extra part headers, each ending in "\r\n", or ""
+ * @param data The data of the part, or NULL to read it from seg
+ * @param seg The spool segment to read the data from, from its position on
+ * @param len Bytes of data in the part
+ * @return 0 if successful, -1 if the body has no room for the part
+ */
+int multipart_add(Multipart *m, const char *filename, const char *headers,
+    const char *data, Segment *seg, size_t len);
+
+/**
+ * Configures a curl handle to POST the body from its start. The handle keeps
+ * reading from the body, so it must not change until the request is done.
+ */
+void multipart_post(Multipart *m, CURL *curl);
+
+/**
+ * Copies the next bytes of the body into dest.
+ *
+ * The signature matches a curl read callback, with userp being the Multipart
+ * to read from.
+ *
+ * @return The number of bytes copied, 0 once the body is exhausted
+ */
+size_t multipart_read(char *dest, size_t size, size_t nmemb, void *userp);
+
+/**
+ * Rewinds the body, for curl to send it again on a new connection.
+ *
+ * Once any data of a spool segment has been read, the body is not rewound
+ * and curl fails the request instead: the server may have stored part of the
+ * segment, and the relay asks it how much before resuming from there rather
+ * than sending every file again from its start.
+ *
+ * The signature matches a curl seek callback, with userp being the Multipart
+ * to rewind. Only seeking to the start is supported.
+ */
+int multipart_seek(void *userp, curl_off_t offset, int origin);
+
+#endif
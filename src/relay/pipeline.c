@@ -0,0 +1,343 @@
+/**
+ * @file pipeline.c
+ * Implementation of the live upload pipeline
+ * @see pipeline.h
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pipeline.h"
+
+static void *stage_main(void *arg);
+static void push(Pipeline *p, int q, int slot);
+static int pop(Pipeline *p, int q);
+
+/**
+ * Allocates the slots and starts the stages
+ * @see pipeline.h
+ */
+Pipeline* pipeline_init(const Stage *stages, int nstages, Seal *seals,
+    size_t space, size_t samples, void *ctx) {
+  Pipeline *p;
+  int i;
+
+  if (nstages < 1 || nstages > PIPELINE_STAGES_MAX
+      || (p = (Pipeline*) calloc(1, sizeof(Pipeline))) == NULL )
+    return NULL ;
+  pthread_mutex_init(&p->lock, NULL );
+  pthread_cond_init(&p->moved, NULL );
+  p->nstages = nstages;
+  p->limit = PIPELINE_SLOTS;
+  p->ctx = ctx;
+  for (i = 0; i < nstages; ++i) {
+    p->stages[i].name = stages[i].name;
+    p->stages[i].work = stages[i].work;
+    p->stages[i].pipeline = p;
+    p->stages[i].index = i;
+  }
+  for (i = 0; i < PIPELINE_SLOTS; ++i) {
+    p->slots[i].seal = &seals[i];
+    p->slots[i].raw = &seals[i].buffer;
+    if (space > 0 && (p->slots[i].space = (char*) malloc(space)) == NULL )
+      goto fail;
+    if (samples > 0 && (p->slots[i].samples = (int16_t*) malloc(
+        samples * sizeof(int16_t))) == NULL )
+      goto fail;
+  }
+
+  for (i = 0; i < nstages; ++i) {
+    pthread_mutex_lock(&p->lock);
+    if (pthread_create(&p->threads[i], NULL, &stage_main, &p->stages[i]) != 0) {
+      pthread_mutex_unlock(&p->lock);
+      goto fail;
+    }
+    ++p->started;
+    ++p->running;
+    pthread_mutex_unlock(&p->lock);
+  }
+  return p;
+
+  fail: pipeline_cleanup(&p);
+  return NULL ;
+}
+
+/**
+ * Checks a shared slot
+ * @see pipeline.h
+ */
+int pipeline_undelivered(const Seal *s, const Buffer *buffers) {
+  const Buffer *from = &buffers[s->source];
+
+  if (s->owner == 0)
+    return 0;
+  /* Not if the consumer never got the buffer back; ids are never reused,
+   * where two buffers of the same samples share a checksum */
+  return s->released || from->size != from->capacity
+      || from->id != s->buffer.id;
+}
+
+/**
+ * Takes over the shared slots
+ * @see pipeline.h
+ */
+int pipeline_claim(Pipeline *p, Buffer *buffers) {
+  int order[PIPELINE_SLOTS];
+  int taken = 0, i, j;
+
+  pthread_mutex_lock(&p->lock);
+  for (i = 0; i < PIPELINE_SLOTS; ++i) {
+    Seal *s = p->slots[i].seal;
+    if (!pipeline_undelivered(s, buffers)) {
+      s->owner = 0;
+      push(p, p->nstages, i);
+      continue;
+    }
+
+    /* Oldest first */
+    for (j = taken++; j > 0 && p->slots[order[j - 1]].seal->seq > s->seq; --j)
+      order[j] = order[j - 1];
+    order[j] = i;
+    if (s->seq >= p->sealed)
+      p->sealed = s->seq + 1;
+  }
+  for (i = 0; i < taken; ++i) {
+    Slot *s = &p->slots[order[i]];
+    s->seal->owner = getpid();
+    s->seal->released = 1;
+    s->seq = s->seal->seq;
+    push(p, 0, order[i]);
+  }
+  p->claimed = 1;
+  pthread_mutex_unlock(&p->lock);
+  return taken;
+}
+
+/**
+ * Seals a full buffer
+ * @see pipeline.h
+ */
+int pipeline_seal(Pipeline *p, Buffer *buffers, int idx) {
+  Seal *seal;
+  int i;
+
+  pthread_mutex_lock(&p->lock);
+  i = p->claimed && PIPELINE_SLOTS - p->count[p->nstages] < p->limit ?
+      pop(p, p->nstages) : -1;
+  pthread_mutex_unlock(&p->lock);
+  if (i < 0) {
+    ++p->stalls;
+    return -1;
+  }
+
+  /* The free slot belongs to the caller alone until it is pushed */
+  seal = p->slots[i].seal;
+  seal->released = 0;
+  seal->source = idx;
+  memcpy(&seal->buffer, &buffers[idx], sizeof(Buffer));
+  __sync_synchronize();
+  /* The consumer may have taken the buffer back since it was found full, to
+   * dump it and start it afresh under a new id (see buffer.h); the copy may
+   * be torn or of the new buffer, and the dump file holds the old one */
+  if (seal->buffer.size != seal->buffer.capacity
+      || buffers[idx].id != seal->buffer.id
+      || buffers[idx].size != seal->buffer.size) {
+    pthread_mutex_lock(&p->lock);
+    push(p, p->nstages, i);
+    pthread_mutex_unlock(&p->lock);
+    return 1;
+  }
+  seal->seq = p->slots[i].seq = p->sealed++;
+  /* Owned only once complete, so a relay taking over never sees half of it */
+  seal->owner = getpid();
+  __sync_synchronize();
+  /* Taken back only now, the copy is whole and the dump a duplicate */
+  __sync_bool_compare_and_swap(&buffers[idx].size, seal->buffer.size, 0);
+  __sync_synchronize();
+  seal->released = 1;
+
+  pthread_mutex_lock(&p->lock);
+  push(p, 0, i);
+  pthread_mutex_unlock(&p->lock);
+  return 0;
+}
+
+/**
+ * Limits the slots in use
+ * @see pipeline.h
+ */
+void pipeline_limit(Pipeline *p, int slots) {
+  pthread_mutex_lock(&p->lock);
+  p->limit = slots <= 0 || slots > PIPELINE_SLOTS ? PIPELINE_SLOTS : slots;
+  pthread_mutex_unlock(&p->lock);
+}
+
+/**
+ * Counts the slots in use
+ * @see pipeline.h
+ */
+int pipeline_in_flight(Pipeline *p, int *limit) {
+  int n;
+  pthread_mutex_lock(&p->lock);
+  n = PIPELINE_SLOTS - p->count[p->nstages];
+  if (limit != NULL )
+    *limit = p->limit;
+  pthread_mutex_unlock(&p->lock);
+  return n;
+}
+
+/**
+ * Takes waiting slots for the last stage
+ * @see pipeline.h
+ */
+int pipeline_gather(Pipeline *p, Slot **more, int max, long wait_ms) {
+  int last = p->nstages - 1;
+  struct timespec until;
+  int n = 0, i;
+
+  clock_gettime(CLOCK_REALTIME, &until);
+  until.tv_sec += wait_ms / 1000;
+  until.tv_nsec += wait_ms % 1000 * 1000000;
+  if (until.tv_nsec >= 1000000000) {
+    ++until.tv_sec;
+    until.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&p->lock);
+  /* The slot being handled is in use, but in no queue */
+  while (p->count[last] < max && !p->stop
+      && (PIPELINE_SLOTS - p->count[p->nstages] - 1 > p->count[last]
+          || PIPELINE_SLOTS - p->count[p->nstages] < p->limit))
+    if (pthread_cond_timedwait(&p->moved, &p->lock, &until) != 0)
+      break;
+  while (n < max && (i = pop(p, last)) >= 0) {
+    p->gathered[p->ngathered++] = i;
+    more[n++] = &p->slots[i];
+  }
+  pthread_mutex_unlock(&p->lock);
+  return n;
+}
+
+/**
+ * Checks for shutdown
+ * @see pipeline.h
+ */
+int pipeline_stopping(Pipeline *p) {
+  int stop;
+  pthread_mutex_lock(&p->lock);
+  stop = p->stop;
+  pthread_mutex_unlock(&p->lock);
+  return stop;
+}
+
+/**
+ * Writes stage statistics
+ * @see pipeline.h
+ */
+void pipeline_print(Pipeline *p, FILE *out) {
+  int i;
+
+  pthread_mutex_lock(&p->lock);
+  fprintf(out, "pipeline slots=%d limit=%d free=%d sealed=%u stalls=%lu\n",
+      PIPELINE_SLOTS, p->limit, p->count[p->nstages], p->sealed, p->stalls);
+  for (i = 0; i < p->nstages; ++i)
+    fprintf(out, "stage %s queued=%d items=%lu busy_ms=%.1f\n",
+        p->stages[i].name, p->count[i], p->stages[i].items,
+        p->stages[i].busy * 1000);
+  pthread_mutex_unlock(&p->lock);
+}
+
+/**
+ * Drains and frees the pipeline
+ * @see pipeline.h
+ */
+void pipeline_cleanup(Pipeline **p) {
+  int i;
+
+  pthread_mutex_lock(&(*p)->lock);
+  (*p)->stop = 1;
+  pthread_cond_broadcast(&(*p)->moved);
+  pthread_mutex_unlock(&(*p)->lock);
+  for (i = 0; i < (*p)->started; ++i)
+    pthread_join((*p)->threads[i], NULL );
+
+  for (i = 0; i < PIPELINE_SLOTS; ++i) {
+    free((*p)->slots[i].space);
+    free((*p)->slots[i].samples);
+  }
+  pthread_cond_destroy(&(*p)->moved);
+  pthread_mutex_destroy(&(*p)->lock);
+  free(*p);
+  *p = NULL;
+}
+
+/**
+ * Runs one stage: take the oldest slot waiting for it, do the work and pass
+ * the slot on. Once the pipeline is stopping, a stage exits when its queue is
+ * empty and the stage before it has exited, so every sealed slot is finished.
+ */
+static void *stage_main(void *arg) {
+  Stage *st = (Stage*) arg;
+  Pipeline *p = st->pipeline;
+  int stage = st->index;
+  struct timespec start, end;
+  int i;
+
+  pthread_mutex_lock(&p->lock);
+  while (1) {
+    if ((i = pop(p, stage)) < 0) {
+      /* Stages exit in order, so this holds once those before it are gone */
+      if (p->stop && stage <= p->nstages - p->running)
+        break;
+      pthread_cond_wait(&p->moved, &p->lock);
+      continue;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    st->work(p->ctx, &p->slots[i]);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    pthread_mutex_lock(&p->lock);
+    ++st->items;
+    st->busy += (end.tv_sec - start.tv_sec)
+        + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (stage == p->nstages - 1) {
+      int g;
+      p->slots[i].seal->owner = 0; /* delivered */
+      for (g = 0; g < p->ngathered; ++g) {
+        p->slots[p->gathered[g]].seal->owner = 0;
+        ++st->items;
+        push(p, stage + 1, p->gathered[g]);
+      }
+      p->ngathered = 0;
+    }
+    push(p, stage + 1, i);
+  }
+  --p->running;
+  pthread_cond_broadcast(&p->moved);
+  pthread_mutex_unlock(&p->lock);
+  return NULL ;
+}
+
+/** Appends a slot to a queue. Called with the lock held. */
+static void push(Pipeline *p, int q, int slot) {
+  p->queue[q][(p->head[q] + p->count[q]) % PIPELINE_SLOTS] = slot;
+  ++p->count[q];
+  pthread_cond_broadcast(&p->moved);
+}
+
+/** Takes the first slot off a queue, or returns -1. Called with the lock held. */
+static int pop(Pipeline *p, int q) {
+  int slot;
+  if (p->count[q] == 0)
+    return -1;
+  slot = p->queue[q][p->head[q]];
+  p->head[q] = (p->head[q] + 1) % PIPELINE_SLOTS;
+  --p->count[q];
+  return slot;
+}
@@ -0,0 +1,218 @@
+/**
+ * @file pipeline.h
+ * Bounded pipeline of worker threads for live uploads
+ *
+ * The relay used to verify, encode and upload each full buffer in turn while
+ * the consumer waited for it back. Instead, the relay now seals a full buffer
+ * by copying it into a free pipeline slot, hands the buffer straight back to
+ * the consumer, and passes the slot down a chain of stages, each run by its
+ * own thread: encoding buffer N+1 overlaps checksumming buffer N and
+ * transmitting buffer N-1.
+ *
+ * Slots and their payload space are allocated once, up front. There are only
+ * #PIPELINE_SLOTS of them, so when the later stages fall behind, sealing finds
+ * no free slot and the buffers stay with the relay, which is the consumer's
+ * signal (see occupancy.h) that the relay cannot keep up. Each stage handles
+ * slots in the order they were sealed. The last stage may take the slots
+ * queued behind the one it is handling and deliver them all at once.
+ *
+ * The sealed buffers themselves live in shared memory, each marked with the
+ * relay that owns it, so that a relay taking over from one that died (see
+ * failover.h) finds the buffers it had taken from the consumer but not yet
+ * delivered, and sends them again. A buffer is only sent twice if its relay
+ * died while uploading it, or after the server had it but before the slot
+ * was freed.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#ifndef _RELAY_PIPELINE_H
+#define _RELAY_PIPELINE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "../shared/buffer.h"
+
+/** Number of buffers that can be in the pipeline at once */
+#define PIPELINE_SLOTS 4
+/** Maximum number of stages after sealing */
+#define PIPELINE_STAGES_MAX 4
+
+/**
+ * The part of a slot kept in shared memory.
+ */
+struct pipeline_seal_st {
+  Buffer buffer; /**< Copy of the buffer as sealed */
+  int32_t owner; /**< Pid of the relay holding the slot, 0 while it is free */
+  int32_t source; /**< Index of the shared buffer it was sealed from */
+  int32_t released; /**< Set once the shared buffer was handed back */
+  uint32_t seq; /**< Number of the buffer in sealing order */
+};
+
+typedef struct pipeline_seal_st Seal;
+
+/**
+ * A sealed buffer on its way through the pipeline.
+ */
+struct pipeline_slot_st {
+  Seal *seal; /**< The slot's sealed buffer, in shared memory */
+  Buffer *raw; /**< The buffer as sealed, &seal->buffer */
+  char *space; /**< Preallocated space for an encoded payload, or NULL */
+  int16_t *samples; /**< Preallocated space for unpacked samples, or NULL */
+  size_t nsamples; /**< Samples unpacked into samples */
+  const char *payload; /**< What to upload: raw->data or space */
+  size_t len; /**< Bytes of payload */
+  int codec; /**< Codec of payload (see codec.h) */
+  size_t size; /**< Bytes payload decodes to */
+  uint32_t crc; /**< CRC-32C of payload */
+  uint32_t seq; /**< Number of the slot's buffer in sealing order */
+};
+
+typedef struct pipeline_slot_st Slot;
+
+/**
+ * One stage of the pipeline. The work function returns once it is done with
+ * the slot, which then moves on to the next stage, or back to the free slots
+ * after the last one.
+ */
+struct pipeline_stage_st {
+  const char *name; /**< Name used in the metrics snapshot */
+  void (*work)(void *ctx, Slot *s); /**< Handles one slot */
+  unsigned long items; /**< Slots handled */
+  double busy; /**< Seconds spent handling slots */
+  struct pipeline_st *pipeline; /**< Pipeline the stage belongs to */
+  int index; /**< Position of the stage in the pipeline */
+};
+
+typedef struct pipeline_stage_st Stage;
+
+/**
+ * The pipeline. Queue i holds the slots waiting for stage i; the last queue
+ * holds the free slots.
+ */
+struct pipeline_st {
+  pthread_mutex_t lock; /**< Guards the queues and stop */
+  pthread_cond_t moved; /**< Signalled whenever a slot changes queue */
+  Slot slots[PIPELINE_SLOTS];
+  Stage stages[PIPELINE_STAGES_MAX];
+  pthread_t threads[PIPELINE_STAGES_MAX];
+  int nstages; /**< Number of stages */
+  int queue[PIPELINE_STAGES_MAX + 1][PIPELINE_SLOTS]; /**< Slot indices */
+  int head[PIPELINE_STAGES_MAX + 1]; /**< First entry of each queue */
+  int count[PIPELINE_STAGES_MAX + 1]; /**< Entries in each queue */
+  int started; /**< Number of stage threads started */
+  int running; /**< Number of stage threads that have not exited */
+  int stop; /**< Set once no more slots will be sealed */
+  int claimed; /**< Set once the slots belong to this process */
+  int limit; /**< Slots that may be in the pipeline at once */
+  int gathered[PIPELINE_SLOTS]; /**< Slots the last stage took to deliver
+   with the one it is handling */
+  int ngathered; /**< Entries in gathered */
+  void *ctx; /**< Passed to every work function */
+  uint32_t sealed; /**< Buffers sealed */
+  unsigned long stalls; /**< Times a full buffer found no free slot */
+};
+
+typedef struct pipeline_st Pipeline;
+
+/**
+ * Allocates the slots and starts one thread per stage. The pipeline only
+ * uses the shared slots once it has claimed them.
+ *
+ * @param stages The stages, in order. Only name and work need be set.
+ * @param nstages The number of stages, up to #PIPELINE_STAGES_MAX
+ * @param seals #PIPELINE_SLOTS sealed buffers in shared memory, all zero
+ * when the client starts
+ * @param space Bytes of payload space to allocate per slot, or 0
+ * @param samples Samples of space to allocate per slot for unpacking the
+ * buffer into, or 0
+ * @param ctx Passed to every work function
+ * @return A malloc'd pipeline to be freed with #pipeline_cleanup, or NULL
+ */
+Pipeline* pipeline_init(const Stage *stages, int nstages, Seal *seals,
+    size_t space, size_t samples, void *ctx);
+
+/**
+ * Checks whether a shared slot holds a buffer that a relay sealed but did not
+ * deliver. A slot whose relay died before handing the buffer back to the
+ * consumer does not: the buffer is still in the shared buffers.
+ *
+ * @param s The slot
+ * @param buffers The shared double buffer
+ */
+int pipeline_undelivered(const Seal *s, const Buffer *buffers);
+
+/**
+ * Takes the shared slots over for this process, once it is the relay in
+ * charge. Buffers a previous relay left in the slots are started down the
+ * pipeline again, oldest first, except any it died before handing back to
+ * the consumer: those are still in the shared buffers and will be sealed
+ * again.
+ *
+ * @param buffers The shared double buffer
+ * @return The number of buffers taken over
+ */
+int pipeline_claim(Pipeline *p, Buffer *buffers);
+
+/**
+ * Seals a full shared buffer: copies it into a free slot and starts the slot
+ * down the pipeline, then hands the buffer back to the consumer.
+ *
+ * @param buffers The shared double buffer
+ * @param idx The index of the full buffer
+ * @return 0 if the buffer was sealed, -1 if no slot was free, 1 if the
+ * consumer took the buffer back while it was being copied
+ */
+int pipeline_seal(Pipeline *p, Buffer *buffers, int idx);
+
+/**
+ * Limits how many slots may be in the pipeline at once, so fewer buffers are
+ * in flight. Slots already sealed are not affected.
+ *
+ * @param slots The limit, from 1 to #PIPELINE_SLOTS, or 0 for every slot
+ */
+void pipeline_limit(Pipeline *p, int slots);
+
+/**
+ * Counts the slots sealed and not yet through the last stage.
+ *
+ * @param limit Set to the current limit on slots in use, if not NULL
+ * @return The number of slots in use
+ */
+int pipeline_in_flight(Pipeline *p, int *limit);
+
+/**
+ * Takes more slots waiting for the last stage, for a last stage that
+ * delivers several at once. Called from the last stage's work function; the
+ * slots taken are delivered along with the one it was given when it returns.
+ * Waiting stops early once no more slots could arrive: the rest of those in
+ * use are already waiting, and no more may be sealed.
+ *
+ * @param more Set to the slots taken, oldest first
+ * @param max Most slots to take
+ * @param wait_ms Longest to wait for max of them to be waiting
+ * @return The number of slots taken
+ */
+int pipeline_gather(Pipeline *p, Slot **more, int max, long wait_ms);
+
+/**
+ * Checks whether the pipeline is shutting down, so that a stage retrying
+ * some work can give up.
+ */
+int pipeline_stopping(Pipeline *p);
+
+/**
+ * Writes one line of statistics per stage.
+ */
+void pipeline_print(Pipeline *p, FILE *out);
+
+/**
+ * Lets every sealed slot finish the pipeline, stops the threads and frees the
+ * pipeline. The specified handle will be NULL after this function returns.
+ */
+void pipeline_cleanup(Pipeline **p);
+
+#endif
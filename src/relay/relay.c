@@ -16,11 +16,42 @@
 #include <unistd.h>
 
 #include "relay.h"
+#include "segment.h"
+#include "stream.h"
 #include "../shared/buffer.h"
+#include "../shared/fault.h"
+#include "../shared/spool.h"
+#include "../shared/trace.h"
 
 static size_t write_data(void* buffer, size_t size, size_t nmemb, void* userp);
+static size_t discard(void* buffer, size_t size, size_t nmemb, void* userp);
+static int drain_progress(void *clientp, curl_off_t dltotal, curl_off_t dlnow,
+    curl_off_t ultotal, curl_off_t ulnow);
+static CURLcode relay_perform(Relay *r, CURL *curl, Endpoint *ep,
+    size_t bytes);
+static void relay_write_stats(Relay *r);
+static void relay_configure(Relay *r);
+static const char* relay_payload(Relay *r, int idx, size_t *len);
+static const char* relay_encode(Relay *r, const char *data, size_t size,
+    char *out, size_t *len);
+static void relay_compress(Relay *r, Slot *s);
+static int relay_seal(Relay *r);
+static int relay_scan(Relay *r);
+static void stage_unpack(void *ctx, Slot *s);
+static void stage_encode(void *ctx, Slot *s);
+static void stage_checksum(void *ctx, Slot *s);
+static void stage_transmit(void *ctx, Slot *s);
+static int relay_relieve(Relay *r);
+static int relay_spool(Relay *r);
+static int dump_verify(Relay *r, Segment *seg, const char *name,
+    uint32_t *crc);
 static int handle_dump_files(Relay *r, struct dirent **namelist, int n);
-static int dump_filter(const struct dirent *entry);
+static int query_resume(Relay *r, struct dirent **namelist, int *batch,
+    int batch_files);
+static long acked_offset(Relay *r, const char *name);
+static int relay_stream_buffers(Relay *r);
+static void relay_stream_release(Relay *r);
+static int relay_stream_dumps(Relay *r, struct dirent **namelist, int n);
 
 struct handler_st {
   Relay *r;
@@ -28,11 +59,28 @@ struct handler_st {
   int n;
 };
 
+/** The stages a sealed buffer goes through on its way to the server */
+static const Stage stages[] = {
+  { .name = "encode", .work = &stage_encode },
+  { .name = "checksum", .work = &stage_checksum },
+  { .name = "transmit", .work = &stage_transmit },
+};
+
+/** The same, for buffers of the Firefly's packets */
+static const Stage packet_stages[] = {
+  { .name = "unpack", .work = &stage_unpack },
+  { .name = "encode", .work = &stage_encode },
+  { .name = "checksum", .work = &stage_checksum },
+  { .name = "transmit", .work = &stage_transmit },
+};
+
 /**
  * Initializes the relay
  * @see relay.h
  */
-Relay* relay_init(Buffer* b, char* server_url, char* backup_source, int verbose) {
+Relay* relay_init(Buffer* b, Occupancy *occ, Failover *fo, Drain *drain,
+    Seal *seals, Config *config, SpoolStats *spool_stats, char* backup_source,
+    char* metrics_path, int features, int packets, int verbose) {
   Relay* r; /* Relay struct to create */
 
   if (verbose)
@@ -40,9 +88,50 @@ Relay* relay_init(Buffer* b, char* server_url, char* backup_source, int verbose)
 
   r = (Relay*) malloc(sizeof(struct relay_st));
   r->buffers = b;
+  r->occupancy = occ;
+  r->failover = fo;
+  r->drain = drain;
   r->buf_idx = 0;
-  r->server_url = server_url;
+  r->shared_config = config;
+  config_read(config, &r->config);
+  r->spool_stats = spool_stats;
+  r->metrics_path = metrics_path;
+  r->stats_at = 0;
+  r->endpoint = NULL;
+  r->dump_endpoint = NULL;
+  r->features = features;
+  r->firefly = NULL;
+  r->spectrum = NULL;
+  r->suppressor = NULL;
+  r->feature_buf = NULL;
+  r->feature_len = 0;
+  r->pipeline = NULL;
+  r->adapt = NULL;
+  r->batching = NULL;
+  r->live_curl = NULL;
+  memset(&r->spool, 0, sizeof r->spool);
+  multipart_init(&r->batch);
+  multipart_init(&r->live);
+  r->resume_headers[0].data = (char*) "Expect:";
+  r->resume_headers[0].next = &r->resume_headers[1];
+  r->resume_headers[1].data = r->resume_query;
+  r->resume_headers[1].next = NULL;
+  r->payload_crc = 0;
+  r->crc_errors = 0;
   r->verbose = verbose;
+  r->response_len = 0;
+  r->resumed_bytes = 0;
+  r->resume = 1; /* a previous relay may have been cut off mid-upload */
+  r->slot_seq[0] = r->slot_seq[1] = 0;
+  r->slot_sent[0] = r->slot_sent[1] = 0;
+  r->stream = stream_init(r->config.server, verbose);
+  if (r->stream == NULL
+      && endpoints_init(&r->endpoints, r->config.server) < 0) {
+    fprintf(stderr, "[R] No usable server endpoints in \"%s\"\n",
+        r->config.server);
+    free(r);
+    return NULL ;
+  }
   if (verbose)
     printf("[R] Relay initialized!\n");
 
@@ -51,12 +140,8 @@ Relay* relay_init(Buffer* b, char* server_url, char* backup_source, int verbose)
 
   /* Curl initialization */
   CURL* curl;
-  struct curl_httppost* buf0_formpost = NULL;
-  struct curl_httppost* buf0_lastptr = NULL;
-
-  struct curl_httppost* buf1_formpost = NULL;
-  struct curl_httppost* buf1_lastptr = NULL;
   struct curl_slist* headerlist = NULL;
+  size_t space = 0; /* payload space needed per pipeline slot */
   static const char buf[] = "Expect:";
 
   curl_global_init(CURL_GLOBAL_NOTHING); /* Init curl vars */
@@ -67,84 +152,253 @@ Relay* relay_init(Buffer* b, char* server_url, char* backup_source, int verbose)
     return NULL ;
   }
 
-  /* Add the file to the request */
-  curl_formadd(&buf0_formpost, &buf0_lastptr, CURLFORM_COPYNAME, "sendfile",
-      CURLFORM_BUFFER, "buf0", CURLFORM_BUFFERPTR, r->buffers[0].data,
-      CURLFORM_BUFFERLENGTH, r->buffers[0].capacity, CURLFORM_END);
-  curl_formadd(&buf1_formpost, &buf1_lastptr, CURLFORM_COPYNAME, "sendfile",
-      CURLFORM_BUFFER, "buf1", CURLFORM_BUFFERPTR, r->buffers[1].data,
-      CURLFORM_BUFFERLENGTH, r->buffers[1].capacity, CURLFORM_END);
+  if (packets) {
+    /* A resend over the stream would unpack the buffer a second time */
+    if (r->stream != NULL ) {
+      fprintf(stderr, "[R] Firefly packets can only be uploaded over HTTP\n");
+      return NULL ;
+    }
+    if ((r->firefly = firefly_init()) == NULL ) {
+      fprintf(stderr, "[R] Packet parser init failed\n");
+      return NULL ;
+    }
+    if (verbose)
+      printf("[R] Unpacking the Firefly's packets.\n");
+  }
+
+  /* Sized for the largest buffer, whatever capacity is configured */
+  if (features == RELAY_FEATURES_RAW && r->stream == NULL ) {
+    if ((r->adapt = adapt_init()) == NULL ) {
+      fprintf(stderr, "[R] Codec controller init failed\n");
+      return NULL ;
+    }
+    space = CODEC_BEST_BOUND(packets ?
+        FIREFLY_SAMPLES_BOUND(__BUFFER_CAPACITY) * sizeof(int16_t) :
+        __BUFFER_CAPACITY);
+  } else if (features == RELAY_FEATURES_CHANGES) {
+    size_t samples = __BUFFER_CAPACITY / sizeof(int16_t);
+    if ((r->suppressor = suppressor_init()) == NULL ) {
+      fprintf(stderr, "[R] Change detection init failed\n");
+      return NULL ;
+    }
+    space = suppress_payload_max(samples);
+    r->feature_buf = (char*) malloc(space);
+    if (verbose)
+      printf("[R] Uploading changed windows only.\n");
+  } else if (features != RELAY_FEATURES_RAW) {
+    size_t samples = __BUFFER_CAPACITY / sizeof(int16_t);
+    if ((r->spectrum = spectrum_init()) == NULL ) {
+      fprintf(stderr, "[R] Feature extraction init failed\n");
+      return NULL ;
+    }
+    r->feature_len = spectrum_payload_size(samples,
+        features == RELAY_FEATURES_BOTH);
+    space = r->feature_len;
+    r->feature_buf = (char*) malloc(space);
+    if (verbose)
+      printf("[R] Uploading spectra%s. (%zu of %zu bytes per buffer)\n",
+          features == RELAY_FEATURES_BOTH ? " and decimated samples" : "",
+          r->feature_len, (size_t) __BUFFER_CAPACITY);
+  }
 
   if (verbose)
     printf("[R] CURL forms initialized!\n");
 
   headerlist = curl_slist_append(headerlist, buf);
-  curl_easy_setopt(curl, CURLOPT_URL, r->server_url);
   curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headerlist);
   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, r);
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  /* An endpoint that stops responding is failed over rather than waited on */
+  curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, (long) RELAY_CONNECT_TIMEOUT);
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, (long) RELAY_STALL_RATE);
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, (long) RELAY_STALL_TIMEOUT);
 
   /* Add slash at the end if not there */
   r->dump_dir = (char*) malloc(strlen(backup_source) + 2);
   strcpy(r->dump_dir, backup_source);
   if (backup_source[strlen(backup_source) - 1] != '/')
     strcat(r->dump_dir, "/");
+  if ((r->spool_writer = spool_init(r->dump_dir, spool_stats)) == NULL ) {
+    fprintf(stderr, "[R] spool: init failed\n");
+    return NULL ;
+  }
+  spool_configure(r->spool_writer, r->config.spool_sync,
+      r->config.spool_sync_ms, r->config.spool_group);
+  if ((r->spare = (Buffer*) malloc(sizeof(Buffer))) == NULL ) {
+    fprintf(stderr, "[R] spool: no memory for a spare buffer\n");
+    return NULL ;
+  }
+  if ((r->compactor = compactor_init(r->dump_dir, &r->config, verbose))
+      == NULL )
+    fprintf(stderr, "[R] Compactor init failed, dump files stay unpacked\n");
 
   r->curl = curl;
-  r->form0 = buf0_formpost;
-  r->form1 = buf1_formpost;
   r->slist = headerlist;
 
+  /* Live buffers go through the pipeline, on a handle of their own */
+  if (r->stream == NULL ) {
+    if ((r->live_curl = curl_easy_duphandle(curl)) == NULL ) {
+      fprintf(stderr, "[R] curl: init failed\n");
+      return NULL ;
+    }
+    curl_easy_setopt(r->live_curl, CURLOPT_WRITEFUNCTION, discard);
+    curl_easy_setopt(r->live_curl, CURLOPT_WRITEDATA, NULL);
+    /* An upload under way when a drain starts must not outlast it either */
+    curl_easy_setopt(r->live_curl, CURLOPT_XFERINFOFUNCTION, drain_progress);
+    curl_easy_setopt(r->live_curl, CURLOPT_XFERINFODATA, r);
+    curl_easy_setopt(r->live_curl, CURLOPT_NOPROGRESS, 0L);
+    if ((r->batching = batch_init()) == NULL ) {
+      fprintf(stderr, "[R] Batch controller init failed\n");
+      return NULL ;
+    }
+    if ((r->pipeline = r->firefly != NULL ?
+        pipeline_init(packet_stages, sizeof packet_stages
+            / sizeof packet_stages[0], seals, space,
+            FIREFLY_SAMPLES_BOUND(__BUFFER_CAPACITY), r) :
+        pipeline_init(stages, sizeof stages / sizeof stages[0], seals,
+            space, 0, r)) == NULL ) {
+      fprintf(stderr, "[R] Upload pipeline init failed\n");
+      return NULL ;
+    }
+    pipeline_limit(r->pipeline, r->config.pipeline_slots);
+  }
+
   if (verbose)
     printf("[R] Relay initialized!\n");
 
   return r;
 }
 
+/**
+ * Puts the relay in charge
+ * @see relay.h
+ */
+void relay_activate(Relay *r) {
+  int reclaimed = 0;
+
+  if (r->pipeline != NULL )
+    reclaimed = pipeline_claim(r->pipeline, r->buffers);
+  if (r->compactor != NULL && compactor_start(r->compactor) < 0)
+    fprintf(stderr, "[R] Compactor start failed, dump files stay unpacked\n");
+  failover_took_over(r->failover, reclaimed);
+  if (r->failover->failovers == 0 && reclaimed == 0)
+    return; /* the first relay */
+  TRACE(TRACE_FAILOVER, reclaimed, r->failover->last_us);
+  printf("[R] Relay %d took over in %u us, %d buffers reclaimed.\n",
+      (int) getpid(), r->failover->last_us, reclaimed);
+}
+
 /**
  * Perform one unit of work
  * The following constitutes one unit of work:
- *   - Ensure buffer is not being backed up to SD card,
- *     and if it is, spawn a thread to handle it
- *   - Take up to PAYLOAD_SIZE bytes from the buffer
- *     and send it to a remote server
+ *   - Seal full buffers into the upload pipeline, spooling any that do not
+ *     fit if the consumer is running short of room
+ *   - Send a batch of dump files from the SD card to a remote server
+ * When streaming, full buffers are sent after the dump files instead.
  * @see relay.h
  */
 int relay_process(Relay *r) {
-  /* Step 1: check sd card */
-  int n;
-  struct dirent **namelist;
-  if ((n = scandir(r->dump_dir, &namelist, &dump_filter, alphasort)) < 0) {
-    fprintf(stderr, "[R] Error scanning dump directory!");
-    perror("[R] scandir");
-    return -1;
+  int sealed = 0;
+
+  if (config_changed(r->shared_config, &r->config))
+    relay_configure(r);
+  spool_tick(r->spool_writer);
+
+  if (r->metrics_path != NULL && time(NULL ) >= r->stats_at)
+    relay_write_stats(r);
+
+  /* Step 0: make room for the consumer before it has to dump */
+  if (r->stream == NULL ) {
+    sealed = relay_seal(r);
+    if (relay_relieve(r) < 0)
+      return RELAYE_SERV;
   }
 
-  int ret;
-  if (n > 0 && (ret = handle_dump_files(r, namelist, 1)) != 0)
-    return ret; // TODO: allow for multiple dump files to send
+  /* Step 1: check sd card, unless the compactor has it */
+  int n = 0;
+  int ret = 0;
+  if (compactor_hold(r->compactor) == 0) {
+    if ((n = relay_scan(r)) < 0)
+      ret = -1;
+    else if (n > 0)
+      ret = r->stream != NULL ?
+          relay_stream_dumps(r, r->spool.list, n) :
+          handle_dump_files(r, r->spool.list, n);
+    compactor_release(r->compactor);
+  }
+  if (ret != 0)
+    return ret;
 
   /* Step 2: check buffer */
-  if (r->buffers[r->buf_idx].capacity != r->buffers[r->buf_idx].size)
-    r->buf_idx ^= 1; /* switch buffers */
+  if (r->stream != NULL )
+    return relay_stream_buffers(r);
 
-  if (r->buffers[r->buf_idx].capacity != r->buffers[r->buf_idx].size)
-    return 0; /* neither buffer is full, work is done */
+  /* The consumer takes about a second to fill a buffer; do not spin */
+  if (sealed == 0 && n == 0)
+    usleep(RELAY_IDLE_WAIT);
+  return 0;
+}
 
-  /* Set curl buffer pointer */
-  curl_easy_setopt(r->curl, CURLOPT_HTTPPOST,
-      (r->buf_idx == 0) ? r->form0 : r->form1);
+/**
+ * Apply a changed configuration between units of work. The transmit stage
+ * reads its tunables from r->config as it goes.
+ */
+static void relay_configure(Relay *r) {
+  char server[CONFIG_URL_MAX];
 
-  CURLcode res = curl_easy_perform(r->curl);
-  if (res != CURLE_OK) {
-    fprintf(stderr, "[R] Error on curl HTTP request!\n");
-    fprintf(stderr, "[R] %s\n", curl_easy_strerror(res));
-    return RELAYE_SERV;
+  memcpy(server, r->config.server, sizeof server);
+  config_read(r->shared_config, &r->config);
+  if (r->pipeline != NULL )
+    pipeline_limit(r->pipeline, r->config.pipeline_slots);
+  spool_configure(r->spool_writer, r->config.spool_sync,
+      r->config.spool_sync_ms, r->config.spool_group);
+  if (strcmp(server, r->config.server) != 0) {
+    if (r->stream != NULL )
+      fprintf(stderr, "[R] Streaming keeps its server until restarted\n");
+    else if (endpoints_update(&r->endpoints, r->config.server) < 0)
+      fprintf(stderr, "[R] No usable server endpoints in \"%s\", keeping "
+          "the old ones\n", r->config.server);
   }
-  /* successful transfer, reset buffer and swap index */
-  r->buffers[r->buf_idx].size = 0;
-  r->buf_idx ^= 1;
+  if (r->verbose)
+    printf("[R] Configuration %u applied\n", r->config.generation / 2);
+}
 
-  return 0;
+/**
+ * Drain the relay for shutdown
+ * @see relay.h
+ */
+void relay_drain(Relay *r) {
+  int i, pass;
+
+  if (r->verbose)
+    printf("[R] Draining, %ld ms left...\n", drain_left_ms(r->drain));
+
+  /* Full buffers get until the deadline to upload, then spool */
+  if (r->pipeline != NULL ) {
+    relay_seal(r);
+    pipeline_cleanup(&r->pipeline);
+  }
+
+  /* Spool the rest, any full buffer before the one being filled */
+  for (pass = 0; pass < 2; ++pass)
+    for (i = 0; i < 2; ++i) {
+      Buffer *b = &r->buffers[r->buf_idx ^ i];
+      if (b->size == 0 || (pass == 0 && b->size != b->capacity))
+        continue;
+      if (spool_write(r->spool_writer, b) < 0) {
+        perror("[R] spool"); /* left to the consumer */
+        continue;
+      }
+      TRACE(TRACE_SPOOL, r->buf_idx ^ i, 0);
+      b->size = 0;
+      ++r->drain->spooled;
+    }
+  spool_flush(r->spool_writer); /* whatever the policy, nothing follows */
+
+  if (r->metrics_path != NULL )
+    relay_write_stats(r);
 }
 
 /**
@@ -155,15 +409,38 @@ void relay_cleanup(Relay **r) {
   if ((*r)->verbose)
     printf("[R] Relay clean up...\n");
 
+  /* Finish with the sealed buffers before the endpoints go */
+  if ((*r)->pipeline != NULL )
+    pipeline_cleanup(&(*r)->pipeline);
+  if ((*r)->compactor != NULL )
+    compactor_cleanup(&(*r)->compactor);
+  spool_scan_close(&(*r)->spool);
+  spool_cleanup(&(*r)->spool_writer);
+  free((*r)->spare);
   free((*r)->dump_dir);
+  if ((*r)->stream != NULL )
+    stream_cleanup(&(*r)->stream);
+  else
+    endpoints_cleanup(&(*r)->endpoints);
 
   if ((*r)->verbose)
     printf("[R] Cleaning up CURL request\n");
 
   curl_easy_cleanup((*r)->curl);
+  if ((*r)->live_curl != NULL )
+    curl_easy_cleanup((*r)->live_curl);
   curl_slist_free_all((*r)->slist);
-  curl_formfree((*r)->form0);
-  curl_formfree((*r)->form1);
+  free((*r)->feature_buf);
+  if ((*r)->spectrum != NULL )
+    spectrum_cleanup(&(*r)->spectrum);
+  if ((*r)->suppressor != NULL )
+    suppressor_cleanup(&(*r)->suppressor);
+  if ((*r)->firefly != NULL )
+    firefly_cleanup(&(*r)->firefly);
+  if ((*r)->adapt != NULL )
+    adapt_cleanup(&(*r)->adapt);
+  if ((*r)->batching != NULL )
+    batch_cleanup(&(*r)->batching);
   curl_global_cleanup();
 
   if ((*r)->verbose) {
@@ -174,51 +451,835 @@ void relay_cleanup(Relay **r) {
   *r = NULL;
 }
 
+/**
+ * Collect the server's response in the relay handle instead of printing it to
+ * stdout. Whatever does not fit in the response buffer is dropped.
+ */
 static size_t write_data(void* buffer, size_t size, size_t nmemb, void* userp) {
-  return size * nmemb; /* Do not print to stdout */
+  Relay *r = (Relay*) userp;
+  size_t amount = size * nmemb;
+  size_t room = sizeof r->response - 1 - r->response_len;
+
+  memcpy(r->response + r->response_len, buffer, amount < room ? amount : room);
+  r->response_len += amount < room ? amount : room;
+  r->response[r->response_len] = '\0';
+  return amount;
+}
+
+/** Drop the server's response to a live upload; only its status matters. */
+static size_t discard(void* buffer, size_t size, size_t nmemb, void* userp) {
+  return size * nmemb;
+}
+
+/**
+ * Progress callback of the live upload handle: aborts the transfer once a
+ * drain has run out of time, so that its buffer is spooled instead.
+ */
+static int drain_progress(void *clientp, curl_off_t dltotal, curl_off_t dlnow,
+    curl_off_t ultotal, curl_off_t ulnow) {
+  return drain_left_ms(((Relay*) clientp)->drain) == 0;
 }
 
+/**
+ * Perform the request configured on a handle against an endpoint, and record
+ * the outcome in the endpoint's statistics, and for a live upload in the
+ * codec controller's. The response body to requests on the relay's own
+ * handle is collected in the relay handle.
+ *
+ * @param curl Either r->curl or r->live_curl
+ * @param ep The endpoint to make the request to
+ * @param bytes The number of bytes the request uploads
+ */
+static CURLcode relay_perform(Relay *r, CURL *curl, Endpoint *ep,
+    size_t bytes) {
+  struct timespec start, end;
+  double seconds;
+  CURLcode res;
+
+  if (curl == r->curl) {
+    r->response_len = 0;
+    r->response[0] = '\0';
+  }
+  endpoint_aim(ep, curl);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  res = curl_easy_perform(curl);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  endpoint_report(ep, res == CURLE_OK, seconds, bytes);
+  if (res == CURLE_OK && curl == r->live_curl && r->adapt != NULL )
+    adapt_sent(r->adapt, bytes, seconds);
+  TRACE(res == CURLE_OK ? TRACE_UPLOAD : TRACE_UPLOAD_FAIL,
+      res == CURLE_OK ? bytes : (size_t) res,
+      (end.tv_sec - start.tv_sec) * 1000000
+          + (end.tv_nsec - start.tv_nsec) / 1000);
+  return res;
+}
+
+/**
+ * Get the payload to upload for a full buffer: either the buffer itself or,
+ * with feature extraction enabled, the spectra computed from it or its changed
+ * windows. A buffer encoded again for a resend is compared against the
+ * baseline as it is by then; either encoding describes the buffer fully.
+ *
+ * @param idx The index of the full buffer
+ * @param len Set to the length of the payload
+ * @return The payload, valid until the next call
+ */
+static const char* relay_payload(Relay *r, int idx, size_t *len) {
+  Buffer *b = &r->buffers[idx];
+  uint32_t crc = crc32c(0, b->data, b->capacity);
+  const char *payload;
+
+  /* The buffer is still sent; losing it would be worse than a bad sample */
+  if (crc != b->crc) {
+    ++r->crc_errors;
+    TRACE(TRACE_CRC_ERROR, idx, crc);
+    fprintf(stderr, "[R] WARNING: Buffer %d failed its checksum "
+        "(%08x, expected %08x)\n", idx, crc, b->crc);
+  }
+
+  payload = relay_encode(r, b->data, b->capacity, r->feature_buf, len);
+  r->payload_crc = payload == b->data ? crc : crc32c(0, payload, *len);
+  return payload;
+}
+
+/**
+ * Encode the payload of a full buffer's samples as configured by
+ * r->features.
+ *
+ * @param data The samples: the buffer's data, or those unpacked from it
+ * @param size Bytes of samples
+ * @param out Where to put an encoded payload, big enough for any
+ * @param len Set to the length of the payload
+ * @return Either out or, when uploading raw samples, data
+ */
+static const char* relay_encode(Relay *r, const char *data, size_t size,
+    char *out, size_t *len) {
+  if (r->features == RELAY_FEATURES_RAW) {
+    *len = size;
+    return data;
+  }
+  if (r->features == RELAY_FEATURES_CHANGES)
+    *len = suppress_compute(r->suppressor, (const int16_t*) data,
+        size / sizeof(int16_t), out);
+  else
+    *len = spectrum_compute(r->spectrum, (const int16_t*) data,
+        size / sizeof(int16_t), r->features == RELAY_FEATURES_BOTH, out);
+  return out;
+}
+
+/**
+ * Seal full buffers, oldest first, into the upload pipeline and hand them
+ * back to the consumer. A full buffer that finds no free slot stays with the
+ * relay, where #relay_relieve spools it if the consumer runs short of room.
+ *
+ * @return The number of buffers sealed
+ */
+static int relay_seal(Relay *r) {
+  int i, ret, sealed = 0;
+
+  for (i = 0; i < 2; ++i) {
+    if (r->buffers[r->buf_idx].capacity != r->buffers[r->buf_idx].size)
+      r->buf_idx ^= 1;
+    if (r->buffers[r->buf_idx].capacity != r->buffers[r->buf_idx].size)
+      break; /* neither buffer is full */
+    FAULT_DELAY(FAULT_SEAL_DELAY);
+    __sync_synchronize(); /* read the data the consumer wrote before size */
+    if ((ret = pipeline_seal(r->pipeline, r->buffers, r->buf_idx)) < 0)
+      break; /* the pipeline is backed up */
+    if (ret > 0)
+      continue; /* the consumer dumped it */
+    TRACE(TRACE_RELEASE, r->buf_idx, 0);
+    r->buf_idx ^= 1;
+    ++sealed;
+  }
+  return sealed;
+}
+
+/**
+ * Unpack stage of the pipeline: find the Firefly's packets in a sealed buffer
+ * and unpack their samples into the slot. Slots arrive in sealing order, so
+ * a packet cut off by the end of one buffer is finished by the next.
+ */
+static void stage_unpack(void *ctx, Slot *s) {
+  Relay *r = (Relay*) ctx;
+  s->nsamples = firefly_parse(r->firefly, s->raw->data, s->raw->capacity,
+      s->samples);
+}
+
+/**
+ * Encode the raw samples payload of a slot with the configured codec, or
+ * the one the controller picks for it. The samples are sent as they are if
+ * the codec does not make them smaller.
+ */
+static void relay_compress(Relay *r, Slot *s) {
+  int codec = r->config.live_codec, limit, in_flight;
+  struct timespec start, end;
+  size_t len;
+
+  if (codec == CODEC_LEVELS) {
+    in_flight = pipeline_in_flight(r->pipeline, &limit);
+    codec = adapt_choose(r->adapt, r->occupancy, in_flight, limit);
+  }
+  if (codec == CODEC_RAW) {
+    adapt_encoded(r->adapt, CODEC_RAW, s->raw->capacity, s->len, 0);
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  len = codec_encode(codec, s->payload, s->len, s->space);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  adapt_encoded(r->adapt, codec, s->raw->capacity, len,
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+  if (len < s->len) {
+    s->payload = s->space;
+    s->len = len;
+    s->codec = codec;
+  }
+}
+
+/**
+ * Encode stage of the pipeline: compute the payload of a sealed buffer, or of
+ * the samples unpacked from it. Runs on its own thread, the only one using
+ * the encoders while uploading over HTTP.
+ */
+static void stage_encode(void *ctx, Slot *s) {
+  Relay *r = (Relay*) ctx;
+  if (s->samples != NULL )
+    s->payload = relay_encode(r, (const char*) s->samples,
+        s->nsamples * sizeof(int16_t), s->space, &s->len);
+  else
+    s->payload = relay_encode(r, s->raw->data, s->raw->capacity, s->space,
+        &s->len);
+  s->codec = CODEC_RAW;
+  s->size = s->len;
+  if (r->adapt != NULL && r->config.live_codec != CODEC_RAW)
+    relay_compress(r, s);
+}
+
+/**
+ * Checksum stage of the pipeline: check a sealed buffer against the checksum
+ * the consumer gave it, and checksum its payload for the server. A raw
+ * payload is the buffer itself, so one pass does for both.
+ */
+static void stage_checksum(void *ctx, Slot *s) {
+  Relay *r = (Relay*) ctx;
+  uint32_t crc = crc32c(0, s->raw->data, s->raw->capacity);
+
+  /* The buffer is still sent; losing it would be worse than a bad sample */
+  if (crc != s->raw->crc) {
+    __sync_fetch_and_add(&r->crc_errors, 1);
+    TRACE(TRACE_CRC_ERROR, s->seq, crc);
+    fprintf(stderr, "[R] WARNING: Buffer %u failed its checksum "
+        "(%08x, expected %08x)\n", s->seq, crc, s->raw->crc);
+  }
+  s->crc = s->payload == s->raw->data ? crc : crc32c(0, s->payload, s->len);
+}
+
+/**
+ * Transmit stage of the pipeline: upload a payload, together with those of
+ * the slots queued behind it if the batch controller (see batch.h) wants
+ * more than one per request, failing over across the endpoints until one
+ * accepts them. The server's response acknowledges the payloads, after which
+ * their slots are free again.
+ *
+ * If every endpoint is down, the sealed buffers are spooled instead and sent
+ * later as dump files, so that they neither hold up the pipeline nor die
+ * with the relay.
+ */
+static void stage_transmit(void *ctx, Slot *s) {
+  Relay *r = (Relay*) ctx;
+  char header[sizeof CRC32C_HEADER + sizeof CODEC_HEADER
+      + sizeof BUFFER_ID_HEADER + 72];
+  Slot *batch[PIPELINE_SLOTS];
+  struct timespec start, end;
+  double waited = 0, seconds = 0;
+  size_t bytes = 0;
+  int n = 1, spooled = 0, i, want, limit;
+  Endpoint *ep;
+  long left;
+
+  batch[0] = s;
+  pipeline_in_flight(r->pipeline, &limit);
+  if ((want = batch_target(r->batching, &r->config, limit)) > 1) {
+    double interval = r->occupancy->fill_rate > 0 ?
+        (double) s->raw->capacity / r->occupancy->fill_rate : 0;
+    /* Those sealed already cost no wait */
+    n += pipeline_gather(r->pipeline, batch + 1, want - 1, 0);
+    if (n < want && batch_hold(r->batching, &r->config, n, interval)) {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      n += pipeline_gather(r->pipeline, batch + n, want - n,
+          r->config.batch_wait_ms);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      waited = (end.tv_sec - start.tv_sec)
+          + (end.tv_nsec - start.tv_nsec) / 1e9;
+    }
+  }
+
+  multipart_reset(&r->live);
+  for (i = 0; i < n; ++i) {
+    int len;
+    s = batch[i];
+    /* No codec header means a raw payload, as servers always had */
+    len = snprintf(header, sizeof header, CRC32C_HEADER ": %08x\r\n", s->crc);
+    if (s->codec != CODEC_RAW)
+      len += snprintf(header + len, sizeof header - len,
+          CODEC_HEADER ": %d %zu\r\n", s->codec, s->size);
+    /* The same id however often, and by whichever path, the buffer is sent */
+    if (s->raw->id != 0)
+      snprintf(header + len, sizeof header - len,
+          BUFFER_ID_HEADER ": %016llx\r\n", (unsigned long long) s->raw->id);
+    multipart_add(&r->live, r->features != RELAY_FEATURES_RAW ? "features" :
+        s->samples != NULL ? "samples" : (s->seq & 1) ? "buf1" : "buf0",
+        header, s->payload, NULL, s->len);
+    bytes += s->len;
+  }
+
+  while (1) {
+    /* Spread requests across endpoints, failing over until one succeeds, or
+     * until a drain runs out of time */
+    ep = NULL;
+    while ((left = drain_left_ms(r->drain)) != 0
+        && (ep = endpoints_pick(&r->endpoints)) != NULL ) {
+      CURLcode res;
+      curl_easy_setopt(r->live_curl, CURLOPT_TIMEOUT_MS, left > 0 ? left : 0L);
+      multipart_post(&r->live, r->live_curl);
+      res = relay_perform(r, r->live_curl, ep, bytes);
+      if (res == CURLE_OK)
+        break;
+      fprintf(stderr, "[R] Error on curl HTTP request to %s!\n", ep->url);
+      fprintf(stderr, "[R] %s\n", curl_easy_strerror(res));
+      ep = NULL;
+    }
+    if (ep != NULL ) {
+      if (left > 0)
+        __sync_fetch_and_add(&r->drain->uploaded, n);
+      curl_easy_getinfo(r->live_curl, CURLINFO_TOTAL_TIME, &seconds);
+      batch_sent(r->batching, r->live_curl, n, bytes, seconds, waited);
+      return;
+    }
+
+    /* Every endpoint is down, or there is no time left */
+    if (left < 0 && !pipeline_stopping(r->pipeline)
+        && !spool_has_room(r->occupancy->spool_files,
+            r->config.spool_quota_mb)) {
+      sleep(1); /* the spool is full, hold on until an endpoint is back */
+      continue;
+    }
+    for (; spooled < n; ++spooled) {
+      s = batch[spooled];
+      if (spool_write(r->spool_writer, s->raw) < 0)
+        break;
+      TRACE(TRACE_SPOOL, s->seq, r->occupancy->overflow_ms);
+      __sync_fetch_and_add(&r->occupancy->spool_files, 1);
+      __sync_fetch_and_add(left < 0 ? &r->occupancy->early_spools :
+          &r->drain->spooled, 1);
+    }
+    if (spooled == n)
+      return;
+    perror("[R] spool");
+    if (pipeline_stopping(r->pipeline)) {
+      for (; spooled < n; ++spooled) {
+        fprintf(stderr, "[R] Dropping buffer %u on the way out\n",
+            batch[spooled]->seq);
+        __sync_fetch_and_add(&r->occupancy->dropped, 1);
+      }
+      return;
+    }
+    /* Those spooled already are sent again with the rest; their ids let the
+     * server tell */
+    sleep(1);
+  }
+}
+
+/**
+ * Spool full buffers, oldest first, while overflow is projected or the
+ * consumer has no empty buffer left. This takes the SD card write off the
+ * consumer's realtime path when the relay cannot keep up, and happens before
+ * any upload since an upload may take as long as the consumer has left.
+ *
+ * @return 0 if successful, -1 if a buffer could not be written
+ */
+static int relay_relieve(Relay *r) {
+  int i;
+
+  for (i = 0; i < 2; ++i) {
+    if (r->buffers[r->buf_idx].capacity != r->buffers[r->buf_idx].size)
+      r->buf_idx ^= 1;
+    if (r->buffers[r->buf_idx].capacity != r->buffers[r->buf_idx].size)
+      return 0; /* nothing to spool */
+    if (!occupancy_at_risk(r->occupancy)
+        && r->buffers[r->buf_idx ^ 1].capacity
+            != r->buffers[r->buf_idx ^ 1].size)
+      return 0; /* the consumer still has room */
+    if (!spool_has_room(r->occupancy->spool_files, r->config.spool_quota_mb))
+      return 0; /* left to the consumer, which drops it if need be */
+    if (relay_spool(r) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/**
+ * Write the current buffer to the spool directory and hand it back to the
+ * consumer. It is uploaded later as a dump file.
+ *
+ * @return 0 if successful, -1 if the buffer could not be written
+ */
+static int relay_spool(Relay *r) {
+  Buffer *b = &r->buffers[r->buf_idx];
+
+  /* Spooled from a copy, checked as pipeline_seal checks its own, since the
+   * consumer may take the buffer back meanwhile (see buffer.h) */
+  memcpy(r->spare, b, sizeof(Buffer));
+  __sync_synchronize();
+  if (r->spare->size != r->spare->capacity || b->id != r->spare->id
+      || b->size != r->spare->size)
+    return 0; /* the consumer dumped it */
+  if (spool_write(r->spool_writer, r->spare) < 0) {
+    perror("[R] spool");
+    return -1; /* try again, or leave it to the consumer */
+  }
+  TRACE(TRACE_SPOOL, r->buf_idx, r->occupancy->overflow_ms);
+  __sync_fetch_and_add(&r->occupancy->early_spools, 1);
+  __sync_fetch_and_add(&r->occupancy->spool_files, 1);
+  __sync_bool_compare_and_swap(&b->size, r->spare->size, 0);
+  r->buf_idx ^= 1;
+  return 0;
+}
+
+/**
+ * Checks a mapped dump file against the checksum in its record header, or a
+ * pack against its trailer. A corrupt file is renamed so that it is neither
+ * sent nor scanned again, but kept for inspection. The spool only names a
+ * dump file once all of it is written (see spool.h), so one of another size
+ * than a Buffer, or with no capacity or id in its header, was cut short or
+ * never filled in, and is corrupt too.
+ *
+ * @param crc Set to the CRC-32C of the whole file
+ * @return 0 if the file may be sent, -1 if it is corrupt
+ */
+static int dump_verify(Relay *r, Segment *seg, const char *name,
+    uint32_t *crc) {
+  const Buffer *b = (const Buffer*) seg->data;
+  char from[256], to[256];
+
+  if (strncmp(name, "client-pack_", SPOOL_STAMP) == 0 ?
+      pack_verify(seg->data, seg->size) >= 0 :
+      seg->size == sizeof(Buffer) && b->id != 0 && b->capacity != 0
+          && b->size <= b->capacity && b->capacity <= __BUFFER_CAPACITY
+          && crc32c(0, b->data, b->size) == b->crc) {
+    *crc = crc32c(0, seg->data, seg->size);
+    return 0;
+  }
+
+  __sync_fetch_and_add(&r->crc_errors, 1);
+  TRACE(TRACE_CRC_ERROR, -1, seg->size >= sizeof(Buffer) ? b->crc : 0);
+  fprintf(stderr, "[R] WARNING: %s failed its checksum, setting it aside\n",
+      name);
+  snprintf(from, sizeof from, "%s%s", r->dump_dir, name);
+  snprintf(to, sizeof to, "%scorrupt-%s", r->dump_dir, name);
+  if (rename(from, to) < 0)
+    perror("[R] rename");
+  return -1;
+}
+
+/**
+ * Write a snapshot of the relay's metrics to the metrics file. The snapshot
+ * is written to a temporary file first so readers never see a partial one.
+ */
+static void relay_write_stats(Relay *r) {
+  char tmp_path[256];
+  FILE *out;
+
+  r->stats_at = time(NULL ) + RELAY_STATS_INTERVAL;
+  snprintf(tmp_path, sizeof tmp_path, "%s.tmp", r->metrics_path);
+  if ((out = fopen(tmp_path, "w")) == NULL ) {
+    perror("[R] metrics");
+    return;
+  }
+  fprintf(out, "time %ld\n", (long) time(NULL ));
+  fprintf(out, "relay resumed_bytes=%zu crc_errors=%lu\n", r->resumed_bytes,
+      r->crc_errors);
+  config_print(&r->config, out);
+  occupancy_print(r->occupancy, out);
+  failover_print(r->failover, out);
+  drain_print(r->drain, out);
+  spool_print(r->spool_stats, out);
+  if (r->compactor != NULL )
+    compactor_print(r->compactor, out);
+  if (r->firefly != NULL )
+    firefly_print(r->firefly, out);
+  if (r->adapt != NULL )
+    adapt_print(r->adapt, out);
+  if (r->suppressor != NULL )
+    fprintf(out, "suppress windows=%lu suppressed=%lu\n",
+        r->suppressor->windows, r->suppressor->suppressed);
+  if (r->stream != NULL )
+    fprintf(out, "stream connected=%d next_seq=%u acked=%u\n",
+        r->stream->fd >= 0, r->stream->next_seq, r->stream->acked);
+  else {
+    if (r->pipeline != NULL )
+      pipeline_print(r->pipeline, out);
+    if (r->batching != NULL )
+      batch_print(r->batching, out);
+    endpoints_print(&r->endpoints, out);
+  }
+  fclose(out);
+  if (rename(tmp_path, r->metrics_path) < 0)
+    perror("[R] metrics");
+}
+
+/**
+ * Send as many dump files as fit in one batch to the server.
+ *
+ * Files are taken in sorted (oldest first) order and added as parts of a
+ * single multipart request until either #RELAY_BATCH_FILES files or
+ * #RELAY_BATCH_LIMIT bytes have been added. Each part is streamed to curl
+ * straight out of the mapped file.
+ *
+ * The server acknowledges every part with the number of bytes of that file it
+ * has stored. A file is deleted once all of it is acknowledged. If an upload
+ * is interrupted, the server is asked how much of each file in the batch it
+ * already holds before the next attempt, and each part is resent from there.
+ * Every part is described by a Content-Range part header.
+ *
+ * @return 0 if the batch was sent, or one of RELAYE_*
+ */
 static int handle_dump_files(Relay *r, struct dirent **namelist, int n) {
-  struct curl_httppost *file_formpost = NULL;
-  struct curl_httppost *file_lastptr = NULL;
+  Segment segs[RELAY_BATCH_FILES]; /* mapped files of the batch */
+  uint32_t crcs[RELAY_BATCH_FILES]; /* checksums of the files */
+  int batch[RELAY_BATCH_FILES]; /* indices into namelist of batched files */
+  char sent[RELAY_BATCH_FILES]; /* whether each file is sent or stored */
+  int batch_files = 0;
+  int parts = 0;
+  size_t batch_bytes = 0;
+  struct stat dump_stat;
+  char fullpath[256];
+  int ret = 0;
 
   int i;
-  for (i = 0; i < n; ++i) {
-    curl_formadd(&file_formpost, &file_lastptr, CURLFORM_FILE,
-        namelist[i]->d_name, CURLFORM_END);
+  for (i = 0; i < n && batch_files < RELAY_BATCH_FILES; ++i) {
+    snprintf(fullpath, sizeof fullpath, "%s%s", r->dump_dir,
+        namelist[i]->d_name);
+    if (stat(fullpath, &dump_stat) < 0 || !S_ISREG(dump_stat.st_mode))
+      continue; /* removed underneath us, or not a dump at all */
+    if (batch_files > 0 && batch_bytes + dump_stat.st_size > RELAY_BATCH_LIMIT)
+      break;
+    if (segment_open(&segs[batch_files], fullpath) < 0)
+      continue;
+    if (dump_verify(r, &segs[batch_files], namelist[i]->d_name,
+        &crcs[batch_files]) < 0) {
+      segment_close(&segs[batch_files]);
+      continue;
+    }
+
+    batch_bytes += segs[batch_files].size;
+    batch[batch_files++] = i;
+  }
+  if (batch_files == 0)
+    return 0;
+
+  /* Stay with one endpoint, since resume offsets only hold for that server */
+  if (r->dump_endpoint == NULL || !r->dump_endpoint->healthy) {
+    if ((r->dump_endpoint = endpoints_pick(&r->endpoints)) == NULL ) {
+      ret = RELAYE_SERV;
+      goto cleanup;
+    }
+    r->resume = 1;
+  }
+  r->endpoint = r->dump_endpoint;
+
+  if (r->resume) {
+    if (query_resume(r, namelist, batch, batch_files) < 0) {
+      ret = RELAYE_SERV;
+      goto cleanup;
+    }
+    for (i = 0; i < batch_files; ++i) {
+      long offset = acked_offset(r, namelist[batch[i]]->d_name);
+      if (offset > 0) {
+        segs[i].pos = (size_t) offset < segs[i].size ? offset : segs[i].size;
+        r->resumed_bytes += segs[i].pos;
+        if (r->verbose)
+          printf("[R] Resuming %s at %zu of %zu bytes\n",
+              namelist[batch[i]]->d_name, segs[i].pos, segs[i].size);
+      }
+    }
+    r->resume = 0;
+  }
+
+  multipart_reset(&r->batch);
+  for (i = 0; i < batch_files; ++i) {
+    const Buffer *b = (const Buffer*) segs[i].data;
+    char headers[192];
+    int len = 0;
+    sent[i] = 1;
+    if (segs[i].size > 0 && segs[i].pos == segs[i].size)
+      continue; /* already stored in full */
+
+    /* Sent from the start too, so that the server knows the size of a file
+     * whose upload is cut short */
+    if (segs[i].size > 0)
+      len = snprintf(headers, sizeof headers,
+          "Content-Range: bytes %zu-%zu/%zu\r\n", segs[i].pos,
+          segs[i].size - 1, segs[i].size);
+    /* Covers the whole file, so the server checks it once it has all of it */
+    len += snprintf(headers + len, sizeof headers - len, "%s: %08x\r\n",
+        CRC32C_HEADER, crcs[i]);
+    /* A pack's ids are in its records */
+    if (segs[i].size == sizeof(Buffer) && b->id != 0)
+      snprintf(headers + len, sizeof headers - len, "%s: %016llx\r\n",
+          BUFFER_ID_HEADER, (unsigned long long) b->id);
+    if (multipart_add(&r->batch, namelist[batch[i]]->d_name, headers, NULL,
+        &segs[i], segs[i].size - segs[i].pos) < 0) {
+      sent[i] = 0; /* no room left in the body, so it waits for the next */
+      continue;
+    }
+    ++parts;
+  }
+
+  if (parts > 0) {
+    multipart_post(&r->batch, r->curl);
+
+    CURLcode res = relay_perform(r, r->curl, r->endpoint, batch_bytes);
+    if (res != CURLE_OK) {
+      fprintf(stderr, "[R] Error on sending curl dump!\n");
+      fprintf(stderr, "[R] %s\n", curl_easy_strerror(res));
+      r->resume = 1;
+      ret = RELAYE_SERV;
+      goto cleanup;
+    }
+  }
+
+  for (i = 0; i < batch_files; ++i) {
+    long offset;
+    if (!sent[i])
+      continue; /* never sent, so nothing is known of it */
+    offset = acked_offset(r, namelist[batch[i]]->d_name);
+    /* A server that does not acknowledge offsets has stored every part */
+    if (parts > 0 && offset >= 0 && (size_t) offset < segs[i].size) {
+      r->resume = 1;
+      continue;
+    }
+
+    snprintf(fullpath, sizeof fullpath, "%s%s", r->dump_dir,
+        namelist[batch[i]]->d_name);
+    if (unlink(fullpath) < 0) {
+      fprintf(stderr, "[R] Error on deleting file:\n  %s\n", fullpath);
+      perror("[R] unlink");
+    }
   }
+  TRACE(TRACE_BATCH, batch_files, batch_bytes);
 
-  curl_easy_setopt(r->curl, CURLOPT_HTTPPOST, file_formpost);
+  cleanup: for (i = 0; i < batch_files; ++i)
+    segment_close(&segs[i]);
+  return ret;
+}
+
+/**
+ * Ask the server how many bytes of each file in the batch it already holds.
+ * The answer is left in the relay's response buffer for #acked_offset.
+ *
+ * @return 0 if the server answered, -1 otherwise
+ */
+static int query_resume(Relay *r, struct dirent **namelist, int *batch,
+    int batch_files) {
+  size_t len;
+  int i;
+
+  /* The query has room for a full batch of the longest names */
+  len = snprintf(r->resume_query, sizeof r->resume_query,
+      "X-Electrisense-Resume:");
+  for (i = 0; i < batch_files; ++i)
+    len += snprintf(r->resume_query + len, sizeof r->resume_query - len, " %s",
+        namelist[batch[i]]->d_name);
+
+  curl_easy_setopt(r->curl, CURLOPT_HTTPGET, 1L);
+  curl_easy_setopt(r->curl, CURLOPT_HTTPHEADER, r->resume_headers);
+  CURLcode res = relay_perform(r, r->curl, r->endpoint, 0);
+  curl_easy_setopt(r->curl, CURLOPT_HTTPHEADER, r->slist);
 
-  CURLcode res = curl_easy_perform(r->curl);
   if (res != CURLE_OK) {
-    /* TODO: Can we retry on certain errors? */
-    fprintf(stderr, "[R] Error on sending curl dump!\n");
+    fprintf(stderr, "[R] Error on querying dump upload progress!\n");
     fprintf(stderr, "[R] %s\n", curl_easy_strerror(res));
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Look up the offset the server acknowledged for a file in its last response.
+ * Each line of the response is of the form "<file name> <offset>".
+ *
+ * @return The acknowledged offset, or -1 if the file was not mentioned
+ */
+static long acked_offset(Relay *r, const char *name) {
+  size_t name_len = strlen(name);
+  const char *line = r->response;
+
+  while (line != NULL && *line != '\0') {
+    if (strncmp(line, name, name_len) == 0 && line[name_len] == ' ')
+      return strtol(line + name_len + 1, NULL, 10);
+    if ((line = strchr(line, '\n')) != NULL )
+      ++line;
+  }
+  return -1;
+}
+
+/**
+ * Send full buffers over the streaming transport.
+ *
+ * Full buffers are written to the receiver as soon as they are found, without
+ * waiting for the previous one to be acknowledged. A buffer is only handed
+ * back to the consumer once the receiver has acknowledged the frame that
+ * carried it. When both buffers are in flight, wait for an acknowledgement.
+ *
+ * @return 0 if successful, or one of RELAYE_*
+ */
+static int relay_stream_buffers(Relay *r) {
+  Stream *s = r->stream;
+  int i;
+
+  if (stream_connect(s) < 0 || stream_poll(s, 0) < 0)
+    goto fail;
+  relay_stream_release(r);
+
+  /* The consumer may have moved on to the other buffer */
+  if (r->slot_seq[r->buf_idx] == 0
+      && r->buffers[r->buf_idx].capacity != r->buffers[r->buf_idx].size)
+    r->buf_idx ^= 1;
+
+  /* Send oldest first, keeping the sequence number across resends */
+  for (i = 0; i < 2; ++i) {
+    int idx = r->buf_idx ^ i;
+    if (r->buffers[idx].capacity != r->buffers[idx].size || r->slot_sent[idx])
+      continue;
+    const char *data;
+    size_t len;
+    if (r->slot_seq[idx] == 0)
+      r->slot_seq[idx] = s->next_seq++;
+    data = relay_payload(r, idx, &len);
+    if (stream_send(s, FRAME_DATA, r->slot_seq[idx], NULL, data, len,
+        r->payload_crc) < 0)
+      goto fail;
+    r->slot_sent[idx] = 1;
+  }
+
+  if (r->slot_sent[0] && r->slot_sent[1]) { /* window is full */
+    if (stream_poll(s, STREAM_ACK_WAIT) < 0)
+      goto fail;
+    relay_stream_release(r);
+  }
+  return 0;
+
+  fail: stream_disconnect(s);
+  r->slot_sent[0] = r->slot_sent[1] = 0; /* resend after reconnecting */
+  return RELAYE_SERV;
+}
+
+/** Hand acknowledged buffers back to the consumer, in the order sent. */
+static void relay_stream_release(Relay *r) {
+  int i;
+  for (i = 0; i < 2; ++i) {
+    int idx = r->buf_idx;
+    if (r->slot_seq[idx] == 0
+        || !FRAME_SEQ_LE(r->slot_seq[idx], r->stream->acked))
+      break;
+    TRACE(TRACE_RELEASE, idx, r->slot_seq[idx]);
+    r->slot_seq[idx] = 0;
+    r->slot_sent[idx] = 0;
+    __sync_bool_compare_and_swap(&r->buffers[idx].size,
+        r->buffers[idx].capacity, 0); /* unless the consumer dumped it */
+    r->buf_idx ^= 1;
+  }
+}
+
+/**
+ * Send a batch of dump files over the streaming transport, one frame per
+ * file, and delete them once the receiver has acknowledged the last one.
+ *
+ * @return 0 if the batch was sent, or one of RELAYE_*
+ */
+static int relay_stream_dumps(Relay *r, struct dirent **namelist, int n) {
+  Stream *s = r->stream;
+  Segment seg;
+  int batch[RELAY_BATCH_FILES]; /* indices into namelist of batched files */
+  uint32_t last = 0;
+  size_t batch_bytes = 0;
+  char fullpath[256];
+  int batch_files = 0;
+  int i, wait;
+
+  if (stream_connect(s) < 0)
     return RELAYE_SERV;
+
+  for (i = 0; i < n && batch_files < RELAY_BATCH_FILES
+      && batch_bytes < RELAY_BATCH_LIMIT; ++i) {
+    snprintf(fullpath, sizeof fullpath, "%s%s", r->dump_dir,
+        namelist[i]->d_name);
+    uint32_t crc;
+    if (segment_open(&seg, fullpath) < 0)
+      continue;
+    if (dump_verify(r, &seg, namelist[i]->d_name, &crc) < 0) {
+      segment_close(&seg);
+      continue;
+    }
+    last = s->next_seq++;
+    if (stream_send(s, FRAME_SEGMENT, last, namelist[i]->d_name, seg.data,
+        seg.size, crc) < 0) {
+      segment_close(&seg);
+      goto fail;
+    }
+    batch_bytes += seg.size;
+    batch[batch_files++] = i;
+    segment_close(&seg);
   }
+  if (batch_files == 0)
+    return 0;
 
-  for (i = 0; i < n; ++i) {
-    char fullpath[256];
-    strcpy(fullpath, r->dump_dir);
-    strcat(fullpath, namelist[i]->d_name);
+  for (wait = 0; !FRAME_SEQ_LE(last, s->acked); ++wait)
+    if (wait == STREAM_SEND_TIMEOUT || stream_poll(s, STREAM_ACK_WAIT) < 0)
+      goto fail;
+
+  for (i = 0; i < batch_files; ++i) {
+    snprintf(fullpath, sizeof fullpath, "%s%s", r->dump_dir,
+        namelist[batch[i]]->d_name);
     if (unlink(fullpath) < 0) {
       fprintf(stderr, "[R] Error on deleting file:\n  %s\n", fullpath);
       perror("[R] unlink");
     }
-    if (r->verbose)
-      printf("[R] %d dump files transfered.\n", n);
   }
-
-  curl_formfree(file_formpost);
+  TRACE(TRACE_BATCH, batch_files, batch_bytes);
   return 0;
+
+  /* Files are sent again, by name, after reconnecting */
+  fail: stream_disconnect(s);
+  r->slot_sent[0] = r->slot_sent[1] = 0;
+  return RELAYE_SERV;
 }
 
-static int dump_filter(const struct dirent *entry) {
-  static const char filter_str[13] = "client-dump_";
-  int i;
-  for (i = 0; i < 12; ++i)
-    if (filter_str[i] != entry->d_name[i])
-      return 0;
-  return 1;
+/**
+ * List the dump files and packs awaiting upload, oldest first, into
+ * r->spool, and recount the spool for the consumer. Only as many files are
+ * listed as one batch takes.
+ *
+ * @return The number of files listed, or -1 if the directory cannot be read
+ */
+static int relay_scan(Relay *r) {
+  uint32_t before = r->occupancy->spool_files;
+  int n;
+
+  if ((n = spool_scan(&r->spool, r->dump_dir)) < 0) {
+    fprintf(stderr, "[R] Error scanning dump directory!");
+    perror("[R] opendir");
+    return -1;
+  }
+  /* The consumer and the transmit threads count dump files as they write
+   * them, so the count is moved by what the scan found rather than stored:
+   * a file written during the scan is then counted, if perhaps twice until
+   * the next scan, and never missed */
+  __sync_fetch_and_add(&r->occupancy->spool_files, r->spool.files - before);
+  return n;
 }
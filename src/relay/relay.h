@@ -9,6 +9,25 @@
  * minimal amount of processor time will be used sending the data across the
  * network.
  *
+ * Full buffers are uploaded over HTTP through a pipeline of worker threads
+ * (see pipeline.h), so the consumer gets each buffer back as soon as it has
+ * been copied rather than once the server has it.
+ *
+ * A relay may be started as a hot standby (see failover.h): it initializes
+ * and then waits for #relay_activate before doing any work.
+ *
+ * Raw buffers may be encoded on the way (see codec.h), by the codec the
+ * configuration names or the one a controller picks per buffer (see
+ * adapt.h); the codec travels with the payload in a part header. Several
+ * sealed buffers may go in one request, as many as a controller finds the
+ * link's round trip calls for (see batch.h).
+ *
+ * Dump files are uploaded oldest first, together with the packs the relay's
+ * compactor (see compact.h) merges them into when they pile up.
+ *
+ * On shutdown the consumer asks the relay to drain (see drain.h), and the
+ * relay calls #relay_drain instead of #relay_process.
+ *
  * @authors Larson, Patrick; Pickett, Cameron
  */
 
@@ -17,21 +36,105 @@
 
 /* This is the public header file, all interface related details belong here */
 #include <curl/curl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include "adapt.h"
+#include "batch.h"
+#include "compact.h"
+#include "endpoint.h"
+#include "firefly.h"
+#include "multipart.h"
+#include "pipeline.h"
+#include "spectrum.h"
+#include "stream.h"
+#include "suppress.h"
 #include "../shared/buffer.h"
+#include "../shared/config.h"
+#include "../shared/crc32c.h"
+#include "../shared/drain.h"
+#include "../shared/failover.h"
+#include "../shared/occupancy.h"
+#include "../shared/spool.h"
 
 /** Server had an issue, not our fault */
 #define RELAYE_SERV -2
 
+/** Maximum number of dump bytes sent to the server in a single request */
+#define RELAY_BATCH_LIMIT (__BUFFER_CAPACITY * 32)
+/** Maximum number of dump files sent to the server in a single request */
+#define RELAY_BATCH_FILES SPOOL_SCAN_MAX
+/** Size of the buffer holding the server's response to a request */
+#define RELAY_RESPONSE_MAX 16384
+/** Seconds allowed to connect to an endpoint */
+#define RELAY_CONNECT_TIMEOUT 5
+/** Seconds a transfer may stall below RELAY_STALL_RATE before failing over */
+#define RELAY_STALL_TIMEOUT 10
+/** Bytes per second below which a transfer counts as stalled */
+#define RELAY_STALL_RATE 1024
+/** Seconds between metrics snapshots */
+#define RELAY_STATS_INTERVAL 10
+/** Microseconds the relay waits when neither buffer is full */
+#define RELAY_IDLE_WAIT 2000
+
+/** Upload buffers as captured */
+#define RELAY_FEATURES_RAW 0
+/** Upload only the spectra of each buffer (see spectrum.h) */
+#define RELAY_FEATURES_SPECTRA 1
+/** Upload the spectra and decimated raw samples of each buffer */
+#define RELAY_FEATURES_BOTH 2
+/** Upload only the windows of each buffer that changed (see suppress.h) */
+#define RELAY_FEATURES_CHANGES 3
+
 struct relay_st {
   /* Any operational parameters go here */
   pthread_mutex_t sd_thread_lock;
   Buffer *buffers;
-  char *server_url;
+  Occupancy *occupancy; /**< Telemetry of the double buffer, shared */
+  Failover *failover; /**< Which relay is in charge, shared */
+  Drain *drain; /**< The consumer's shutdown request, shared */
+  Config *shared_config; /**< The live configuration, shared */
+  Config config; /**< The configuration being applied */
   char *dump_dir;
+  Spool *spool_writer; /**< Writes buffers to dump files in dump_dir */
+  Buffer *spare; /**< Copy of the shared buffer being spooled early */
+  SpoolStats *spool_stats; /**< Counts of spool writes and flushes, shared */
+  char *metrics_path; /**< Where metrics snapshots go, or NULL for none */
+  time_t stats_at; /**< When the next metrics snapshot is due */
+  Endpoints endpoints; /**< The servers uploaded to over HTTP */
+  Endpoint *endpoint; /**< The endpoint of the request being made */
+  Endpoint *dump_endpoint; /**< The endpoint dump files are being sent to */
   CURL *curl;
-  struct curl_httppost *form0;
-  struct curl_httppost *form1;
+  Multipart batch; /**< Body of the dump file batch being uploaded */
+  Multipart live; /**< Body of the live upload, the transmit stage's */
+  SpoolScan spool; /**< Oldest dump files, as last scanned */
+  /** Header asking the server for the progress of a batch */
+  char resume_query[RELAY_BATCH_FILES * (NAME_MAX + 2)];
+  struct curl_slist resume_headers[2]; /**< Headers of the progress query */
+  Pipeline *pipeline; /**< Stages of live uploads, or NULL when streaming */
+  Compactor *compactor; /**< Packs dump files, or NULL */
+  Adapt *adapt; /**< Chooses the codec of live buffers, or NULL unless they
+   are uploaded raw over HTTP */
+  Batch *batching; /**< Sizes the live requests of the pipeline */
+  CURL *live_curl; /**< Handle the pipeline's transmit stage uploads with */
+  int features; /**< What is uploaded per buffer, one of RELAY_FEATURES_* */
+  Firefly *firefly; /**< Unpacks the Firefly's packets, or NULL for a bare
+   stream of samples */
+  Spectrum *spectrum; /**< FFT tables, or NULL unless uploading spectra */
+  Suppressor *suppressor; /**< Change detector, or NULL unless suppressing */
+  char *feature_buf; /**< Payload computed from a buffer */
+  size_t feature_len; /**< Size of the payload in feature_buf */
+  uint32_t payload_crc; /**< CRC-32C of the payload last returned */
+  unsigned long crc_errors; /**< Buffers and dump files that failed checks */
   struct curl_slist *slist;
+  char response[RELAY_RESPONSE_MAX]; /**< Body of the last server response */
+  size_t response_len;
+  size_t resumed_bytes; /**< Dump bytes not resent thanks to resumption */
+  int resume; /**< Set when an interrupted dump upload must be resumed */
+  Stream *stream; /**< Streaming transport, or NULL when using HTTP */
+  uint32_t slot_seq[2]; /**< Frame carrying each buffer, 0 if none yet */
+  int slot_sent[2]; /**< Set once a buffer's frame is written out */
   int buf_idx;
   int verbose;
 };
@@ -46,13 +149,46 @@ typedef struct relay_st Relay;
  *
  * Returns NULL in the event of initialization failure.
  *
+ * @param b A pointer to the shared double buffer.
+ * @param occ The shared occupancy telemetry of the double buffer. While it
+ * projects an overflow, full buffers are spooled rather than uploaded.
+ * @param fo The shared failover bookkeeping
+ * @param drain The shared shutdown request. Once it is made, live uploads
+ * give up at its deadline and spool the buffer instead.
+ * @param seals The shared pipeline slots, #PIPELINE_SLOTS of them
+ * @param config The shared configuration, whose server is where to send
+ * data: either a comma separated list of HTTP endpoints, or a single
+ * tcp://host:port receiver for the streaming transport. Changes to it are
+ * applied at the start of the next #relay_process.
+ * @param spool_stats The shared counts of spool writes and flushes
+ * @param backup_source The directory the consumer dumps buffers to
+ * @param metrics_path A file to periodically write a metrics snapshot to, or
+ * NULL
+ * @param features What to upload for each buffer, one of RELAY_FEATURES_*
+ * @param packets Non-zero if the buffers hold the Firefly's packets (see
+ * firefly.h) rather than a bare stream of samples. The samples unpacked from
+ * them are uploaded instead of the buffer, over HTTP only.
+ * @param verbose Enable verbose output from relay
+ *
  * @return A malloc'd handle to be used for all future calls to to the relay
  * interface. The handle contains all configuration details necessary for the
  * relay to process data. In the event that the relay is stoppped, it is the
  * caller's responsibility to free the Relay handler by calling
  * #relay_cleanup.
  */
-Relay* relay_init(Buffer* b, char* server_url, char* backup_source, int verbose);
+Relay* relay_init(Buffer* b, Occupancy *occ, Failover *fo, Drain *drain,
+    Seal *seals, Config *config, SpoolStats *spool_stats, char* backup_source,
+    char* metrics_path, int features, int packets, int verbose);
+
+/**
+ * Puts an initialized relay in charge. Must be called once, before
+ * #relay_process, by the relay the consumer has made active; buffers sealed
+ * but not delivered by a relay that died before it are sent again, and the
+ * compactor starts.
+ *
+ * @param r The relay taking over
+ */
+void relay_activate(Relay *r);
 
 /**
  * Perform one unit of work.
@@ -78,6 +214,16 @@ Relay* relay_init(Buffer* b, char* server_url, char* backup_source, int verbose)
  */
 int relay_process(Relay *r);
 
+/**
+ * Drains the relay once the consumer has stopped and requested it: full
+ * buffers are sealed and uploaded until the deadline, and the rest, partially
+ * filled buffers included, is spooled as dump files. Nothing more must be
+ * asked of the relay but #relay_cleanup.
+ *
+ * @param r The relay to drain
+ */
+void relay_drain(Relay *r);
+
 /**
  * Frees the relay handle and performs any additional cleanup required to shut
  * down the relay. The specified handle will be NULL after this function
@@ -0,0 +1,114 @@
+/**
+ * @file segment.c
+ * Implementation of memory-mapped spool segment access
+ * @see segment.h
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "segment.h"
+
+static void segment_advise(Segment *s);
+
+/**
+ * Opens and maps a spool segment
+ * @see segment.h
+ */
+int segment_open(Segment *s, const char *path) {
+  struct stat seg_stat;
+
+  s->data = NULL;
+  s->size = 0;
+  s->pos = 0;
+  s->advised = 0;
+  s->released = 0;
+
+  if ((s->fd = open(path, O_RDONLY)) < 0) {
+    perror("[R] open");
+    return -1;
+  }
+  if (fstat(s->fd, &seg_stat) < 0) {
+    perror("[R] fstat");
+    close(s->fd);
+    return -1;
+  }
+  s->size = seg_stat.st_size;
+  if (s->size == 0)
+    return 0; /* Nothing to map */
+
+  s->data = (char*) mmap(NULL, s->size, PROT_READ, MAP_SHARED, s->fd, 0);
+  if (s->data == MAP_FAILED) {
+    perror("[R] mmap");
+    close(s->fd);
+    s->data = NULL;
+    return -1;
+  }
+  madvise(s->data, s->size, MADV_SEQUENTIAL);
+  segment_advise(s);
+
+  return 0;
+}
+
+/**
+ * Copies the next bytes of a segment
+ * @see segment.h
+ */
+size_t segment_read(char *dest, size_t size, size_t nmemb, void *userp) {
+  Segment *s = (Segment*) userp;
+  size_t amount = size * nmemb;
+
+  if (amount > s->size - s->pos)
+    amount = s->size - s->pos;
+  if (amount == 0)
+    return 0;
+
+  memcpy(dest, s->data + s->pos, amount);
+  s->pos += amount;
+  segment_advise(s);
+
+  return amount;
+}
+
+/**
+ * Unmaps and closes a segment
+ * @see segment.h
+ */
+void segment_close(Segment *s) {
+  if (s->data != NULL )
+    munmap(s->data, s->size);
+  close(s->fd);
+  s->data = NULL;
+}
+
+/**
+ * Keeps readahead requested one window past the read position, and drops the
+ * pages that have already been sent.
+ */
+static void segment_advise(Segment *s) {
+  size_t page = (size_t) sysconf(_SC_PAGESIZE);
+  size_t start, end;
+
+  if (s->advised < s->size && s->pos + SEGMENT_READAHEAD / 2 >= s->advised) {
+    start = s->advised & ~(page - 1);
+    end = s->pos + SEGMENT_READAHEAD;
+    if (end > s->size)
+      end = s->size;
+    madvise(s->data + start, end - start, MADV_WILLNEED);
+    s->advised = end;
+  }
+
+  /* Sent pages will not be read again */
+  end = s->pos & ~(page - 1);
+  if (end >= s->released + SEGMENT_READAHEAD) {
+    madvise(s->data + s->released, end - s->released, MADV_DONTNEED);
+    s->released = end;
+  }
+}
@@ -0,0 +1,63 @@
+/**
+ * @file segment.h
+ * Memory-mapped access to spool segments for the relay
+ *
+ * Data the consumer could not hand to the relay in time is spooled to the SD
+ * card. When the relay sends that backlog, each spool segment is mapped into
+ * memory and handed to curl through a read callback, so that no user space
+ * staging copy of the file is needed. Readahead is requested a window ahead of
+ * the read position, and pages that have already been sent are released so
+ * that a large backlog does not crowd the page cache on the Carambola.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#ifndef _RELAY_SEGMENT_H
+#define _RELAY_SEGMENT_H
+
+#include <stdlib.h>
+
+/** Number of bytes to request readahead for beyond the read position */
+#define SEGMENT_READAHEAD (128 * 1024)
+
+/**
+ * A mapped spool segment and the position of the next byte to be read.
+ */
+struct segment_st {
+  char *data; /**< The mapped file, or NULL if the file is empty */
+  size_t size; /**< The size of the file */
+  size_t pos; /**< Offset of the next byte to be read */
+  size_t advised; /**< Offset up to which readahead has been requested */
+  size_t released; /**< Offset below which pages have been released */
+  int fd; /**< The open spool segment */
+};
+
+typedef struct segment_st Segment;
+
+/**
+ * Opens and maps the spool segment located at path.
+ *
+ * @param s The segment to initialize
+ * @param path The path of the spool segment
+ * @return 0 if successful, -1 if there is an error
+ */
+int segment_open(Segment *s, const char *path);
+
+/**
+ * Copies the next bytes of a segment into dest.
+ *
+ * The signature matches a curl read callback, with userp being the Segment
+ * to read from.
+ *
+ * @return The number of bytes copied, 0 once the segment is exhausted
+ */
+size_t segment_read(char *dest, size_t size, size_t nmemb, void *userp);
+
+/**
+ * Unmaps and closes a segment opened by #segment_open.
+ *
+ * @param s The segment to close
+ */
+void segment_close(Segment *s);
+
+#endif
@@ -0,0 +1,270 @@
+/**
+ * @file spectrum.c
+ * Implementation of fixed-point spectral feature extraction
+ * @see spectrum.h
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__SSE2__) && !defined(SPECTRUM_SCALAR)
+#include <emmintrin.h>
+#endif
+
+#include "spectrum.h"
+
+static void fft_stages(Spectrum *s, int16_t *x);
+static void accumulate_power(Spectrum *s);
+static uint16_t isqrt(uint32_t v);
+
+/** Power is scaled down before accumulation so the sums cannot overflow */
+#define POWER_SHIFT 4
+
+/**
+ * Allocates and fills the FFT tables
+ * @see spectrum.h
+ */
+Spectrum* spectrum_init() {
+  Spectrum *s;
+  int i, h, k;
+
+  if ((s = (Spectrum*) malloc(sizeof(Spectrum))) == NULL )
+    return NULL ;
+
+  for (i = 0; i < SPECTRUM_SIZE; ++i) {
+    int r = 0, b;
+    for (b = 0; b < SPECTRUM_BITS; ++b)
+      r |= ((i >> b) & 1) << (SPECTRUM_BITS - 1 - b);
+    s->bitrev[i] = r;
+    s->window[i] = (int16_t) lrint(
+        32767 * 0.5 * (1 - cos(2 * M_PI * i / SPECTRUM_SIZE)));
+  }
+
+  /* Twiddles for the stage combining spans of h live at [2h, 4h) */
+  for (h = 1; h < SPECTRUM_SIZE; h <<= 1) {
+    for (k = 0; k < h; ++k) {
+      int16_t c = (int16_t) lrint(32767 * cos(M_PI * k / h));
+      int16_t sn = (int16_t) lrint(32767 * sin(M_PI * k / h));
+      s->tw_re[2 * (h + k)] = c;
+      s->tw_re[2 * (h + k) + 1] = sn;
+      s->tw_im[2 * (h + k)] = -sn;
+      s->tw_im[2 * (h + k) + 1] = c;
+    }
+  }
+  return s;
+}
+
+/**
+ * The size of the payload for a number of samples
+ * @see spectrum.h
+ */
+size_t spectrum_payload_size(size_t samples, int with_raw) {
+  size_t windows = samples / SPECTRUM_SIZE;
+  size_t frames = windows < SPECTRUM_AVERAGE ?
+      (windows > 0) : windows / SPECTRUM_AVERAGE;
+  size_t size = sizeof(SpectrumHeader)
+      + frames * (SPECTRUM_SIZE / 2) * sizeof(uint16_t);
+
+  if (with_raw)
+    size += (samples / SPECTRUM_DECIMATE) * sizeof(int16_t);
+  return size;
+}
+
+/**
+ * Computes the spectra of a block of samples
+ * @see spectrum.h
+ */
+size_t spectrum_compute(Spectrum *s, const int16_t *samples, size_t n,
+    int with_raw, char *out) {
+  SpectrumHeader *hdr = (SpectrumHeader*) out;
+  size_t windows = n / SPECTRUM_SIZE;
+  size_t frames = windows < SPECTRUM_AVERAGE ?
+      (windows > 0) : windows / SPECTRUM_AVERAGE;
+  uint16_t *bins = (uint16_t*) (out + sizeof(SpectrumHeader));
+  size_t w, f, i;
+
+  hdr->magic = SPECTRUM_MAGIC;
+  hdr->fft_size = SPECTRUM_SIZE;
+  hdr->frames = frames;
+  hdr->average = SPECTRUM_AVERAGE;
+  hdr->decimation = with_raw ? SPECTRUM_DECIMATE : 0;
+  hdr->raw_samples = with_raw ? n / SPECTRUM_DECIMATE : 0;
+
+  for (f = 0, w = 0; f < frames; ++f) {
+    /* Any windows left over are folded into the last spectrum */
+    size_t last = f + 1 == frames ? windows : w + SPECTRUM_AVERAGE;
+    size_t count = last - w;
+
+    memset(s->power, 0, sizeof s->power);
+    for (; w < last; ++w) {
+      const int16_t *x = samples + w * SPECTRUM_SIZE;
+      /* Window into bit reversed order, keeping a guard bit of headroom */
+      for (i = 0; i < SPECTRUM_SIZE; ++i) {
+        s->work[2 * s->bitrev[i]] = ((int32_t) x[i] * s->window[i]) >> 16;
+        s->work[2 * s->bitrev[i] + 1] = 0;
+      }
+      fft_stages(s, s->work);
+      accumulate_power(s);
+    }
+    for (i = 0; i < SPECTRUM_SIZE / 2; ++i)
+      bins[f * (SPECTRUM_SIZE / 2) + i] = isqrt(
+          (s->power[i] / count) << POWER_SHIFT);
+  }
+
+  if (with_raw) {
+    int16_t *raw = (int16_t*) (bins + frames * (SPECTRUM_SIZE / 2));
+    for (i = 0; i < n / SPECTRUM_DECIMATE; ++i) {
+      int32_t sum = 0;
+      size_t j;
+      for (j = 0; j < SPECTRUM_DECIMATE; ++j)
+        sum += samples[i * SPECTRUM_DECIMATE + j];
+      raw[i] = sum / SPECTRUM_DECIMATE;
+    }
+  }
+
+  return spectrum_payload_size(n, with_raw);
+}
+
+/**
+ * Transforms SPECTRUM_SIZE complex values in place
+ * @see spectrum.h
+ */
+void spectrum_fft(Spectrum *s, int16_t *x) {
+  int i;
+  for (i = 0; i < SPECTRUM_SIZE; ++i) {
+    int r = s->bitrev[i];
+    if (r > i) {
+      int16_t re = x[2 * i], im = x[2 * i + 1];
+      x[2 * i] = x[2 * r];
+      x[2 * i + 1] = x[2 * r + 1];
+      x[2 * r] = re;
+      x[2 * r + 1] = im;
+    }
+  }
+  fft_stages(s, x);
+}
+
+/**
+ * Frees the FFT tables
+ * @see spectrum.h
+ */
+void spectrum_cleanup(Spectrum **s) {
+  free(*s);
+  *s = NULL;
+}
+
+/**
+ * Runs the radix-2 butterfly stages over bit reversed input. Each butterfly
+ * computes (a + w * b) / 2 and (a - w * b) / 2.
+ *
+ * The first two stages have the trivial twiddles 1 and -i, and are done
+ * without multiplies.
+ */
+static void fft_stages(Spectrum *s, int16_t *x) {
+  int h, g, k;
+
+  /* h = 1: twiddle 1 */
+  for (g = 0; g < SPECTRUM_SIZE; g += 2) {
+    int16_t *a = x + 2 * g;
+    int32_t ar = a[0], ai = a[1], br = a[2], bi = a[3];
+    a[0] = (ar + br) >> 1;
+    a[1] = (ai + bi) >> 1;
+    a[2] = (ar - br) >> 1;
+    a[3] = (ai - bi) >> 1;
+  }
+  /* h = 2: twiddles 1 and -i */
+  for (g = 0; g < SPECTRUM_SIZE; g += 4) {
+    int16_t *a = x + 2 * g;
+    int32_t ar = a[0], ai = a[1], br = a[4], bi = a[5];
+    a[0] = (ar + br) >> 1;
+    a[1] = (ai + bi) >> 1;
+    a[4] = (ar - br) >> 1;
+    a[5] = (ai - bi) >> 1;
+    ar = a[2];
+    ai = a[3];
+    br = a[7]; /* -i * b */
+    bi = -a[6];
+    a[2] = (ar + br) >> 1;
+    a[3] = (ai + bi) >> 1;
+    a[6] = (ar - br) >> 1;
+    a[7] = (ai - bi) >> 1;
+  }
+
+  for (h = 4; h < SPECTRUM_SIZE; h <<= 1) {
+    const int16_t *wr = s->tw_re + 2 * h;
+    const int16_t *wi = s->tw_im + 2 * h;
+    for (g = 0; g < SPECTRUM_SIZE; g += 2 * h) {
+      int16_t *a = x + 2 * g;
+      int16_t *b = x + 2 * (g + h);
+#if defined(__SSE2__) && !defined(SPECTRUM_SCALAR)
+      /* Four butterflies at a time; h is a multiple of four here */
+      for (k = 0; k < h; k += 4) {
+        __m128i vb = _mm_loadu_si128((__m128i*) (b + 2 * k));
+        __m128i va = _mm_loadu_si128((__m128i*) (a + 2 * k));
+        __m128i tr = _mm_srai_epi32(
+            _mm_madd_epi16(vb, _mm_load_si128((__m128i*) (wr + 2 * k))), 15);
+        __m128i ti = _mm_srai_epi32(
+            _mm_madd_epi16(vb, _mm_load_si128((__m128i*) (wi + 2 * k))), 15);
+        __m128i t_lo = _mm_unpacklo_epi32(tr, ti);
+        __m128i t_hi = _mm_unpackhi_epi32(tr, ti);
+        __m128i a_lo = _mm_srai_epi32(_mm_unpacklo_epi16(va, va), 16);
+        __m128i a_hi = _mm_srai_epi32(_mm_unpackhi_epi16(va, va), 16);
+        _mm_storeu_si128((__m128i*) (a + 2 * k),
+            _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(a_lo, t_lo), 1),
+                _mm_srai_epi32(_mm_add_epi32(a_hi, t_hi), 1)));
+        _mm_storeu_si128((__m128i*) (b + 2 * k),
+            _mm_packs_epi32(_mm_srai_epi32(_mm_sub_epi32(a_lo, t_lo), 1),
+                _mm_srai_epi32(_mm_sub_epi32(a_hi, t_hi), 1)));
+      }
+#else
+      for (k = 0; k < h; ++k) {
+        int32_t br = b[2 * k], bi = b[2 * k + 1];
+        int32_t tr = (br * wr[2 * k] + bi * wr[2 * k + 1]) >> 15;
+        int32_t ti = (br * wi[2 * k] + bi * wi[2 * k + 1]) >> 15;
+        int32_t ar = a[2 * k], ai = a[2 * k + 1];
+        a[2 * k] = (ar + tr) >> 1;
+        a[2 * k + 1] = (ai + ti) >> 1;
+        b[2 * k] = (ar - tr) >> 1;
+        b[2 * k + 1] = (ai - ti) >> 1;
+      }
+#endif
+    }
+  }
+}
+
+/** Adds the power of the lower half of the transform to the accumulator. */
+static void accumulate_power(Spectrum *s) {
+  int i = 0;
+#if defined(__SSE2__) && !defined(SPECTRUM_SCALAR)
+  for (; i < SPECTRUM_SIZE / 2; i += 4) {
+    __m128i v = _mm_load_si128((__m128i*) (s->work + 2 * i));
+    __m128i p = _mm_srli_epi32(_mm_madd_epi16(v, v), POWER_SHIFT);
+    __m128i *acc = (__m128i*) (s->power + i);
+    _mm_store_si128(acc, _mm_add_epi32(_mm_load_si128(acc), p));
+  }
+#endif
+  for (; i < SPECTRUM_SIZE / 2; ++i) {
+    int32_t re = s->work[2 * i], im = s->work[2 * i + 1];
+    s->power[i] += (uint32_t) (re * re + im * im) >> POWER_SHIFT;
+  }
+}
+
+/** Integer square root, rounded down. */
+static uint16_t isqrt(uint32_t v) {
+  uint32_t root = 0, bit = 1u << 30;
+
+  while (bit > v)
+    bit >>= 2;
+  while (bit != 0) {
+    if (v >= root + bit) {
+      v -= root + bit;
+      root = (root >> 1) + bit;
+    } else {
+      root >>= 1;
+    }
+    bit >>= 2;
+  }
+  return root > 0xffff ? 0xffff : root;
+}
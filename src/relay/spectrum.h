@@ -0,0 +1,132 @@
+/**
+ * @file spectrum.h
+ * On-device spectral feature extraction for the relay
+ *
+ * Electrisense works on the spectrum of the captured signal, which the server
+ * normally computes from the raw samples. On a constrained uplink the relay
+ * can instead compute the spectra itself and upload those, optionally along
+ * with a decimated copy of the raw signal, cutting the bytes sent per buffer
+ * by an order of magnitude.
+ *
+ * Samples are taken to be little-endian signed 16-bit values. Each buffer is
+ * cut into windows of #SPECTRUM_SIZE samples, which are Hann windowed and
+ * transformed by a fixed-point radix-2 FFT. The power in every bin is
+ * averaged over #SPECTRUM_AVERAGE consecutive windows, and the square root of
+ * that average is reported for each of the SPECTRUM_SIZE / 2 bins.
+ *
+ * The FFT works in Q15 with interleaved real and imaginary parts, halving at
+ * every stage so that it cannot overflow; bin values are therefore the
+ * amplitude spectrum divided by SPECTRUM_SIZE * 2. The kernel only needs
+ * 32-bit multiplies, which suits the Carambola's MIPS core. On x86 builds the
+ * butterflies and power accumulation use SSE2 and produce results identical
+ * to the scalar kernel, which defining SPECTRUM_SCALAR selects instead.
+ *
+ * Payload format
+ * --------------
+ * A payload starts with a SpectrumHeader, followed by frames * SPECTRUM_SIZE
+ * / 2 unsigned 16-bit bin values, followed by raw_samples signed 16-bit
+ * decimated samples if decimation is non-zero. All values are little-endian.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#ifndef _RELAY_SPECTRUM_H
+#define _RELAY_SPECTRUM_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/** Number of samples per FFT window; must be a power of two */
+#define SPECTRUM_SIZE 1024
+/** log2(SPECTRUM_SIZE) */
+#define SPECTRUM_BITS 10
+/** Number of windows whose power is averaged into one reported spectrum */
+#define SPECTRUM_AVERAGE 10
+/** Factor by which raw samples are decimated when uploaded with spectra */
+#define SPECTRUM_DECIMATE 16
+
+/** Marks the start of a spectrum payload ("ESPC") */
+#define SPECTRUM_MAGIC 0x43505345
+
+/**
+ * The header of a spectrum payload.
+ */
+struct spectrum_header_st {
+  /** Always #SPECTRUM_MAGIC */
+  uint32_t magic;
+  /** The FFT window size */
+  uint16_t fft_size;
+  /** Number of spectra that follow */
+  uint16_t frames;
+  /** Windows averaged into each spectrum; the last may cover more */
+  uint16_t average;
+  /** Decimation factor of the raw samples, or 0 if none are included */
+  uint16_t decimation;
+  /** Number of decimated raw samples following the spectra */
+  uint32_t raw_samples;
+};
+
+typedef struct spectrum_header_st SpectrumHeader;
+
+/**
+ * Precomputed tables and scratch space for the FFT.
+ */
+struct spectrum_st {
+  int16_t window[SPECTRUM_SIZE]; /**< Hann window, Q15 */
+  uint16_t bitrev[SPECTRUM_SIZE]; /**< Bit reversed index of each sample */
+  /** Per-stage twiddles as (cos, sin) pairs for the real part of a product */
+  int16_t tw_re[2 * SPECTRUM_SIZE] __attribute__((aligned(16)));
+  /** Per-stage twiddles as (-sin, cos) pairs for the imaginary part */
+  int16_t tw_im[2 * SPECTRUM_SIZE] __attribute__((aligned(16)));
+  /** Interleaved complex working data */
+  int16_t work[2 * SPECTRUM_SIZE] __attribute__((aligned(16)));
+  /** Accumulated power of each bin */
+  uint32_t power[SPECTRUM_SIZE / 2] __attribute__((aligned(16)));
+};
+
+typedef struct spectrum_st Spectrum;
+
+/**
+ * Allocates and fills the FFT tables.
+ *
+ * @return A malloc'd handle to be freed with #spectrum_cleanup, or NULL
+ */
+Spectrum* spectrum_init();
+
+/**
+ * The size of the payload produced from a number of samples.
+ *
+ * @param samples The number of input samples
+ * @param with_raw Non-zero if decimated raw samples are included
+ */
+size_t spectrum_payload_size(size_t samples, int with_raw);
+
+/**
+ * Computes the spectra of a block of samples into a payload.
+ *
+ * @param s The FFT tables
+ * @param samples The input samples
+ * @param n The number of input samples. Samples past the last full window are
+ * only included in the decimated raw data.
+ * @param with_raw Non-zero to append decimated raw samples
+ * @param out Where to write the payload; must hold
+ * #spectrum_payload_size(n, with_raw) bytes
+ * @return The number of bytes written to out
+ */
+size_t spectrum_compute(Spectrum *s, const int16_t *samples, size_t n,
+    int with_raw, char *out);
+
+/**
+ * Transforms SPECTRUM_SIZE complex values in place. Input is interleaved
+ * (real, imaginary) Q15 in natural order, with magnitudes of at most 0.5;
+ * output is the transform divided by SPECTRUM_SIZE.
+ */
+void spectrum_fft(Spectrum *s, int16_t *x);
+
+/**
+ * Frees the FFT tables. The specified handle will be NULL after this
+ * function returns.
+ */
+void spectrum_cleanup(Spectrum **s);
+
+#endif
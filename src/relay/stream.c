@@ -0,0 +1,264 @@
+/**
+ * @file stream.c
+ * Implementation of the TCP streaming transport
+ * @see stream.h
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "stream.h"
+#include "../shared/trace.h"
+
+static int write_all(int fd, struct iovec *iov, int iovcnt);
+static void frame_header(Frame *f, int type, uint32_t seq, size_t len,
+    uint32_t crc);
+
+/**
+ * Creates the streaming transport
+ * @see stream.h
+ */
+Stream* stream_init(const char *url, int verbose) {
+  Stream *s;
+  const char *host, *colon;
+  struct timeval tv;
+
+  if (strncmp(url, STREAM_SCHEME, strlen(STREAM_SCHEME)) != 0)
+    return NULL ;
+  host = url + strlen(STREAM_SCHEME);
+  if ((colon = strrchr(host, ':')) == NULL ) {
+    fprintf(stderr, "[R] Stream server path needs a port: %s\n", url);
+    return NULL ;
+  }
+
+  s = (Stream*) malloc(sizeof(struct stream_st));
+  s->host = strndup(host, colon - host);
+  s->port = strdup(colon + 1);
+  s->port[strcspn(s->port, "/")] = '\0';
+  s->fd = -1;
+  gettimeofday(&tv, NULL );
+  s->session = ((uint64_t) tv.tv_sec << 32)
+      ^ ((uint64_t) getpid() << 20) ^ tv.tv_usec;
+  s->next_seq = 1;
+  s->acked = 0;
+  s->rx_len = 0;
+  s->verbose = verbose;
+
+  if (verbose)
+    printf("[R] Streaming to %s port %s (session %016llx)\n", s->host,
+        s->port, (unsigned long long) s->session);
+  return s;
+}
+
+/**
+ * Connects to the receiver
+ * @see stream.h
+ */
+int stream_connect(Stream *s) {
+  struct addrinfo hints, *res, *ai;
+  struct timeval tv = { STREAM_SEND_TIMEOUT, 0 };
+  uint32_t session[2];
+  struct iovec iov[2];
+  Frame hello;
+  int one = 1;
+  int err;
+
+  if (s->fd >= 0)
+    return 0;
+
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if ((err = getaddrinfo(s->host, s->port, &hints, &res)) != 0) {
+    fprintf(stderr, "[R] Stream: %s\n", gai_strerror(err));
+    return -1;
+  }
+  for (ai = res; ai != NULL ; ai = ai->ai_next) {
+    if ((s->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+      continue;
+    if (connect(s->fd, ai->ai_addr, ai->ai_addrlen) == 0)
+      break;
+    close(s->fd);
+    s->fd = -1;
+  }
+  freeaddrinfo(res);
+  if (s->fd < 0) {
+    perror("[R] connect");
+    return -1;
+  }
+  setsockopt(s->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+  setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+  s->rx_len = 0;
+
+  /* Introduce the session; the receiver answers with what it already has */
+  session[0] = htonl((uint32_t) (s->session >> 32));
+  session[1] = htonl((uint32_t) s->session);
+  frame_header(&hello, FRAME_HELLO, 0, sizeof session, 0);
+  iov[0].iov_base = &hello;
+  iov[0].iov_len = sizeof hello;
+  iov[1].iov_base = session;
+  iov[1].iov_len = sizeof session;
+  if (write_all(s->fd, iov, 2) < 0 || stream_poll(s, STREAM_ACK_WAIT) < 0) {
+    stream_disconnect(s);
+    return -1;
+  }
+
+  if (s->verbose)
+    printf("[R] Stream connected. (acked = %u)\n", s->acked);
+  return 0;
+}
+
+/**
+ * Writes one frame
+ * @see stream.h
+ */
+int stream_send(Stream *s, int type, uint32_t seq, const char *name,
+    const char *data, size_t len, uint32_t crc) {
+  struct iovec iov[4];
+  uint16_t name_len = 0;
+  uint16_t net_len;
+  Frame f;
+  int n = 0;
+
+  if (s->fd < 0)
+    return -1;
+  if (name != NULL )
+    name_len = strlen(name);
+
+  frame_header(&f, type, seq,
+      len + (name != NULL ? sizeof net_len + name_len : 0), crc);
+  iov[n].iov_base = &f;
+  iov[n++].iov_len = sizeof f;
+  if (name != NULL ) { /* segment frames lead with the file name */
+    net_len = htons(name_len);
+    iov[n].iov_base = &net_len;
+    iov[n++].iov_len = sizeof net_len;
+    iov[n].iov_base = (char*) name;
+    iov[n++].iov_len = name_len;
+  }
+  iov[n].iov_base = (char*) data;
+  iov[n++].iov_len = len;
+  if (write_all(s->fd, iov, n) < 0)
+    return -1;
+  TRACE(TRACE_FRAME, seq, len);
+  return 0;
+}
+
+/**
+ * Reads acknowledgements
+ * @see stream.h
+ */
+int stream_poll(Stream *s, int timeout) {
+  struct pollfd pfd;
+  ssize_t got;
+
+  if (s->fd < 0)
+    return -1;
+  pfd.fd = s->fd;
+  pfd.events = POLLIN;
+
+  while (poll(&pfd, 1, timeout) > 0) {
+    got = read(s->fd, s->rx + s->rx_len, sizeof s->rx - s->rx_len);
+    if (got < 0 && (errno == EINTR || errno == EAGAIN))
+      continue;
+    if (got <= 0) {
+      if (got < 0)
+        perror("[R] stream read");
+      else
+        fprintf(stderr, "[R] Stream closed by receiver\n");
+      return -1;
+    }
+    s->rx_len += got;
+    if (s->rx_len == sizeof s->rx) {
+      Frame *f = (Frame*) s->rx;
+      if (ntohl(f->magic) != FRAME_MAGIC || ntohs(f->type) != FRAME_ACK
+          || f->length != 0) {
+        fprintf(stderr, "[R] Stream: unexpected frame from receiver\n");
+        return -1;
+      }
+      s->acked = ntohl(f->seq);
+      TRACE(TRACE_ACK, s->acked, s->next_seq - 1 - s->acked);
+      s->rx_len = 0;
+    }
+    timeout = 0; /* Only wait for the first one */
+  }
+  return 0;
+}
+
+/**
+ * Drops the connection
+ * @see stream.h
+ */
+void stream_disconnect(Stream *s) {
+  if (s->fd >= 0)
+    close(s->fd);
+  s->fd = -1;
+  s->rx_len = 0;
+}
+
+/**
+ * Frees the streaming transport
+ * @see stream.h
+ */
+void stream_cleanup(Stream **s) {
+  stream_disconnect(*s);
+  free((*s)->host);
+  free((*s)->port);
+  free(*s);
+  *s = NULL;
+}
+
+/**
+ * Writes every byte described by iov, resuming after partial writes. A
+ * receiver that went away is reported as an error rather than a SIGPIPE.
+ */
+static int write_all(int fd, struct iovec *iov, int iovcnt) {
+  struct msghdr msg;
+  ssize_t n;
+
+  memset(&msg, 0, sizeof msg);
+  while (iovcnt > 0) {
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    if ((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("[R] stream write");
+      return -1;
+    }
+    while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+      n -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char*) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+/** Fills in a frame header in network byte order */
+static void frame_header(Frame *f, int type, uint32_t seq, size_t len,
+    uint32_t crc) {
+  f->magic = htonl(FRAME_MAGIC);
+  f->type = htons(type);
+  f->flags = 0;
+  f->seq = htonl(seq);
+  f->length = htonl(len);
+  f->crc = htonl(crc);
+}
@@ -0,0 +1,109 @@
+/**
+ * @file stream.h
+ * Persistent TCP streaming transport for the relay
+ *
+ * Instead of one HTTP request per buffer, the streaming transport keeps a
+ * single TCP connection open to a receiver and writes buffers to it as framed
+ * messages (see frame.h). The relay does not wait for a response between
+ * buffers; the receiver acknowledges frames cumulatively, and a buffer is only
+ * released back to the consumer once the frame carrying it is acknowledged.
+ * If the connection drops, the relay reconnects and resends whatever was not
+ * acknowledged.
+ *
+ * The transport is selected by giving the relay a server path of the form
+ * tcp://host:port.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#ifndef _RELAY_STREAM_H
+#define _RELAY_STREAM_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "../shared/frame.h"
+
+/** Prefix of server paths that select the streaming transport */
+#define STREAM_SCHEME "tcp://"
+
+/** Milliseconds to wait for an acknowledgement when no more can be sent */
+#define STREAM_ACK_WAIT 1000
+
+/** Seconds a blocked write may take before the connection is given up */
+#define STREAM_SEND_TIMEOUT 10
+
+struct stream_st {
+  char *host; /**< Host name of the receiver */
+  char *port; /**< Port of the receiver */
+  int fd; /**< The connection to the receiver, or -1 if not connected */
+  uint64_t session; /**< Identifies this relay to the receiver */
+  uint32_t next_seq; /**< Sequence number for the next new frame */
+  uint32_t acked; /**< Highest sequence number acknowledged */
+  char rx[sizeof(Frame)]; /**< Partially received acknowledgement */
+  size_t rx_len; /**< Number of bytes held in rx */
+  int verbose;
+};
+
+/**
+ * A handle used to store the state of the streaming transport.
+ */
+typedef struct stream_st Stream;
+
+/**
+ * Creates a streaming transport for the given server path. No connection is
+ * made until #stream_connect is called.
+ *
+ * @param url A server path of the form tcp://host:port
+ * @param verbose Enable verbose output
+ * @return A malloc'd handle, or NULL if url does not select the streaming
+ * transport. The caller must free it with #stream_cleanup.
+ */
+Stream* stream_init(const char *url, int verbose);
+
+/**
+ * Connects to the receiver if not already connected, and learns which frames
+ * of this session it already holds.
+ *
+ * @return 0 if connected, -1 if there is an error
+ */
+int stream_connect(Stream *s);
+
+/**
+ * Writes one frame to the receiver.
+ *
+ * @param type One of FRAME_DATA or FRAME_SEGMENT
+ * @param seq The sequence number of the frame. A frame that is resent must
+ * keep the sequence number it was first sent with.
+ * @param name The spool segment name for FRAME_SEGMENT, NULL otherwise
+ * @param data The payload
+ * @param len The number of bytes of payload
+ * @param crc The CRC-32C of the payload
+ * @return 0 if the frame was written, -1 if the connection failed
+ */
+int stream_send(Stream *s, int type, uint32_t seq, const char *name,
+    const char *data, size_t len, uint32_t crc);
+
+/**
+ * Reads any acknowledgements the receiver has sent, waiting up to timeout
+ * milliseconds for the first one.
+ *
+ * @return 0 if successful, -1 if the connection failed
+ */
+int stream_poll(Stream *s, int timeout);
+
+/**
+ * Drops the connection to the receiver. Frames that were not acknowledged
+ * must be resent after the next #stream_connect.
+ */
+void stream_disconnect(Stream *s);
+
+/**
+ * Disconnects and frees the handle. The specified handle will be NULL after
+ * this function returns.
+ *
+ * @param s The handle to be freed
+ */
+void stream_cleanup(Stream **s);
+
+#endif
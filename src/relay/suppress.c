@@ -0,0 +1,221 @@
+/**
+ * @file suppress.c
+ * Implementation of steady-state suppression
+ * @see suppress.h
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <string.h>
+
+#include "suppress.h"
+
+static void signature(Suppressor *s, const int16_t *x, uint8_t *level);
+static int differs(Suppressor *s, const uint8_t *level);
+static void rebase(Suppressor *s, const uint8_t *level);
+static uint8_t quarter_log2(uint64_t v);
+
+/** Largest number of windows in one payload */
+#define WINDOWS_MAX 65535
+
+/**
+ * Creates a suppressor
+ * @see suppress.h
+ */
+Suppressor* suppressor_init() {
+  Suppressor *s;
+
+  if ((s = (Suppressor*) malloc(sizeof(Suppressor))) == NULL )
+    return NULL ;
+  if ((s->spectrum = spectrum_init()) == NULL ) {
+    free(s);
+    return NULL ;
+  }
+  /* For the most windows, so that no buffer size a reload sets makes the
+   * relay allocate */
+  if ((s->levels = (uint8_t*) malloc(WINDOWS_MAX * (SUPPRESS_BANDS + 1)))
+      == NULL ) {
+    spectrum_cleanup(&s->spectrum);
+    free(s);
+    return NULL ;
+  }
+  s->have_baseline = 0;
+  s->changed_run = 0;
+  s->hold = 0;
+  s->windows = 0;
+  s->suppressed = 0;
+  return s;
+}
+
+/**
+ * The largest payload produced from a number of samples
+ * @see suppress.h
+ */
+size_t suppress_payload_max(size_t samples) {
+  /* At worst every window starts a new record */
+  return sizeof(SuppressHeader)
+      + (samples / SUPPRESS_WINDOW) * sizeof(SuppressRecord)
+      + samples * sizeof(int16_t);
+}
+
+/**
+ * Encodes a block of samples
+ * @see suppress.h
+ */
+size_t suppress_compute(Suppressor *s, const int16_t *samples, size_t n,
+    char *out) {
+  SuppressHeader *hdr = (SuppressHeader*) out;
+  size_t windows = n / SUPPRESS_WINDOW;
+  size_t len = sizeof(SuppressHeader);
+  uint8_t *levels = s->levels; /* band levels of each window */
+  char *raw;
+  size_t w, start;
+  int records = 0;
+
+  if (windows > WINDOWS_MAX)
+    windows = WINDOWS_MAX;
+
+  raw = (char*) levels + windows * SUPPRESS_BANDS; /* set to send whole */
+
+  /* Classify every window, marking those to send whole */
+  for (w = 0; w < windows; ++w) {
+    uint8_t *lv = levels + w * SUPPRESS_BANDS;
+    signature(s, samples + w * SUPPRESS_WINDOW, lv);
+    raw[w] = 0;
+    if (!s->have_baseline) {
+      rebase(s, lv);
+      s->hold = SUPPRESS_CONTEXT + 1;
+    } else if (differs(s, lv)) {
+      size_t b = w < SUPPRESS_CONTEXT ? 0 : w - SUPPRESS_CONTEXT;
+      for (; b < w; ++b)
+        raw[b] = 1;
+      s->hold = SUPPRESS_CONTEXT + 1;
+      if (++s->changed_run >= SUPPRESS_REBASE)
+        rebase(s, lv);
+    } else {
+      int i;
+      s->changed_run = 0;
+      for (i = 0; i < SUPPRESS_BANDS; ++i)
+        s->baseline[i] += lv[i] - (s->baseline[i] >> SUPPRESS_ADAPT);
+    }
+    if (s->hold > 0) {
+      raw[w] = 1;
+      --s->hold;
+    }
+  }
+
+  /* Emit runs of windows of the same kind */
+  for (start = 0; start < windows; start = w) {
+    SuppressRecord *rec = (SuppressRecord*) (out + len);
+    for (w = start; w < windows && raw[w] == raw[start]; ++w)
+      ;
+    rec->type = raw[start] ? SUPPRESS_RAW : SUPPRESS_RUN;
+    rec->count = w - start;
+    len += sizeof(SuppressRecord);
+    if (raw[start]) {
+      memcpy(rec->level, levels + start * SUPPRESS_BANDS, SUPPRESS_BANDS);
+      memcpy(out + len, samples + start * SUPPRESS_WINDOW,
+          (w - start) * SUPPRESS_WINDOW * sizeof(int16_t));
+      len += (w - start) * SUPPRESS_WINDOW * sizeof(int16_t);
+    } else {
+      int i;
+      for (i = 0; i < SUPPRESS_BANDS; ++i)
+        rec->level[i] = s->baseline[i] >> SUPPRESS_ADAPT;
+      s->suppressed += w - start;
+    }
+    ++records;
+  }
+  s->windows += windows;
+
+  memcpy(out + len, samples + windows * SUPPRESS_WINDOW,
+      (n - windows * SUPPRESS_WINDOW) * sizeof(int16_t));
+  len += (n - windows * SUPPRESS_WINDOW) * sizeof(int16_t);
+
+  hdr->magic = SUPPRESS_MAGIC;
+  hdr->window = SUPPRESS_WINDOW;
+  hdr->windows = windows;
+  hdr->records = records;
+  hdr->tail = n - windows * SUPPRESS_WINDOW;
+  return len;
+}
+
+/**
+ * Frees the suppressor
+ * @see suppress.h
+ */
+void suppressor_cleanup(Suppressor **s) {
+  spectrum_cleanup(&(*s)->spectrum);
+  free((*s)->levels);
+  free(*s);
+  *s = NULL;
+}
+
+/**
+ * Computes the band levels of one window: the quarter-octave power level in
+ * each octave of the spectrum, the lowest band also holding DC.
+ */
+static void signature(Suppressor *s, const int16_t *x, uint8_t *level) {
+  int16_t *work = s->spectrum->work;
+  int i, band, lo = 0;
+
+  for (i = 0; i < SPECTRUM_SIZE; ++i) {
+    work[2 * i] = ((int32_t) x[i] * s->spectrum->window[i]) >> 16;
+    work[2 * i + 1] = 0;
+  }
+  spectrum_fft(s->spectrum, work);
+
+  /* Bands end at bins SPECTRUM_SIZE / 2 >> (SUPPRESS_BANDS - 1 - band) */
+  for (band = 0; band < SUPPRESS_BANDS; ++band) {
+    int hi = (SPECTRUM_SIZE / 2) >> (SUPPRESS_BANDS - 1 - band);
+    uint64_t power = 0;
+    for (i = lo; i < hi; ++i) {
+      int32_t re = work[2 * i], im = work[2 * i + 1];
+      power += (uint32_t) (re * re + im * im);
+    }
+    level[band] = quarter_log2(power);
+    lo = hi;
+  }
+}
+
+/**
+ * Whether a window's levels are outside the tolerance of the baseline, in any
+ * band within #SUPPRESS_RANGE of the baseline's strongest band.
+ */
+static int differs(Suppressor *s, const uint8_t *level) {
+  int floor = 0;
+  int i;
+
+  for (i = 0; i < SUPPRESS_BANDS; ++i)
+    if ((s->baseline[i] >> SUPPRESS_ADAPT) - SUPPRESS_RANGE > floor)
+      floor = (s->baseline[i] >> SUPPRESS_ADAPT) - SUPPRESS_RANGE;
+  for (i = 0; i < SUPPRESS_BANDS; ++i) {
+    int base = s->baseline[i] >> SUPPRESS_ADAPT;
+    int d = level[i] - base;
+    /* Faint bands are dominated by leakage from the strong ones */
+    if (level[i] < floor && base < floor)
+      continue;
+    if (d > SUPPRESS_TOLERANCE || d < -SUPPRESS_TOLERANCE)
+      return 1;
+  }
+  return 0;
+}
+
+/** Takes a window's levels as the new baseline. */
+static void rebase(Suppressor *s, const uint8_t *level) {
+  int i;
+  for (i = 0; i < SUPPRESS_BANDS; ++i)
+    s->baseline[i] = level[i] << SUPPRESS_ADAPT;
+  s->have_baseline = 1;
+  s->changed_run = 0;
+}
+
+/** log2(v + 1) in quarters, so each step is 0.75 dB of power. */
+static uint8_t quarter_log2(uint64_t v) {
+  int e = 0;
+
+  ++v;
+  while ((v >> e) > 1)
+    ++e;
+  /* Two bits of mantissa below the leading one */
+  return 4 * e + (e >= 2 ? (v >> (e - 2)) & 3 : (v << (2 - e)) & 3);
+}
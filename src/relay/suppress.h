@@ -0,0 +1,147 @@
+/**
+ * @file suppress.h
+ * Steady-state suppression of buffers before upload
+ *
+ * Most of the time the electrical environment is quiet, and consecutive
+ * buffers are statistically the same. With suppression enabled, the relay
+ * cuts each buffer into windows of #SUPPRESS_WINDOW samples and summarises
+ * each window by a signature: the level of its power in #SUPPRESS_BANDS
+ * octave bands, in quarter-octaves of power (0.75 dB steps). Signatures are
+ * compared against a rolling baseline, ignoring bands too faint to be more
+ * than leakage from the strong ones. Windows that match the baseline are
+ * replaced by a record saying "the baseline, for N windows"; windows that
+ * differ are sent whole, together with #SUPPRESS_CONTEXT windows either side
+ * of them so that the server sees each event in full.
+ *
+ * The baseline follows quiet windows slowly, so drift in the background is
+ * tracked without letting a short event pull it along. If the signal stays
+ * different for #SUPPRESS_REBASE windows, the new signal is taken as the
+ * baseline.
+ *
+ * Samples are taken to be little-endian signed 16-bit values.
+ *
+ * Payload format
+ * --------------
+ * A payload starts with a SuppressHeader, followed by records. Each record is
+ * a SuppressRecord; a #SUPPRESS_RAW record is followed by count windows of
+ * samples, while a #SUPPRESS_RUN record stands for count windows matching the
+ * levels it carries. Any samples past the last whole window follow the last
+ * record. All values are little-endian.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#ifndef _RELAY_SUPPRESS_H
+#define _RELAY_SUPPRESS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "spectrum.h"
+
+/** Samples per compared window */
+#define SUPPRESS_WINDOW SPECTRUM_SIZE
+/** Number of octave bands in a window's signature */
+#define SUPPRESS_BANDS 8
+/** Largest difference from the baseline, in band levels, of a quiet window */
+#define SUPPRESS_TOLERANCE 4
+/** Bands this many levels (30 dB) below the strongest are not compared */
+#define SUPPRESS_RANGE 40
+/** Windows sent whole either side of a window that differs */
+#define SUPPRESS_CONTEXT 2
+/** Consecutive differing windows after which the baseline is reset */
+#define SUPPRESS_REBASE 50
+/** The baseline moves 1 / 2^SUPPRESS_ADAPT of the way to each quiet window */
+#define SUPPRESS_ADAPT 3
+
+/** Marks the start of a suppressed payload ("ESSS") */
+#define SUPPRESS_MAGIC 0x53535345
+
+/** A record followed by windows of samples */
+#define SUPPRESS_RAW 1
+/** A record standing for windows that match the baseline */
+#define SUPPRESS_RUN 2
+
+/**
+ * The header of a suppressed payload.
+ */
+struct suppress_header_st {
+  /** Always #SUPPRESS_MAGIC */
+  uint32_t magic;
+  /** Samples per window */
+  uint16_t window;
+  /** Number of whole windows the records cover */
+  uint16_t windows;
+  /** Number of records that follow */
+  uint16_t records;
+  /** Number of samples following the records */
+  uint16_t tail;
+};
+
+typedef struct suppress_header_st SuppressHeader;
+
+/**
+ * A run of windows.
+ */
+struct suppress_record_st {
+  /** #SUPPRESS_RAW or #SUPPRESS_RUN */
+  uint16_t type;
+  /** Number of windows in the run */
+  uint16_t count;
+  /** Band levels of the baseline for a run, of the first window otherwise */
+  uint8_t level[SUPPRESS_BANDS];
+};
+
+typedef struct suppress_record_st SuppressRecord;
+
+/**
+ * The rolling baseline and statistics of a suppressor.
+ */
+struct suppressor_st {
+  Spectrum *spectrum; /**< FFT tables used to compute signatures */
+  /** Baseline band levels, scaled by 2^SUPPRESS_ADAPT */
+  int baseline[SUPPRESS_BANDS];
+  int have_baseline; /**< Set once the first window has been seen */
+  int changed_run; /**< Consecutive windows that differed from the baseline */
+  int hold; /**< Windows still to be sent whole after the last change */
+  /** Band levels of each window of a buffer, then whether each is sent
+   * whole; room for the most windows a payload holds */
+  uint8_t *levels;
+  unsigned long windows; /**< Windows seen */
+  unsigned long suppressed; /**< Windows replaced by run records */
+};
+
+typedef struct suppressor_st Suppressor;
+
+/**
+ * Creates a suppressor with no baseline.
+ *
+ * @return A malloc'd handle to be freed with #suppressor_cleanup, or NULL
+ */
+Suppressor* suppressor_init();
+
+/**
+ * The largest payload produced from a number of samples.
+ */
+size_t suppress_payload_max(size_t samples);
+
+/**
+ * Encodes a block of samples, updating the baseline.
+ *
+ * @param s The suppressor
+ * @param samples The input samples
+ * @param n The number of input samples
+ * @param out Where to write the payload; must hold #suppress_payload_max(n)
+ * bytes
+ * @return The number of bytes written to out
+ */
+size_t suppress_compute(Suppressor *s, const int16_t *samples, size_t n,
+    char *out);
+
+/**
+ * Frees the suppressor. The specified handle will be NULL after this function
+ * returns.
+ */
+void suppressor_cleanup(Suppressor **s);
+
+#endif
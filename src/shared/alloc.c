@@ -0,0 +1,76 @@
+/**
+ * @file alloc.c
+ * Implementation of the counting allocator
+ * @see alloc.h
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include "alloc.h"
+
+#ifdef ALLOC_COUNT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The real allocator, as renamed by the linker's --wrap */
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+static unsigned long count; /**< Allocations made */
+
+/** Counts a malloc */
+void *__wrap_malloc(size_t size) {
+  __sync_fetch_and_add(&count, 1);
+  return __real_malloc(size);
+}
+
+/** Counts a calloc */
+void *__wrap_calloc(size_t nmemb, size_t size) {
+  __sync_fetch_and_add(&count, 1);
+  return __real_calloc(nmemb, size);
+}
+
+/** Counts a realloc */
+void *__wrap_realloc(void *ptr, size_t size) {
+  __sync_fetch_and_add(&count, 1);
+  return __real_realloc(ptr, size);
+}
+
+/**
+ * Checks for allocations in the steady state
+ * @see alloc.h
+ */
+void alloc_check(const char *who) {
+  static pid_t pid; /* the process the state below belongs to */
+  static time_t steady; /* when warm-up ends */
+  static unsigned long last; /* count at the last check */
+  unsigned long now = __sync_fetch_and_add(&count, 0);
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  /* A relay forked from the consumer warms up afresh */
+  if (pid != getpid()) {
+    pid = getpid();
+    steady = ts.tv_sec + ALLOC_WARMUP;
+  }
+  if (ts.tv_sec >= steady && now != last) {
+    fprintf(stderr, "%s %lu allocations after warm-up\n", who, now - last);
+    abort();
+  }
+  last = now;
+}
+
+/**
+ * Gets the allocation count
+ * @see alloc.h
+ */
+unsigned long alloc_count(void) {
+  return __sync_fetch_and_add(&count, 0);
+}
+
+#endif
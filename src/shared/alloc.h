@@ -0,0 +1,48 @@
+/**
+ * @file alloc.h
+ * Counting allocator for checking that the client's steady state is free of
+ * allocations.
+ *
+ * The consumer and relay allocate everything they need while starting up:
+ * read staging, upload bodies, pipeline slots, the dump directory listing.
+ * From then on their loops should not allocate at all, since on the
+ * Carambola's 32 MB every allocation risks fragmentation and costs allocator
+ * time. When the client is built with ALLOC_COUNT=1 (see the Makefile), the
+ * linker routes every malloc, calloc and realloc made by the client's own
+ * code through a counter. Once #ALLOC_WARMUP seconds have passed, each
+ * process checks on every pass of its main loop that the count has not
+ * moved, and aborts if it has, so a core shows the offender. Allocations
+ * made inside libc and libcurl are not counted.
+ *
+ * In a normal build #ALLOC_CHECK compiles to nothing.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#ifndef _SHARED_ALLOC_H
+#define _SHARED_ALLOC_H
+
+/** Seconds after a process starts during which it may still allocate */
+#define ALLOC_WARMUP 5
+
+#ifdef ALLOC_COUNT
+
+/**
+ * Checks that nothing has been allocated since the last check, once warm-up
+ * is over, and aborts the process otherwise.
+ *
+ * @param who The log prefix of the process, "[C]" or "[R]"
+ */
+void alloc_check(const char *who);
+
+/**
+ * Gets the number of allocations made by this process so far.
+ */
+unsigned long alloc_count(void);
+
+#define ALLOC_CHECK(who) alloc_check(who)
+#else
+#define ALLOC_CHECK(who) do { } while (0)
+#endif
+
+#endif
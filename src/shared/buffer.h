@@ -11,15 +11,41 @@
  * to empty it. When this buffer is empty, the buffer size shall be reset
  * for that buffer. Again, this must happen *after* any interaction with the
  * buffer is complete, or else a race condition could occur.
+ *
+ * The one exception is a consumer that fills a buffer while the other is
+ * still full: it dumps the buffer it filled to the SD card and starts it
+ * afresh, setting its size to 0 and giving it a new id before writing to it.
+ * A relay copying that buffer meanwhile checks that the copy is full and
+ * that the buffer's id and size have not changed since, and lets the copy go
+ * otherwise. It hands a buffer back with a compare-and-swap of its size, so
+ * that it never empties one the consumer has started again.
+ *
+ * The consumer keeps the CRC-32C of the data in each buffer as it fills it
+ * (see crc32c.h), so that the relay can detect a buffer that was torn in the
+ * handoff or a dumped buffer corrupted on the SD card.
+ *
+ * The consumer also gives each buffer it starts an id, unique to the client,
+ * which stays with the buffer's data through the relay's pipeline, dump
+ * files and packs. The relay sends it with every upload in an
+ * #BUFFER_ID_HEADER header, so that a server can recognize a buffer it
+ * already holds, however many times and by whichever path it is sent again.
+ * The upper 32 bits are a number the consumer picks at random when it
+ * starts, the lower 32 count the buffers it has started since; 0 is no id.
+ *
+ * The two buffers are followed in shared memory by their occupancy telemetry
+ * (see occupancy.h).
  */
 
 #ifndef _SHARED_BUFFER_H
 #define _SHARED_BUFFER_H
 
+#include <stdint.h>
 #include <stdlib.h>
 
 /** The capacity of each buffer */
 #define __BUFFER_CAPACITY 102400
+/** Part header giving a buffer's id, as 16 hex digits */
+#define BUFFER_ID_HEADER "X-Electrisense-Id"
 
 /**
  * A buffer with status fields.
@@ -33,6 +59,10 @@ struct buffer_st {
   size_t size;
   /** The capacity of the buffer */
   size_t capacity;
+  /** CRC-32C of the first size bytes of data */
+  uint32_t crc;
+  /** Identifies the data wherever it goes, 0 for none */
+  uint64_t id;
   /** Data buffer */
   char data[__BUFFER_CAPACITY ];
 };
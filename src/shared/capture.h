@@ -0,0 +1,48 @@
+/**
+ * @file capture.h
+ * Definition of the capture file format.
+ *
+ * A capture records the raw stream read by the consumer from its data source,
+ * together with when each read returned, so that the stream can be replayed
+ * later with its original timing (see the replay tool). A capture file is a
+ * CaptureHeader followed by one record per read:
+ *
+ * - the microseconds since the previous read (since the start of the capture
+ *   for the first record), as a varint
+ * - the number of bytes read, as a varint
+ * - the bytes read
+ *
+ * Varints are little-endian base 128: seven bits per byte, low bits first,
+ * with the top bit set on every byte but the last. Header fields are
+ * little-endian.
+ */
+
+#ifndef _SHARED_CAPTURE_H
+#define _SHARED_CAPTURE_H
+
+#include <stdint.h>
+
+/** Marks the start of a capture file ("ESCP") */
+#define CAPTURE_MAGIC 0x50435345
+/** Version of the format described here */
+#define CAPTURE_VERSION 1
+/** Largest number of bytes in a varint of up to 64 bits */
+#define CAPTURE_VARINT_MAX 10
+
+/**
+ * The header at the start of a capture file.
+ */
+struct capture_header_st {
+  /** Always #CAPTURE_MAGIC */
+  uint32_t magic;
+  /** #CAPTURE_VERSION */
+  uint16_t version;
+  /** Reserved, must be 0 */
+  uint16_t flags;
+  /** Wall clock time the capture started, in seconds since the epoch */
+  uint64_t start;
+};
+
+typedef struct capture_header_st CaptureHeader;
+
+#endif
@@ -0,0 +1,21 @@
+/**
+ * @file clock.c
+ * Implementation of the monotonic time
+ * @see clock.h
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <time.h>
+
+#include "clock.h"
+
+/**
+ * Reads the monotonic clock
+ * @see clock.h
+ */
+uint64_t clock_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
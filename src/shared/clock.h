@@ -0,0 +1,26 @@
+/**
+ * @file clock.h
+ * Monotonic time for the bookkeeping kept in shared memory.
+ *
+ * The failover and drain records both store times that one process writes
+ * and another reads, so they must come from the same clock: CLOCK_MONOTONIC,
+ * which is shared by every process on the board and does not jump when the
+ * wall clock is set.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#ifndef _SHARED_CLOCK_H
+#define _SHARED_CLOCK_H
+
+#include <stdint.h>
+
+/**
+ * Reads the monotonic clock. Safe to call from a signal handler, since
+ * clock_gettime is async-signal-safe.
+ *
+ * @return The time in nanoseconds
+ */
+uint64_t clock_ns(void);
+
+#endif
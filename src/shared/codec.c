@@ -0,0 +1,213 @@
+/**
+ * @file codec.c
+ * Implementation of the sample codecs
+ * @see codec.h
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <string.h>
+
+#include "codec.h"
+
+/** Block tag: samples stored as differences from the previous one */
+#define BLOCK_FIRST 1
+/** Block tag: samples stored as differences from a line through two */
+#define BLOCK_SECOND 2
+
+static uint8_t* put_residual(uint8_t *o, uint16_t r);
+static int get_residual(const uint8_t **s, const uint8_t *end, uint16_t *r);
+static size_t encode_block(const uint8_t *s, size_t n, int order,
+    uint16_t prev, uint16_t prev2, uint8_t *out);
+
+/**
+ * Encodes with the delta codec
+ * @see codec.h
+ */
+size_t codec_delta_encode(const char *in, size_t len, char *out) {
+  const uint8_t *s = (const uint8_t*) in;
+  uint8_t *o = (uint8_t*) out;
+  uint16_t prev = 0;
+  size_t i;
+
+  for (i = 0; i + 1 < len; i += 2) {
+    uint16_t cur = s[i] | s[i + 1] << 8;
+    o = put_residual(o, cur - prev);
+    prev = cur;
+  }
+  if (i < len)
+    *o++ = s[i];
+  return o - (uint8_t*) out;
+}
+
+/**
+ * Decodes the delta codec
+ * @see codec.h
+ */
+int codec_delta_decode(const char *in, size_t len, char *out, size_t size) {
+  const uint8_t *s = (const uint8_t*) in, *end = s + len;
+  uint8_t *o = (uint8_t*) out;
+  uint16_t prev = 0, r;
+  size_t i;
+
+  for (i = 0; i + 1 < size; i += 2) {
+    if (get_residual(&s, end, &r) < 0)
+      return -1;
+    prev += r;
+    *o++ = (uint8_t) prev;
+    *o++ = (uint8_t) (prev >> 8);
+  }
+  if (i < size) {
+    if (s == end)
+      return -1;
+    *o = *s++;
+  }
+  return s == end ? 0 : -1;
+}
+
+/**
+ * Encodes with the best codec
+ * @see codec.h
+ */
+size_t codec_best_encode(const char *in, size_t len, char *out) {
+  const uint8_t *s = (const uint8_t*) in;
+  uint8_t *o = (uint8_t*) out;
+  uint8_t second[CODEC_DELTA_BOUND(CODEC_BLOCK * 2)];
+  uint16_t prev = 0, prev2 = 0;
+  size_t samples = len / 2, i;
+
+  for (i = 0; i < samples; i += CODEC_BLOCK) {
+    size_t n = samples - i < CODEC_BLOCK ? samples - i : CODEC_BLOCK;
+    size_t first_len = encode_block(s + 2 * i, n, BLOCK_FIRST, prev, prev2,
+        o + 1);
+    size_t second_len = encode_block(s + 2 * i, n, BLOCK_SECOND, prev, prev2,
+        second);
+
+    if (second_len < first_len) {
+      *o = BLOCK_SECOND;
+      memcpy(o + 1, second, second_len);
+      o += 1 + second_len;
+    } else {
+      *o = BLOCK_FIRST;
+      o += 1 + first_len;
+    }
+    prev2 = n > 1 ? s[2 * (i + n) - 4] | s[2 * (i + n) - 3] << 8 : prev;
+    prev = s[2 * (i + n) - 2] | s[2 * (i + n) - 1] << 8;
+  }
+  if (len & 1)
+    *o++ = s[len - 1];
+  return o - (uint8_t*) out;
+}
+
+/**
+ * Decodes the best codec
+ * @see codec.h
+ */
+int codec_best_decode(const char *in, size_t len, char *out, size_t size) {
+  const uint8_t *s = (const uint8_t*) in, *end = s + len;
+  uint8_t *o = (uint8_t*) out;
+  uint16_t prev = 0, prev2 = 0, r;
+  size_t samples = size / 2, i, j;
+
+  for (i = 0; i < samples; i += CODEC_BLOCK) {
+    size_t n = samples - i < CODEC_BLOCK ? samples - i : CODEC_BLOCK;
+    int order;
+
+    if (s == end || ((order = *s++) != BLOCK_FIRST && order != BLOCK_SECOND))
+      return -1;
+    for (j = 0; j < n; ++j) {
+      uint16_t cur;
+      if (get_residual(&s, end, &r) < 0)
+        return -1;
+      cur = (order == BLOCK_FIRST ? prev : 2 * prev - prev2) + r;
+      prev2 = prev;
+      prev = cur;
+      *o++ = (uint8_t) cur;
+      *o++ = (uint8_t) (cur >> 8);
+    }
+  }
+  if (size & 1) {
+    if (s == end)
+      return -1;
+    *o = *s++;
+  }
+  return s == end ? 0 : -1;
+}
+
+/**
+ * Encodes with a codec
+ * @see codec.h
+ */
+size_t codec_encode(int codec, const char *in, size_t len, char *out) {
+  if (codec == CODEC_DELTA)
+    return codec_delta_encode(in, len, out);
+  if (codec == CODEC_BEST)
+    return codec_best_encode(in, len, out);
+  memcpy(out, in, len);
+  return len;
+}
+
+/**
+ * Decodes a codec
+ * @see codec.h
+ */
+int codec_decode(int codec, const char *in, size_t len, char *out,
+    size_t size) {
+  if (codec == CODEC_DELTA)
+    return codec_delta_decode(in, len, out, size);
+  if (codec == CODEC_BEST)
+    return codec_best_decode(in, len, out, size);
+  if (codec != CODEC_RAW || len != size)
+    return -1;
+  memcpy(out, in, len);
+  return 0;
+}
+
+/** Writes a 16-bit residual, zigzag encoded, as a varint of 1 to 3 bytes */
+static uint8_t* put_residual(uint8_t *o, uint16_t r) {
+  int16_t d = (int16_t) r;
+  uint32_t z = (uint16_t) ((d << 1) ^ (d >> 15));
+
+  while (z >= 0x80) {
+    *o++ = (uint8_t) (z | 0x80);
+    z >>= 7;
+  }
+  *o++ = (uint8_t) z;
+  return o;
+}
+
+/** Reads a residual written by put_residual, or returns -1 if malformed */
+static int get_residual(const uint8_t **s, const uint8_t *end, uint16_t *r) {
+  uint32_t z = 0;
+  int shift = 0;
+
+  do {
+    if (*s == end || shift > 14)
+      return -1;
+    z |= (uint32_t) (**s & 0x7f) << shift;
+    shift += 7;
+  } while (*(*s)++ & 0x80);
+  if (z > 0xffff)
+    return -1;
+  *r = (uint16_t) ((z >> 1) ^ -(z & 1));
+  return 0;
+}
+
+/**
+ * Writes the residuals of a block of n samples, predicted from the previous
+ * sample or from the line through the previous two.
+ */
+static size_t encode_block(const uint8_t *s, size_t n, int order,
+    uint16_t prev, uint16_t prev2, uint8_t *out) {
+  uint8_t *o = out;
+  size_t i;
+
+  for (i = 0; i < n; ++i) {
+    uint16_t cur = s[2 * i] | s[2 * i + 1] << 8;
+    o = put_residual(o,
+        cur - (order == BLOCK_FIRST ? prev : (uint16_t) (2 * prev - prev2)));
+    prev2 = prev;
+    prev = cur;
+  }
+  return o - out;
+}
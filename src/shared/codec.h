@@ -0,0 +1,114 @@
+/**
+ * @file codec.h
+ * Lossless compression of buffered samples
+ *
+ * Consecutive samples from the Firefly are close to each other, so storing
+ * the difference from the previous sample takes far fewer bits than the
+ * sample itself. The delta codec treats its input as little-endian signed
+ * 16-bit samples and writes each difference, zigzag encoded so that small
+ * negative differences are small numbers too, as a base-128 varint of one to
+ * three bytes. A trailing odd byte is copied as is. Decoding is exact.
+ *
+ * Quiet signals shrink to about half; white noise can grow by half, which is
+ * why callers keep whichever of the raw and encoded forms is smaller.
+ *
+ * The best codec spends about twice the CPU time for a little more: it cuts
+ * the samples into blocks of #CODEC_BLOCK and stores each block, after a tag
+ * byte, either as the delta codec does or as the difference from a straight
+ * line through the two previous samples, whichever is smaller. Smooth
+ * signals such as the mains waveform suit the second; noisy ones the first.
+ *
+ * The codecs are numbered in order of CPU time, so that a caller can trade
+ * CPU time for bytes by choosing a higher one.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#ifndef _SHARED_CODEC_H
+#define _SHARED_CODEC_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/** Data stored as is */
+#define CODEC_RAW 0
+/** Data stored as zigzag varint sample differences */
+#define CODEC_DELTA 1
+/** Data stored in blocks of first or second order differences */
+#define CODEC_BEST 2
+/** Number of codecs */
+#define CODEC_LEVELS 3
+
+/** Part header naming the codec of a live payload and its decoded size */
+#define CODEC_HEADER "X-Electrisense-Codec"
+
+/** Samples per block of the best codec */
+#define CODEC_BLOCK 1024
+/** Most bytes the delta codec writes for len bytes of input */
+#define CODEC_DELTA_BOUND(len) ((len) / 2 * 3 + 1)
+/** Most bytes the best codec writes for len bytes of input */
+#define CODEC_BEST_BOUND(len) (CODEC_DELTA_BOUND(len) \
+    + ((len) / 2 + CODEC_BLOCK - 1) / CODEC_BLOCK)
+
+/**
+ * Encodes samples with the delta codec.
+ *
+ * @param in The samples
+ * @param len Bytes of input
+ * @param out Room for #CODEC_DELTA_BOUND(len) bytes
+ * @return Bytes written to out
+ */
+size_t codec_delta_encode(const char *in, size_t len, char *out);
+
+/**
+ * Decodes the output of #codec_delta_encode.
+ *
+ * @param in The encoded data
+ * @param len Bytes of encoded data
+ * @param out Where to write the samples
+ * @param size Bytes the data decodes to, as given to #codec_delta_encode
+ * @return 0 if successful, -1 if the data is malformed
+ */
+int codec_delta_decode(const char *in, size_t len, char *out, size_t size);
+
+/**
+ * Encodes samples with the best codec.
+ *
+ * @param in The samples
+ * @param len Bytes of input
+ * @param out Room for #CODEC_BEST_BOUND(len) bytes
+ * @return Bytes written to out
+ */
+size_t codec_best_encode(const char *in, size_t len, char *out);
+
+/**
+ * Decodes the output of #codec_best_encode.
+ *
+ * @param in The encoded data
+ * @param len Bytes of encoded data
+ * @param out Where to write the samples
+ * @param size Bytes the data decodes to, as given to #codec_best_encode
+ * @return 0 if successful, -1 if the data is malformed
+ */
+int codec_best_decode(const char *in, size_t len, char *out, size_t size);
+
+/**
+ * Encodes samples with a codec.
+ *
+ * @param codec One of CODEC_*
+ * @param in The samples
+ * @param len Bytes of input
+ * @param out Room for #CODEC_BEST_BOUND(len) bytes
+ * @return Bytes written to out
+ */
+size_t codec_encode(int codec, const char *in, size_t len, char *out);
+
+/**
+ * Decodes the output of #codec_encode.
+ *
+ * @return 0 if successful, -1 if the data is malformed or the codec unknown
+ */
+int codec_decode(int codec, const char *in, size_t len, char *out,
+    size_t size);
+
+#endif
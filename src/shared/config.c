@@ -0,0 +1,227 @@
+/**
+ * @file config.c
+ * Implementation of the live-tunable configuration
+ * @see config.h
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <ctype.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "config.h"
+#include "drain.h"
+#include "pack.h"
+#include "spool.h"
+
+/** The numeric tunables, by name */
+static const struct {
+  const char *key;
+  size_t offset;
+} keys[] = {
+  { "read_size", offsetof(Config, read_size) },
+  { "read_wait_us", offsetof(Config, read_wait_us) },
+  { "error_limit", offsetof(Config, error_limit) },
+  { "retry_wait_ms", offsetof(Config, retry_wait_ms) },
+  { "buffer_capacity", offsetof(Config, capacity) },
+  { "pipeline_slots", offsetof(Config, pipeline_slots) },
+  { "drain_deadline_ms", offsetof(Config, drain_ms) },
+  { "spool_quota_mb", offsetof(Config, spool_quota_mb) },
+  { "compact_files", offsetof(Config, compact_files) },
+  { "live_codec", offsetof(Config, live_codec) },
+  { "spool_sync", offsetof(Config, spool_sync) },
+  { "spool_sync_ms", offsetof(Config, spool_sync_ms) },
+  { "spool_group", offsetof(Config, spool_group) },
+  { "batch_min", offsetof(Config, batch_min) },
+  { "batch_max", offsetof(Config, batch_max) },
+  { "batch_wait_ms", offsetof(Config, batch_wait_ms) },
+  { "batch_efficiency", offsetof(Config, batch_efficiency) },
+};
+
+static char* trim(char *s);
+static const char* config_check(const Config *c);
+
+/**
+ * Sets the defaults
+ * @see config.h
+ */
+void config_defaults(Config *c) {
+  memset(c, 0, sizeof *c);
+  c->read_size = 1024;
+  c->read_wait_us = 10000;
+  c->error_limit = CONFIG_ERROR_LIMIT;
+  c->retry_wait_ms = 1000;
+  c->capacity = __BUFFER_CAPACITY;
+  c->drain_ms = DRAIN_DEADLINE_MS;
+  c->compact_files = PACK_RECORDS_MAX;
+  c->spool_sync = SPOOL_SYNC_PERIODIC;
+  c->spool_sync_ms = 1000;
+  c->spool_group = 4;
+  c->batch_min = 1;
+  c->batch_wait_ms = 500;
+  c->batch_efficiency = 80;
+}
+
+/**
+ * Loads a config file
+ * @see config.h
+ */
+int config_load(Config *c, const char *path) {
+  Config next = *c;
+  char line[CONFIG_URL_MAX + 64];
+  const char *problem = NULL;
+  int lineno = 0;
+  FILE *in;
+
+  if ((in = fopen(path, "r")) == NULL ) {
+    perror("[C] config");
+    return -1;
+  }
+  while (problem == NULL && fgets(line, sizeof line, in) != NULL ) {
+    char *key, *value, *end;
+    unsigned long n;
+    size_t i;
+
+    ++lineno;
+    if ((end = strchr(line, '#')) != NULL )
+      *end = '\0';
+    if (*(key = trim(line)) == '\0')
+      continue;
+    if ((value = strchr(key, '=')) == NULL ) {
+      problem = "expected key = value";
+      break;
+    }
+    *value++ = '\0';
+    key = trim(key);
+    value = trim(value);
+
+    if (strcmp(key, "server") == 0) {
+      if (*value == '\0' || strlen(value) >= sizeof next.server)
+        problem = "bad server";
+      else
+        strcpy(next.server, value);
+      continue;
+    }
+    for (i = 0; i < sizeof keys / sizeof keys[0]; ++i)
+      if (strcmp(key, keys[i].key) == 0)
+        break;
+    n = strtoul(value, &end, 10);
+    if (i == sizeof keys / sizeof keys[0])
+      problem = "unknown key";
+    else if (end == value || *end != '\0' || n > UINT32_MAX)
+      problem = "expected a number";
+    else
+      *(uint32_t*) ((char*) &next + keys[i].offset) = n;
+  }
+  fclose(in);
+
+  if (problem == NULL && (problem = config_check(&next)) != NULL )
+    lineno = 0;
+  if (problem != NULL ) {
+    if (lineno > 0)
+      fprintf(stderr, "[C] %s:%d: %s\n", path, lineno, problem);
+    else
+      fprintf(stderr, "[C] %s: %s\n", path, problem);
+    return -1;
+  }
+  *c = next;
+  return 0;
+}
+
+/**
+ * Publishes a Config
+ * @see config.h
+ */
+void config_publish(Config *shared, const Config *c) {
+  uint32_t generation = shared->generation;
+
+  shared->generation = generation + 1; /* odd: readers retry */
+  __sync_synchronize();
+  memcpy((char*) shared + sizeof shared->generation,
+      (const char*) c + sizeof c->generation,
+      sizeof *c - sizeof c->generation);
+  __sync_synchronize();
+  shared->generation = generation + 2;
+}
+
+/**
+ * Checks for a change
+ * @see config.h
+ */
+int config_changed(const Config *shared, const Config *local) {
+  return *(volatile const uint32_t*) &shared->generation != local->generation;
+}
+
+/**
+ * Copies the shared Config
+ * @see config.h
+ */
+void config_read(const Config *shared, Config *local) {
+  volatile const uint32_t *generation = &shared->generation;
+  uint32_t before;
+
+  do {
+    while ((before = *generation) & 1)
+      ; /* being published */
+    __sync_synchronize();
+    memcpy(local, shared, sizeof *local);
+    __sync_synchronize();
+  } while (*generation != before);
+  local->generation = before;
+}
+
+/**
+ * Writes the tunables
+ * @see config.h
+ */
+void config_print(const Config *c, FILE *out) {
+  fprintf(out, "config generation=%u read_size=%u read_wait_us=%u "
+      "error_limit=%u retry_wait_ms=%u buffer_capacity=%u pipeline_slots=%u "
+      "drain_deadline_ms=%u spool_quota_mb=%u compact_files=%u "
+      "live_codec=%u spool_sync=%u spool_sync_ms=%u spool_group=%u "
+      "batch_min=%u batch_max=%u batch_wait_ms=%u batch_efficiency=%u\n",
+      c->generation / 2, c->read_size, c->read_wait_us, c->error_limit,
+      c->retry_wait_ms, c->capacity, c->pipeline_slots, c->drain_ms,
+      c->spool_quota_mb, c->compact_files, c->live_codec, c->spool_sync,
+      c->spool_sync_ms, c->spool_group, c->batch_min, c->batch_max,
+      c->batch_wait_ms, c->batch_efficiency);
+}
+
+/** Strips leading and trailing white space in place */
+static char* trim(char *s) {
+  char *end;
+
+  while (isspace((unsigned char) *s))
+    ++s;
+  end = s + strlen(s);
+  while (end > s && isspace((unsigned char) end[-1]))
+    --end;
+  *end = '\0';
+  return s;
+}
+
+/** Checks the tunables against each other, returning the problem if any */
+static const char* config_check(const Config *c) {
+  if (c->read_size == 0 || c->read_size > CONFIG_READ_MAX)
+    return "read_size out of range";
+  if (c->error_limit == 0)
+    return "error_limit must be at least 1";
+  if (c->capacity < c->read_size || c->capacity > __BUFFER_CAPACITY
+      || c->capacity % CONFIG_CAPACITY_STEP != 0)
+    return "buffer_capacity must be a multiple of 4096, at least read_size "
+        "and at most the compiled-in capacity";
+  if (c->live_codec > CODEC_LEVELS)
+    return "live_codec out of range";
+  if (c->spool_sync > SPOOL_SYNC_GROUP)
+    return "spool_sync out of range";
+  if (c->spool_group == 0 || c->spool_group > SPOOL_GROUP_MAX)
+    return "spool_group must be from 1 to 16";
+  if (c->batch_min == 0 || (c->batch_max != 0 && c->batch_max < c->batch_min))
+    return "batch_min must be at least 1 and at most batch_max";
+  if (c->batch_efficiency == 0 || c->batch_efficiency > 99)
+    return "batch_efficiency must be from 1 to 99";
+  return NULL ;
+}
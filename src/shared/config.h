@@ -0,0 +1,128 @@
+/**
+ * @file config.h
+ * Live-tunable configuration, shared between the consumer and relay.
+ *
+ * The client's tunables used to be compiled in or fixed by the command line,
+ * so tuning a site meant restarting it and losing data meanwhile. They now
+ * live in a Config in shared memory, after the drain request (see drain.h),
+ * seeded from the defaults and the command line and overridden by a config
+ * file of "key = value" lines, with "#" starting a comment:
+ *
+ *     read_size = 1024         # bytes read from the source at once
+ *     read_wait_us = 10000     # microseconds between reads
+ *     error_limit = 10         # dumps before the server is notified
+ *     retry_wait_ms = 1000     # wait after a server error
+ *     buffer_capacity = 102400 # bytes each buffer is filled to
+ *     pipeline_slots = 4       # live buffers in flight, 0 for all
+ *     drain_deadline_ms = 3000 # see drain.h
+ *     spool_quota_mb = 0       # megabytes of dump files kept, 0 for no limit
+ *     compact_files = 64       # dump files before packing, 0 for never
+ *     live_codec = 0           # 0 raw, 1 delta, 2 best, 3 adaptive
+ *     spool_sync = 1           # 0 none, 1 periodic, 2 group (see spool.h)
+ *     spool_sync_ms = 1000     # longest a dump file waits to be flushed
+ *     spool_group = 4          # dump files flushed together under group
+ *     batch_min = 1            # fewest live buffers per request
+ *     batch_max = 0            # most live buffers per request, 0 for all
+ *     batch_wait_ms = 500      # longest a request waits for its buffers
+ *     batch_efficiency = 80    # percent of request time spent sending
+ *     server = http://a/,http://b/
+ *
+ * On SIGHUP the consumer reloads the file and, if it is valid, publishes it.
+ * Publishing bumps the generation, which is odd while the Config is being
+ * written, so readers copy it seqlock-style without ever blocking the
+ * consumer. The consumer and relay each check the generation once per pass
+ * and apply a new Config between units of work: a new buffer capacity takes
+ * effect from the next buffer started, a new server list from the next
+ * request. The streaming transport keeps its server until restarted.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#ifndef _SHARED_CONFIG_H
+#define _SHARED_CONFIG_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/** Room for the server path */
+#define CONFIG_URL_MAX 1024
+/** Largest read size, which sizes the consumer's staging */
+#define CONFIG_READ_MAX 16384
+/** Buffer capacities are a multiple of this, so encoders see whole frames */
+#define CONFIG_CAPACITY_STEP 4096
+/** Default number of dumps before the consumer notifies the server */
+#define CONFIG_ERROR_LIMIT 10
+
+/**
+ * The tunables.
+ */
+struct config_st {
+  uint32_t generation; /**< Bumped by every change, odd during one */
+  uint32_t read_size; /**< Bytes the consumer reads at once */
+  uint32_t read_wait_us; /**< Microseconds the consumer waits between reads */
+  uint32_t error_limit; /**< Dumps before the consumer notifies the server */
+  uint32_t retry_wait_ms; /**< Milliseconds the relay waits after a server
+   error */
+  uint32_t capacity; /**< Bytes each buffer is filled to */
+  uint32_t pipeline_slots; /**< Live buffers the relay may have in flight,
+   0 for as many as it has slots */
+  uint32_t drain_ms; /**< Milliseconds the relay has to drain on shutdown */
+  uint32_t spool_quota_mb; /**< Megabytes of dump files the spool may hold,
+   0 for no limit */
+  uint32_t compact_files; /**< Dump files in the spool before the relay packs
+   them (see compact.h), 0 for never */
+  uint32_t live_codec; /**< Codec of live buffers (see codec.h), or
+   #CODEC_LEVELS to let the relay choose per buffer (see adapt.h) */
+  uint32_t spool_sync; /**< Durability of dump files (see spool.h) */
+  uint32_t spool_sync_ms; /**< Milliseconds a dump file may wait to be
+   flushed */
+  uint32_t spool_group; /**< Dump files waiting that force a flush, under
+   #SPOOL_SYNC_GROUP */
+  uint32_t batch_min; /**< Fewest live buffers per request (see batch.h) */
+  uint32_t batch_max; /**< Most live buffers per request, 0 for as many as
+   the pipeline has slots */
+  uint32_t batch_wait_ms; /**< Milliseconds a live request may wait for its
+   buffers */
+  uint32_t batch_efficiency; /**< Percent of a live request's time it should
+   spend sending payload rather than waiting on the round trip */
+  char server[CONFIG_URL_MAX]; /**< The server path (see relay.h) */
+};
+
+typedef struct config_st Config;
+
+/**
+ * Sets every tunable to its compiled-in default and the server to "".
+ */
+void config_defaults(Config *c);
+
+/**
+ * Overrides tunables with those named in a config file. Nothing is changed
+ * unless the whole file is valid.
+ *
+ * @param path The config file
+ * @return 0 if successful, -1 if the file could not be read or is invalid
+ */
+int config_load(Config *c, const char *path);
+
+/**
+ * Copies a Config into the shared one, under a new generation. Only the
+ * consumer publishes.
+ */
+void config_publish(Config *shared, const Config *c);
+
+/**
+ * Checks whether the shared Config has changed since a copy was taken.
+ */
+int config_changed(const Config *shared, const Config *local);
+
+/**
+ * Takes a consistent copy of the shared Config.
+ */
+void config_read(const Config *shared, Config *local);
+
+/**
+ * Writes the tunables as a line of the metrics snapshot.
+ */
+void config_print(const Config *c, FILE *out);
+
+#endif
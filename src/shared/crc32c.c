@@ -0,0 +1,114 @@
+/**
+ * @file crc32c.c
+ * Implementation of CRC-32C checksums
+ * @see crc32c.h
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include "crc32c.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) \
+    && !defined(CRC32C_SOFTWARE)
+#define CRC32C_HW 1
+#include <nmmintrin.h>
+#endif
+
+/** The reflected Castagnoli polynomial */
+#define POLY 0x82f63b78
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len);
+#ifdef CRC32C_HW
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len);
+#endif
+
+/** table[k][b] is the CRC of byte b followed by k zero bytes */
+static uint32_t table[8][256];
+static uint32_t (*kernel)(uint32_t, const unsigned char*, size_t);
+
+/**
+ * Builds the lookup tables
+ * @see crc32c.h
+ */
+void crc32c_init() {
+  uint32_t c;
+  int b, k;
+
+  if (kernel != NULL )
+    return;
+  for (b = 0; b < 256; ++b) {
+    c = b;
+    for (k = 0; k < 8; ++k)
+      c = c & 1 ? (c >> 1) ^ POLY : c >> 1;
+    table[0][b] = c;
+  }
+  for (b = 0; b < 256; ++b)
+    for (k = 1; k < 8; ++k)
+      table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+
+  kernel = crc32c_sw;
+#ifdef CRC32C_HW
+  if (__builtin_cpu_supports("sse4.2"))
+    kernel = crc32c_hw;
+#endif
+}
+
+/**
+ * Extends a checksum
+ * @see crc32c.h
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+  if (kernel == NULL )
+    crc32c_init();
+  return ~kernel(~crc, (const unsigned char*) data, len);
+}
+
+/**
+ * Slicing-by-8: each step folds eight bytes into the CRC with eight table
+ * lookups. Words are assembled a byte at a time, so this works on either
+ * byte order.
+ */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+  while (len >= 8) {
+    uint32_t lo = crc
+        ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24);
+    uint32_t hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t) p[7] << 24;
+    crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff]
+        ^ table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24]
+        ^ table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff]
+        ^ table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+    p += 8;
+    len -= 8;
+  }
+  while (len-- > 0)
+    crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+  return crc;
+}
+
+#ifdef CRC32C_HW
+/** The SSE4.2 crc32 instruction, eight bytes at a time where possible. */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+#if defined(__x86_64__)
+  uint64_t c = crc;
+  while (len >= 8) {
+    uint64_t v;
+    __builtin_memcpy(&v, p, 8);
+    c = _mm_crc32_u64(c, v);
+    p += 8;
+    len -= 8;
+  }
+  crc = (uint32_t) c;
+#endif
+  while (len >= 4) {
+    uint32_t v;
+    __builtin_memcpy(&v, p, 4);
+    crc = _mm_crc32_u32(crc, v);
+    p += 4;
+    len -= 4;
+  }
+  while (len-- > 0)
+    crc = _mm_crc32_u8(crc, *p++);
+  return crc;
+}
+#endif
@@ -0,0 +1,48 @@
+/**
+ * @file crc32c.h
+ * CRC-32C (Castagnoli) checksums of buffers, spool records and uploads.
+ *
+ * Every full buffer carries the CRC-32C of its data, kept up to date by the
+ * consumer as it fills the buffer. The relay checks it before a buffer or a
+ * spool record leaves the device, and sends the checksum of each upload
+ * alongside it so the server can check what it stored.
+ *
+ * The checksum is computed eight bytes at a time with sliced lookup tables,
+ * or with the SSE4.2 crc32 instruction on x86 processors that have it.
+ * Building with CRC32C_SOFTWARE defined keeps to the tables everywhere, so
+ * that the tests can check both.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#ifndef _SHARED_CRC32C_H
+#define _SHARED_CRC32C_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/** Request and part header carrying the CRC-32C of the payload, in hex */
+#define CRC32C_HEADER "X-Electrisense-CRC32C"
+
+/**
+ * Builds the lookup tables and selects the fastest kernel. It is called by
+ * #crc32c when needed, but must be called before any threads that use
+ * #crc32c are started.
+ */
+void crc32c_init();
+
+/**
+ * Extends a checksum with more data. The checksum of data split into pieces
+ * is the same as that of the whole:
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~{.c}
+ * crc32c(crc32c(0, a, a_len), b, b_len) == crc32c(0, ab, a_len + b_len)
+ * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *
+ * @param crc The checksum of the data so far, 0 to start
+ * @param data The data to add
+ * @param len The number of bytes of data
+ * @return The checksum including data
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+#endif
@@ -0,0 +1,55 @@
+/**
+ * @file drain.c
+ * Implementation of the coordinated shutdown request
+ * @see drain.h
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <string.h>
+
+#include "clock.h"
+#include "drain.h"
+
+/**
+ * Resets the request
+ * @see drain.h
+ */
+void drain_init(Drain *d) {
+  memset(d, 0, sizeof *d);
+}
+
+/**
+ * Requests a drain
+ * @see drain.h
+ */
+void drain_start(Drain *d, uint32_t deadline_ms) {
+  d->deadline_ms = deadline_ms;
+  d->deadline_ns = clock_ns() + (uint64_t) deadline_ms * 1000000;
+  /* The deadline must be visible before the request */
+  __sync_synchronize();
+  d->requested = 1;
+}
+
+/**
+ * Checks the time left
+ * @see drain.h
+ */
+long drain_left_ms(const Drain *d) {
+  uint64_t now;
+
+  if (!d->requested)
+    return -1;
+  if ((now = clock_ns()) >= d->deadline_ns)
+    return 0;
+  return (d->deadline_ns - now + 999999) / 1000000;
+}
+
+/**
+ * Writes the outcome
+ * @see drain.h
+ */
+void drain_print(const Drain *d, FILE *out) {
+  fprintf(out, "drain requested=%d deadline_ms=%u uploaded=%u spooled=%u\n",
+      (int) d->requested, d->deadline_ms, d->uploaded, d->spooled);
+}
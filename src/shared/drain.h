@@ -0,0 +1,68 @@
+/**
+ * @file drain.h
+ * Coordinated shutdown of the consumer and relay, shared between them.
+ *
+ * A SIGTERM, SIGINT or SIGPWR used to kill both processes mid-loop, losing
+ * the buffer being filled and whatever the relay had in hand. Instead, the
+ * consumer now stops reading and asks the relay to drain within a deadline:
+ * the relay seals its full buffers and gives the upload pipeline until the
+ * deadline to deliver them, then spools whatever is left, the buffer the
+ * consumer was filling included, as dump files. The consumer waits for the
+ * relay, spools anything a relay that died or overran left behind, and
+ * removes the shared memory. The next run uploads the dump files first, so
+ * the data carries on where it stopped.
+ *
+ * The request lives in shared memory after the failover bookkeeping (see
+ * failover.h).
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#ifndef _SHARED_DRAIN_H
+#define _SHARED_DRAIN_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/** Default milliseconds the relay has to drain */
+#define DRAIN_DEADLINE_MS 3000
+/** Milliseconds the consumer waits for the relay past the deadline */
+#define DRAIN_GRACE_MS 2000
+
+/**
+ * A drain request and its outcome.
+ */
+struct drain_st {
+  int32_t requested; /**< Set once the consumer has stopped reading */
+  uint32_t deadline_ms; /**< Milliseconds allowed for the drain */
+  uint64_t deadline_ns; /**< When the drain must be over */
+  uint32_t uploaded; /**< Buffers uploaded during the drain */
+  uint32_t spooled; /**< Buffers spooled during the drain */
+};
+
+typedef struct drain_st Drain;
+
+/**
+ * Resets the request.
+ */
+void drain_init(Drain *d);
+
+/**
+ * Requests a drain, to be over deadline_ms from now.
+ */
+void drain_start(Drain *d, uint32_t deadline_ms);
+
+/**
+ * Checks how long a drain has left.
+ *
+ * @return The milliseconds left, at least 1 until the deadline and 0 after
+ * it, or -1 if no drain was requested
+ */
+long drain_left_ms(const Drain *d);
+
+/**
+ * Writes the outcome as a line of the metrics snapshot.
+ */
+void drain_print(const Drain *d, FILE *out);
+
+#endif
@@ -0,0 +1,55 @@
+/**
+ * @file failover.c
+ * Implementation of the hot-standby relay bookkeeping
+ * @see failover.h
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <string.h>
+
+#include "clock.h"
+#include "failover.h"
+
+/**
+ * Resets the bookkeeping
+ * @see failover.h
+ */
+void failover_init(Failover *f) {
+  memset(f, 0, sizeof *f);
+}
+
+/**
+ * Records a relay death
+ * @see failover.h
+ */
+void failover_died(Failover *f) {
+  f->died_ns = clock_ns(); /* clock_gettime is async-signal-safe */
+}
+
+/**
+ * Records a takeover
+ * @see failover.h
+ */
+void failover_took_over(Failover *f, int reclaimed) {
+  uint64_t us;
+
+  f->reclaimed += reclaimed;
+  if (f->died_ns == 0)
+    return; /* the first relay, not a takeover */
+  us = (clock_ns() - f->died_ns) / 1000;
+  f->last_us = us > UINT32_MAX ? UINT32_MAX : us;
+  if (f->last_us > f->max_us)
+    f->max_us = f->last_us;
+  ++f->failovers;
+}
+
+/**
+ * Writes the bookkeeping
+ * @see failover.h
+ */
+void failover_print(const Failover *f, FILE *out) {
+  fprintf(out, "failover active=%d standby=%d failovers=%u last_us=%u "
+      "max_us=%u reclaimed=%u\n", (int) f->active, (int) f->standby,
+      f->failovers, f->last_us, f->max_us, f->reclaimed);
+}
@@ -0,0 +1,65 @@
+/**
+ * @file failover.h
+ * Hot-standby relay bookkeeping, shared between the processes.
+ *
+ * When the relay died, the consumer used to fork a new one, which then had to
+ * set up curl, its encoders and its pipeline before anything moved again,
+ * while the double buffer kept filling. With a standby, the consumer keeps a
+ * second relay forked and initialized, waiting in sigtimedwait. When the
+ * active relay dies, the consumer's SIGCHLD handler promotes the standby and
+ * wakes it with SIGUSR1; the standby claims the shared pipeline slots (see
+ * pipeline.h), resending whatever the dead relay had sealed but not
+ * delivered, and the consumer forks a new standby behind it.
+ *
+ * The time from the consumer noticing the death to the new relay taking over
+ * is kept here, in shared memory after the occupancy telemetry, and appears in
+ * the relay's metrics snapshot.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#ifndef _SHARED_FAILOVER_H
+#define _SHARED_FAILOVER_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Which relay is in charge, and how long taking over has taken.
+ */
+struct failover_st {
+  int32_t active; /**< Pid of the relay in charge, 0 if none */
+  int32_t standby; /**< Pid of the standby relay, 0 if none */
+  uint32_t failovers; /**< Times a relay took over from one that died */
+  uint32_t last_us; /**< Microseconds the last takeover took */
+  uint32_t max_us; /**< Microseconds the slowest takeover took */
+  uint32_t reclaimed; /**< Buffers taken over from relays that died */
+  uint64_t died_ns; /**< When the consumer saw the last relay die */
+};
+
+typedef struct failover_st Failover;
+
+/**
+ * Resets the bookkeeping.
+ */
+void failover_init(Failover *f);
+
+/**
+ * Records that the active relay died, on the monotonic clock. Safe to call
+ * from a signal handler.
+ */
+void failover_died(Failover *f);
+
+/**
+ * Records that the calling relay has taken over.
+ *
+ * @param reclaimed The number of buffers it took over from the dead relay
+ */
+void failover_took_over(Failover *f, int reclaimed);
+
+/**
+ * Writes the bookkeeping as a line of the metrics snapshot.
+ */
+void failover_print(const Failover *f, FILE *out);
+
+#endif
@@ -0,0 +1,121 @@
+/**
+ * @file fault.c
+ * Implementation of fault injection
+ * @see fault.h
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include "fault.h"
+
+#ifdef FAULTS
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *names[FAULT_SITES] = { "spool_write", "fill_delay",
+    "seal_delay" };
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; /**< Guards below */
+static long values[FAULT_SITES]; /**< Value of each site */
+static struct timespec changed; /**< Modification time of the fault file */
+static struct timespec checked; /**< When the fault file was last checked */
+static pid_t pid; /**< Process the seed belongs to */
+static unsigned seed; /**< Random state */
+
+/**
+ * Rereads the fault file if it has changed, at most every #FAULT_CHECK_MS.
+ * Called with the lock held.
+ */
+static void reload(void) {
+  const char *path = getenv(FAULT_ENV);
+  char text[1024], name[32], *line, *next;
+  struct timespec now;
+  struct stat st;
+  long value;
+  ssize_t len;
+  int fd, i;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if ((now.tv_sec - checked.tv_sec) * 1000
+      + (now.tv_nsec - checked.tv_nsec) / 1000000 < FAULT_CHECK_MS
+      && checked.tv_sec != 0)
+    return;
+  checked = now;
+  if (path == NULL || stat(path, &st) < 0) {
+    memset(values, 0, sizeof values);
+    return;
+  }
+  if (st.st_mtim.tv_sec == changed.tv_sec
+      && st.st_mtim.tv_nsec == changed.tv_nsec)
+    return;
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return;
+  len = read(fd, text, sizeof text - 1);
+  close(fd);
+  if (len < 0)
+    return;
+  text[len] = '\0';
+  changed = st.st_mtim;
+
+  memset(values, 0, sizeof values);
+  for (line = text; line != NULL && *line != '\0'; line = next) {
+    if ((next = strchr(line, '\n')) != NULL )
+      *next++ = '\0';
+    if (sscanf(line, "%31s %ld", name, &value) != 2)
+      continue;
+    for (i = 0; i < FAULT_SITES; ++i)
+      if (strcmp(name, names[i]) == 0)
+        values[i] = value;
+  }
+}
+
+/**
+ * Reads a site's value and a random number to go with it.
+ */
+static long site_value(int site, int *roll) {
+  long value;
+
+  pthread_mutex_lock(&lock);
+  /* A relay forked from the consumer draws its own numbers */
+  if (pid != getpid()) {
+    pid = getpid();
+    seed = (unsigned) time(NULL ) ^ (unsigned) pid;
+  }
+  reload();
+  value = values[site];
+  *roll = rand_r(&seed);
+  pthread_mutex_unlock(&lock);
+  return value;
+}
+
+/**
+ * Decides whether an operation fails
+ * @see fault.h
+ */
+int fault_fail(int site) {
+  int roll;
+  long pct = site_value(site, &roll);
+
+  return pct > 0 && roll % 100 < pct;
+}
+
+/**
+ * Stalls for a random time
+ * @see fault.h
+ */
+void fault_delay(int site) {
+  int roll;
+  long us = site_value(site, &roll);
+
+  if (us > 0)
+    usleep(roll % us);
+}
+
+#endif
@@ -0,0 +1,70 @@
+/**
+ * @file fault.h
+ * Fault injection for stress runs of the consumer and relay.
+ *
+ * The handoff between the consumer and relay, and the spooling and resending
+ * around it, only go wrong at unlucky moments: a buffer filling while the
+ * relay is between checking and sealing it, a dump file failing to write
+ * while the server is down. When the client is built with FAULTS=1 (see the
+ * Makefile), a few places in it can be made to stall or fail at random, so
+ * that a stress run (see src/tools/stress.c) reaches those moments often.
+ *
+ * The faults are read from the file named by the #FAULT_ENV environment
+ * variable, one "site value" line each, and reread when it changes, so a run
+ * can turn them on and off while the client keeps going:
+ *
+ *     spool_write 30     percent of dump file writes that fail with EIO
+ *     fill_delay 5000    longest stall, in microseconds, of the consumer
+ *                        between filling a buffer and marking it full
+ *     seal_delay 5000    longest stall of the relay between finding a
+ *                        buffer full and sealing it
+ *
+ * A site not named does nothing. In a normal build #FAULT_FAIL is 0 and
+ * #FAULT_DELAY compiles to nothing.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#ifndef _SHARED_FAULT_H
+#define _SHARED_FAULT_H
+
+/** Environment variable naming the fault file */
+#define FAULT_ENV "ELECTRISENSE_FAULTS"
+/** Milliseconds between checks of the fault file for changes */
+#define FAULT_CHECK_MS 100
+
+/**
+ * Places a fault can be injected.
+ */
+enum fault_site {
+  FAULT_SPOOL_WRITE, /**< spool_write fails */
+  FAULT_FILL_DELAY, /**< The consumer stalls before a buffer is full */
+  FAULT_SEAL_DELAY, /**< The relay stalls before sealing a full buffer */
+  FAULT_SITES
+};
+
+#ifdef FAULTS
+
+/**
+ * Decides whether an operation fails this time.
+ *
+ * @param site A failure site
+ * @return Non-zero in the site's percentage of calls
+ */
+int fault_fail(int site);
+
+/**
+ * Stalls for a random time up to the site's value in microseconds.
+ *
+ * @param site A delay site
+ */
+void fault_delay(int site);
+
+#define FAULT_FAIL(site) fault_fail(site)
+#define FAULT_DELAY(site) fault_delay(site)
+#else
+#define FAULT_FAIL(site) 0
+#define FAULT_DELAY(site) do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,71 @@
+/**
+ * @file frame.h
+ * Definition of the framing used by the streaming transport.
+ *
+ * When the relay is pointed at a tcp:// server path, buffers are not sent as
+ * individual HTTP requests. Instead, a single long-lived TCP connection
+ * carries a stream of frames, each a fixed-size header followed by a payload:
+ *
+ * - *HELLO*: sent by the relay when it connects. The payload is the 8-byte
+ *   session id of the relay. The receiver answers with an ACK carrying the
+ *   highest sequence number it holds for that session, so that the relay only
+ *   resends what has not arrived.
+ * - *DATA*: a full buffer. The payload is the buffer's data.
+ * - *SEGMENT*: a spool segment from the SD card. The payload is a 16-bit name
+ *   length, the file name, and the contents of the file.
+ * - *ACK*: sent by the receiver. The sequence number is cumulative: every
+ *   frame up to and including it has been stored.
+ *
+ * DATA and SEGMENT frames carry the CRC-32C of the buffer or file contents
+ * (see crc32c.h). A receiver that finds a mismatch drops the connection
+ * without storing or acknowledging the frame, so that the relay resends it.
+ *
+ * Sequence numbers start at 1 for each session and increase by one per DATA
+ * or SEGMENT frame. The relay may have several frames in flight before it
+ * needs an acknowledgement; the receiver acknowledges once it has caught up
+ * with everything that has arrived, so one ACK usually covers several frames.
+ *
+ * All header fields are in network byte order.
+ */
+
+#ifndef _SHARED_FRAME_H
+#define _SHARED_FRAME_H
+
+#include <stdint.h>
+
+/** Marks the start of every frame header ("ESNS") */
+#define FRAME_MAGIC 0x45534e53
+
+/** Frame types */
+#define FRAME_HELLO 1
+#define FRAME_DATA 2
+#define FRAME_SEGMENT 3
+#define FRAME_ACK 4
+
+/** Largest payload a receiver has to accept */
+#define FRAME_PAYLOAD_MAX (16 * 1024 * 1024)
+
+/**
+ * The header preceding every frame's payload.
+ */
+struct frame_st {
+  /** Always #FRAME_MAGIC */
+  uint32_t magic;
+  /** One of FRAME_* */
+  uint16_t type;
+  /** Reserved, must be 0 */
+  uint16_t flags;
+  /** Sequence number of the frame, or the acknowledged one for ACK */
+  uint32_t seq;
+  /** Number of payload bytes following the header */
+  uint32_t length;
+  /** CRC-32C of the buffer or file contents, 0 for HELLO and ACK */
+  uint32_t crc;
+};
+
+typedef struct frame_st Frame;
+
+/** Wrap-around safe check that sequence number a is at or before b */
+#define FRAME_SEQ_LE(a, b) ((int32_t) ((a) - (b)) <= 0)
+
+#endif
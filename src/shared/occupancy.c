@@ -0,0 +1,100 @@
+/**
+ * @file occupancy.c
+ * Implementation of the double buffer occupancy telemetry
+ * @see occupancy.h
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+#include "occupancy.h"
+
+/**
+ * Resets the telemetry
+ * @see occupancy.h
+ */
+void occupancy_init(Occupancy *o) {
+  struct timespec now;
+
+  memset(o, 0, sizeof *o);
+  o->overflow_ms = -1;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  o->last_ns = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+  o->start_ns = o->last_ns;
+}
+
+/**
+ * Updates the telemetry
+ * @see occupancy.h
+ */
+int occupancy_update(Occupancy *o, size_t held_before, size_t held_after,
+    size_t added, size_t capacity) {
+  struct timespec now;
+  uint64_t now_ns;
+  size_t drained;
+  double dt, alpha, ms;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  now_ns = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+  dt = (now_ns - o->last_ns) / 1e9;
+  o->last_ns = now_ns;
+  drained = o->last_held > held_before ? o->last_held - held_before : 0;
+  o->last_held = held_after;
+
+  /* Exponential averages of the rates, weighted by the time each covers */
+  if (dt > 0) {
+    alpha = 1 - exp(-dt / OCCUPANCY_TAU);
+    o->fill += alpha * (added / dt - o->fill);
+    o->drain += alpha * (drained / dt - o->drain);
+  }
+
+  o->capacity = capacity;
+  o->held = held_after;
+  if (held_after > o->high_water)
+    o->high_water = held_after;
+  o->fill_rate = o->fill;
+  o->drain_rate = o->drain;
+  /* Nothing has drained before the relay's first buffer; do not project yet */
+  if (now_ns - o->start_ns < 2 * OCCUPANCY_TAU * 1e9)
+    o->overflow_ms = -1;
+  else if (o->fill > o->drain) {
+    ms = (capacity - held_after) / (o->fill - o->drain) * 1000;
+    o->overflow_ms = ms < INT32_MAX ? (int32_t) ms : INT32_MAX;
+  } else
+    o->overflow_ms = -1;
+
+  /* Warn once per approach, and only again after backing well away */
+  if (occupancy_at_risk(o)) {
+    if (!o->warned) {
+      o->warned = 1;
+      ++o->warnings;
+      return 1;
+    }
+  } else if (o->overflow_ms < 0 || o->overflow_ms > 2 * OCCUPANCY_HORIZON_MS)
+    o->warned = 0;
+  return 0;
+}
+
+/**
+ * Checks for projected overflow
+ * @see occupancy.h
+ */
+int occupancy_at_risk(const Occupancy *o) {
+  return o->overflow_ms >= 0 && o->overflow_ms < OCCUPANCY_HORIZON_MS
+      && o->held >= o->capacity / 2;
+}
+
+/**
+ * Writes the telemetry
+ * @see occupancy.h
+ */
+void occupancy_print(const Occupancy *o, FILE *out) {
+  fprintf(out, "occupancy held=%u high_water=%u fill_rate=%u drain_rate=%u "
+      "overflow_ms=%d warnings=%u dumps=%u early_spools=%u spool_files=%u "
+      "dropped=%u\n", o->held,
+      o->high_water, o->fill_rate, o->drain_rate, o->overflow_ms, o->warnings,
+      o->dumps, o->early_spools, o->spool_files, o->dropped);
+}
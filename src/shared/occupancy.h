@@ -0,0 +1,99 @@
+/**
+ * @file occupancy.h
+ * Occupancy telemetry of the shared double buffer.
+ *
+ * The consumer used to learn that the relay had fallen behind only when it
+ * found the other buffer still full, by which time it had to dump a buffer to
+ * the SD card in its realtime path. Instead, after every read it now updates
+ * smoothed fill and drain rates of the double buffer, the number of bytes held
+ * and their high-water mark, and a projection of when both buffers will be
+ * full. These live in shared memory after the buffers, so the relay can act
+ * on them: when overflow is projected within #OCCUPANCY_HORIZON_MS, it spools
+ * full buffers to the SD card itself rather than uploading them, keeping the
+ * consumer from ever having to block on the card. The state also appears in
+ * the relay's metrics snapshot.
+ *
+ * Only the consumer writes the telemetry, except for early_spools, which only
+ * the relay writes, and dropped and spool_files, which both processes add to.
+ * The relay corrects spool_files by what each scan of the spool finds. The
+ * counters are only ever changed with atomic adds, since more than one thread
+ * may change them. Every published field is a naturally aligned 32-bit value,
+ * so readers never see one torn.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#ifndef _SHARED_OCCUPANCY_H
+#define _SHARED_OCCUPANCY_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/** Time constant of the fill and drain rate averages, in seconds */
+#define OCCUPANCY_TAU 2.0
+/** Overflow projected sooner than this, in milliseconds, calls for action */
+#define OCCUPANCY_HORIZON_MS 3000
+
+/**
+ * Occupancy of the double buffer.
+ */
+struct occupancy_st {
+  uint32_t capacity; /**< Capacity of both buffers together */
+  uint32_t held; /**< Bytes buffered and not yet released by the relay */
+  uint32_t high_water; /**< Largest number of bytes held */
+  uint32_t fill_rate; /**< Bytes buffered per second */
+  uint32_t drain_rate; /**< Bytes released by the relay per second */
+  int32_t overflow_ms; /**< Projected time until both buffers are full, or -1
+   if they are not filling faster than they drain or the averages are still
+   settling */
+  uint32_t warnings; /**< Times overflow came within the horizon */
+  uint32_t dumps; /**< Buffers the consumer had to dump */
+  uint32_t early_spools; /**< Buffers the relay spooled instead of sending */
+  uint32_t spool_files; /**< Dump files in the spool, a pack counting as
+   the dump files it takes the room of */
+  uint32_t dropped; /**< Buffers dropped with the spool over its quota or
+   failing to write */
+
+  /* The consumer's bookkeeping */
+  double fill; /**< Average fill rate */
+  double drain; /**< Average drain rate */
+  uint64_t start_ns; /**< When the telemetry was reset */
+  uint64_t last_ns; /**< When the last update happened */
+  uint32_t last_held; /**< Bytes held after the last update */
+  int warned; /**< Set while overflow is within the horizon */
+};
+
+typedef struct occupancy_st Occupancy;
+
+/**
+ * Resets the telemetry.
+ */
+void occupancy_init(Occupancy *o);
+
+/**
+ * Updates the telemetry after the consumer has handled a read. Bytes released
+ * by the relay since the last update count towards the drain rate.
+ *
+ * @param held_before Bytes held in both buffers before the read was handled
+ * @param held_after Bytes held in both buffers after the read was handled
+ * @param added Bytes of the read that were buffered
+ * @param capacity Capacity of both buffers together
+ * @return 1 if overflow has just come within #OCCUPANCY_HORIZON_MS, 0
+ * otherwise
+ */
+int occupancy_update(Occupancy *o, size_t held_before, size_t held_after,
+    size_t added, size_t capacity);
+
+/**
+ * Checks whether overflow is projected within #OCCUPANCY_HORIZON_MS while a
+ * full buffer is waiting on the relay. Until one is, the relay has not fallen
+ * behind, however slowly the buffers have drained so far.
+ */
+int occupancy_at_risk(const Occupancy *o);
+
+/**
+ * Writes the telemetry as a line of the metrics snapshot.
+ */
+void occupancy_print(const Occupancy *o, FILE *out);
+
+#endif
@@ -0,0 +1,161 @@
+/**
+ * @file pack.c
+ * Implementation of the pack format
+ * @see pack.h
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "crc32c.h"
+#include "pack.h"
+
+static size_t record_size(const char *data);
+static void read_record(const char *data, uint32_t offset, PackRecord *rec);
+
+/**
+ * Names a dump file or pack
+ * @see pack.h
+ */
+void pack_name(char *out, const char *prefix, uint64_t stamp) {
+  /* As spool_write names dump files: seconds, then six digits of micros */
+  snprintf(out, PACK_NAME_MAX, "%s%" PRIu64 "%06" PRIu64 ".dat", prefix,
+      stamp / 1000000, stamp % 1000000);
+}
+
+/**
+ * Gets the time from a name
+ * @see pack.h
+ */
+uint64_t pack_stamp(const char *name) {
+  const char *p = strchr(name, '_');
+  uint64_t stamp = 0;
+
+  if (p == NULL || *++p < '0' || *p > '9')
+    return 0;
+  while (*p >= '0' && *p <= '9')
+    stamp = stamp * 10 + (*p++ - '0');
+  return strcmp(p, ".dat") == 0 ? stamp : 0;
+}
+
+/**
+ * Writes a record
+ * @see pack.h
+ */
+size_t pack_record(const Buffer *b, uint64_t stamp, char *out) {
+  PackRecord rec;
+  char *data = out + sizeof rec;
+
+  memset(&rec, 0, sizeof rec);
+  rec.stamp = stamp;
+  rec.id = b->id;
+  rec.size = b->size;
+  rec.capacity = b->capacity;
+  rec.crc = b->crc;
+  rec.codec = CODEC_DELTA;
+  rec.length = codec_delta_encode(b->data, b->size, data);
+  if (rec.length >= b->size) {
+    rec.codec = CODEC_RAW;
+    rec.length = b->size;
+    memcpy(data, b->data, b->size);
+  }
+  memcpy(out, &rec, sizeof rec);
+  return sizeof rec + rec.length;
+}
+
+/**
+ * Checks a pack
+ * @see pack.h
+ */
+int pack_verify(const char *data, size_t size) {
+  PackHeader h;
+  PackTrailer t;
+  PackEntry e;
+  uint32_t i;
+
+  if (size < sizeof h + sizeof t)
+    return -1;
+  memcpy(&h, data, sizeof h);
+  memcpy(&t, data + size - sizeof t, sizeof t);
+  if (h.magic != PACK_MAGIC || (h.version != 1 && h.version != PACK_VERSION)
+      || t.magic != PACK_MAGIC || t.index < sizeof h
+      || t.index + (uint64_t) t.records * sizeof e + sizeof t != size
+      || crc32c(0, data, size - sizeof t) != t.crc)
+    return -1;
+  for (i = 0; i < t.records; ++i) {
+    memcpy(&e, data + t.index + i * sizeof e, sizeof e);
+    if (e.offset < sizeof h || e.length < record_size(data)
+        || (uint64_t) e.offset + e.length > t.index)
+      return -1;
+  }
+  return t.records;
+}
+
+/**
+ * Copies out an index entry
+ * @see pack.h
+ */
+void pack_entry(const char *data, size_t size, int i, PackEntry *e) {
+  PackTrailer t;
+
+  memcpy(&t, data + size - sizeof t, sizeof t);
+  memcpy(e, data + t.index + i * sizeof *e, sizeof *e);
+}
+
+/**
+ * Expands a record
+ * @see pack.h
+ */
+int pack_expand(const char *data, size_t size, int i, Buffer *b) {
+  PackEntry e;
+  PackRecord rec;
+  const char *stored;
+
+  pack_entry(data, size, i, &e);
+  read_record(data, e.offset, &rec);
+  stored = data + e.offset + record_size(data);
+  if (rec.length != e.length - record_size(data) || rec.size > rec.capacity
+      || rec.capacity > __BUFFER_CAPACITY)
+    return -1;
+
+  memset(b, 0, sizeof *b);
+  b->size = rec.size;
+  b->capacity = rec.capacity;
+  b->crc = rec.crc;
+  b->id = rec.id;
+  if (rec.codec == CODEC_RAW) {
+    if (rec.length != rec.size)
+      return -1;
+    memcpy(b->data, stored, rec.size);
+  } else if (rec.codec != CODEC_DELTA
+      || codec_delta_decode(stored, rec.length, b->data, rec.size) < 0)
+    return -1;
+  return crc32c(0, b->data, b->size) == b->crc ? 0 : -1;
+}
+
+/** Bytes a record takes before its data, in the pack's version */
+static size_t record_size(const char *data) {
+  PackHeader h;
+
+  memcpy(&h, data, sizeof h);
+  return h.version == 1 ? sizeof(PackRecord) - sizeof(uint64_t) :
+      sizeof(PackRecord);
+}
+
+/** Copies out a record, which version 1 keeps without the id */
+static void read_record(const char *data, uint32_t offset, PackRecord *rec) {
+  size_t head = offsetof(PackRecord, id);
+
+  if (record_size(data) == sizeof *rec) {
+    memcpy(rec, data + offset, sizeof *rec);
+    return;
+  }
+  memcpy(rec, data + offset, head);
+  rec->id = 0;
+  memcpy((char*) rec + head + sizeof rec->id, data + offset + head,
+      sizeof *rec - head - sizeof rec->id);
+}
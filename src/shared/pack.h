@@ -0,0 +1,135 @@
+/**
+ * @file pack.h
+ * Packs: many dump files compacted into one spool file
+ *
+ * A site that has been offline for a while holds thousands of dump files
+ * (see spool.h), each a whole Buffer. Listing, uploading and deleting them
+ * one by one is slow, and wears the SD card. The relay's compactor (see
+ * compact.h) merges them, oldest first, into packs named
+ * client-pack_<time>.dat after the time of the first dump they hold, so that
+ * packs and dump files sort together by the time in their names. Packs are
+ * uploaded like dump files, and the server expands each one back into the
+ * dump files it holds.
+ *
+ * Format
+ * ------
+ * A pack is a PackHeader, then one PackRecord per dump followed by its data,
+ * then an index of one PackEntry per record, then a PackTrailer. A record
+ * keeps the dump's Buffer header and its size bytes of data, stored with one
+ * of the CODEC_* codecs (see codec.h); the unused end of the buffer is not
+ * kept. The trailer holds the CRC-32C of everything before it, so a pack cut
+ * short or corrupted on the card is recognized. Values are in the byte order
+ * of the client, like the Buffer in a dump file, and are not aligned, so
+ * they are copied out rather than read in place. Records of version 1 packs
+ * lack the buffer's id (see buffer.h); they are still read, as buffers
+ * without one.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#ifndef _SHARED_PACK_H
+#define _SHARED_PACK_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "buffer.h"
+#include "codec.h"
+
+/** Marks the start and end of a pack */
+#define PACK_MAGIC 0x4b504345
+/** Version of the pack format */
+#define PACK_VERSION 2
+/** Most dump files in one pack, as many as one upload batch takes */
+#define PACK_RECORDS_MAX 64
+/** Room for a pack or dump file name */
+#define PACK_NAME_MAX 64
+/** Most bytes one record takes in a pack */
+#define PACK_RECORD_MAX (sizeof(PackRecord) \
+    + CODEC_DELTA_BOUND(__BUFFER_CAPACITY))
+
+struct pack_header_st {
+  uint32_t magic; /**< #PACK_MAGIC */
+  uint32_t version; /**< #PACK_VERSION */
+};
+
+typedef struct pack_header_st PackHeader;
+
+struct pack_record_st {
+  uint64_t stamp; /**< Time in the dump file's name, in microseconds */
+  uint64_t id; /**< Id of the buffer, from version 2 */
+  uint32_t size; /**< Bytes of data in the buffer */
+  uint32_t capacity; /**< Capacity of the buffer */
+  uint32_t crc; /**< CRC-32C of the data, as in the Buffer */
+  uint32_t codec; /**< How the data is stored, one of CODEC_* */
+  uint32_t length; /**< Bytes of stored data after the record */
+  uint32_t reserved;
+};
+
+typedef struct pack_record_st PackRecord;
+
+struct pack_entry_st {
+  uint64_t stamp; /**< Time in the dump file's name, in microseconds */
+  uint32_t offset; /**< Offset of the record in the pack */
+  uint32_t length; /**< Bytes of the record, including its data */
+};
+
+typedef struct pack_entry_st PackEntry;
+
+struct pack_trailer_st {
+  uint32_t index; /**< Offset of the index in the pack */
+  uint32_t records; /**< Number of records */
+  uint32_t crc; /**< CRC-32C of the pack up to the trailer */
+  uint32_t magic; /**< #PACK_MAGIC */
+};
+
+typedef struct pack_trailer_st PackTrailer;
+
+/**
+ * Names the dump file or pack of a given time.
+ *
+ * @param out Room for #PACK_NAME_MAX bytes
+ * @param prefix "client-dump_" or "client-pack_"
+ * @param stamp The time, in microseconds
+ */
+void pack_name(char *out, const char *prefix, uint64_t stamp);
+
+/**
+ * Gets the time from a dump file or pack name.
+ *
+ * @return The time in microseconds, or 0 if the name has none
+ */
+uint64_t pack_stamp(const char *name);
+
+/**
+ * Writes a dump's record, with its data in whichever of the raw and delta
+ * encoded forms is smaller.
+ *
+ * @param b The dump's buffer
+ * @param stamp The time in the dump file's name
+ * @param out Room for #PACK_RECORD_MAX bytes
+ * @return Bytes written to out
+ */
+size_t pack_record(const Buffer *b, uint64_t stamp, char *out);
+
+/**
+ * Checks a whole pack in memory: its trailer, checksum and index.
+ *
+ * @return The number of records, or -1 if it is not a valid pack
+ */
+int pack_verify(const char *data, size_t size);
+
+/**
+ * Copies out an index entry of a pack checked by #pack_verify.
+ */
+void pack_entry(const char *data, size_t size, int i, PackEntry *e);
+
+/**
+ * Expands a record of a pack checked by #pack_verify back into the Buffer
+ * of its dump file. The end of the buffer past its size is zeroed.
+ *
+ * @return 0 if successful, -1 if the record is malformed
+ */
+int pack_expand(const char *data, size_t size, int i, Buffer *b);
+
+#endif
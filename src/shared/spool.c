@@ -0,0 +1,370 @@
+/**
+ * @file spool.c
+ * Implementation of writing buffers to the spool directory
+ * @see spool.h
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#define _GNU_SOURCE /* for fallocate and sync_file_range */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "spool.h"
+#include "fault.h"
+
+/** Number of later names tried when a dump file name is taken */
+#define SPOOL_NAME_TRIES 16
+
+static int spool_filter(const struct dirent *entry);
+static int flush_due(const Spool *s, const struct timespec *now);
+static void flush_locked(Spool *s);
+static long long elapsed_us(const struct timespec *from,
+    const struct timespec *to);
+static void raise_max(uint32_t *max, uint32_t value);
+
+/**
+ * Resets the counts
+ * @see spool.h
+ */
+void spool_stats_init(SpoolStats *stats) {
+  memset(stats, 0, sizeof *stats);
+}
+
+/**
+ * Allocates a writer
+ * @see spool.h
+ */
+Spool* spool_init(const char *dir, SpoolStats *stats) {
+  size_t len = strlen(dir);
+  Spool *s;
+
+  if ((s = (Spool*) calloc(1, sizeof(Spool))) == NULL )
+    return NULL ;
+  if ((s->dir = (char*) malloc(len + 2)) == NULL ) {
+    free(s);
+    return NULL ;
+  }
+  strcpy(s->dir, dir);
+  if (len == 0 || dir[len - 1] != '/')
+    strcat(s->dir, "/");
+  s->dir_fd = open(s->dir, O_RDONLY); /* retried at the first flush */
+  s->stats = stats;
+  pthread_mutex_init(&s->lock, NULL );
+  s->sync = SPOOL_SYNC_NONE;
+  s->group = 1;
+  return s;
+}
+
+/**
+ * Applies the durability tunables
+ * @see spool.h
+ */
+void spool_configure(Spool *s, uint32_t sync, uint32_t sync_ms,
+    uint32_t group) {
+  pthread_mutex_lock(&s->lock);
+  s->sync = sync;
+  s->sync_ms = sync_ms;
+  s->group = group == 0 ? 1 :
+      group > SPOOL_GROUP_MAX ? SPOOL_GROUP_MAX : group;
+  if (sync == SPOOL_SYNC_NONE && s->npending > 0)
+    flush_locked(s);
+  pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * Writes a buffer to a new dump file
+ * @see spool.h
+ */
+int spool_write(Spool *s, const Buffer *b) {
+  struct timeval tv;
+  struct timespec start, now;
+  char tmp[256], path[256], head[offsetof(Buffer, data)];
+  const char *data = head;
+  size_t left = sizeof head;
+  long long us;
+  ssize_t n;
+  int fd = -1, i, ret = 0;
+
+  if (FAULT_FAIL(FAULT_SPOOL_WRITE)) {
+    errno = EIO;
+    return -1;
+  }
+  /* The relay may hand back a full buffer the consumer is dumping (see
+   * buffer.h), so the header is taken once; the data stays as it is */
+  memcpy(head, b, sizeof head);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  /* The consumer and relay may both spool in the same microsecond */
+  gettimeofday(&tv, NULL );
+  us = (long long) tv.tv_sec * 1000000 + tv.tv_usec;
+  for (i = 0; i < SPOOL_NAME_TRIES && fd < 0; ++i) {
+    snprintf(tmp, sizeof tmp, "%stmp-dump_%lld%06lld.dat", s->dir,
+        (us + i) / 1000000, (us + i) % 1000000);
+    if ((fd = open(tmp, O_CREAT | O_EXCL | O_WRONLY, 0644)) < 0
+        && errno != EEXIST)
+      return -1;
+  }
+  if (fd < 0)
+    return -1;
+  us += i - 1;
+
+  /* Not every file system can preallocate; those that cannot just write */
+  if (s->sync != SPOOL_SYNC_NONE && fallocate(fd, 0, 0, sizeof(Buffer)) < 0
+      && errno != EOPNOTSUPP && errno != ENOSYS) {
+    close(fd);
+    unlink(tmp);
+    return -1;
+  }
+  while (left > 0) {
+    if ((n = write(fd, data, left)) < 0) {
+      if (errno == EAGAIN || errno == EINTR)
+        continue;
+      close(fd);
+      unlink(tmp);
+      return -1;
+    }
+    data += n;
+    left -= n;
+    if (left == 0 && data == head + sizeof head) {
+      data = b->data;
+      left = sizeof(Buffer) - sizeof head;
+    }
+  }
+  /* Only a whole file takes a name the relay scans for, or a later one if
+   * a file written meanwhile has it */
+  do {
+    snprintf(path, sizeof path, "%sclient-dump_%lld%06lld.dat", s->dir,
+        us / 1000000, us % 1000000);
+    ++us;
+  } while (access(path, F_OK) == 0);
+  if (rename(tmp, path) < 0) {
+    close(fd);
+    unlink(tmp);
+    return -1;
+  }
+  __sync_fetch_and_add(&s->stats->writes, 1);
+
+  pthread_mutex_lock(&s->lock);
+  if (s->sync == SPOOL_SYNC_NONE)
+    ret = close(fd);
+  else {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (s->npending == 0) {
+      s->due = now;
+      s->due.tv_sec += s->sync_ms / 1000;
+      s->due.tv_nsec += (long) (s->sync_ms % 1000) * 1000000;
+      if (s->due.tv_nsec >= 1000000000) {
+        ++s->due.tv_sec;
+        s->due.tv_nsec -= 1000000000;
+      }
+    }
+    s->pending[s->npending++] = fd;
+    if (flush_due(s, &now))
+      flush_locked(s);
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  raise_max(&s->stats->write_us_max, elapsed_us(&start, &now));
+  return ret;
+}
+
+/**
+ * Flushes the files waiting if due
+ * @see spool.h
+ */
+void spool_tick(Spool *s) {
+  struct timespec now;
+
+  if (s->npending == 0)
+    return; /* read unlocked: a file written meanwhile waits for the next */
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  pthread_mutex_lock(&s->lock);
+  if (flush_due(s, &now))
+    flush_locked(s);
+  pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * Flushes the files waiting
+ * @see spool.h
+ */
+void spool_flush(Spool *s) {
+  pthread_mutex_lock(&s->lock);
+  if (s->npending > 0)
+    flush_locked(s);
+  pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * Lists the oldest files
+ * @see spool.h
+ */
+int spool_scan(SpoolScan *s, const char *dir) {
+  struct dirent *entry, *slot;
+  struct timeval now;
+  unsigned long long stale;
+  uint32_t files = 0;
+  int n = 0, i;
+
+  if (s->dirp == NULL && (s->dirp = opendir(dir)) == NULL )
+    return -1;
+  rewinddir(s->dirp);
+
+  /* Dump files are named for the time in microseconds they were written */
+  gettimeofday(&now, NULL );
+  stale = ((unsigned long long) now.tv_sec - SPOOL_STALE_AGE) * 1000000
+      + now.tv_usec;
+  while ((entry = readdir(s->dirp)) != NULL ) {
+    struct stat pack_stat;
+    if (strncmp(entry->d_name, "tmp-dump_", 9) == 0) {
+      /* A writer that died left it; those being written are younger */
+      if (strtoull(entry->d_name + 9, NULL, 10) < stale)
+        unlinkat(dirfd(s->dirp), entry->d_name, 0);
+      continue;
+    }
+    if (!spool_filter(entry))
+      continue;
+    if (strncmp(entry->d_name, "client-pack_", SPOOL_STAMP) == 0
+        && fstatat(dirfd(s->dirp), entry->d_name, &pack_stat, 0) == 0)
+      files += (pack_stat.st_size + sizeof(Buffer) - 1) / sizeof(Buffer);
+    else
+      ++files;
+    if (n == SPOOL_SCAN_MAX && strcmp(entry->d_name + SPOOL_STAMP,
+        s->list[n - 1]->d_name + SPOOL_STAMP) >= 0)
+      continue; /* newer than every file listed */
+
+    /* Insert in order, making room by dropping the newest if need be */
+    if (n < SPOOL_SCAN_MAX) {
+      slot = &s->ents[n];
+      i = n++;
+    } else {
+      slot = s->list[n - 1];
+      i = n - 1;
+    }
+    for (; i > 0 && strcmp(s->list[i - 1]->d_name + SPOOL_STAMP,
+        entry->d_name + SPOOL_STAMP) > 0; --i)
+      s->list[i] = s->list[i - 1];
+    memcpy(slot->d_name, entry->d_name, sizeof slot->d_name);
+    s->list[i] = slot;
+  }
+  s->files = files;
+  return n;
+}
+
+/**
+ * Closes the directory
+ * @see spool.h
+ */
+void spool_scan_close(SpoolScan *s) {
+  if (s->dirp != NULL )
+    closedir(s->dirp);
+  s->dirp = NULL;
+}
+
+/**
+ * Checks the quota
+ * @see spool.h
+ */
+int spool_has_room(uint32_t files, uint32_t quota_mb) {
+  return quota_mb == 0
+      || (uint64_t) (files + 1) * sizeof(Buffer) <= (uint64_t) quota_mb << 20;
+}
+
+/**
+ * Writes the counts
+ * @see spool.h
+ */
+void spool_print(const SpoolStats *stats, FILE *out) {
+  fprintf(out, "spool writes=%u syncs=%u synced=%u sync_errors=%u "
+      "sync_ms=%u sync_us_max=%u write_us_max=%u\n", stats->writes,
+      stats->syncs, stats->synced, stats->sync_errors, stats->sync_ms,
+      stats->sync_us_max, stats->write_us_max);
+}
+
+/**
+ * Frees the writer
+ * @see spool.h
+ */
+void spool_cleanup(Spool **s) {
+  spool_flush(*s);
+  if ((*s)->dir_fd >= 0)
+    close((*s)->dir_fd);
+  pthread_mutex_destroy(&(*s)->lock);
+  free((*s)->dir);
+  free(*s);
+  *s = NULL;
+}
+
+/** Dump files and packs, whose names differ only up to #SPOOL_STAMP */
+static int spool_filter(const struct dirent *entry) {
+  return strncmp(entry->d_name, "client-dump_", SPOOL_STAMP) == 0
+      || strncmp(entry->d_name, "client-pack_", SPOOL_STAMP) == 0;
+}
+
+/** Checks whether the files waiting are to be flushed */
+static int flush_due(const Spool *s, const struct timespec *now) {
+  if (s->npending == 0)
+    return 0;
+  return s->npending == SPOOL_GROUP_MAX
+      || (s->sync == SPOOL_SYNC_GROUP && (uint32_t) s->npending >= s->group)
+      || elapsed_us(&s->due, now) >= 0;
+}
+
+/**
+ * Flushes the files waiting, then the directory for their names, and closes
+ * them. A file that could not be flushed still goes, as there is nothing
+ * better to do with it than leave it to the kernel's write-back.
+ */
+static void flush_locked(Spool *s) {
+  struct timespec start, end;
+  uint32_t failed = 0, us;
+  int i;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  /* Start every file on its way first, so the card takes them together */
+  for (i = 0; i < s->npending; ++i)
+    sync_file_range(s->pending[i], 0, 0, SYNC_FILE_RANGE_WRITE);
+  for (i = 0; i < s->npending; ++i) {
+    if (fdatasync(s->pending[i]) < 0)
+      ++failed;
+    close(s->pending[i]);
+  }
+  if (s->dir_fd < 0)
+    s->dir_fd = open(s->dir, O_RDONLY);
+  if (s->dir_fd < 0 || fsync(s->dir_fd) < 0)
+    failed = s->npending; /* none of the names is sure to last */
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  us = elapsed_us(&start, &end);
+  __sync_fetch_and_add(&s->stats->syncs, 1);
+  __sync_fetch_and_add(&s->stats->synced, s->npending - failed);
+  __sync_fetch_and_add(&s->stats->sync_errors, failed);
+  __sync_fetch_and_add(&s->stats->sync_ms, (us + 500) / 1000);
+  raise_max(&s->stats->sync_us_max, us);
+  s->npending = 0;
+}
+
+/** Microseconds from one time to another, negative if it is earlier */
+static long long elapsed_us(const struct timespec *from,
+    const struct timespec *to) {
+  return (long long) (to->tv_sec - from->tv_sec) * 1000000
+      + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+/** Raises a shared maximum, which the other process may be raising too */
+static void raise_max(uint32_t *max, uint32_t value) {
+  uint32_t cur;
+
+  while ((cur = *max) < value
+      && !__sync_bool_compare_and_swap(max, cur, value))
+    ;
+}
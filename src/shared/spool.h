@@ -0,0 +1,209 @@
+/**
+ * @file spool.h
+ * Writing buffers to the spool directory on the SD card.
+ *
+ * A buffer that cannot be uploaded in time is written to the spool directory
+ * as a dump file, a copy of the whole Buffer named client-dump_<time>.dat
+ * after the time in microseconds it was written, so that names sort oldest
+ * first. The relay uploads dump files before live buffers. A dump file is
+ * written as tmp-dump_<time>.dat and renamed once all of it is written, so
+ * the relay never sees one cut short; #spool_scan deletes those a writer
+ * left behind when it died.
+ *
+ * The relay lists the spool with #spool_scan, which keeps the directory open
+ * and copies the entries it keeps, so that scanning allocates nothing after
+ * the first time.
+ *
+ * The spool may be given a quota (see config.h), past which buffers that
+ * would have been spooled in the normal run of things are dropped instead,
+ * so that a long outage cannot fill the SD card. Buffers spooled on shutdown
+ * (see drain.h) are kept regardless.
+ *
+ * Durability
+ * ----------
+ * A dump file that has been written is only in the page cache until the
+ * kernel writes it back, so a power cut can lose it, while flushing each one
+ * as it is written would hold the writer up for a whole flash commit per
+ * buffer. The spool_sync tunable (see config.h) chooses between:
+ *
+ *   - #SPOOL_SYNC_NONE: dump files are left to the kernel's write-back.
+ *   - #SPOOL_SYNC_PERIODIC: dump files are kept open once written, and
+ *     flushed together spool_sync_ms after the first of them, so at most
+ *     that long's worth of spooled buffers is at risk.
+ *   - #SPOOL_SYNC_GROUP: as periodic, but the files are also flushed as soon
+ *     as spool_group of them are waiting, so that a burst of dumps puts at
+ *     most that many at risk and pays for one flush per group.
+ *
+ * A flush is an fdatasync of each waiting file and one fsync of the spool
+ * directory, for their names. It happens in whichever #spool_write or
+ * #spool_tick finds it due, so its cost lands on the consumer or relay, and
+ * is counted in the shared SpoolStats. With a policy other than none, a dump
+ * file is preallocated with fallocate before it is written, so the card
+ * allocates it in one go, and a full card fails the write before any of it
+ * is written.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#ifndef _SHARED_SPOOL_H
+#define _SHARED_SPOOL_H
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "buffer.h"
+
+/** Most files listed by one scan */
+#define SPOOL_SCAN_MAX 64
+/** Length of "client-dump_" and "client-pack_", after which comes the time */
+#define SPOOL_STAMP 12
+
+/** Dump files are left to the kernel's write-back */
+#define SPOOL_SYNC_NONE 0
+/** Dump files are flushed together a while after the first is written */
+#define SPOOL_SYNC_PERIODIC 1
+/** As periodic, or once spool_group of them are waiting */
+#define SPOOL_SYNC_GROUP 2
+/** Most dump files waiting for a flush at once */
+#define SPOOL_GROUP_MAX 16
+/** Seconds after which a tmp-dump_ file is taken for one left by a writer
+ * that died */
+#define SPOOL_STALE_AGE 60
+
+/**
+ * Counts of spool writes and flushes, shared by the consumer and relay.
+ */
+struct spool_stats_st {
+  uint32_t writes; /**< Dump files written */
+  uint32_t syncs; /**< Flushes, each of one or more dump files */
+  uint32_t synced; /**< Dump files flushed */
+  uint32_t sync_errors; /**< Dump files that could not be flushed */
+  uint32_t sync_ms; /**< Milliseconds spent flushing */
+  uint32_t sync_us_max; /**< Longest flush */
+  uint32_t write_us_max; /**< Longest #spool_write, any flush it made
+   included */
+};
+
+typedef struct spool_stats_st SpoolStats;
+
+/**
+ * A process's writer of dump files, and the files waiting to be flushed.
+ */
+struct spool_st {
+  char *dir; /**< The spool directory, ending in a slash */
+  int dir_fd; /**< The spool directory, open for fsync, or -1 */
+  SpoolStats *stats; /**< Where writes and flushes are counted */
+  pthread_mutex_t lock; /**< Guards the rest, for the relay's threads */
+  uint32_t sync; /**< One of the SPOOL_SYNC_* policies */
+  uint32_t sync_ms; /**< Milliseconds a file may wait for a flush */
+  uint32_t group; /**< Files waiting that force a flush, under
+   #SPOOL_SYNC_GROUP */
+  int pending[SPOOL_GROUP_MAX]; /**< Files written but not flushed */
+  int npending; /**< Entries in pending */
+  struct timespec due; /**< When the pending files must be flushed */
+};
+
+typedef struct spool_st Spool;
+
+/**
+ * The oldest files in the spool, dump files and packs alike.
+ */
+struct spool_scan_st {
+  DIR *dirp; /**< The spool directory, kept open between scans */
+  struct dirent *list[SPOOL_SCAN_MAX]; /**< Oldest files, sorted */
+  struct dirent ents[SPOOL_SCAN_MAX]; /**< Entries list points to */
+  uint32_t files; /**< Dump files in the spool, counting a pack as the dump
+   files it takes the room of */
+};
+
+typedef struct spool_scan_st SpoolScan;
+
+/**
+ * Resets the shared counts.
+ */
+void spool_stats_init(SpoolStats *stats);
+
+/**
+ * Allocates a writer for a process, with no flushing until #spool_configure.
+ *
+ * @param dir The spool directory, with or without a trailing slash
+ * @param stats The shared counts
+ * @return A malloc'd handle to be freed with #spool_cleanup, or NULL
+ */
+Spool* spool_init(const char *dir, SpoolStats *stats);
+
+/**
+ * Applies the durability tunables. Files waiting under the old policy are
+ * flushed if the new one is #SPOOL_SYNC_NONE, and otherwise wait as before.
+ *
+ * @param sync One of the SPOOL_SYNC_* policies
+ * @param sync_ms Milliseconds a dump file may wait for a flush
+ * @param group Files waiting that force a flush, under #SPOOL_SYNC_GROUP
+ */
+void spool_configure(Spool *s, uint32_t sync, uint32_t sync_ms,
+    uint32_t group);
+
+/**
+ * Writes a buffer to a new dump file, and flushes the files waiting if that
+ * is due.
+ *
+ * @param s The writer
+ * @param b The buffer to write
+ * @return 0 if the file was written, -1 with errno set otherwise. A failed
+ * flush is counted in the SpoolStats, not returned.
+ */
+int spool_write(Spool *s, const Buffer *b);
+
+/**
+ * Flushes the files waiting if that is due. Meant to be called once per pass
+ * of the consumer and relay, so that files are flushed on time when no more
+ * are written; it returns at once if none are waiting.
+ */
+void spool_tick(Spool *s);
+
+/**
+ * Flushes the files waiting now, whatever the policy.
+ */
+void spool_flush(Spool *s);
+
+/**
+ * Lists the oldest dump files and packs in the spool, by the time in their
+ * names, and counts the dump files in all of it. Unfinished dump files older
+ * than #SPOOL_STALE_AGE are deleted on the way.
+ *
+ * @param s The scan, all zero before the first one
+ * @param dir The spool directory, ending in a slash
+ * @return The number of files listed, up to #SPOOL_SCAN_MAX, or -1 if the
+ * directory cannot be read
+ */
+int spool_scan(SpoolScan *s, const char *dir);
+
+/**
+ * Closes the directory a scan keeps open.
+ */
+void spool_scan_close(SpoolScan *s);
+
+/**
+ * Checks whether the spool has room for another dump file under its quota.
+ *
+ * @param files The number of dump files in the spool
+ * @param quota_mb The most megabytes of dump files allowed, 0 for no limit
+ * @return Non-zero if there is room
+ */
+int spool_has_room(uint32_t files, uint32_t quota_mb);
+
+/**
+ * Writes the counts as a line of the metrics snapshot.
+ */
+void spool_print(const SpoolStats *stats, FILE *out);
+
+/**
+ * Flushes the files waiting and frees the writer. The specified handle will
+ * be NULL after this function returns.
+ */
+void spool_cleanup(Spool **s);
+
+#endif
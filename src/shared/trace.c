@@ -0,0 +1,105 @@
+/**
+ * @file trace.c
+ * Implementation of the binary event trace
+ * @see trace.h
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/** Size of the mapped trace file */
+#define TRACE_FILE_SIZE \
+  (sizeof(TraceHeader) + TRACE_RECORDS * sizeof(TraceRecord))
+
+TraceHeader *trace_ring = NULL;
+
+/** This process's id, cached since getpid() is a system call */
+static uint16_t trace_pid;
+
+static void trace_forked();
+static uint64_t now_ns(clockid_t clock);
+
+/**
+ * Creates and maps a trace file
+ * @see trace.h
+ */
+int trace_open(const char *path) {
+  TraceHeader *h;
+  int fd;
+
+  if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+    return -1;
+  if (ftruncate(fd, TRACE_FILE_SIZE) < 0) {
+    close(fd);
+    return -1;
+  }
+  h = (TraceHeader*) mmap(NULL, TRACE_FILE_SIZE, PROT_READ | PROT_WRITE,
+      MAP_SHARED, fd, 0);
+  close(fd);
+  if (h == MAP_FAILED )
+    return -1;
+
+  memset(h, 0, sizeof *h);
+  h->version = TRACE_VERSION;
+  h->record_size = sizeof(TraceRecord);
+  h->records = TRACE_RECORDS;
+  h->start_mono = now_ns(CLOCK_MONOTONIC);
+  h->start_real = now_ns(CLOCK_REALTIME);
+  __sync_synchronize();
+  h->magic = TRACE_MAGIC;
+  trace_ring = h;
+  trace_pid = getpid();
+  pthread_atfork(NULL, NULL, &trace_forked);
+  return 0;
+}
+
+/**
+ * Records an event
+ * @see trace.h
+ */
+void trace_event(int event, uint64_t a, uint64_t b) {
+  TraceRecord *ring = (TraceRecord*) (trace_ring + 1);
+  uint32_t idx = __sync_fetch_and_add(&trace_ring->head, 1);
+  TraceRecord *rec = &ring[idx & (TRACE_RECORDS - 1)];
+
+  rec->seq = 0;
+  __sync_synchronize();
+  rec->time = now_ns(CLOCK_MONOTONIC);
+  rec->event = event;
+  rec->pid = trace_pid;
+  rec->a = a;
+  rec->b = b;
+  __sync_synchronize();
+  rec->seq = idx + 1;
+}
+
+/**
+ * Unmaps the trace file
+ * @see trace.h
+ */
+void trace_close() {
+  if (trace_ring == NULL )
+    return;
+  munmap(trace_ring, TRACE_FILE_SIZE);
+  trace_ring = NULL;
+}
+
+/** Keeps the cached process id right in forked children. */
+static void trace_forked() {
+  trace_pid = getpid();
+}
+
+/** The time on the given clock, in nanoseconds. */
+static uint64_t now_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,117 @@
+/**
+ * @file trace.h
+ * Binary event trace shared by the consumer and relay.
+ *
+ * Logging every read and every upload with printf disturbs the timing it is
+ * meant to show, so the hot paths record fixed-size binary events in a ring
+ * instead. The ring lives in a file mapped by both processes: writers claim a
+ * slot with one atomic increment and never block each other, and the file can
+ * be decoded at any time, including after a crash, with the tracedump tool.
+ *
+ * Each slot holds a TraceRecord. A writer clears the slot's sequence number,
+ * fills in the record and then sets the sequence number to one more than the
+ * slot's index in the stream of events, so a reader can tell complete records
+ * from ones being written or already overwritten. Records are in host byte
+ * order.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#ifndef _SHARED_TRACE_H
+#define _SHARED_TRACE_H
+
+#include <stdint.h>
+
+/** Marks the start of a trace file ("TRCE") */
+#define TRACE_MAGIC 0x45435254
+/** Version of the format described here */
+#define TRACE_VERSION 1
+/** Number of records in the ring, a power of two */
+#define TRACE_RECORDS 16384
+
+/** Events recorded, and what their arguments hold */
+enum trace_event {
+  TRACE_READ = 1, /**< Consumer read: bytes read, buffer fill before it */
+  TRACE_SWITCH, /**< Consumer switched buffers: new index, bytes carried */
+  TRACE_DUMP, /**< Consumer dumped a buffer: index, dumps since notify */
+  TRACE_UPLOAD, /**< Relay request succeeded: bytes, microseconds */
+  TRACE_UPLOAD_FAIL, /**< Relay request failed: curl code, microseconds */
+  TRACE_RELEASE, /**< Relay handed a buffer back: index, stream sequence */
+  TRACE_FRAME, /**< Relay sent a stream frame: sequence, bytes */
+  TRACE_ACK, /**< Relay received a stream ACK: sequence, frames in flight */
+  TRACE_BATCH, /**< Relay sent a batch of dump files: files, bytes */
+  TRACE_CRC_ERROR, /**< Relay found corrupt data: buffer index or -1, crc */
+  TRACE_OVERFLOW_WARN, /**< Consumer projected overflow: ms, bytes held */
+  TRACE_SPOOL, /**< Relay spooled a buffer early: index, ms to overflow */
+  TRACE_FAILOVER, /**< Relay took over: buffers reclaimed, microseconds */
+  TRACE_COMPACT, /**< Relay packed dump files: files, bytes of pack */
+  TRACE_RESYNC, /**< Relay lost the Firefly's packets: last sequence, packets */
+  TRACE_CODEC, /**< Relay changed the live codec: codec, bytes per second */
+  TRACE_BATCH_SIZE, /**< Relay changed the live batch: buffers, round trip us */
+  TRACE_EVENTS /**< Number of event types, plus one */
+};
+
+/**
+ * One event.
+ */
+struct trace_record_st {
+  uint64_t time; /**< CLOCK_MONOTONIC time of the event, in nanoseconds */
+  uint32_t seq; /**< Index of the event plus one, or 0 while being written */
+  uint16_t event; /**< One of enum trace_event */
+  uint16_t pid; /**< Low bits of the recording process id */
+  uint64_t a; /**< First argument */
+  uint64_t b; /**< Second argument */
+};
+
+typedef struct trace_record_st TraceRecord;
+
+/**
+ * The header at the start of a trace file, followed by the ring.
+ */
+struct trace_header_st {
+  uint32_t magic; /**< Always #TRACE_MAGIC */
+  uint16_t version; /**< #TRACE_VERSION */
+  uint16_t record_size; /**< sizeof(TraceRecord) */
+  uint32_t records; /**< Number of records in the ring */
+  uint32_t head; /**< Number of events claimed so far */
+  uint64_t start_mono; /**< CLOCK_MONOTONIC time the trace was created */
+  uint64_t start_real; /**< CLOCK_REALTIME time the trace was created */
+  uint8_t reserved[32];
+};
+
+typedef struct trace_header_st TraceHeader;
+
+/** The mapped trace file, or NULL when tracing is off */
+extern TraceHeader *trace_ring;
+
+/**
+ * Records an event if tracing is on. The arguments are only evaluated when it
+ * is.
+ */
+#define TRACE(event, a, b) \
+  do { \
+    if (trace_ring != NULL) \
+      trace_event((event), (uint64_t) (a), (uint64_t) (b)); \
+  } while (0)
+
+/**
+ * Creates a trace file and maps it, turning tracing on. Call before forking,
+ * so that both processes record into the same ring.
+ *
+ * @param path The trace file, which is replaced if it exists
+ * @return 0 if successful, -1 otherwise
+ */
+int trace_open(const char *path);
+
+/**
+ * Records an event. Use #TRACE instead, which skips the call when tracing is
+ * off.
+ */
+void trace_event(int event, uint64_t a, uint64_t b);
+
+/**
+ * Unmaps the trace file, turning tracing off in this process.
+ */
+void trace_close();
+
+#endif
@@ -0,0 +1,169 @@
+/**
+ * @file adapt_test.c
+ * Behaviour test of the codec controller.
+ *
+ * Drives the controller (see adapt.h) the way the relay's encode and
+ * transmit stages do: choose a codec for a buffer, record how it encoded at a
+ * fixed ratio per codec, and record its upload over a link of a given speed.
+ * Each scenario is a list of phases of so many buffers, each with a link
+ * speed, a share of the CPU left idle, and whether the buffers are backing
+ * up, and the codecs chosen are checked buffer by buffer against the expected
+ * sequence:
+ *
+ *   - fast: a link with plenty of room keeps buffers raw.
+ *   - congested, slow: the controller steps up, a codec at a time and only
+ *     after #ADAPT_DWELL_UP buffers at each, until the link has room.
+ *   - hysteresis: with the link between #ADAPT_UP and #ADAPT_DOWN times what
+ *     the cheaper codec would send, the codec stays put; only once the
+ *     smoothed throughput passes #ADAPT_DOWN does it step down.
+ *   - dwell: the link speeds up right after a change, and the controller
+ *     waits #ADAPT_DWELL_DOWN buffers at each codec before stepping down.
+ *   - pressure, full: overflow at risk, or every pipeline slot in use, steps
+ *     up however fast the link is, and the controller steps back down once
+ *     it clears.
+ *   - cpu: with the CPU short it does not step up, and steps down as soon
+ *     as the cheaper codec fits.
+ *
+ * The CPU is not sampled: the idle share is set by each phase. A line of
+ * key=value pairs is printed for each scenario; the exit status is non-zero
+ * on any mismatch.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../relay/adapt.h"
+
+/** Bytes in each buffer */
+#define BUFFER 32768
+/** Bytes buffered per second */
+#define DEMAND 1000000
+/** Pipeline slots */
+#define LIMIT 4
+/** Phases in a scenario, at most */
+#define PHASES 4
+/** Buffers in a scenario, at most */
+#define BUFFERS 64
+
+/** Bytes each codec sends per byte buffered */
+static const double ratio[CODEC_LEVELS] = { 1.0, 0.6, 0.5 };
+/** Letters standing for each codec in the expected sequences */
+static const char letter[CODEC_LEVELS] = { 'r', 'd', 'b' };
+
+/**
+ * A stretch of buffers under the same conditions.
+ */
+struct phase_st {
+  int buffers;
+  double link; /**< Bytes per second uploads run at */
+  double idle; /**< Share of the CPU left idle */
+  int at_risk; /**< Set if overflow is projected within the horizon */
+  int full; /**< Set if every pipeline slot is in use */
+};
+
+typedef struct phase_st Phase;
+
+/**
+ * A scenario and the codecs it should choose, a letter per buffer.
+ */
+struct scenario_st {
+  const char *name;
+  Phase phase[PHASES];
+  const char *expect;
+};
+
+typedef struct scenario_st Scenario;
+
+static const Scenario scenarios[] = {
+  { "fast", { { 40, 10e6, 1, 0, 0 } },
+    "rrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrrr" },
+  { "congested", { { 40, 1.1e6, 1, 0, 0 } },
+    "rrdddddddddddddddddddddddddddddddddddddd" },
+  { "slow", { { 40, 0.6e6, 1, 0, 0 } },
+    "rrddbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb" },
+  { "hysteresis", { { 20, 1.1e6, 1, 0, 0 }, { 20, 1.6e6, 1, 0, 0 },
+    { 20, 3e6, 1, 0, 0 } },
+    "rrdddddddddddddddddd" "dddddddddddddddddddd" "ddrrrrrrrrrrrrrrrrrr" },
+  { "dwell", { { 5, 0.6e6, 1, 0, 0 }, { 30, 100e6, 1, 0, 0 } },
+    "rrddb" "bbbbbbbddddddddrrrrrrrrrrrrrrr" },
+  { "pressure", { { 12, 10e6, 1, 1, 0 }, { 20, 10e6, 1, 0, 0 } },
+    "rrddbbbbbbbb" "ddddddddrrrrrrrrrrrr" },
+  { "full", { { 12, 10e6, 1, 0, 1 }, { 20, 10e6, 1, 0, 0 } },
+    "rrddbbbbbbbb" "ddddddddrrrrrrrrrrrr" },
+  { "cpu", { { 20, 1.1e6, 0.1, 0, 0 }, { 10, 1.1e6, 1, 0, 0 },
+    { 10, 2e6, 0.1, 0, 0 } },
+    "rrrrrrrrrrrrrrrrrrrr" "dddddddddd" "drrrrrrrrr" },
+};
+
+static int run(const Scenario *sc);
+
+/**
+ * Main entrypoint into the controller test.
+ */
+int main(int argc, char *argv[]) {
+  size_t i;
+  int failed = 0;
+
+  for (i = 0; i < sizeof scenarios / sizeof scenarios[0]; ++i)
+    if (run(&scenarios[i]) != 0)
+      failed = 1;
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Runs a scenario on a new controller and checks the codecs it chose.
+ *
+ * @return 0 if they are as expected
+ */
+static int run(const Scenario *sc) {
+  char chose[BUFFERS + 1];
+  unsigned long changes = 0;
+  Occupancy occ;
+  Adapt *a;
+  int p, i, n = 0, bad;
+
+  if ((a = adapt_init()) == NULL ) {
+    fprintf(stderr, "adapt_init failed\n");
+    return 1;
+  }
+  /* Keeps the controller from sampling the CPU */
+  a->cpu_at = time(NULL ) + 86400;
+  memset(&occ, 0, sizeof occ);
+  occ.capacity = 2 * BUFFER;
+  occ.fill_rate = DEMAND;
+
+  for (p = 0; p < PHASES && sc->phase[p].buffers > 0; ++p) {
+    const Phase *ph = &sc->phase[p];
+    occ.held = ph->at_risk ? occ.capacity : 0;
+    occ.overflow_ms = ph->at_risk ? OCCUPANCY_HORIZON_MS / 2 : -1;
+    for (i = 0; i < ph->buffers && n < BUFFERS; ++i) {
+      size_t out;
+      int codec;
+
+      a->idle = ph->idle;
+      codec = adapt_choose(a, &occ, ph->full ? LIMIT : 1, LIMIT);
+      if (n > 0 && letter[codec] != chose[n - 1])
+        ++changes;
+      chose[n++] = letter[codec];
+      out = BUFFER * ratio[codec];
+      adapt_encoded(a, codec, BUFFER, out, 0.001);
+      adapt_sent(a, out, out / ph->link);
+    }
+  }
+  chose[n] = '\0';
+
+  bad = strcmp(chose, sc->expect) != 0 || a->changes != changes
+      || a->chosen[CODEC_RAW] + a->chosen[CODEC_DELTA]
+          + a->chosen[CODEC_BEST] != (unsigned long) n;
+  printf("scenario=%s buffers=%d changes=%lu raw=%lu delta=%lu best=%lu "
+      "result=%s\n", sc->name, n, a->changes, a->chosen[CODEC_RAW],
+      a->chosen[CODEC_DELTA], a->chosen[CODEC_BEST], bad ? "FAIL" : "ok");
+  if (bad)
+    printf("  expected %s\n  chose    %s\n", sc->expect, chose);
+  adapt_cleanup(&a);
+  return bad;
+}
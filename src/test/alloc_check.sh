@@ -0,0 +1,128 @@
+#!/bin/sh
+#
+# Allocation check: runs a client built with ALLOC_COUNT=1 (see
+# src/shared/alloc.h) against the stand-in server, past the warm-up, through
+# a reload that grows the read size and buffer capacity, a server outage that
+# makes it dump buffers to the spool, the upload of that backlog and a drain,
+# and fails if either process allocated once warm.
+#
+# The client is run twice, with raw uploads and with decimation and the
+# changes feature mode, so that the consumer's decimator and the relay's
+# suppressor see the reload too.
+#
+#     make alloc-check
+#     src/test/alloc_check.sh [BIN_DIR [WORK_DIR [PORT]]]
+#
+# @authors Larson, Patrick; Pickett, Cameron
+
+BIN=${1:-bin}
+WORK=${2:-/tmp/alloc_check}
+PORT=${3:-18091}
+SERVER=http://127.0.0.1:$PORT/
+
+writer=
+standin=
+client=
+
+fail() {
+  echo "alloc-check: $*" >&2
+  cleanup
+  echo "result=FAIL"
+  exit 1
+}
+
+cleanup() {
+  for p in $client $standin $writer; do
+    kill $p 2>/dev/null
+  done
+  wait 2>/dev/null
+  client= standin= writer=
+}
+
+start_standin() {
+  "$BIN/x86_standin" -p $PORT -o "$WORK/store" >>"$WORK/standin.log" 2>&1 &
+  standin=$!
+  sleep 1
+}
+
+stop_standin() {
+  kill $standin
+  wait $standin 2>/dev/null
+  standin=
+}
+
+# Writes the client's config file; a reload rewrites it
+configure() {
+  cat >"$WORK/client.conf" <<EOF
+read_size = $1
+read_wait_us = 1000
+buffer_capacity = $2
+retry_wait_ms = 500
+server = $SERVER
+EOF
+}
+
+# Runs the client once with the given extra options
+run() {
+  name=$1
+  shift
+  rm -rf "$WORK/spool" "$WORK/store"
+  mkdir -p "$WORK/spool" "$WORK/store"
+  rm -f "$WORK/source"
+  mkfifo "$WORK/source" || fail "cannot make $WORK/source"
+  log="$WORK/client-$name.log"
+
+  start_standin
+  configure 1024 32768
+  # Random samples, about 2 MB/s, for as long as the client reads them
+  (while head -c 65536 /dev/urandom; do sleep 0.03; done) \
+      >"$WORK/source" 2>/dev/null &
+  writer=$!
+  "$BIN/x86_client" -d "$WORK/source" -e "$WORK/spool" \
+      -C "$WORK/client.conf" "$@" >"$log" 2>&1 &
+  client=$!
+
+  # Past the warm-up of both processes
+  sleep 7
+  kill -0 $client 2>/dev/null || fail "$name: client exited early, see $log"
+
+  # Larger reads and buffers than at start, the largest read allowed
+  configure 16384 98304
+  kill -HUP $client
+  sleep 3
+  grep -q "Configuration reloaded" "$log" || fail "$name: reload not applied"
+
+  # An outage, long enough for both buffers to fill and be dumped
+  stop_standin
+  sleep 4
+  dumps=$(ls "$WORK/spool" | grep -c '^client-')
+  [ "$dumps" -gt 0 ] || fail "$name: nothing was dumped during the outage"
+
+  # The backlog goes up alongside live buffers, then the client drains
+  start_standin
+  sleep 5
+  kill -TERM $client 2>/dev/null
+  wait $client
+  status=$?
+  client=
+  kill $writer 2>/dev/null
+  wait $writer 2>/dev/null
+  writer=
+  stop_standin
+
+  if grep "allocations after warm-up" "$log" >&2; then
+    fail "$name: allocated once warm, see $log"
+  fi
+  [ $status -eq 0 ] || fail "$name: client exited with status $status"
+  echo "run=$name dumps=$dumps result=ok"
+}
+
+trap 'cleanup; exit 1' INT TERM
+mkdir -p "$WORK" || exit 1
+rm -f "$WORK/standin.log"
+[ -x "$BIN/x86_client" ] && [ -x "$BIN/x86_standin" ] \
+    || fail "build with make ALLOC_COUNT=1 x86 tools first"
+
+run raw -s "$SERVER"
+run changes -s "$SERVER" -D 4 -f changes
+echo "result=ok"
@@ -0,0 +1,149 @@
+#!/bin/sh
+#
+# Batch sizing check: runs the client against the stand-in server with the
+# live batch bounds (see src/relay/batch.h) set two ways, and fails if the
+# request sizes in the relay's "batch" metrics line stray outside them.
+#
+#   - floor: batch_min = batch_max = 3 on a quick link. Requests wait for
+#     three buffers, and only one that gave up waiting after batch_wait_ms
+#     may hold fewer. The samples the stand-in appended to live.dat must be
+#     the start of those the client read.
+#   - cap: batch_max = 2 and batch_efficiency = 99, with the stand-in slow
+#     to answer so that sealed buffers queue up. The controller must aim for
+#     two buffers and send requests of two, but never more.
+#
+#     make test
+#     src/test/batch_check.sh [BIN_DIR [WORK_DIR [PORT]]]
+#
+# @authors Larson, Patrick; Pickett, Cameron
+
+BIN=${1:-bin}
+WORK=${2:-/tmp/batch_check}
+PORT=${3:-18093}
+SERVER=http://127.0.0.1:$PORT/
+CAPACITY=32768
+WAIT_MS=500
+
+writer=
+standin=
+client=
+
+fail() {
+  echo "batch-check: $*" >&2
+  cleanup
+  echo "result=FAIL"
+  exit 1
+}
+
+cleanup() {
+  for p in $client $standin $writer; do
+    kill $p 2>/dev/null
+  done
+  wait 2>/dev/null
+  client= standin= writer=
+}
+
+# Prints one field of the metrics line starting with the given word
+metric() {
+  sed -n "/^$1 /p" "$WORK/metrics" | tr ' ' '\n' | sed -n "s/^$2=//p"
+}
+
+# Prints the requests sent of more buffers than the given number
+larger() {
+  sed -n "/^batch /p" "$WORK/metrics" | tr ' ' '\n' \
+      | sed -n "s/^of\([0-9]*\)=/\1 /p" \
+      | awk -v n=$1 '$1 > n { sum += $2 } END { print sum + 0 }'
+}
+
+# Runs the client for the given seconds reading the given command's output,
+# against a stand-in given the options after them
+run() {
+  name=$1 seconds=$2 source=$3
+  shift 3
+  rm -rf "$WORK/spool" "$WORK/store"
+  mkdir -p "$WORK/spool" "$WORK/store"
+  rm -f "$WORK/source" "$WORK/metrics"
+  mkfifo "$WORK/source" || fail "cannot make $WORK/source"
+  log="$WORK/client-$name.log"
+
+  "$BIN/x86_standin" -p $PORT -o "$WORK/store" "$@" \
+      >>"$WORK/standin.log" 2>&1 &
+  standin=$!
+  sleep 1
+  # Kept open after the data, so the client does not see the end of it
+  ($source; sleep 60) >"$WORK/source" 2>/dev/null &
+  writer=$!
+  "$BIN/x86_client" -d "$WORK/source" -e "$WORK/spool" \
+      -C "$WORK/client.conf" -m "$WORK/metrics" >"$log" 2>&1 &
+  client=$!
+
+  sleep $seconds
+  kill -TERM $client 2>/dev/null
+  wait $client
+  status=$?
+  client=
+  kill $writer 2>/dev/null
+  wait $writer 2>/dev/null
+  writer=
+  kill $standin
+  wait $standin 2>/dev/null
+  standin=
+
+  [ $status -eq 0 ] || fail "$name: client exited with status $status"
+  # The relay writes its metrics once more after draining
+  target=$(metric batch target)
+  requests=$(metric batch requests)
+  [ -n "$target" ] && [ -n "$requests" ] \
+      || fail "$name: no batch line in the metrics"
+  [ "$requests" -gt 0 ] || fail "$name: no live requests sent"
+  echo "run=$name $(sed -n 's/^batch //p' "$WORK/metrics")"
+}
+
+trap 'cleanup; exit 1' INT TERM
+mkdir -p "$WORK" || exit 1
+rm -f "$WORK/standin.log"
+[ -x "$BIN/x86_client" ] && [ -x "$BIN/x86_standin" ] \
+    || fail "build with make x86 tools first"
+
+# About three seconds of samples at the rate below
+head -c 3000000 /dev/urandom >"$WORK/data"
+cat >"$WORK/client.conf" <<EOF
+read_size = 4096
+read_wait_us = 2000
+buffer_capacity = $CAPACITY
+batch_min = 3
+batch_max = 3
+batch_wait_ms = $WAIT_MS
+server = $SERVER
+EOF
+run floor 6 "cat $WORK/data"
+[ "$target" -eq 3 ] || fail "floor: target $target, not 3"
+[ "$(larger 3)" -eq 0 ] || fail "floor: requests of more than 3 buffers"
+short=$(metric batch short)
+[ $(($(metric batch of1) + $(metric batch of2))) -le "$short" ] \
+    || fail "floor: requests of fewer than 3 buffers that did not wait"
+[ "$(metric batch holds)" -gt 0 ] || fail "floor: no request waited"
+waited=$(metric batch wait_ms | cut -d. -f1)
+[ "$waited" -le $((requests * WAIT_MS)) ] \
+    || fail "floor: requests waited $waited ms, over $WAIT_MS ms each"
+# What was not sent live was left in the buffers and spooled on the way out
+live=$(stat -c %s "$WORK/store/live.dat" 2>/dev/null || echo 0)
+[ "$live" -ge $((3000000 - 2 * CAPACITY)) ] \
+    || fail "floor: only $live bytes uploaded live"
+cmp -s -n "$live" "$WORK/data" "$WORK/store/live.dat" \
+    || fail "floor: live.dat is not what the client read"
+
+cat >"$WORK/client.conf" <<EOF
+read_size = 16384
+read_wait_us = 2000
+buffer_capacity = $CAPACITY
+batch_min = 1
+batch_max = 2
+batch_efficiency = 99
+server = $SERVER
+EOF
+run cap 5 "cat /dev/urandom" -d 10
+[ "$target" -eq 2 ] || fail "cap: target $target, not 2"
+[ "$(larger 2)" -eq 0 ] || fail "cap: requests of more than 2 buffers"
+[ "$(metric batch of2)" -gt 0 ] || fail "cap: no request of 2 buffers"
+echo "result=ok"
@@ -0,0 +1,187 @@
+/**
+ * @file decimate_test.c
+ * Correctness test of the consumer's decimation stage.
+ *
+ * Runs decimator_process (see decimate.h) over a stream of random samples
+ * for a few filters, and checks that:
+ *
+ *   - its output, in one call, is that of a direct FIR filter computed in
+ *     double precision with the decimator's own Q15 taps, rounded and
+ *     clipped the same way, sample for sample;
+ *   - fed the same stream in reads of random sizes, odd ones included, it
+ *     gives the same output byte for byte;
+ *   - a read of a single byte gives nothing and the byte is carried into
+ *     the next read.
+ *
+ * The stream is full scale, so that filters with gain clip. `make test`
+ * builds it twice, with the SSE2 dot product and with DECIMATE_SCALAR, the
+ * one the board runs, and runs both. Each filter gives a line of key=value
+ * pairs; the exit status is non-zero on any mismatch.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../consumer/decimate.h"
+#include "../shared/config.h"
+
+/** Bytes in the test stream, the most one call may take */
+#define STREAM_BYTES CONFIG_READ_MAX
+/** Times the stream is fed in random reads */
+#define SPLITS 20
+
+/**
+ * A test filter.
+ */
+struct filter_st {
+  const char *name;
+  int factor;
+  int taps; /**< 0 for the default design */
+  double gain; /**< Sum of the absolute values of random taps, 0 for the
+   default design */
+};
+
+typedef struct filter_st Filter;
+
+static const Filter filters[] = {
+  { "identity", 1, 1, 1.0 },
+  { "default-4", 4, 0, 0 },
+  { "default-64", 64, 0, 0 },
+  { "random-7x61", 7, 61, 1.2 },
+  { "clipping-3x40", 3, 40, 1.95 },
+  { "long-16x512", 16, 512, 0.9 },
+};
+
+static uint32_t seed = 12345;
+
+static uint32_t next(void);
+static size_t reference(const Decimator *d, const unsigned char *in,
+    int16_t *out);
+
+/**
+ * Main entrypoint into the decimation test.
+ */
+int main(int argc, char *argv[]) {
+  static unsigned char stream[STREAM_BYTES];
+  static char whole[STREAM_BYTES], piece[STREAM_BYTES],
+      split[STREAM_BYTES];
+  static int16_t ref[STREAM_BYTES / 2];
+  double coef[DECIMATE_TAPS_MAX];
+  size_t i, j, n, len;
+  int failed = 0;
+
+  for (i = 0; i < STREAM_BYTES; ++i)
+    stream[i] = next() >> 24;
+
+  for (i = 0; i < sizeof filters / sizeof filters[0]; ++i) {
+    const Filter *f = &filters[i];
+    unsigned long ref_bad = 0, split_bad = 0, carry_bad = 0;
+    Decimator *d;
+    double sum = 0;
+    int k;
+
+    /* Random taps, scaled to the gain wanted, on the Q15 grid */
+    for (k = 0; k < f->taps; ++k)
+      sum += fabs(coef[k] = (int32_t) (next() >> 16) - 32768);
+    for (k = 0; k < f->taps; ++k)
+      coef[k] = floor(coef[k] * f->gain / sum * 32768) / 32768;
+    if ((d = decimator_init(f->factor, f->taps == 0 ? NULL : coef,
+        f->taps)) == NULL ) {
+      fprintf(stderr, "%s: decimator_init failed\n", f->name);
+      return EXIT_FAILURE;
+    }
+
+    /* In one call, against the reference */
+    memcpy(whole, stream, STREAM_BYTES);
+    len = decimator_process(d, whole, STREAM_BYTES);
+    n = reference(d, stream, ref);
+    if (len != n * 2)
+      ref_bad = n + 1;
+    else
+      for (j = 0; j < n; ++j)
+        if ((int16_t) ((unsigned char) whole[2 * j]
+            | (unsigned char) whole[2 * j + 1] << 8) != ref[j])
+          ++ref_bad;
+    decimator_cleanup(&d);
+
+    /* In random reads, against the one call */
+    for (k = 0; k < SPLITS; ++k) {
+      size_t at = 0, out = 0, most = 1 + next() % 4096;
+      d = decimator_init(f->factor, f->taps == 0 ? NULL : coef, f->taps);
+      while (at < STREAM_BYTES) {
+        size_t take = 1 + next() % most;
+        int half = d->pending >= 0;
+        if (take > STREAM_BYTES - at)
+          take = STREAM_BYTES - at;
+        memcpy(piece, stream + at, take);
+        n = decimator_process(d, piece, take);
+        /* Half a sample is left over after an odd number of bytes in all */
+        if ((d->pending >= 0) != ((half + take) % 2 == 1))
+          ++carry_bad;
+        if (out + n > STREAM_BYTES)
+          break;
+        memcpy(split + out, piece, n);
+        out += n;
+        at += take;
+      }
+      if (out != len || memcmp(split, whole, len) != 0)
+        ++split_bad;
+      decimator_cleanup(&d);
+    }
+
+    /* A lone byte gives nothing, and completes the next read's first sample */
+    d = decimator_init(f->factor, f->taps == 0 ? NULL : coef, f->taps);
+    memcpy(piece, stream, STREAM_BYTES);
+    if (decimator_process(d, piece, 1) != 0 || d->pending != stream[0])
+      ++carry_bad;
+    memcpy(piece, stream + 1, STREAM_BYTES - 1);
+    n = decimator_process(d, piece, STREAM_BYTES - 1);
+    if (n != len || memcmp(piece, whole, len) != 0)
+      ++carry_bad;
+    decimator_cleanup(&d);
+
+    printf("filter=%s factor=%d outputs=%zu reference_mismatches=%lu "
+        "split_mismatches=%lu carry_errors=%lu result=%s\n", f->name,
+        f->factor, len / 2, ref_bad, split_bad, carry_bad,
+        ref_bad + split_bad + carry_bad == 0 ? "ok" : "FAIL");
+    if (ref_bad + split_bad + carry_bad > 0)
+      failed = 1;
+  }
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/** A linear congruential generator, the same on every machine. */
+static uint32_t next(void) {
+  seed = seed * 1664525u + 1013904223u;
+  return seed;
+}
+
+/**
+ * Filters the stream directly in double precision with the decimator's
+ * taps, keeping every factor'th output from the first, as the decimator
+ * does from a zero history.
+ *
+ * @return The number of outputs
+ */
+static size_t reference(const Decimator *d, const unsigned char *in,
+    int16_t *out) {
+  size_t samples = STREAM_BYTES / 2, n = 0, m;
+  int j;
+
+  for (m = 0; m < samples; m += d->factor) {
+    double acc = 0, y;
+    for (j = 0; j < d->padded && (size_t) j <= m; ++j) {
+      size_t at = 2 * (m - j);
+      acc += d->coef[d->padded - 1 - j]
+          * (double) (int16_t) (in[at] | in[at + 1] << 8);
+    }
+    y = floor(acc / 32768 + 0.5);
+    out[n++] = y > 32767 ? 32767 : y < -32768 ? -32768 : y;
+  }
+  return n;
+}
@@ -0,0 +1,322 @@
+/**
+ * @file firefly_test.c
+ * Correctness test of the Firefly packet parser and unpacking.
+ *
+ * Builds streams of packets (see firefly.h) with random samples and counts
+ * and a sequence number that wraps, and checks that firefly_parse gives
+ * exactly the samples of the packets that should survive, with the
+ * statistics to match:
+ *
+ *   - clean: packets back to back.
+ *   - garbage: runs of random bytes and false packet headers before and
+ *     between packets, which must all be skipped and the parser resync on
+ *     the next packet.
+ *   - checksum: packets with a sample or a checksum byte changed, which must
+ *     be rejected, and a packet missing altogether, which must count as lost.
+ *
+ * Each stream is parsed in one call, split in two at every byte of its first
+ * packets, so that a packet is cut at every point, and in reads of random
+ * sizes, single bytes included; the output must be the same every way.
+ * firefly_unpack is also checked on every 12-bit value, in both halves of a
+ * group, and on runs of pairs of every length up to a few and at every
+ * alignment, against a field-by-field reference. `make test` builds it
+ * twice, with the 64-bit SWAR unpacking and with FIREFLY_SCALAR, the one the
+ * board runs, and runs both. Each check gives a line of key=value pairs; the
+ * exit status is non-zero on any mismatch.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../relay/firefly.h"
+
+/** Packets in each stream */
+#define PACKETS 300
+/** Largest stream, with garbage before every packet */
+#define STREAM_MAX (PACKETS * (FIREFLY_PACKET_MAX + 64))
+/** Bytes of each stream split in two at every point */
+#define SPLIT_BYTES 400
+/** Times each stream is parsed in reads of random sizes */
+#define SPLITS 20
+/** Largest of those reads */
+#define READ_MAX 300
+
+/**
+ * A test stream and what should be found in it.
+ */
+struct stream_st {
+  const char *name;
+  uint8_t data[STREAM_MAX];
+  size_t len;
+  int16_t expect[PACKETS * FIREFLY_SAMPLES_MAX];
+  size_t samples;
+  unsigned long packets; /**< Packets that should be found */
+  unsigned long long skipped; /**< Bytes that should be skipped */
+  unsigned long resyncs; /**< Times the parser should lose the packets */
+  unsigned long lost; /**< Packets that should count as lost */
+  unsigned long bad; /**< Fewest packets that should fail the checksum */
+};
+
+typedef struct stream_st Stream;
+
+static uint32_t seed = 12345;
+
+static uint32_t next();
+static void build(Stream *s, int garbage, int corrupt);
+static size_t put_packet(Stream *s, int seq, int keep);
+static void put_garbage(Stream *s, size_t n);
+static int check_stream(const Stream *s);
+static size_t parse(const Stream *s, const size_t *cuts, size_t ncuts,
+    int16_t *out, Firefly **f);
+static int check_unpack();
+
+/**
+ * Main entrypoint into the Firefly test.
+ */
+int main(int argc, char *argv[]) {
+  static Stream s;
+  int failed = 0;
+
+  failed |= check_unpack();
+  s.name = "clean";
+  build(&s, 0, 0);
+  failed |= check_stream(&s);
+  s.name = "garbage";
+  build(&s, 1, 0);
+  failed |= check_stream(&s);
+  s.name = "checksum";
+  build(&s, 0, 1);
+  failed |= check_stream(&s);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/** Steps the test's random number generator */
+static uint32_t next() {
+  seed = seed * 1664525u + 1013904223u;
+  return seed >> 8;
+}
+
+/**
+ * Builds a stream of #PACKETS packets, with garbage before each of them, or
+ * with packet 10 and every fortieth after it corrupted, a sample byte or a
+ * checksum byte in turn, and the packet after each one missing.
+ */
+static void build(Stream *s, int garbage, int corrupt) {
+  int seq;
+
+  s->len = s->samples = 0;
+  s->packets = s->skipped = s->resyncs = s->lost = s->bad = 0;
+  for (seq = 0; seq < PACKETS; ++seq) {
+    if (garbage) {
+      size_t before = s->len;
+      put_garbage(s, next() % 64 + 1);
+      s->skipped += s->len - before;
+      if (seq > 0)
+        ++s->resyncs;
+    }
+    if (corrupt && seq % 40 == 10) {
+      size_t at = s->len, len = put_packet(s, seq, 0);
+      /* A sample byte, or the second byte of the checksum */
+      s->data[(seq / 40) % 2 ? at + len - 1 : at + 4] ^= 0x10;
+      s->skipped += len;
+      ++s->resyncs;
+      ++s->bad;
+      /* Lost along with the next one, which is never sent */
+      s->lost += 2;
+      ++seq;
+    } else
+      put_packet(s, seq, 1);
+  }
+}
+
+/**
+ * Appends a packet with random samples, and its samples to those expected
+ * if it is to be kept.
+ *
+ * @return The length of the packet
+ */
+static size_t put_packet(Stream *s, int seq, int keep) {
+  uint8_t *p = s->data + s->len;
+  size_t count = (next() % (FIREFLY_SAMPLES_MAX / 2) + 1) * 2, i, len;
+  uint32_t sum1 = 0, sum2 = 0;
+
+  p[0] = FIREFLY_SYNC0;
+  p[1] = FIREFLY_SYNC1;
+  p[2] = seq & 0xff;
+  p[3] = count;
+  for (i = 0; i < count; i += 2) {
+    uint32_t a = next() & 0xfff, b = next() & 0xfff, x = a | b << 12;
+    p[4 + i / 2 * 3] = x;
+    p[5 + i / 2 * 3] = x >> 8;
+    p[6 + i / 2 * 3] = x >> 16;
+    if (keep) {
+      s->expect[s->samples++] = ((int) a - 2048) * 16;
+      s->expect[s->samples++] = ((int) b - 2048) * 16;
+    }
+  }
+  len = FIREFLY_OVERHEAD + count / 2 * 3;
+  for (i = 2; i < len - 2; ++i) {
+    sum1 = (sum1 + p[i]) % 255;
+    sum2 = (sum2 + sum1) % 255;
+  }
+  p[len - 2] = sum1;
+  p[len - 1] = sum2;
+  s->len += len;
+  if (keep)
+    ++s->packets;
+  return len;
+}
+
+/**
+ * Appends bytes that hold no packet: random ones, bar the first sync byte,
+ * and, half the time, a false packet header at the end, whose checksum the
+ * bytes after it cannot match.
+ */
+static void put_garbage(Stream *s, size_t n) {
+  uint8_t *p = s->data + s->len;
+  size_t i;
+
+  for (i = 0; i < n; ++i)
+    do
+      p[i] = next();
+    while (p[i] == FIREFLY_SYNC0);
+  if (n >= 4 && next() % 2) {
+    p[n - 4] = FIREFLY_SYNC0;
+    p[n - 3] = FIREFLY_SYNC1;
+    p[n - 2] = next();
+    p[n - 1] = FIREFLY_SAMPLES_MAX;
+  }
+  s->len += n;
+}
+
+/**
+ * Parses a stream whole, split at every point of its first bytes, and in
+ * reads of random sizes, and checks the samples and statistics.
+ *
+ * @return 0 if they are as expected
+ */
+static int check_stream(const Stream *s) {
+  static int16_t out[FIREFLY_SAMPLES_BOUND(STREAM_MAX)];
+  static size_t cuts[STREAM_MAX + 1];
+  size_t n, at, i;
+  unsigned long whole_bad = 0, split_bad = 0, read_bad = 0;
+  Firefly *f;
+  int r, bad = 0;
+
+  /* Whole, with the statistics checked */
+  n = parse(s, NULL, 0, out, &f);
+  if (f == NULL )
+    return 1;
+  if (n != s->samples || memcmp(out, s->expect, n * sizeof(int16_t)) != 0
+      || f->packets != s->packets || f->samples != s->samples
+      || f->skipped != s->skipped || f->resyncs != s->resyncs
+      || f->lost != s->lost || f->bad < s->bad || f->held != 0)
+    whole_bad = 1;
+  printf("stream=%s bytes=%lu packets=%lu samples=%llu skipped=%llu "
+      "resyncs=%lu bad=%lu lost=%lu ", s->name, (unsigned long) s->len,
+      f->packets, f->samples, f->skipped, f->resyncs, f->bad, f->lost);
+  firefly_cleanup(&f);
+
+  /* In two reads, cut at every point */
+  for (i = 1; i < SPLIT_BYTES && i < s->len; ++i) {
+    cuts[0] = i;
+    n = parse(s, cuts, 1, out, &f);
+    if (f == NULL )
+      return 1;
+    if (n != s->samples || memcmp(out, s->expect, n * sizeof(int16_t)) != 0
+        || f->packets != s->packets || f->skipped != s->skipped)
+      ++split_bad;
+    firefly_cleanup(&f);
+  }
+
+  /* In reads of random sizes */
+  for (r = 0; r < SPLITS; ++r) {
+    size_t ncuts = 0;
+    for (at = 0; at < s->len; cuts[ncuts++] = at)
+      at += r == 0 ? 1 : next() % READ_MAX + 1;
+    n = parse(s, cuts, ncuts - 1, out, &f);
+    if (f == NULL )
+      return 1;
+    if (n != s->samples || memcmp(out, s->expect, n * sizeof(int16_t)) != 0
+        || f->packets != s->packets || f->skipped != s->skipped)
+      ++read_bad;
+    firefly_cleanup(&f);
+  }
+
+  bad = whole_bad || split_bad > 0 || read_bad > 0;
+  printf("whole_errors=%lu split_errors=%lu read_errors=%lu result=%s\n",
+      whole_bad, split_bad, read_bad, bad ? "FAIL" : "ok");
+  return bad;
+}
+
+/**
+ * Parses a stream on a new parser in reads ending at the given offsets, then
+ * at the end of the stream.
+ *
+ * @param f Set to the parser, or NULL if it could not be made
+ * @return The number of samples written to out
+ */
+static size_t parse(const Stream *s, const size_t *cuts, size_t ncuts,
+    int16_t *out, Firefly **f) {
+  size_t n = 0, at = 0, i;
+
+  if ((*f = firefly_init()) == NULL ) {
+    fprintf(stderr, "firefly_init failed\n");
+    return 0;
+  }
+  for (i = 0; i <= ncuts; ++i) {
+    size_t end = i < ncuts && cuts[i] < s->len ? cuts[i] : s->len;
+    n += firefly_parse(*f, (const char*) s->data + at, end - at, out + n);
+    at = end;
+  }
+  return n;
+}
+
+/**
+ * Checks firefly_unpack on every value in both halves of a group, and on
+ * random runs of every length up to nine pairs at every alignment.
+ *
+ * @return 0 if it matches the reference
+ */
+static int check_unpack() {
+  uint8_t in[3 * 9 + 8];
+  int16_t out[2 * 9 + 1];
+  unsigned long wrong = 0, runs = 0;
+  size_t pairs, align, i;
+  uint32_t v;
+
+  for (v = 0; v < 4096; ++v) {
+    uint32_t x = v | (4095 - v) << 12;
+    in[0] = x;
+    in[1] = x >> 8;
+    in[2] = x >> 16;
+    firefly_unpack(in, 1, out);
+    if (out[0] != ((int) v - 2048) * 16
+        || out[1] != ((int) (4095 - v) - 2048) * 16)
+      ++wrong;
+  }
+  for (pairs = 1; pairs <= 9; ++pairs)
+    for (align = 0; align < 8; ++align, ++runs) {
+      uint8_t *p = in + align;
+      for (i = 0; i < sizeof in; ++i)
+        in[i] = next();
+      out[2 * pairs] = 0x1234;
+      firefly_unpack(p, pairs, out);
+      for (i = 0; i < 2 * pairs; ++i) {
+        const uint8_t *g = p + i / 2 * 3;
+        int value = i % 2 ? g[1] >> 4 | g[2] << 4 : g[0] | (g[1] & 0xf) << 8;
+        if (out[i] != (value - 2048) * 16)
+          ++wrong;
+      }
+      /* Nothing past the last pair is written */
+      if (out[2 * pairs] != 0x1234)
+        ++wrong;
+    }
+  printf("unpack values=4096 runs=%lu errors=%lu result=%s\n", runs, wrong,
+      wrong ? "FAIL" : "ok");
+  return wrong > 0;
+}
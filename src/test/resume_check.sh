@@ -0,0 +1,133 @@
+#!/bin/sh
+#
+# Resume check: runs the client through a server outage long enough to dump
+# buffers, keeping a copy of every dump file spooled, then stops the samples
+# and brings up the stand-in server aborting every upload (-a 100): the first
+# is cut off partway through its body, the next stored whole but its answer
+# lost, and so on. The relay must resume each interrupted upload from the
+# offsets the stand-in acknowledged, and the check fails unless:
+#
+#   - every dump file spooled in the outage reached the stand-in, and is
+#     byte for byte the file spooled, with nothing missing or sent twice;
+#   - the relay resumed partway through a file, which shows in its
+#     resumed_bytes metric not being a whole number of dump files.
+#
+#     make test
+#     src/test/resume_check.sh [BIN_DIR [WORK_DIR [PORT]]]
+#
+# @authors Larson, Patrick; Pickett, Cameron
+
+BIN=${1:-bin}
+WORK=${2:-/tmp/resume_check}
+PORT=${3:-18094}
+SERVER=http://127.0.0.1:$PORT/
+# Seconds without a server
+OUTAGE=6
+
+writer=
+standin=
+client=
+
+fail() {
+  echo "resume-check: $*" >&2
+  cleanup
+  echo "result=FAIL"
+  exit 1
+}
+
+cleanup() {
+  for p in $client $standin $writer; do
+    kill $p 2>/dev/null
+  done
+  wait 2>/dev/null
+  client= standin= writer=
+}
+
+# Prints one field of the metrics line starting with the given word
+metric() {
+  sed -n "/^$1 /p" "$WORK/metrics" | tr ' ' '\n' | sed -n "s/^$2=//p"
+}
+
+trap 'cleanup; exit 1' INT TERM
+mkdir -p "$WORK" || exit 1
+[ -x "$BIN/x86_client" ] && [ -x "$BIN/x86_standin" ] \
+    || fail "build with make x86 tools first"
+rm -rf "$WORK/spool" "$WORK/store" "$WORK/spooled"
+mkdir -p "$WORK/spool" "$WORK/store" "$WORK/spooled"
+rm -f "$WORK/source" "$WORK/metrics" "$WORK/standin.log"
+mkfifo "$WORK/source" || fail "cannot make $WORK/source"
+log="$WORK/client.log"
+
+cat >"$WORK/client.conf" <<EOF
+read_size = 1024
+read_wait_us = 10000
+buffer_capacity = 32768
+retry_wait_ms = 500
+compact_files = 0
+server = $SERVER
+EOF
+# Random samples, faster than the client reads them, through the outage.
+# Kept open after, so the client does not see the end of them.
+(end=$(($(date +%s) + OUTAGE))
+while [ $(date +%s) -lt $end ]; do head -c 65536 /dev/urandom; sleep 0.03
+done; sleep 600) >"$WORK/source" 2>/dev/null &
+writer=$!
+"$BIN/x86_client" -d "$WORK/source" -e "$WORK/spool" \
+    -C "$WORK/client.conf" -m "$WORK/metrics" >"$log" 2>&1 &
+client=$!
+
+# No server yet, so buffers are dumped. Once the samples stop, the relay
+# dumps the last full buffer too, leaving nothing to upload but the backlog.
+# Dump files only take their names once written, so what is copied is whole.
+sleep $((OUTAGE + 2))
+kill -0 $client 2>/dev/null || fail "client exited early, see $log"
+spooled=$(ls "$WORK/spool" | grep '^client-dump_')
+[ -n "$spooled" ] || fail "nothing was dumped during the outage"
+for f in $spooled; do
+  cp "$WORK/spool/$f" "$WORK/spooled/$f" || fail "cannot copy $f"
+done
+
+# The backlog goes up through the faults, then the client drains
+"$BIN/x86_standin" -p $PORT -o "$WORK/store" -a 100 \
+    >>"$WORK/standin.log" 2>&1 &
+standin=$!
+for i in $(seq 1 60); do
+  left=0
+  for f in $spooled; do
+    [ -f "$WORK/spool/$f" ] && left=$((left + 1))
+  done
+  [ $left -eq 0 ] && break
+  sleep 1
+done
+kill -TERM $client
+wait $client
+status=$?
+client=
+kill $writer 2>/dev/null
+wait $writer 2>/dev/null
+writer=
+kill $standin
+wait $standin 2>/dev/null
+standin=
+
+[ $status -eq 0 ] || fail "client exited with status $status"
+[ $left -eq 0 ] || fail "$left dump files still spooled, see $log"
+files=0
+for f in $spooled; do
+  stored="$WORK/store/$f"
+  [ -f "$stored" ] || stored="$WORK/store/$f.dup"
+  [ -f "$stored" ] || fail "$f never reached the stand-in"
+  cmp -s "$WORK/spooled/$f" "$stored" \
+      || fail "$f is not what was spooled, see $WORK/spooled"
+  files=$((files + 1))
+done
+
+# The relay writes its metrics once more after draining
+resumed=$(metric relay resumed_bytes)
+size=$(stat -c %s "$WORK/spooled/$f")
+[ -n "$resumed" ] || fail "no relay line in the metrics"
+echo "files=$files file_bytes=$size resumed_bytes=$resumed"
+[ "$resumed" -gt 0 ] || fail "no upload was resumed"
+[ $((resumed % size)) -ne 0 ] \
+    || fail "no upload was resumed partway through a file"
+echo "result=ok"
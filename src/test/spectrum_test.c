@@ -0,0 +1,170 @@
+/**
+ * @file spectrum_test.c
+ * Accuracy test of the spectral feature extraction.
+ *
+ * Runs spectrum_compute (see spectrum.h) on known signals and compares every
+ * bin with the same spectrum computed in double precision: each window is
+ * Hann windowed and put through a direct DFT, the power of each bin is
+ * averaged over the windows, and the result is scaled as spectrum.h describes.
+ * A bin may be off from the reference by at most #ABS_TOLERANCE plus
+ * #REL_TOLERANCE of the largest bin of its spectrum, which allows for the
+ * rounding of the Q15 window and twiddles, and for the butterflies' halving
+ * shifts, which round down and so leave a few units in the lowest bins of any
+ * signal that is not silent.
+ *
+ * `make test` builds it twice, with the SSE2 kernel and with SPECTRUM_SCALAR,
+ * the kernel the board runs, and runs both. Each signal gives a line of
+ * key=value pairs with the largest error found; the exit status is non-zero
+ * if any bin is out of bounds.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../relay/spectrum.h"
+
+/** Windows in each test signal, so that one spectrum averages all of them */
+#define WINDOWS SPECTRUM_AVERAGE
+/** Samples in each test signal */
+#define SAMPLES (WINDOWS * SPECTRUM_SIZE)
+/** Most a bin may be off, in output units, whatever its size */
+#define ABS_TOLERANCE 6.0
+/** Most a bin may be off, as a share of the largest bin of the spectrum */
+#define REL_TOLERANCE 0.002
+
+/**
+ * A test signal.
+ */
+struct signal_st {
+  const char *name;
+  double amplitude; /**< Of the sinusoid, or the level for DC */
+  double cycles; /**< Cycles per window, 0 for DC */
+  double noise; /**< Amplitude of uniform noise added */
+};
+
+typedef struct signal_st Signal;
+
+static const Signal signals[] = {
+  { "silence", 0, 0, 0 },
+  { "dc", 20000, 0, 0 },
+  { "bin-centre", 30000, 64, 0 },
+  { "between-bins", 30000, 100.5, 0 },
+  { "near-nyquist", 30000, 500, 0 },
+  { "quiet", 200, 200, 0 },
+  { "full-scale-noise", 32767, 37, 2048 },
+};
+
+static void generate(const Signal *sig, int16_t *x);
+static void reference(const int16_t *x, double *bins);
+
+/**
+ * Main entrypoint into the spectrum test.
+ */
+int main(int argc, char *argv[]) {
+  static int16_t x[SAMPLES];
+  static double ref[SPECTRUM_SIZE / 2];
+  static char out[sizeof(SpectrumHeader) + SPECTRUM_SIZE];
+  const uint16_t *bins = (const uint16_t*) (out + sizeof(SpectrumHeader));
+  const SpectrumHeader *hdr = (const SpectrumHeader*) out;
+  Spectrum *s;
+  size_t i, j;
+  int failed = 0;
+
+  if ((s = spectrum_init()) == NULL ) {
+    fprintf(stderr, "spectrum_init failed\n");
+    return EXIT_FAILURE;
+  }
+
+  for (i = 0; i < sizeof signals / sizeof signals[0]; ++i) {
+    double peak = 0, worst = 0, bound;
+    size_t worst_bin = 0, bad = 0;
+
+    generate(&signals[i], x);
+    reference(x, ref);
+    if (spectrum_compute(s, x, SAMPLES, 0, out) != sizeof out
+        || hdr->frames != 1) {
+      fprintf(stderr, "%s: unexpected payload\n", signals[i].name);
+      return EXIT_FAILURE;
+    }
+
+    for (j = 0; j < SPECTRUM_SIZE / 2; ++j)
+      if (ref[j] > peak)
+        peak = ref[j];
+    bound = ABS_TOLERANCE + REL_TOLERANCE * peak;
+    for (j = 0; j < SPECTRUM_SIZE / 2; ++j) {
+      double err = fabs(bins[j] - ref[j]);
+      if (err > worst) {
+        worst = err;
+        worst_bin = j;
+      }
+      if (err > bound)
+        ++bad;
+    }
+
+    printf("signal=%s peak=%.1f max_error=%.2f at_bin=%zu bound=%.2f "
+        "bad_bins=%zu result=%s\n", signals[i].name, peak, worst, worst_bin,
+        bound, bad, bad == 0 ? "ok" : "FAIL");
+    if (bad > 0)
+      failed = 1;
+  }
+
+  spectrum_cleanup(&s);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Fills a test signal, clipped to the sample range.
+ */
+static void generate(const Signal *sig, int16_t *x) {
+  uint32_t seed = 12345;
+  size_t i;
+
+  for (i = 0; i < SAMPLES; ++i) {
+    double v = sig->cycles == 0 ? sig->amplitude :
+        sig->amplitude * sin(2 * M_PI * sig->cycles * i / SPECTRUM_SIZE + 0.3);
+    seed = seed * 1664525u + 1013904223u;
+    v += sig->noise * ((seed >> 8) / (double) (1 << 24) * 2 - 1);
+    x[i] = (int16_t) lrint(v > 32767 ? 32767 : v < -32768 ? -32768 : v);
+  }
+}
+
+/**
+ * Computes the reference spectrum of a test signal in double precision, with
+ * a direct DFT of each window.
+ */
+static void reference(const int16_t *x, double *bins) {
+  static double c[SPECTRUM_SIZE], sn[SPECTRUM_SIZE], w[SPECTRUM_SIZE];
+  static double power[SPECTRUM_SIZE / 2];
+  double v[SPECTRUM_SIZE];
+  size_t win, i, k;
+
+  for (i = 0; i < SPECTRUM_SIZE; ++i) {
+    c[i] = cos(2 * M_PI * i / SPECTRUM_SIZE);
+    sn[i] = sin(2 * M_PI * i / SPECTRUM_SIZE);
+    w[i] = 0.5 * (1 - cos(2 * M_PI * i / SPECTRUM_SIZE));
+  }
+  for (k = 0; k < SPECTRUM_SIZE / 2; ++k)
+    power[k] = 0;
+
+  for (win = 0; win < WINDOWS; ++win) {
+    for (i = 0; i < SPECTRUM_SIZE; ++i)
+      v[i] = x[win * SPECTRUM_SIZE + i] * w[i];
+    for (k = 0; k < SPECTRUM_SIZE / 2; ++k) {
+      double re = 0, im = 0;
+      for (i = 0; i < SPECTRUM_SIZE; ++i) {
+        size_t t = (k * i) % SPECTRUM_SIZE;
+        re += v[i] * c[t];
+        im -= v[i] * sn[t];
+      }
+      power[k] += re * re + im * im;
+    }
+  }
+
+  /* The kernel halves the windowed input and every FFT stage */
+  for (k = 0; k < SPECTRUM_SIZE / 2; ++k)
+    bins[k] = sqrt(power[k] / WINDOWS) / (2.0 * SPECTRUM_SIZE);
+}
@@ -0,0 +1,161 @@
+#!/bin/sh
+#
+# Spool durability check: runs the client under each spool_sync policy (see
+# src/shared/spool.h) through a server outage long enough to dump buffers,
+# then brings the stand-in server up and drains, and fails if the flush
+# counts in the relay's metrics do not follow the policy or a dump file
+# spooled during the outage did not reach the stand-in.
+#
+#   - none: no flushes at all.
+#   - periodic: a flush at most every spool_sync_ms per writer, each of
+#     several dump files, and every dump file flushed by the end.
+#   - group: with spool_sync_ms too long to matter, flushes of exactly
+#     spool_group files, bar the last of each writer, and every dump file
+#     flushed by the end.
+#
+#     make test
+#     src/test/spool_check.sh [BIN_DIR [WORK_DIR [PORT]]]
+#
+# @authors Larson, Patrick; Pickett, Cameron
+
+BIN=${1:-bin}
+WORK=${2:-/tmp/spool_check}
+PORT=${3:-18092}
+SERVER=http://127.0.0.1:$PORT/
+# Seconds without a server, and the periodic flush interval in milliseconds
+OUTAGE=6
+SYNC_MS=2000
+GROUP=4
+# The consumer and the relay each have a writer
+WRITERS=2
+
+writer=
+standin=
+client=
+
+fail() {
+  echo "spool-check: $*" >&2
+  cleanup
+  echo "result=FAIL"
+  exit 1
+}
+
+cleanup() {
+  for p in $client $standin $writer; do
+    kill $p 2>/dev/null
+  done
+  wait 2>/dev/null
+  client= standin= writer=
+}
+
+# Prints one field of the metrics line starting with the given word
+metric() {
+  sed -n "/^$1 /p" "$WORK/metrics" | tr ' ' '\n' | sed -n "s/^$2=//p"
+}
+
+# Runs the client once under the given policy, with the given sync_ms
+run() {
+  name=$1
+  rm -rf "$WORK/spool" "$WORK/store"
+  mkdir -p "$WORK/spool" "$WORK/store"
+  rm -f "$WORK/source" "$WORK/metrics"
+  mkfifo "$WORK/source" || fail "cannot make $WORK/source"
+  log="$WORK/client-$name.log"
+
+  cat >"$WORK/client.conf" <<EOF
+read_size = 1024
+read_wait_us = 10000
+buffer_capacity = 32768
+retry_wait_ms = 500
+compact_files = 0
+spool_sync = $2
+spool_sync_ms = $3
+spool_group = $GROUP
+server = $SERVER
+EOF
+  # Random samples, faster than the client reads them
+  (while head -c 65536 /dev/urandom; do sleep 0.03; done) \
+      >"$WORK/source" 2>/dev/null &
+  writer=$!
+  "$BIN/x86_client" -d "$WORK/source" -e "$WORK/spool" \
+      -C "$WORK/client.conf" -m "$WORK/metrics" >"$log" 2>&1 &
+  client=$!
+
+  # No server yet, so buffers are dumped
+  sleep $OUTAGE
+  kill -0 $client 2>/dev/null || fail "$name: client exited early, see $log"
+  spooled=$(ls "$WORK/spool" | grep '^client-dump_')
+  [ -n "$spooled" ] || fail "$name: nothing was dumped during the outage"
+
+  # The backlog goes up, then the client drains
+  "$BIN/x86_standin" -p $PORT -o "$WORK/store" >>"$WORK/standin.log" 2>&1 &
+  standin=$!
+  for i in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15; do
+    ls "$WORK/spool" | grep -q '^client-dump_' || break
+    sleep 1
+  done
+  kill -TERM $client
+  wait $client
+  status=$?
+  client=
+  kill $writer 2>/dev/null
+  wait $writer 2>/dev/null
+  writer=
+  kill $standin
+  wait $standin 2>/dev/null
+  standin=
+
+  [ $status -eq 0 ] || fail "$name: client exited with status $status"
+  for f in $spooled; do
+    [ -f "$WORK/store/$f" ] || [ -f "$WORK/store/$f.dup" ] \
+        || fail "$name: $f never reached the stand-in"
+  done
+
+  # The relay writes its metrics once more after draining
+  [ -f "$WORK/metrics" ] || fail "$name: no metrics written"
+  writes=$(metric spool writes)
+  syncs=$(metric spool syncs)
+  synced=$(metric spool synced)
+  errors=$(metric spool sync_errors)
+  [ -n "$writes" ] && [ -n "$syncs" ] && [ -n "$synced" ] \
+      || fail "$name: no spool line in the metrics"
+  echo "run=$name writes=$writes syncs=$syncs synced=$synced" \
+      "sync_errors=$errors"
+  [ "$errors" -eq 0 ] || fail "$name: dump files failed to flush"
+}
+
+# Flushed files: all of them but those the consumer may still hold, since
+# the relay's last metrics are written before the consumer's last flush
+check_synced() {
+  [ "$synced" -le "$writes" ] && [ $((writes - synced)) -le $1 ] \
+      || fail "$name: $synced of $writes dump files flushed"
+}
+
+trap 'cleanup; exit 1' INT TERM
+mkdir -p "$WORK" || exit 1
+rm -f "$WORK/standin.log"
+[ -x "$BIN/x86_client" ] && [ -x "$BIN/x86_standin" ] \
+    || fail "build with make x86 tools first"
+
+run none 0 $SYNC_MS
+[ "$syncs" -eq 0 ] && [ "$synced" -eq 0 ] \
+    || fail "none: dump files were flushed"
+
+run periodic 1 $SYNC_MS
+# At most one flush per interval per writer over the outage and the upload,
+# and one more each on the way out
+limit=$(( (OUTAGE + 15) * 1000 / SYNC_MS * WRITERS + WRITERS ))
+[ "$syncs" -gt 0 ] && [ "$syncs" -le $limit ] \
+    || fail "periodic: $syncs flushes, expected 1 to $limit"
+[ "$synced" -gt "$syncs" ] \
+    || fail "periodic: $syncs flushes of $synced dump files, none shared"
+check_synced 16
+
+run group 2 600000
+[ "$synced" -le $((syncs * GROUP)) ] \
+    && [ "$synced" -ge $(( (syncs - WRITERS) * GROUP )) ] \
+    || fail "group: $syncs flushes of $synced dump files, not by $GROUP"
+[ "$syncs" -gt $WRITERS ] \
+    || fail "group: only $syncs flushes, groups never filled"
+check_synced $GROUP
+echo "result=ok"
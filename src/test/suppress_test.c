@@ -0,0 +1,188 @@
+/**
+ * @file suppress_test.c
+ * Behaviour test of steady-state suppression.
+ *
+ * Feeds suppress_compute (see suppress.h) a steady tone with a little noise
+ * and checks, window by window, what it sends whole and what it replaces by
+ * runs of the baseline:
+ *
+ *   - burst: a second, strong tone for a few windows in the middle. The
+ *     first windows are sent whole while the baseline is set, then the
+ *     burst with #SUPPRESS_CONTEXT windows either side; everything else is
+ *     suppressed.
+ *   - rebase: the second tone comes on and stays. Windows are sent whole
+ *     until #SUPPRESS_REBASE of them have differed, when the new signal
+ *     becomes the baseline and is suppressed from then on.
+ *
+ * The payload is also taken apart: its header, the record counts adding up
+ * to the windows, the windows sent whole and the samples past the last whole
+ * window holding the input unchanged, and the run records holding the
+ * baseline, which ends within the tolerance of the last window. A line of key=value pairs is printed for each signal; the exit
+ * status is non-zero on any mismatch.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../relay/suppress.h"
+
+/** Windows in each test signal */
+#define WINDOWS 120
+/** Samples past the last whole window */
+#define TAIL 100
+/** Samples in each test signal */
+#define SAMPLES (WINDOWS * SUPPRESS_WINDOW + TAIL)
+
+/**
+ * A test signal: the second tone is on from window on to window off.
+ */
+struct signal_st {
+  const char *name;
+  int on;
+  int off;
+};
+
+typedef struct signal_st Signal;
+
+static const Signal signals[] = {
+  { "burst", 40, 45 },
+  { "rebase", 20, WINDOWS },
+};
+
+static void generate(const Signal *sig, int16_t *x);
+static int expected_raw(const Signal *sig, int w);
+static int check(const Signal *sig, const int16_t *x, const char *out,
+    size_t len, const Suppressor *s);
+
+/**
+ * Main entrypoint into the suppression test.
+ */
+int main(int argc, char *argv[]) {
+  static int16_t x[SAMPLES];
+  static char out[sizeof(SuppressHeader)
+      + WINDOWS * sizeof(SuppressRecord) + SAMPLES * sizeof(int16_t)];
+  Suppressor *s;
+  size_t i, len;
+  int failed = 0;
+
+  if (suppress_payload_max(SAMPLES) > sizeof out) {
+    fprintf(stderr, "suppress_payload_max is larger than expected\n");
+    return EXIT_FAILURE;
+  }
+  for (i = 0; i < sizeof signals / sizeof signals[0]; ++i) {
+    if ((s = suppressor_init()) == NULL ) {
+      fprintf(stderr, "suppressor_init failed\n");
+      return EXIT_FAILURE;
+    }
+    generate(&signals[i], x);
+    len = suppress_compute(s, x, SAMPLES, out);
+    if (check(&signals[i], x, out, len, s) != 0)
+      failed = 1;
+    suppressor_cleanup(&s);
+  }
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Fills a test signal: a tone in the third band, noise 46 dB below it, and
+ * while the signal's second tone is on, an equal tone in the sixth band.
+ */
+static void generate(const Signal *sig, int16_t *x) {
+  uint32_t seed = 12345;
+  size_t i;
+
+  for (i = 0; i < SAMPLES; ++i) {
+    size_t w = i / SUPPRESS_WINDOW;
+    double v = 10000 * sin(2 * M_PI * 12 * i / SUPPRESS_WINDOW);
+    if (w >= (size_t) sig->on && w < (size_t) sig->off)
+      v += 10000 * sin(2 * M_PI * 100 * i / SUPPRESS_WINDOW + 0.5);
+    seed = seed * 1664525u + 1013904223u;
+    v += 50 * ((seed >> 8) / (double) (1 << 24) * 2 - 1);
+    x[i] = (int16_t) lrint(v);
+  }
+}
+
+/**
+ * Whether a window should be sent whole: the first #SUPPRESS_CONTEXT + 1
+ * while the baseline is set, and each differing window with
+ * #SUPPRESS_CONTEXT either side, the tone's start and end both differing
+ * from the baseline of the steady tone until #SUPPRESS_REBASE windows in a
+ * row have.
+ */
+static int expected_raw(const Signal *sig, int w) {
+  int last = sig->off - 1; /* the last window that differs */
+
+  if (sig->off - sig->on >= SUPPRESS_REBASE)
+    last = sig->on + SUPPRESS_REBASE - 1;
+  return w <= SUPPRESS_CONTEXT
+      || (w >= sig->on - SUPPRESS_CONTEXT && w <= last + SUPPRESS_CONTEXT);
+}
+
+/**
+ * Takes a payload apart and checks it against the signal.
+ *
+ * @return 0 if it is as expected
+ */
+static int check(const Signal *sig, const int16_t *x, const char *out,
+    size_t len, const Suppressor *s) {
+  const SuppressHeader *hdr = (const SuppressHeader*) out;
+  size_t at = sizeof(SuppressHeader);
+  unsigned long wrong = 0, raw = 0, data_bad = 0, level_bad = 0;
+  int w = 0, r, i, expect = 0, bad = 0;
+
+  if (hdr->magic != SUPPRESS_MAGIC || hdr->window != SUPPRESS_WINDOW
+      || hdr->windows != WINDOWS || hdr->tail != TAIL)
+    bad = 1;
+  for (r = 0; !bad && r < hdr->records; ++r) {
+    const SuppressRecord *rec = (const SuppressRecord*) (out + at);
+    at += sizeof(SuppressRecord);
+    if (rec->count == 0 || w + rec->count > WINDOWS
+        || (rec->type != SUPPRESS_RAW && rec->type != SUPPRESS_RUN)) {
+      bad = 1;
+      break;
+    }
+    for (i = 0; i < rec->count; ++i)
+      if (expected_raw(sig, w + i) != (rec->type == SUPPRESS_RAW))
+        ++wrong;
+    if (rec->type == SUPPRESS_RAW) {
+      size_t bytes = rec->count * SUPPRESS_WINDOW * sizeof(int16_t);
+      if (at + bytes > len
+          || memcmp(out + at, x + w * SUPPRESS_WINDOW, bytes) != 0)
+        ++data_bad;
+      at += bytes;
+      raw += rec->count;
+    } else
+      /* Runs carry the baseline as it stands at the end of the block */
+      for (i = 0; i < SUPPRESS_BANDS; ++i)
+        if (rec->level[i] != s->baseline[i] >> SUPPRESS_ADAPT)
+          ++level_bad;
+    w += rec->count;
+  }
+  if (!bad && (w != WINDOWS || at + TAIL * sizeof(int16_t) != len
+      || memcmp(out + at, x + WINDOWS * SUPPRESS_WINDOW,
+          TAIL * sizeof(int16_t)) != 0))
+    bad = 1;
+  /* Which, after a rebase, is the signal with both tones */
+  for (i = 0; i < SUPPRESS_BANDS; ++i) {
+    int d = s->levels[(WINDOWS - 1) * SUPPRESS_BANDS + i]
+        - (s->baseline[i] >> SUPPRESS_ADAPT);
+    if (d > SUPPRESS_TOLERANCE || d < -SUPPRESS_TOLERANCE)
+      ++level_bad;
+  }
+  for (i = 0; i < WINDOWS; ++i)
+    expect += expected_raw(sig, i);
+  if (s->windows != WINDOWS || s->suppressed != WINDOWS - raw)
+    bad = 1;
+
+  bad |= wrong > 0 || data_bad > 0 || level_bad > 0;
+  printf("signal=%s windows=%d records=%d whole=%lu expected_whole=%d "
+      "suppressed=%lu misclassified=%lu data_errors=%lu level_errors=%lu "
+      "result=%s\n", sig->name, WINDOWS, hdr->records, raw, expect,
+      s->suppressed, wrong, data_bad, level_bad, bad ? "FAIL" : "ok");
+  return bad;
+}
@@ -0,0 +1,605 @@
+/**
+ * @file bench.c
+ * Microbenchmarks of the client's hot paths.
+ *
+ * doc/examples/buffertest.c times whole fill and send iterations, which says
+ * little about which step a change made faster or slower. bench times the
+ * steps one at a time, each through the client's own code:
+ *
+ *   - read_N: a bare read of N bytes from /dev/zero, the floor under the
+ *     consumer's reads
+ *   - consumer_N: #consumer_process reading N bytes from /dev/zero into the
+ *     double buffer, with the bench handing full buffers straight back as a
+ *     relay would; reads that do not divide the buffer capacity cross buffer
+ *     boundaries now and then
+ *   - consumer_split_N: the same, with every read crossing a boundary
+ *   - spool_write: #spool_write of a full buffer into the work directory,
+ *     left to the kernel's write-back
+ *   - spool_group_N: the same under #SPOOL_SYNC_GROUP, flushing every N
+ *     files, so the cost per buffer of each group size (see spool.h)
+ *   - spool_fdatasync: writing a buffer's worth to a file and flushing it to
+ *     the medium with fdatasync, the cost of making one dump file durable
+ *   - scan_N: #spool_scan of a spool of N dump files
+ *   - upload_mime, upload_multipart, upload_raw: setting up a request to
+ *     upload a buffer: as a curl MIME form, as the relay's preallocated
+ *     multipart body (see multipart.h), and as a bare request body
+ *   - crc32c, delta_encode, delta_decode, best_encode, best_decode,
+ *     firefly_unpack: the checksum and codec kernels over a buffer of
+ *     samples shaped like a random walk
+ *
+ * Each benchmark is first run with doubling iteration counts until one run
+ * takes the target time, which also warms the caches, and then run the given
+ * number of times more. Times come from CLOCK_MONOTONIC around each run, and
+ * the statistics are of the time per operation across runs, so a run
+ * interrupted by the scheduler shows up as a high maximum and coefficient of
+ * variation rather than skewing the median.
+ *
+ * Output
+ * ------
+ * One line describing the build and host, then one line per benchmark, each
+ * a name followed by key=value pairs like the relay's metrics snapshot:
+ *
+ *     bench_host arch=x86_64 cc=12.2.0 capacity=102400 runs=11 target_ms=50
+ *     bench name=crc32c iters=4096 ns_min=... ns_median=... ns_mean=...
+ *         ns_max=... cv=... bytes=102400 mb_s=...
+ *
+ * mb_s is worked out from the median, for benchmarks that move bytes. Lines
+ * from builds for different machines or versions of the client can be joined
+ * on name.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <curl/curl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../consumer/consumer.h"
+#include "../relay/firefly.h"
+#include "../relay/multipart.h"
+#include "../shared/buffer.h"
+#include "../shared/codec.h"
+#include "../shared/config.h"
+#include "../shared/crc32c.h"
+#include "../shared/occupancy.h"
+#include "../shared/spool.h"
+
+/** Most runs per benchmark */
+#define RUNS_MAX 101
+/** Most iterations in one run */
+#define ITERS_MAX (1L << 30)
+/** Data source of the read and consumer benchmarks */
+#define BENCH_SOURCE "/dev/zero"
+
+#if defined(__mips__)
+#define BENCH_ARCH "mips"
+#elif defined(__x86_64__)
+#define BENCH_ARCH "x86_64"
+#elif defined(__i386__)
+#define BENCH_ARCH "i386"
+#else
+#define BENCH_ARCH "unknown"
+#endif
+
+/**
+ * One benchmark.
+ */
+struct case_st {
+  const char *name; /**< Name, with %ld for param if it has one */
+  double (*run)(const struct case_st *c, long iters); /**< Returns seconds */
+  long param; /**< Read size or number of files */
+  size_t bytes; /**< Bytes handled per operation, 0 if not meaningful */
+};
+
+typedef struct case_st Case;
+
+static double run_read(const Case *c, long iters);
+static double run_consumer(const Case *c, long iters);
+static double run_spool_write(const Case *c, long iters);
+static double run_fdatasync(const Case *c, long iters);
+static double run_scan(const Case *c, long iters);
+static double run_mime(const Case *c, long iters);
+static double run_multipart(const Case *c, long iters);
+static double run_raw(const Case *c, long iters);
+static double run_kernel(const Case *c, long iters);
+static double now();
+static void measure(const Case *c, int runs, double target);
+static int compare(const void *a, const void *b);
+static int fill_spool(long files);
+static void empty_spool();
+static void usage();
+
+/** Kernels run by #run_kernel, by param */
+enum kernel {
+  KERNEL_CRC32C, KERNEL_DELTA_ENCODE, KERNEL_DELTA_DECODE, KERNEL_BEST_ENCODE,
+  KERNEL_BEST_DECODE, KERNEL_FIREFLY_UNPACK
+};
+
+/** Set for consumer_split_N */
+#define SPLIT 0x100000
+
+static const Case cases[] = {
+  { "read_%ld", &run_read, 64, 64 },
+  { "read_%ld", &run_read, 1024, 1024 },
+  { "read_%ld", &run_read, 3001, 3001 },
+  { "read_%ld", &run_read, 16384, 16384 },
+  { "consumer_%ld", &run_consumer, 64, 64 },
+  { "consumer_%ld", &run_consumer, 1024, 1024 },
+  { "consumer_%ld", &run_consumer, 3001, 3001 },
+  { "consumer_%ld", &run_consumer, 16384, 16384 },
+  { "consumer_split_%ld", &run_consumer, SPLIT | 1024, 1024 },
+  { "consumer_split_%ld", &run_consumer, SPLIT | 16384, 16384 },
+  { "spool_write", &run_spool_write, 0, sizeof(Buffer) },
+  { "spool_group_%ld", &run_spool_write, 1, sizeof(Buffer) },
+  { "spool_group_%ld", &run_spool_write, 4, sizeof(Buffer) },
+  { "spool_group_%ld", &run_spool_write, SPOOL_GROUP_MAX, sizeof(Buffer) },
+  { "spool_fdatasync", &run_fdatasync, 0, sizeof(Buffer) },
+  { "scan_%ld", &run_scan, 16, 0 },
+  { "scan_%ld", &run_scan, 256, 0 },
+  { "scan_%ld", &run_scan, 4096, 0 },
+  { "upload_mime", &run_mime, 0, 0 },
+  { "upload_multipart", &run_multipart, 0, 0 },
+  { "upload_raw", &run_raw, 0, 0 },
+  { "crc32c", &run_kernel, KERNEL_CRC32C, __BUFFER_CAPACITY },
+  { "delta_encode", &run_kernel, KERNEL_DELTA_ENCODE, __BUFFER_CAPACITY },
+  { "delta_decode", &run_kernel, KERNEL_DELTA_DECODE, __BUFFER_CAPACITY },
+  { "best_encode", &run_kernel, KERNEL_BEST_ENCODE, __BUFFER_CAPACITY },
+  { "best_decode", &run_kernel, KERNEL_BEST_DECODE, __BUFFER_CAPACITY },
+  { "firefly_unpack", &run_kernel, KERNEL_FIREFLY_UNPACK,
+    __BUFFER_CAPACITY / 4 * 3 },
+};
+
+static char *work_dir = "/tmp"; /**< Where spool benchmarks write */
+static char spool_dir[1024]; /**< Their spool, in work_dir */
+static Buffer *buffers; /**< A double buffer, and a full buffer to spool */
+static char *samples; /**< A buffer of random walk samples */
+static char *coded; /**< Them delta encoded, then best encoded */
+static size_t delta_len, best_len; /**< Bytes of them encoded */
+static int16_t *unpacked; /**< Room for firefly_unpack's output */
+static SpoolStats spool_stats; /**< Counts for the writers benchmarked */
+
+/**
+ * Main entrypoint into the benchmarks.
+ */
+int main(int argc, char *argv[]) {
+  const char *only = NULL;
+  double target = 0.05;
+  int runs = 11, list = 0, c;
+  char cc[64], name[64];
+  uint32_t walk = 0, seed = 1;
+  size_t i;
+
+  while ((c = getopt(argc, argv, "d:r:t:b:lh")) != -1) {
+    switch (c) {
+    case 'd':
+      work_dir = optarg;
+      break;
+    case 'r':
+      runs = atoi(optarg);
+      break;
+    case 't':
+      target = atof(optarg) / 1000;
+      break;
+    case 'b':
+      only = optarg;
+      break;
+    case 'l':
+      list = 1;
+      break;
+    default:
+      usage();
+      exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  }
+  if (runs < 1 || runs > RUNS_MAX || target <= 0 || optind != argc) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  snprintf(spool_dir, sizeof spool_dir, "%s/bench-spool/", work_dir);
+  if ((buffers = (Buffer*) calloc(3, sizeof(Buffer))) == NULL
+      || (samples = (char*) malloc(__BUFFER_CAPACITY)) == NULL
+      || (coded = (char*) malloc(2 * CODEC_BEST_BOUND(__BUFFER_CAPACITY)))
+          == NULL
+      || (unpacked = (int16_t*) malloc(__BUFFER_CAPACITY / 3 * 4 + 4))
+          == NULL ) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  /* A random walk, which the codecs shrink about as far as a real signal */
+  for (i = 0; i < __BUFFER_CAPACITY / 2; ++i) {
+    seed = seed * 1103515245 + 12345;
+    walk += (seed >> 16) % 81 - 40;
+    samples[2 * i] = (char) walk;
+    samples[2 * i + 1] = (char) (walk >> 8);
+  }
+  buffers[2].size = buffers[2].capacity = __BUFFER_CAPACITY;
+  memcpy(buffers[2].data, samples, __BUFFER_CAPACITY);
+  buffers[2].crc = crc32c(0, samples, __BUFFER_CAPACITY);
+
+  snprintf(cc, sizeof cc, "%s", __VERSION__);
+  for (i = 0; cc[i] != '\0'; ++i)
+    if (cc[i] == ' ')
+      cc[i] = '_';
+  if (!list)
+    printf("bench_host arch=%s cc=%s capacity=%d runs=%d target_ms=%.0f\n",
+        BENCH_ARCH, cc, __BUFFER_CAPACITY, runs, target * 1000);
+
+  curl_global_init(CURL_GLOBAL_NOTHING);
+  for (i = 0; i < sizeof cases / sizeof cases[0]; ++i) {
+    snprintf(name, sizeof name, cases[i].name, cases[i].param & ~SPLIT);
+    if (only != NULL && strncmp(name, only, strlen(only)) != 0)
+      continue;
+    if (list)
+      printf("%s\n", name);
+    else
+      measure(&cases[i], runs, target);
+    fflush(stdout);
+  }
+  curl_global_cleanup();
+  return 0;
+}
+
+/**
+ * Runs a benchmark until one run takes the target time, then the given
+ * number of runs, and prints the statistics of the time per operation.
+ */
+static void measure(const Case *c, int runs, double target) {
+  double per_op[RUNS_MAX], t, sum = 0, sq = 0, mean, median;
+  char name[64];
+  long iters = 1;
+  int i;
+
+  snprintf(name, sizeof name, c->name, c->param & ~SPLIT);
+  while ((t = c->run(c, iters)) >= 0 && t < target && iters < ITERS_MAX)
+    iters *= 2;
+  if (t < 0) {
+    printf("bench name=%s error=%d\n", name, errno);
+    return;
+  }
+
+  for (i = 0; i < runs; ++i) {
+    if ((t = c->run(c, iters)) < 0) {
+      printf("bench name=%s error=%d\n", name, errno);
+      return;
+    }
+    per_op[i] = t / iters * 1e9;
+    sum += per_op[i];
+  }
+  mean = sum / runs;
+  for (i = 0; i < runs; ++i)
+    sq += (per_op[i] - mean) * (per_op[i] - mean);
+  qsort(per_op, runs, sizeof per_op[0], &compare);
+  median = runs % 2 ? per_op[runs / 2] :
+      (per_op[runs / 2 - 1] + per_op[runs / 2]) / 2;
+
+  printf("bench name=%s iters=%ld ns_min=%.1f ns_median=%.1f ns_mean=%.1f "
+      "ns_max=%.1f cv=%.4f", name, iters, per_op[0], median, mean,
+      per_op[runs - 1], mean > 0 ? sqrt(sq / runs) / mean : 0);
+  if (c->bytes > 0)
+    printf(" bytes=%zu mb_s=%.2f", c->bytes, c->bytes / median * 1e3);
+  printf("\n");
+}
+
+/** Times bare reads from the data source */
+static double run_read(const Case *c, long iters) {
+  char staging[CONFIG_READ_MAX];
+  double start, end;
+  long i;
+  int fd;
+
+  if ((fd = open(BENCH_SOURCE, O_RDONLY)) < 0)
+    return -1;
+  start = now();
+  for (i = 0; i < iters; ++i)
+    if (read(fd, staging, c->param) < 0)
+      break;
+  end = now();
+  close(fd);
+  return end - start;
+}
+
+/**
+ * Times the consumer's reads, handing full buffers back as the relay would.
+ * For consumer_split_N, the buffer being filled is set up before each read
+ * so that the read crosses into the other one.
+ */
+static double run_consumer(const Case *c, long iters) {
+  long size = c->param & ~SPLIT;
+  Occupancy occ;
+  Config config;
+  Consumer *con;
+  double start, end;
+  long i;
+
+  memset(buffers, 0, 2 * sizeof(Buffer));
+  occupancy_init(&occ); /* too new to project an overflow */
+  config_defaults(&config);
+  config.read_size = size;
+  buffers[0].capacity = buffers[1].capacity = config.capacity;
+  if ((con = consumer_init(buffers, &occ, &config, &spool_stats, BENCH_SOURCE,
+      work_dir, NULL, NULL, 0)) == NULL )
+    return -1;
+
+  start = now();
+  for (i = 0; i < iters; ++i) {
+    if (c->param & SPLIT) {
+      Buffer *cur = &buffers[con->buf_idx];
+      cur->capacity = config.capacity;
+      cur->size = config.capacity - size / 2;
+      buffers[con->buf_idx ^ 1].size = 0;
+    }
+    if (consumer_process(con) < 0)
+      break;
+    if (buffers[0].size == buffers[0].capacity)
+      buffers[0].size = 0;
+    if (buffers[1].size == buffers[1].capacity)
+      buffers[1].size = 0;
+  }
+  end = now();
+  consumer_cleanup(&con);
+  return i == iters ? end - start : -1;
+}
+
+/**
+ * Times spooling full buffers, flushing every param of them, or never if
+ * param is 0. The flush of any left over at the end is timed too.
+ */
+static double run_spool_write(const Case *c, long iters) {
+  Spool *spool;
+  double start, end;
+  long i;
+
+  if (fill_spool(0) < 0 || (spool = spool_init(spool_dir, &spool_stats))
+      == NULL )
+    return -1;
+  if (c->param > 0)
+    spool_configure(spool, SPOOL_SYNC_GROUP, 3600000, c->param);
+  start = now();
+  for (i = 0; i < iters; ++i)
+    if (spool_write(spool, &buffers[2]) < 0)
+      break;
+  spool_cleanup(&spool);
+  end = now();
+  empty_spool();
+  return i == iters ? end - start : -1;
+}
+
+/** Times writing a buffer's worth to a file and flushing it */
+static double run_fdatasync(const Case *c, long iters) {
+  char path[sizeof spool_dir + 256];
+  double start, end;
+  long i;
+  int fd;
+
+  if (fill_spool(0) < 0)
+    return -1;
+  snprintf(path, sizeof path, "%sclient-sync.dat", spool_dir);
+  start = now();
+  for (i = 0; i < iters; ++i) {
+    if ((fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0)
+      break;
+    if (write(fd, &buffers[2], sizeof(Buffer)) != sizeof(Buffer)
+        || fdatasync(fd) < 0) {
+      close(fd);
+      break;
+    }
+    close(fd);
+  }
+  end = now();
+  unlink(path);
+  empty_spool();
+  return i == iters ? end - start : -1;
+}
+
+/** Times scanning a spool of param dump files */
+static double run_scan(const Case *c, long iters) {
+  SpoolScan scan;
+  double start, end;
+  long i;
+
+  memset(&scan, 0, sizeof scan);
+  if (fill_spool(c->param) < 0)
+    return -1;
+  start = now();
+  for (i = 0; i < iters; ++i)
+    if (spool_scan(&scan, spool_dir) != (c->param < SPOOL_SCAN_MAX ?
+        c->param : SPOOL_SCAN_MAX))
+      break;
+  end = now();
+  spool_scan_close(&scan);
+  empty_spool();
+  return i == iters ? end - start : -1;
+}
+
+/** Times setting up an upload as a curl MIME form */
+static double run_mime(const Case *c, long iters) {
+  char header[sizeof CRC32C_HEADER + 16];
+  curl_mimepart *part;
+  struct curl_slist *headers;
+  curl_mime *mime;
+  double start, end;
+  CURL *curl;
+  long i;
+
+  if ((curl = curl_easy_init()) == NULL )
+    return -1;
+  snprintf(header, sizeof header, CRC32C_HEADER ": %08x", buffers[2].crc);
+  start = now();
+  for (i = 0; i < iters; ++i) {
+    mime = curl_mime_init(curl);
+    part = curl_mime_addpart(mime);
+    curl_mime_name(part, "file");
+    curl_mime_filename(part, (i & 1) ? "buf1" : "buf0");
+    curl_mime_data(part, buffers[2].data, __BUFFER_CAPACITY);
+    headers = curl_slist_append(NULL, header);
+    curl_mime_headers(part, headers, 1);
+    curl_easy_setopt(curl, CURLOPT_MIMEPOST, mime);
+    curl_easy_setopt(curl, CURLOPT_MIMEPOST, NULL);
+    curl_mime_free(mime);
+  }
+  end = now();
+  curl_easy_cleanup(curl);
+  return end - start;
+}
+
+/** Times setting up an upload as the relay's multipart body */
+static double run_multipart(const Case *c, long iters) {
+  static Multipart m; /* too big for some stacks */
+  char header[sizeof CRC32C_HEADER + 16];
+  double start, end;
+  CURL *curl;
+  long i;
+
+  if ((curl = curl_easy_init()) == NULL )
+    return -1;
+  multipart_init(&m);
+  snprintf(header, sizeof header, CRC32C_HEADER ": %08x\r\n", buffers[2].crc);
+  start = now();
+  for (i = 0; i < iters; ++i) {
+    multipart_reset(&m);
+    multipart_add(&m, (i & 1) ? "buf1" : "buf0", header, buffers[2].data,
+        NULL, __BUFFER_CAPACITY);
+    multipart_post(&m, curl);
+  }
+  end = now();
+  curl_easy_cleanup(curl);
+  return end - start;
+}
+
+/** Times setting up an upload of a bare request body */
+static double run_raw(const Case *c, long iters) {
+  char header[sizeof CRC32C_HEADER + 16];
+  struct curl_slist headers = { header, NULL };
+  double start, end;
+  CURL *curl;
+  long i;
+
+  if ((curl = curl_easy_init()) == NULL )
+    return -1;
+  start = now();
+  for (i = 0; i < iters; ++i) {
+    snprintf(header, sizeof header, CRC32C_HEADER ": %08x", buffers[2].crc);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, &headers);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, buffers[2].data);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long) __BUFFER_CAPACITY);
+  }
+  end = now();
+  curl_easy_cleanup(curl);
+  return end - start;
+}
+
+/** Times a checksum or codec kernel over a buffer of samples */
+static double run_kernel(const Case *c, long iters) {
+  char *out = buffers[0].data;
+  volatile uint32_t sink = 0; /* keeps the work from being optimized out */
+  double start, end;
+  long i;
+
+  delta_len = codec_delta_encode(samples, __BUFFER_CAPACITY, coded);
+  best_len = codec_best_encode(samples, __BUFFER_CAPACITY, coded
+      + CODEC_BEST_BOUND(__BUFFER_CAPACITY));
+  start = now();
+  for (i = 0; i < iters; ++i) {
+    switch (c->param) {
+    case KERNEL_CRC32C:
+      sink += crc32c(0, samples, __BUFFER_CAPACITY);
+      break;
+    case KERNEL_DELTA_ENCODE:
+      sink += codec_delta_encode(samples, __BUFFER_CAPACITY, out);
+      break;
+    case KERNEL_DELTA_DECODE:
+      sink += codec_delta_decode(coded, delta_len, out, __BUFFER_CAPACITY);
+      break;
+    case KERNEL_BEST_ENCODE:
+      sink += codec_best_encode(samples, __BUFFER_CAPACITY, out);
+      break;
+    case KERNEL_BEST_DECODE:
+      sink += codec_best_decode(coded + CODEC_BEST_BOUND(__BUFFER_CAPACITY),
+          best_len, out, __BUFFER_CAPACITY);
+      break;
+    case KERNEL_FIREFLY_UNPACK:
+      firefly_unpack((const uint8_t*) samples, __BUFFER_CAPACITY / 4,
+          unpacked);
+      sink += unpacked[0];
+      break;
+    }
+  }
+  end = now();
+  return end - start;
+}
+
+/** Reads the monotonic clock, in seconds */
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Orders times for qsort */
+static int compare(const void *a, const void *b) {
+  double x = *(const double*) a, y = *(const double*) b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Creates the benchmarks' spool directory, holding the given number of
+ * empty dump files.
+ *
+ * @return 0 if successful, -1 otherwise
+ */
+static int fill_spool(long files) {
+  char path[sizeof spool_dir + 256];
+  long i;
+  int fd;
+
+  empty_spool();
+  if (mkdir(spool_dir, 0755) < 0 && errno != EEXIST)
+    return -1;
+  for (i = 0; i < files; ++i) {
+    /* Spread over a day, in no particular order */
+    snprintf(path, sizeof path, "%sclient-dump_%ld%06ld.dat", spool_dir,
+        1400000000L + (i * 7919) % 86400, i);
+    if ((fd = open(path, O_CREAT | O_WRONLY, 0644)) < 0)
+      return -1;
+    close(fd);
+  }
+  return 0;
+}
+
+/** Deletes the benchmarks' spool directory and what is in it */
+static void empty_spool() {
+  char path[sizeof spool_dir + 256];
+  struct dirent *entry;
+  DIR *dirp;
+
+  if ((dirp = opendir(spool_dir)) == NULL )
+    return;
+  while ((entry = readdir(dirp)) != NULL ) {
+    if (entry->d_name[0] == '.')
+      continue;
+    snprintf(path, sizeof path, "%s%s", spool_dir, entry->d_name);
+    unlink(path);
+  }
+  closedir(dirp);
+  rmdir(spool_dir);
+}
+
+/** Prints usage information */
+static void usage() {
+  printf("Usage: bench [-d DIR] [-r RUNS] [-t MS] [-b PREFIX] [-l]\n"
+      "  -d DIR     Directory for the spool benchmarks (default /tmp)\n"
+      "  -r RUNS    Timed runs per benchmark, up to %d (default 11)\n"
+      "  -t MS      Target milliseconds per run (default 50)\n"
+      "  -b PREFIX  Only run the benchmarks whose names start with PREFIX\n"
+      "  -l         List the benchmarks instead of running them\n", RUNS_MAX);
+}
@@ -0,0 +1,336 @@
+/**
+ * @file receiver.c
+ * Reference receiver for the relay's streaming transport.
+ *
+ * The receiver accepts relay connections on a TCP port and reads the framed
+ * stream described in frame.h. DATA frames are appended to live.dat and
+ * SEGMENT frames are written to a file named after the segment, both in the
+ * store directory.
+ *
+ * The payload of every frame is checked against the CRC-32C in its header. A
+ * frame that fails the check is not stored, and the connection is dropped so
+ * that the relay sends the frame again.
+ *
+ * Once everything that has arrived on a connection is stored, the receiver
+ * acknowledges the highest sequence number seen, so a single ACK usually
+ * covers several frames. The highest sequence number stored is remembered per
+ * relay session, so that frames resent after a reconnect are not stored
+ * twice.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "../shared/crc32c.h"
+#include "../shared/frame.h"
+
+#define SESSIONS_MAX 64 /**< Number of relay sessions remembered */
+#define COPY_CHUNK 65536 /**< Size of the payload copy buffer */
+
+/**
+ * The progress of one relay session.
+ */
+struct session_st {
+  uint64_t id; /**< Session id sent by the relay in its HELLO */
+  uint32_t last; /**< Highest sequence number stored */
+  int used; /**< Set if this entry is in use */
+};
+
+static struct session_st sessions[SESSIONS_MAX];
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t live_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *store_dir;
+static int verbose;
+
+static void usage();
+static void *handle_conn(void *arg);
+static struct session_st *find_session(uint64_t id);
+static int read_all(int fd, void *dest, size_t len);
+static int copy_payload(int fd, int out, size_t len, uint32_t *crc);
+static int send_ack(int fd, uint32_t seq);
+
+/**
+ * Main entrypoint into the receiver.
+ */
+int main(int argc, char *argv[]) {
+  struct sockaddr_in addr;
+  int port = 9090;
+  int sock, opt = 1;
+  int c;
+
+  store_dir = ".";
+  verbose = 0;
+  while ((c = getopt(argc, argv, "p:o:vh")) != -1) {
+    switch (c) {
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'o':
+      store_dir = optarg;
+      break;
+    case 'v':
+      ++verbose;
+      break;
+    default:
+      usage();
+      exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  }
+
+  signal(SIGPIPE, SIG_IGN );
+  crc32c_init();
+  if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    perror("[V] socket");
+    exit(EXIT_FAILURE);
+  }
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof opt);
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(sock, (struct sockaddr*) &addr, sizeof addr) < 0
+      || listen(sock, 16) < 0) {
+    perror("[V] bind");
+    exit(EXIT_FAILURE);
+  }
+  if (verbose)
+    printf("[V] Listening on port %d, storing in %s\n", port, store_dir);
+
+  while (1) {
+    pthread_t thread;
+    int *fd = (int*) malloc(sizeof(int));
+
+    if ((*fd = accept(sock, NULL, NULL )) < 0) {
+      free(fd);
+      if (errno == EINTR)
+        continue;
+      perror("[V] accept");
+      break;
+    }
+    if (pthread_create(&thread, NULL, &handle_conn, fd) != 0) {
+      perror("[V] pthread_create");
+      close(*fd);
+      free(fd);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+
+  close(sock);
+  return EXIT_FAILURE;
+}
+
+/** Print out help message */
+static void usage() {
+  fprintf(stderr, "Usage: receiver [-p <port>] [-o <dir>] [-v]\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "  -p PORT  port to listen on (default 9090)\n");
+  fprintf(stderr, "  -o DIR   directory received data is stored in\n");
+  fprintf(stderr, "  -v       increase program output\n");
+}
+
+/**
+ * Read frames from one relay connection until it is closed.
+ */
+static void *handle_conn(void *arg) {
+  int fd = *(int*) arg;
+  struct session_st *session = NULL;
+  struct pollfd pfd;
+  Frame f;
+
+  free(arg);
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+
+  while (read_all(fd, &f, sizeof f) == 0) {
+    uint32_t seq = ntohl(f.seq);
+    uint32_t len = ntohl(f.length);
+    uint32_t crc = 0;
+    int type = ntohs(f.type);
+    int dup;
+
+    if (ntohl(f.magic) != FRAME_MAGIC || len > FRAME_PAYLOAD_MAX) {
+      fprintf(stderr, "[V] Bad frame header, dropping connection\n");
+      break;
+    }
+
+    if (type == FRAME_HELLO) {
+      uint32_t id[2];
+      if (len != sizeof id || read_all(fd, id, sizeof id) < 0)
+        break;
+      session = find_session(((uint64_t) ntohl(id[0]) << 32) | ntohl(id[1]));
+      if (session == NULL ) {
+        fprintf(stderr, "[V] Too many sessions\n");
+        break;
+      }
+      if (verbose)
+        printf("[V] Session %016llx connected at %u\n",
+            (unsigned long long) session->id, session->last);
+      if (send_ack(fd, session->last) < 0)
+        break;
+      continue;
+    }
+    if (session == NULL || (type != FRAME_DATA && type != FRAME_SEGMENT)) {
+      fprintf(stderr, "[V] Unexpected frame type %d\n", type);
+      break;
+    }
+
+    /* Frames resent after a reconnect are read but not stored again */
+    dup = FRAME_SEQ_LE(seq, session->last);
+    if (type == FRAME_DATA) {
+      struct stat live_stat;
+      int out = -1;
+      int res;
+      if (!dup) {
+        char path[1024];
+        pthread_mutex_lock(&live_lock);
+        snprintf(path, sizeof path, "%s/live.dat", store_dir);
+        if ((out = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0
+            || fstat(out, &live_stat) < 0)
+          perror("[V] open");
+      }
+      res = copy_payload(fd, out, len, &crc);
+      if (res == 0 && !dup && crc != ntohl(f.crc)) {
+        fprintf(stderr, "[V] Frame %u failed its checksum\n", seq);
+        res = -1;
+      }
+      if (out >= 0) {
+        /* A torn or corrupt frame is resent whole, so it must not be kept */
+        if (res < 0 && ftruncate(out, live_stat.st_size) < 0)
+          perror("[V] ftruncate");
+        close(out);
+      }
+      if (!dup)
+        pthread_mutex_unlock(&live_lock);
+      if (res < 0)
+        break;
+    } else {
+      char name[256];
+      char path[1024];
+      uint16_t name_len;
+      int out = -1;
+      int res;
+      if (len < sizeof name_len || read_all(fd, &name_len, sizeof name_len) < 0)
+        break;
+      name_len = ntohs(name_len);
+      if (name_len >= sizeof name || name_len + sizeof name_len > len
+          || read_all(fd, name, name_len) < 0)
+        break;
+      name[name_len] = '\0';
+      if (name[0] == '.' || strchr(name, '/') != NULL ) {
+        fprintf(stderr, "[V] Bad segment name \"%s\"\n", name);
+        break;
+      }
+      if (!dup) {
+        snprintf(path, sizeof path, "%s/%s", store_dir, name);
+        if ((out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+          perror("[V] open");
+      }
+      res = copy_payload(fd, out, len - sizeof name_len - name_len, &crc);
+      if (res == 0 && !dup && crc != ntohl(f.crc)) {
+        fprintf(stderr, "[V] Segment %s failed its checksum\n", name);
+        res = -1;
+      }
+      if (out >= 0) {
+        close(out);
+        if (res < 0)
+          unlink(path);
+      }
+      if (res < 0)
+        break;
+      if (verbose > 1 && !dup)
+        printf("[V] Stored segment %s\n", name);
+    }
+
+    if (!dup)
+      session->last = seq;
+    /* Acknowledge once caught up with everything that has arrived */
+    if (poll(&pfd, 1, 0) == 0 && send_ack(fd, session->last) < 0)
+      break;
+  }
+
+  if (verbose && session != NULL )
+    printf("[V] Session %016llx disconnected at %u\n",
+        (unsigned long long) session->id, session->last);
+  close(fd);
+  return NULL ;
+}
+
+/** Looks up a session by id, creating it if it is new. */
+static struct session_st *find_session(uint64_t id) {
+  struct session_st *found = NULL;
+  int i;
+
+  pthread_mutex_lock(&sessions_lock);
+  for (i = 0; i < SESSIONS_MAX && found == NULL ; ++i)
+    if (sessions[i].used && sessions[i].id == id)
+      found = &sessions[i];
+  for (i = 0; i < SESSIONS_MAX && found == NULL ; ++i)
+    if (!sessions[i].used) {
+      found = &sessions[i];
+      found->used = 1;
+      found->id = id;
+      found->last = 0;
+    }
+  pthread_mutex_unlock(&sessions_lock);
+  return found;
+}
+
+/** Reads exactly len bytes. */
+static int read_all(int fd, void *dest, size_t len) {
+  ssize_t got;
+  while (len > 0) {
+    if ((got = read(fd, dest, len)) < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      return -1;
+    dest = (char*) dest + got;
+    len -= got;
+  }
+  return 0;
+}
+
+/**
+ * Copies len payload bytes from the connection to out, or drops them, and
+ * computes their checksum.
+ */
+static int copy_payload(int fd, int out, size_t len, uint32_t *crc) {
+  char buf[COPY_CHUNK];
+  while (len > 0) {
+    size_t chunk = len < sizeof buf ? len : sizeof buf;
+    if (read_all(fd, buf, chunk) < 0)
+      return -1;
+    *crc = crc32c(*crc, buf, chunk);
+    if (out >= 0 && write(out, buf, chunk) != (ssize_t) chunk)
+      perror("[V] write");
+    len -= chunk;
+  }
+  return 0;
+}
+
+/** Sends a cumulative acknowledgement. */
+static int send_ack(int fd, uint32_t seq) {
+  Frame ack;
+  ack.magic = htonl(FRAME_MAGIC);
+  ack.type = htons(FRAME_ACK);
+  ack.flags = 0;
+  ack.seq = htonl(seq);
+  ack.length = 0;
+  ack.crc = 0;
+  return write(fd, &ack, sizeof ack) == sizeof ack ? 0 : -1;
+}
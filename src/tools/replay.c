@@ -0,0 +1,270 @@
+/**
+ * @file replay.c
+ * Replays a capture on a pseudo-terminal.
+ *
+ * The replay tool reads a capture recorded by the consumer (see capture.h) and
+ * writes each recorded read to the master side of a new pseudo-terminal, at
+ * the time it was originally read, so that a client given the slave side as
+ * its data source sees the stream the Firefly produced. The capture can be
+ * played back at its original rate, N times faster, or as fast as the client
+ * reads it, which makes overflow and latency behaviour reproducible from one
+ * build of the client to the next.
+ *
+ * The slave side is kept open and in raw mode for the whole replay, so data
+ * written before the client opens it is held rather than lost. After the last
+ * record the tool waits for the client to read everything written (giving up
+ * if it stops reading for #DRAIN_TIMEOUT seconds), reports how far behind
+ * schedule the replay fell, and exits, which hangs up the client's data
+ * source.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../shared/capture.h"
+
+#define DRAIN_TIMEOUT 5 /**< Seconds to wait for a client that stops reading */
+
+static void usage();
+static int read_header(FILE *in, CaptureHeader *h);
+static int read_varint(FILE *in, uint64_t *v);
+static int write_all(int fd, const char *data, size_t len);
+static int64_t elapsed_us(const struct timespec *from);
+
+/**
+ * Main entrypoint into the replay tool.
+ */
+int main(int argc, char *argv[]) {
+  CaptureHeader hdr;
+  struct timespec start, due;
+  struct termios tio;
+  FILE *in;
+  char *link = NULL, *data = NULL;
+  size_t data_size = 0;
+  double speed = 1;
+  int wait = 2, loops = 1, verbose = 0;
+  int master, slave, loop, stalled, last = -1, c;
+  uint64_t delta, len, offset_us, lag_us = 0, max_lag_us = 0;
+  unsigned long records = 0;
+  unsigned long long bytes = 0;
+
+  while ((c = getopt(argc, argv, "x:w:n:l:vh")) != -1) {
+    switch (c) {
+    case 'x':
+      speed = atof(optarg);
+      break;
+    case 'w':
+      wait = atoi(optarg);
+      break;
+    case 'n':
+      loops = atoi(optarg);
+      break;
+    case 'l':
+      link = optarg;
+      break;
+    case 'v':
+      ++verbose;
+      break;
+    default:
+      usage();
+      exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  }
+  if (optind != argc - 1 || speed < 0 || loops < 1) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  if ((in = fopen(argv[optind], "rb")) == NULL ) {
+    perror("[P] fopen");
+    exit(EXIT_FAILURE);
+  }
+  if (read_header(in, &hdr) < 0) {
+    fprintf(stderr, "[P] %s is not a capture\n", argv[optind]);
+    exit(EXIT_FAILURE);
+  }
+
+  /* Open the pty, and its slave side so nothing is lost before the client */
+  if ((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(master) < 0
+      || unlockpt(master) < 0
+      || (slave = open(ptsname(master), O_RDWR | O_NOCTTY)) < 0) {
+    perror("[P] pty");
+    exit(EXIT_FAILURE);
+  }
+  tcgetattr(slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+  if (link != NULL ) {
+    unlink(link);
+    if (symlink(ptsname(master), link) < 0) {
+      perror("[P] symlink");
+      exit(EXIT_FAILURE);
+    }
+  }
+  printf("[P] Replaying %s on %s", argv[optind], ptsname(master));
+  if (speed == 0)
+    printf(" at full speed\n");
+  else
+    printf(" at %gx\n", speed);
+  fflush(stdout);
+  sleep(wait);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  offset_us = 0;
+  for (loop = 0; loop < loops; ++loop) {
+    fseek(in, sizeof(CaptureHeader), SEEK_SET);
+    while (read_varint(in, &delta) == 0) {
+      if (read_varint(in, &len) < 0)
+        break;
+      if (len > data_size) {
+        data_size = len;
+        if ((data = (char*) realloc(data, data_size)) == NULL ) {
+          perror("[P] realloc");
+          exit(EXIT_FAILURE);
+        }
+      }
+      if (fread(data, 1, len, in) != len)
+        break;
+
+      offset_us += delta;
+      if (speed > 0) {
+        uint64_t at = offset_us / speed;
+        due.tv_sec = start.tv_sec + at / 1000000;
+        due.tv_nsec = start.tv_nsec + (at % 1000000) * 1000;
+        if (due.tv_nsec >= 1000000000) {
+          due.tv_nsec -= 1000000000;
+          ++due.tv_sec;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL )
+            == EINTR)
+          ;
+      }
+
+      if (write_all(master, data, len) < 0) {
+        perror("[P] write");
+        exit(EXIT_FAILURE);
+      }
+      if (speed > 0) {
+        int64_t late = elapsed_us(&start) - (int64_t) (offset_us / speed);
+        lag_us = late > 0 ? late : 0;
+        if (lag_us > max_lag_us)
+          max_lag_us = lag_us;
+        if (verbose > 1)
+          printf("[P] %lu: %llu bytes, %llu us late\n", records,
+              (unsigned long long) len, (unsigned long long) lag_us);
+      }
+      ++records;
+      bytes += len;
+    }
+  }
+
+  /* Wait for the client to take everything, then hang up */
+  for (stalled = 0; stalled < DRAIN_TIMEOUT * 100; ++stalled) {
+    int pending = 0;
+    if (ioctl(slave, TIOCINQ, &pending) < 0 || pending == 0)
+      break;
+    if (pending != last)
+      stalled = 0;
+    last = pending;
+    usleep(10000);
+  }
+  printf("[P] Replayed %lu reads, %llu bytes in %.3f s (captured over "
+      "%.3f s)\n", records, bytes, elapsed_us(&start) / 1e6,
+      offset_us / 1e6 / loops);
+  if (speed > 0)
+    printf("[P] Fell behind schedule by up to %.3f ms\n", max_lag_us / 1e3);
+
+  if (link != NULL )
+    unlink(link);
+  free(data);
+  fclose(in);
+  close(slave);
+  close(master);
+  return EXIT_SUCCESS;
+}
+
+/** Print out help message */
+static void usage() {
+  fprintf(stderr,
+      "Usage: replay [-x <speed>] [-w <secs>] [-n <times>] [-l <link>] [-v] "
+          "<capture>\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr,
+      "  -x SPEED  replay SPEED times faster than captured, 0 for as fast as\n"
+      "            the client reads (default 1)\n");
+  fprintf(stderr,
+      "  -w SECS   wait SECS seconds for the client before starting (default 2)\n");
+  fprintf(stderr, "  -n TIMES  replay the capture TIMES times over (default 1)\n");
+  fprintf(stderr, "  -l LINK   also make LINK a symbolic link to the pty\n");
+  fprintf(stderr, "  -v        increase program output\n");
+}
+
+/** Read and check the capture header. */
+static int read_header(FILE *in, CaptureHeader *h) {
+  unsigned char b[sizeof(CaptureHeader)];
+  int i;
+
+  if (fread(b, sizeof b, 1, in) != 1)
+    return -1;
+  h->magic = b[0] | b[1] << 8 | b[2] << 16 | (uint32_t) b[3] << 24;
+  h->version = b[4] | b[5] << 8;
+  h->flags = b[6] | b[7] << 8;
+  h->start = 0;
+  for (i = 7; i >= 0; --i)
+    h->start = h->start << 8 | b[8 + i];
+  if (h->magic != CAPTURE_MAGIC || h->version != CAPTURE_VERSION)
+    return -1;
+  return 0;
+}
+
+/** Read one varint, returning -1 at the end of the capture. */
+static int read_varint(FILE *in, uint64_t *v) {
+  int b, shift;
+
+  *v = 0;
+  for (shift = 0; shift < 7 * CAPTURE_VARINT_MAX; shift += 7) {
+    if ((b = getc(in)) == EOF)
+      return -1;
+    *v |= (uint64_t) (b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return 0;
+  }
+  return -1;
+}
+
+/** Write all of data to fd. */
+static int write_all(int fd, const char *data, size_t len) {
+  ssize_t n;
+
+  while (len > 0) {
+    if ((n = write(fd, data, len)) < 0) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/** Microseconds since from. */
+static int64_t elapsed_us(const struct timespec *from) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) (now.tv_sec - from->tv_sec) * 1000000
+      + (now.tv_nsec - from->tv_nsec) / 1000;
+}
@@ -0,0 +1,896 @@
+/**
+ * @file standin.c
+ * Local stand-in for the Electrisense ingest server.
+ *
+ * The stand-in accepts the same requests the relay sends to the real server
+ * and stores what it receives under a directory, so that the client can be
+ * exercised without the lab's server.
+ *
+ * Live buffers
+ * ------------
+ * Multipart parts that are not spool segments (the relay names them "buf0"
+ * and "buf1") are appended to live.dat in the store directory. A part with
+ * an X-Electrisense-Codec header of "<codec> <size>" was encoded by the relay
+ * (see codec.h); it is held until all of it is in, decoded to its size and
+ * the samples appended instead.
+ *
+ * Spool segments
+ * --------------
+ * Parts whose file name begins with "client-dump_" or "client-pack_" are
+ * spool segments. Each
+ * one is written to a file of the same name in the store directory as the
+ * bytes arrive, starting at the offset given by the part's Content-Range
+ * header (0 if absent). The acknowledged offset of a segment is the number of
+ * bytes stored for it, which survives a transfer that is cut short. The
+ * response to a POST lists one "<name> <offset>" line per segment part.
+ *
+ * Packs
+ * -----
+ * A pack (see pack.h) holds many dump files. Once one is completely stored
+ * and passes its checksums, it is expanded into the dump files it holds,
+ * which are written to the store directory as if each had been uploaded on
+ * its own. The pack itself is kept, so that it is still acknowledged.
+ *
+ * Checksums
+ * ---------
+ * A part may carry an X-Electrisense-CRC32C header with the CRC-32C of its
+ * contents; for a spool segment this covers the whole file, however it was
+ * split across requests. A live part that fails the check is removed from
+ * live.dat and the request is answered with 422. A segment is checked once all
+ * of it is stored; if it fails, it is emptied and acknowledged at offset 0 so
+ * that the relay sends it again.
+ *
+ * Duplicates
+ * ----------
+ * A part may carry an X-Electrisense-Id header with the id of the buffer it
+ * holds (see buffer.h); dump files and the records of packs hold it in any
+ * case. The stand-in keeps every id it holds, with the name of the segment
+ * it came in (none for a live part, but the bytes it added to live.dat), in
+ * ids.dat in the store directory, so that it remembers them across restarts.
+ * On start, a record cut short at the end of ids.dat and whatever live.dat
+ * holds past the live parts ids.dat accounts for are cut off, since the
+ * stand-in was stopped while writing them. A live part whose buffer is
+ * already held is acknowledged but not kept, and a dump file, whole or from
+ * a pack, whose buffer is held from elsewhere is renamed with a .dup suffix,
+ * where it is still acknowledged. The store then holds each buffer once,
+ * however often the relay sent it: live.dat and the client-dump_ files hold
+ * each buffer exactly once.
+ *
+ * Faults
+ * ------
+ * For stress runs (see stress.c) and the resume check (resume_check.sh),
+ * -f refuses a share of uploads with 503 before reading them, -a stores a share but closes the connection instead
+ * of answering, every other one cut off at a random point of the body, as if
+ * the connection or the answer were lost on the way, and -d holds every
+ * answer back for a random time up to the given milliseconds. What arrived
+ * of a segment cut off is kept and acknowledged; a live part cut off is
+ * taken back out of live.dat.
+ *
+ * Resume queries
+ * --------------
+ * A GET carrying an X-Electrisense-Resume header with a space separated list
+ * of segment names is answered with one "<name> <offset>" line per name, so
+ * that the relay can continue an interrupted upload where the server left
+ * off. Any other GET is answered with an empty 200 response.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../shared/codec.h"
+#include "../shared/crc32c.h"
+#include "../shared/pack.h"
+
+#define HEADER_MAX 8192 /**< Largest request or part header accepted */
+#define BODY_CHUNK 65536 /**< Size of the body parsing window */
+#define ACKS_MAX 4096 /**< Largest acknowledgement response body */
+#define HELD_INITIAL 4096 /**< Initial room in the table of held ids */
+
+/**
+ * A client connection and the request currently being read from it.
+ */
+struct conn_st {
+  int fd; /**< The connected socket */
+  char buf[BODY_CHUNK]; /**< Bytes read from the socket but not yet handled */
+  size_t len; /**< Number of bytes held in buf */
+  size_t remaining; /**< Request body bytes not yet read from the socket */
+  int in_body; /**< Set while reads are limited to the request body */
+  int corrupt; /**< Set if a live part of the request failed its checksum */
+  char acks[ACKS_MAX]; /**< Response body under construction */
+  size_t acks_len; /**< Length of acks */
+};
+
+typedef struct conn_st Conn;
+
+/**
+ * A buffer held, as kept in the table of held ids and in ids.dat.
+ */
+struct held_st {
+  uint64_t id; /**< The buffer's id, 0 for an empty entry */
+  uint32_t where; /**< CRC-32C of the segment name it came in, 0 if live */
+  uint32_t bytes; /**< Bytes it added to live.dat, 0 for a dump file */
+};
+
+typedef struct held_st Held;
+
+static char *store_dir;
+static int verbose;
+static pthread_mutex_t live_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t held_lock = PTHREAD_MUTEX_INITIALIZER;
+static Held *held; /**< Open addressed table of held ids */
+static size_t held_size; /**< Entries in the table, a power of two */
+static size_t held_count; /**< Entries used */
+static int held_fd = -1; /**< ids.dat, appended to */
+static unsigned long duplicates; /**< Duplicates dropped */
+static int fail_pct; /**< Percent of uploads refused */
+static int drop_pct; /**< Percent of uploads stored but not answered */
+static unsigned long aborts; /**< Uploads stored but not answered */
+static int delay_ms; /**< Longest an answer is held back */
+
+static void usage();
+static void *handle_conn(void *arg);
+static int fill(Conn *c);
+static char *find(char *hay, size_t hay_len, const char *needle,
+    size_t needle_len);
+static int header_value(const char *headers, const char *name, char *out,
+    size_t out_len);
+static int handle_multipart(Conn *c, const char *boundary);
+static int store_part(Conn *c, const char *part_headers, const char *delim,
+    size_t delim_len);
+static void add_ack(Conn *c, const char *name, off_t offset);
+static int segment_name_ok(const char *name);
+static int segment_crc_ok(const char *path, off_t size, uint32_t expected);
+static void expand_pack(const char *path, const char *name);
+static off_t stored_size(const char *name);
+static void held_load();
+static Held* held_find(uint64_t id);
+static int held_claim(uint64_t id, const char *name, uint32_t bytes);
+static Held* held_add(uint64_t id, uint32_t where, uint32_t bytes);
+static void set_aside(const char *path, const char *name, uint64_t id);
+static int send_response(Conn *c, int status, const char *reason);
+
+/**
+ * Main entrypoint into the stand-in server.
+ */
+int main(int argc, char *argv[]) {
+  struct sockaddr_in addr;
+  int port = 8080;
+  int sock, opt = 1;
+  int c;
+
+  store_dir = ".";
+  verbose = 0;
+  while ((c = getopt(argc, argv, "p:o:f:a:d:vh")) != -1) {
+    switch (c) {
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'o':
+      store_dir = optarg;
+      break;
+    case 'f':
+      fail_pct = atoi(optarg);
+      break;
+    case 'a':
+      drop_pct = atoi(optarg);
+      break;
+    case 'd':
+      delay_ms = atoi(optarg);
+      break;
+    case 'v':
+      ++verbose;
+      break;
+    default:
+      usage();
+      exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  }
+
+  signal(SIGPIPE, SIG_IGN );
+  crc32c_init();
+  held_load();
+  if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    perror("[S] socket");
+    exit(EXIT_FAILURE);
+  }
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof opt);
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(sock, (struct sockaddr*) &addr, sizeof addr) < 0
+      || listen(sock, 16) < 0) {
+    perror("[S] bind");
+    exit(EXIT_FAILURE);
+  }
+  if (verbose)
+    printf("[S] Listening on port %d, storing in %s\n", port, store_dir);
+
+  while (1) {
+    pthread_t thread;
+    Conn *conn;
+    int fd;
+
+    if ((fd = accept(sock, NULL, NULL )) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("[S] accept");
+      break;
+    }
+    conn = (Conn*) malloc(sizeof(Conn));
+    conn->fd = fd;
+    conn->len = 0;
+    if (pthread_create(&thread, NULL, &handle_conn, conn) != 0) {
+      perror("[S] pthread_create");
+      close(fd);
+      free(conn);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+
+  close(sock);
+  return EXIT_FAILURE;
+}
+
+/** Print out help message */
+static void usage() {
+  fprintf(stderr, "Usage: standin [-p <port>] [-o <dir>] [-f <pct>] [-a <pct>] "
+      "[-d <ms>] [-v]\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "  -p PORT  port to listen on (default 8080)\n");
+  fprintf(stderr, "  -o DIR   directory received data is stored in\n");
+  fprintf(stderr, "  -f PCT   refuse this percent of uploads\n");
+  fprintf(stderr, "  -a PCT   store this percent of uploads, some cut off, "
+      "without answering\n");
+  fprintf(stderr, "  -d MS    hold each answer back up to MS milliseconds\n");
+  fprintf(stderr, "  -v       increase program output\n");
+}
+
+/**
+ * Serve requests on one connection until the client closes it.
+ */
+static void *handle_conn(void *arg) {
+  Conn *c = (Conn*) arg;
+  char headers[HEADER_MAX + 1];
+  char value[HEADER_MAX];
+  char method[16];
+  char *end;
+  unsigned seed = (unsigned) time(NULL ) ^ (unsigned) (uintptr_t) c;
+
+  while (1) {
+    size_t header_len;
+    int status = 200;
+    int roll = rand_r(&seed) % 100;
+
+    /* Read a complete request header */
+    c->in_body = 0;
+    while ((end = find(c->buf, c->len, "\r\n\r\n", 4)) == NULL ) {
+      if (c->len >= HEADER_MAX || fill(c) <= 0)
+        goto done;
+    }
+    header_len = end + 4 - c->buf;
+    memcpy(headers, c->buf, header_len);
+    headers[header_len] = '\0';
+    memmove(c->buf, c->buf + header_len, c->len - header_len);
+    c->len -= header_len;
+    c->acks_len = 0;
+    c->corrupt = 0;
+
+    if (sscanf(headers, "%15s", method) != 1)
+      goto done;
+    c->in_body = 1;
+    c->remaining = 0;
+    if (header_value(headers, "Content-Length", value, sizeof value) == 0)
+      c->remaining = strtoul(value, NULL, 10);
+    /* Part of the body may already be buffered */
+    if (c->remaining >= c->len) {
+      c->remaining -= c->len;
+    } else {
+      c->remaining = 0; /* pipelined requests are not supported */
+      c->len = 0;
+    }
+
+    if (strcmp(method, "GET") == 0) {
+      if (header_value(headers, "X-Electrisense-Resume", value, sizeof value)
+          == 0) {
+        char *name, *save;
+        for (name = strtok_r(value, " ", &save); name != NULL ;
+            name = strtok_r(NULL, " ", &save))
+          if (segment_name_ok(name))
+            add_ack(c, name, stored_size(name));
+      }
+    } else if (strcmp(method, "POST") == 0 && roll < fail_pct) {
+      send_response(c, 503, "Service Unavailable");
+      goto done;
+    } else if (strcmp(method, "POST") == 0) {
+      char boundary[256];
+      char *b;
+      /* Of the uploads whose answer is lost, every other one is cut off */
+      if (roll < fail_pct + drop_pct && __sync_add_and_fetch(&aborts, 1) % 2)
+        c->remaining = rand_r(&seed) % (c->remaining + 1);
+      if (header_value(headers, "Content-Type", value, sizeof value) < 0
+          || (b = strstr(value, "boundary=")) == NULL ) {
+        status = 415;
+      } else {
+        snprintf(boundary, sizeof boundary, "%s", b + 9);
+        if (handle_multipart(c, boundary) < 0)
+          goto done;
+        if (c->corrupt)
+          status = 422;
+      }
+    } else {
+      status = 405;
+    }
+
+    /* Discard whatever is left of the request body */
+    c->len = 0;
+    while (c->remaining > 0)
+      if (fill(c) <= 0)
+        goto done;
+      else
+        c->len = 0;
+
+    if (strcmp(method, "POST") == 0 && roll < fail_pct + drop_pct)
+      goto done; /* stored, but the answer is lost */
+    if (delay_ms > 0)
+      usleep(rand_r(&seed) % delay_ms * 1000);
+    if (send_response(c, status, status == 200 ? "OK" : "Error") < 0)
+      break;
+  }
+
+  done: close(c->fd);
+  free(c);
+  return NULL ;
+}
+
+/**
+ * Reads more of the request from the socket, never past the end of the body.
+ *
+ * @return The number of bytes read, 0 on end of stream, -1 on error
+ */
+static int fill(Conn *c) {
+  size_t want = sizeof c->buf - c->len;
+  ssize_t got;
+
+  if (c->in_body && want > c->remaining)
+    want = c->remaining;
+  if (want == 0)
+    return 0;
+  while ((got = read(c->fd, c->buf + c->len, want)) < 0)
+    if (errno != EINTR)
+      return -1;
+  c->len += got;
+  if (c->in_body)
+    c->remaining -= got;
+  return got;
+}
+
+/** Finds the first occurrence of needle in a buffer that is not a string */
+static char *find(char *hay, size_t hay_len, const char *needle,
+    size_t needle_len) {
+  size_t i;
+  if (hay_len < needle_len)
+    return NULL ;
+  for (i = 0; i <= hay_len - needle_len; ++i)
+    if (hay[i] == needle[0] && memcmp(hay + i, needle, needle_len) == 0)
+      return hay + i;
+  return NULL ;
+}
+
+/**
+ * Copies the value of the named header out of a block of headers.
+ *
+ * @return 0 if the header was found, -1 otherwise
+ */
+static int header_value(const char *headers, const char *name, char *out,
+    size_t out_len) {
+  const char *line = headers;
+  size_t name_len = strlen(name);
+
+  while (line != NULL && *line != '\0') {
+    if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+      const char *v = line + name_len + 1;
+      size_t len;
+      while (*v == ' ')
+        ++v;
+      len = strcspn(v, "\r\n");
+      if (len >= out_len)
+        len = out_len - 1;
+      memcpy(out, v, len);
+      out[len] = '\0';
+      return 0;
+    }
+    if ((line = strstr(line, "\r\n")) != NULL )
+      line += 2;
+  }
+  return -1;
+}
+
+/**
+ * Parses a multipart body as it arrives, storing each part.
+ *
+ * @return 0 if the body was read completely, -1 if the connection failed
+ */
+static int handle_multipart(Conn *c, const char *boundary) {
+  char delim[300];
+  size_t delim_len;
+  char part_headers[HEADER_MAX + 1];
+  char *p;
+
+  /* The first delimiter is not preceded by a line break */
+  delim_len = snprintf(delim, sizeof delim, "--%s", boundary);
+  while ((p = find(c->buf, c->len, delim, delim_len)) == NULL )
+    if (fill(c) <= 0)
+      return -1;
+  delim_len = snprintf(delim, sizeof delim, "\r\n--%s", boundary);
+  p += delim_len - 2;
+
+  while (1) {
+    size_t used;
+
+    /* After a delimiter comes either "--" (end) or a line break */
+    while (c->len - (p - c->buf) < 2) {
+      used = p - c->buf;
+      if (fill(c) <= 0)
+        return -1;
+      p = c->buf + used;
+    }
+    if (p[0] == '-' && p[1] == '-')
+      return 0;
+
+    /* Part headers */
+    used = p + 2 - c->buf;
+    memmove(c->buf, c->buf + used, c->len - used);
+    c->len -= used;
+    while ((p = find(c->buf, c->len, "\r\n\r\n", 4)) == NULL )
+      if (c->len >= HEADER_MAX || fill(c) <= 0)
+        return -1;
+    used = p + 4 - c->buf;
+    memcpy(part_headers, c->buf, used);
+    part_headers[used] = '\0';
+    memmove(c->buf, c->buf + used, c->len - used);
+    c->len -= used;
+
+    if (store_part(c, part_headers, delim, delim_len) < 0)
+      return -1;
+    p = c->buf + delim_len;
+  }
+}
+
+/**
+ * Stores the data of one part, leaving the delimiter that ends it at the
+ * start of the connection buffer.
+ *
+ * @return 0 if the part was read completely, -1 if the connection failed
+ */
+static int store_part(Conn *c, const char *part_headers, const char *delim,
+    size_t delim_len) {
+  char disposition[HEADER_MAX];
+  char range[128];
+  char value[64];
+  char name[256] = "";
+  char path[1024];
+  off_t offset = 0;
+  off_t total = -1; /* size of the whole segment, if known */
+  off_t live_size = 0;
+  struct stat live_stat;
+  uint32_t expected = 0, crc = 0;
+  int has_crc = 0;
+  int segment = 0;
+  int codec = CODEC_RAW;
+  size_t size = 0; /* bytes an encoded part decodes to */
+  char *coded = NULL; /* an encoded part, held until all of it is in */
+  size_t coded_len = 0;
+  uint64_t id = 0;
+  int duplicate = 0, failed = 0, cut;
+  int fd = -1;
+  char *p;
+
+  if (header_value(part_headers, CRC32C_HEADER, value, sizeof value) == 0)
+    has_crc = sscanf(value, "%" SCNx32, &expected) == 1;
+  if (header_value(part_headers, BUFFER_ID_HEADER, value, sizeof value) == 0
+      && sscanf(value, "%" SCNx64, &id) != 1)
+    id = 0;
+  if (header_value(part_headers, CODEC_HEADER, value, sizeof value) == 0
+      && sscanf(value, "%d %zu", &codec, &size) != 2)
+    codec = -1;
+
+  if (header_value(part_headers, "Content-Disposition", disposition,
+      sizeof disposition) == 0 && (p = strstr(disposition, "filename=\""))
+      != NULL ) {
+    p += 10;
+    snprintf(name, sizeof name, "%.*s", (int) strcspn(p, "\""), p);
+  }
+  if ((strncmp(name, "client-dump_", 12) == 0
+      || strncmp(name, "client-pack_", 12) == 0) && segment_name_ok(name)) {
+    struct stat seg_stat;
+    segment = 1;
+    if (header_value(part_headers, "Content-Range", range, sizeof range) == 0) {
+      intmax_t from, to, size;
+      if (sscanf(range, "bytes %jd-%jd/%jd", &from, &to, &size) == 3) {
+        offset = from;
+        total = size;
+      }
+    }
+    snprintf(path, sizeof path, "%s/%s", store_dir, name);
+    fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (fd >= 0 && fstat(fd, &seg_stat) == 0 && offset > seg_stat.st_size) {
+      /* A gap would be acknowledged as stored. Refuse the part. */
+      fprintf(stderr, "[S] %s: offset %jd past stored %jd\n", name,
+          (intmax_t) offset, (intmax_t) seg_stat.st_size);
+      close(fd);
+      fd = -1;
+    }
+  } else {
+    pthread_mutex_lock(&live_lock);
+    snprintf(path, sizeof path, "%s/live.dat", store_dir);
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd >= 0 && fstat(fd, &live_stat) == 0)
+      live_size = live_stat.st_size;
+    /* Read past rather than stored; checked again once it is all in */
+    pthread_mutex_lock(&held_lock);
+    duplicate = id != 0 && held_find(id)->id == id;
+    pthread_mutex_unlock(&held_lock);
+  }
+  if (fd < 0)
+    perror("[S] open");
+
+  while (1) {
+    size_t keep, out;
+    p = find(c->buf, c->len, delim, delim_len);
+    /* Everything before a possible partial delimiter is data */
+    out = p != NULL ? (size_t) (p - c->buf) :
+        (c->len >= delim_len ? c->len - delim_len + 1 : 0);
+    if (out > 0 && duplicate) {
+      /* already held */
+    } else if (out > 0 && fd >= 0 && !segment && codec != CODEC_RAW) {
+      char *grown = (char*) realloc(coded, coded_len + out);
+      if (grown == NULL ) {
+        perror("[S] realloc");
+        close(fd);
+        fd = -1;
+      } else {
+        memcpy(grown + coded_len, c->buf, out);
+        coded = grown;
+        coded_len += out;
+        crc = crc32c(crc, c->buf, out);
+      }
+    } else if (out > 0 && fd >= 0) {
+      if ((segment ? pwrite(fd, c->buf, out, offset) : write(fd, c->buf, out))
+          != (ssize_t) out)
+        perror("[S] write");
+      offset += out;
+      if (!segment)
+        crc = crc32c(crc, c->buf, out);
+    }
+    keep = c->len - out;
+    memmove(c->buf, c->buf + out, keep);
+    c->len = keep;
+    if (p != NULL || fill(c) <= 0)
+      break;
+  }
+  cut = p == NULL; /* the connection was lost before the end of the part */
+
+  if (duplicate) {
+    if (verbose)
+      printf("[S] Buffer %016" PRIx64 " already held, live part dropped "
+          "(%lu duplicates)\n", id, __sync_add_and_fetch(&duplicates, 1));
+  } else if (!segment && fd >= 0 && cut) {
+    if (ftruncate(fd, live_size) < 0)
+      perror("[S] ftruncate");
+    failed = 1;
+  } else if (!segment && fd >= 0 && has_crc && crc != expected) {
+    fprintf(stderr, "[S] Live part failed its checksum\n");
+    if (ftruncate(fd, live_size) < 0)
+      perror("[S] ftruncate");
+    c->corrupt = failed = 1;
+  } else if (!segment && fd >= 0 && codec != CODEC_RAW) {
+    char *samples = (char*) malloc(size > 0 ? size : 1);
+    if (samples == NULL || codec_decode(codec, coded, coded_len, samples, size)
+        < 0) {
+      fprintf(stderr, "[S] Live part failed to decode\n");
+      c->corrupt = failed = 1;
+    } else if (write(fd, samples, size) != (ssize_t) size)
+      perror("[S] write");
+    free(samples);
+  }
+  /* Held from a dump file meanwhile: take it back out */
+  if (!segment && fd >= 0 && !duplicate && !failed && id != 0
+      && fstat(fd, &live_stat) == 0
+      && !held_claim(id, NULL, live_stat.st_size - live_size)) {
+    if (ftruncate(fd, live_size) < 0)
+      perror("[S] ftruncate");
+    if (verbose)
+      printf("[S] Buffer %016" PRIx64 " already held, live part dropped "
+          "(%lu duplicates)\n", id, __sync_add_and_fetch(&duplicates, 1));
+  }
+  free(coded);
+  if (fd >= 0)
+    close(fd);
+  if (segment) {
+    struct stat seg_stat;
+    off_t stored = stat(path, &seg_stat) == 0 ? seg_stat.st_size : 0;
+    if (total < 0 && !cut)
+      total = offset; /* the part held the whole segment */
+    if (has_crc && stored == total && !segment_crc_ok(path, stored, expected)) {
+      fprintf(stderr, "[S] %s failed its checksum\n", name);
+      if (truncate(path, 0) < 0)
+        perror("[S] truncate");
+      stored = 0;
+    }
+    if (stored > 0 && stored == total && strncmp(name, "client-pack_", 12) == 0)
+      expand_pack(path, name);
+    else if (stored == sizeof(Buffer) && stored == total) {
+      Buffer head;
+      if (id == 0 && (fd = open(path, O_RDONLY)) >= 0) {
+        if (pread(fd, &head, offsetof(Buffer, data), 0)
+            == (ssize_t) offsetof(Buffer, data))
+          id = head.id;
+        close(fd);
+      }
+      if (id != 0 && !held_claim(id, name, 0))
+        set_aside(path, name, id);
+    }
+    add_ack(c, name, stored);
+    if (verbose > 1)
+      printf("[S] %s stored up to %jd\n", name, (intmax_t) stored);
+  } else {
+    pthread_mutex_unlock(&live_lock);
+  }
+
+  return find(c->buf, c->len, delim, delim_len) == c->buf ? 0 : -1;
+}
+
+/** Appends an acknowledgement line to the response body */
+static void add_ack(Conn *c, const char *name, off_t offset) {
+  int n = snprintf(c->acks + c->acks_len, sizeof c->acks - c->acks_len,
+      "%s %jd\n", name, (intmax_t) offset);
+  if (n > 0 && c->acks_len + n < sizeof c->acks)
+    c->acks_len += n;
+}
+
+/** Only plain file names may be used as segment names */
+static int segment_name_ok(const char *name) {
+  return *name != '\0' && *name != '.' && strchr(name, '/') == NULL;
+}
+
+/** Checks a stored segment against the checksum the relay sent */
+static int segment_crc_ok(const char *path, off_t size, uint32_t expected) {
+  char buf[BODY_CHUNK];
+  uint32_t crc = 0;
+  off_t at = 0;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return 0;
+  while (at < size) {
+    ssize_t got = pread(fd, buf, sizeof buf, at);
+    if (got <= 0)
+      break;
+    crc = crc32c(crc, buf, got);
+    at += got;
+  }
+  close(fd);
+  return at == size && crc == expected;
+}
+
+/** Writes out the dump files held in a completely stored pack */
+static void expand_pack(const char *path, const char *name) {
+  struct stat pack_stat;
+  char *data = NULL;
+  Buffer *b = NULL;
+  ssize_t got = -1;
+  int records, i, fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &pack_stat) < 0
+      || (data = malloc(pack_stat.st_size)) == NULL
+      || (b = malloc(sizeof *b)) == NULL ) {
+    perror("[S] expand");
+    goto done;
+  }
+  got = pread(fd, data, pack_stat.st_size, 0);
+  if (got != pack_stat.st_size
+      || (records = pack_verify(data, pack_stat.st_size)) < 0) {
+    fprintf(stderr, "[S] %s is not a valid pack\n", name);
+    goto done;
+  }
+  for (i = 0; i < records; ++i) {
+    PackEntry e;
+    char dump_name[PACK_NAME_MAX];
+    char dump_path[1024];
+    int out;
+
+    pack_entry(data, pack_stat.st_size, i, &e);
+    if (pack_expand(data, pack_stat.st_size, i, b) < 0) {
+      fprintf(stderr, "[S] %s: record %d is malformed\n", name, i);
+      continue;
+    }
+    pack_name(dump_name, "client-dump_", e.stamp);
+    snprintf(dump_path, sizeof dump_path, "%s/%s%s", store_dir, dump_name,
+        b->id != 0 && !held_claim(b->id, dump_name, 0) ? ".dup" : "");
+    if ((out = open(dump_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0
+        || write(out, b, sizeof *b) != (ssize_t) sizeof *b)
+      perror("[S] expand");
+    if (out >= 0)
+      close(out);
+  }
+  if (verbose)
+    printf("[S] %s expanded into %d dump files\n", name, records);
+
+done:
+  if (fd >= 0)
+    close(fd);
+  free(data);
+  free(b);
+}
+
+/**
+ * Gets the bytes stored of a segment, which may have been set aside as a
+ * duplicate.
+ */
+static off_t stored_size(const char *name) {
+  char path[1024];
+  struct stat seg_stat;
+
+  snprintf(path, sizeof path, "%s/%s", store_dir, name);
+  if (stat(path, &seg_stat) == 0)
+    return seg_stat.st_size;
+  snprintf(path, sizeof path, "%s/%s.dup", store_dir, name);
+  return stat(path, &seg_stat) == 0 ? seg_stat.st_size : 0;
+}
+
+/** Reads the ids held before a restart, and opens ids.dat to add to it */
+static void held_load() {
+  char path[1024];
+  struct stat st;
+  off_t whole = 0, live = 0;
+  int sized = 1;
+  Held h;
+  int fd;
+
+  snprintf(path, sizeof path, "%s/ids.dat", store_dir);
+  if ((fd = open(path, O_RDONLY)) >= 0) {
+    while (read(fd, &h, sizeof h) == sizeof h) {
+      whole += sizeof h;
+      if (h.where == 0) {
+        live += h.bytes;
+        sized &= h.bytes > 0; /* kept by a stand-in that did not count */
+      }
+      if (h.id != 0 && held_find(h.id)->id != h.id)
+        held_add(h.id, h.where, h.bytes);
+    }
+    close(fd);
+    if (truncate(path, whole) < 0)
+      perror("[S] ids.dat");
+  }
+  snprintf(path, sizeof path, "%s/live.dat", store_dir);
+  if (sized && stat(path, &st) == 0 && st.st_size > live) {
+    fprintf(stderr, "[S] Cutting live.dat back from %jd to %jd bytes\n",
+        (intmax_t) st.st_size, (intmax_t) live);
+    if (truncate(path, live) < 0)
+      perror("[S] live.dat");
+  }
+  snprintf(path, sizeof path, "%s/ids.dat", store_dir);
+  if ((held_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0)
+    perror("[S] ids.dat");
+  if (verbose)
+    printf("[S] Holding %zu buffers from earlier runs\n", held_count);
+}
+
+/**
+ * Finds the entry of an id in the table, or the empty entry where it would
+ * go. The caller holds held_lock, or is the only thread.
+ */
+static Held* held_find(uint64_t id) {
+  size_t i;
+
+  if (held_size == 0) {
+    held_size = HELD_INITIAL;
+    if ((held = (Held*) calloc(held_size, sizeof *held)) == NULL ) {
+      perror("[S] calloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (i = (size_t) (id ^ id >> 29) & (held_size - 1);
+      held[i].id != 0 && held[i].id != id; i = (i + 1) & (held_size - 1))
+    ;
+  return &held[i];
+}
+
+/**
+ * Claims a buffer for a segment name, or for live.dat if NULL.
+ *
+ * @param bytes Bytes the buffer added to live.dat
+ * @return Non-zero if it is now held there, 0 if it is held elsewhere
+ */
+static int held_claim(uint64_t id, const char *name, uint32_t bytes) {
+  uint32_t where = name != NULL ? crc32c(0, name, strlen(name)) : 0;
+  Held *h;
+  int ret = 1;
+
+  pthread_mutex_lock(&held_lock);
+  if ((h = held_find(id))->id == id)
+    ret = h->where == where && name != NULL; /* the same dump sent again */
+  else {
+    h = held_add(id, where, bytes);
+    if (held_fd >= 0 && write(held_fd, h, sizeof *h) != sizeof *h)
+      perror("[S] ids.dat");
+  }
+  pthread_mutex_unlock(&held_lock);
+  return ret;
+}
+
+/**
+ * Adds an id not yet held to the table, keeping it at most half full. The
+ * caller holds held_lock, or is the only thread.
+ */
+static Held* held_add(uint64_t id, uint32_t where, uint32_t bytes) {
+  Held *h;
+
+  if (2 * (held_count + 1) > held_size && held_size != 0) {
+    Held *old = held;
+    size_t old_size = held_size, i;
+    held_size *= 2;
+    if ((held = (Held*) calloc(held_size, sizeof *held)) == NULL ) {
+      perror("[S] calloc");
+      exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < old_size; ++i)
+      if (old[i].id != 0)
+        *held_find(old[i].id) = old[i];
+    free(old);
+  }
+  h = held_find(id);
+  h->id = id;
+  h->where = where;
+  h->bytes = bytes;
+  ++held_count;
+  return h;
+}
+
+/** Renames a dump file whose buffer is held from elsewhere */
+static void set_aside(const char *path, const char *name, uint64_t id) {
+  char dup[1024];
+
+  snprintf(dup, sizeof dup, "%s.dup", path);
+  if (rename(path, dup) < 0)
+    perror("[S] rename");
+  if (verbose)
+    printf("[S] Buffer %016" PRIx64 " already held, %s set aside "
+        "(%lu duplicates)\n", id, name, __sync_add_and_fetch(&duplicates, 1));
+}
+
+/**
+ * Sends the response for the current request, with the acknowledgement lines
+ * as its body.
+ */
+static int send_response(Conn *c, int status, const char *reason) {
+  char header[256];
+  int n = snprintf(header, sizeof header, "HTTP/1.1 %d %s\r\n"
+      "Content-Type: text/plain\r\nContent-Length: %zu\r\n\r\n", status,
+      reason, c->acks_len);
+
+  if (write(c->fd, header, n) != n)
+    return -1;
+  if (c->acks_len > 0 && write(c->fd, c->acks, c->acks_len) != c->acks_len)
+    return -1;
+  return 0;
+}
@@ -0,0 +1,791 @@
+/**
+ * @file stress.c
+ * Stress run of the client against the stand-in server, with faults.
+ *
+ * The stress tool runs the real client, built with FAULTS=1 (see fault.h),
+ * against the stand-in server (see standin.c) for a series of phases, each
+ * injecting one kind of fault, and then checks that every byte the client
+ * read reached the store exactly once.
+ *
+ * A writer process feeds the client's data source, a FIFO, as fast as the
+ * client takes it or at a given rate, with a stream in which every 32-bit
+ * word is determined by its position: word i is i * #PATTERN_STEP. The phases
+ * are, in order:
+ *
+ *   - baseline: no faults.
+ *   - handoff: the consumer stalls between filling a buffer and marking it
+ *     full, and the relay between finding it full and sealing it, so that
+ *     the two meet at every point of the handoff.
+ *   - server-errors: the stand-in refuses a share of uploads with 503.
+ *   - lost-acks: the stand-in stores a share of uploads but does not answer.
+ *   - server-delay: the stand-in holds each answer back.
+ *   - relay-kills: the relay, or the standby with -S, is killed every few
+ *     seconds, with the handoff stalls on.
+ *   - sd-errors: the stand-in refuses every upload and a share of dump file
+ *     writes fail.
+ *   - recover: no faults, until the spool is empty.
+ *
+ * The stand-in is restarted with each phase's options, so its restarts are
+ * faults too. After each phase a line of key=value pairs gives its length,
+ * the rate the source was read at, the rate data reached the store, the dump
+ * files left in the spool and the relays killed.
+ *
+ * Then the writer stops, the client is stopped, and a second client with an
+ * idle source uploads whatever was spooled on the way out. The check splits
+ * live.dat into buffers by the live records of the stand-in's ids.dat, adds
+ * the dump files stored, and orders the buffers of each run of the consumer
+ * by id. Each buffer's checksum must hold and its data must follow the
+ * pattern, each must start where the one before it ended, none may be held
+ * twice, and ids missing from a run may only be buffers the client reported
+ * dropped (the dropped count of the metrics snapshots). A final line gives
+ * the counts and "result=ok" or "result=FAIL", which is also the exit status.
+ *
+ *     make clean && make FAULTS=1 x86 tools
+ *     bin/x86_stress -t 10 -d /tmp/stress
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../shared/buffer.h"
+#include "../shared/crc32c.h"
+#include "../shared/fault.h"
+
+/** Multiplier giving the pattern word at each position */
+#define PATTERN_STEP 2654435761u
+/** Its inverse modulo 2^32, finding the position of a pattern word */
+#define PATTERN_INVERSE 244002641u
+/** Bytes the writer writes at once */
+#define WRITE_CHUNK 4096
+/** Most buffers the check holds */
+#define MAX_PIECES (1 << 20)
+/** Seconds the client is given to stop */
+#define STOP_TIMEOUT 30
+
+/**
+ * A phase of the run.
+ */
+struct phase_st {
+  const char *name; /**< Printed in the report */
+  int fail_pct; /**< Stand-in -f */
+  int drop_pct; /**< Stand-in -a */
+  int delay_ms; /**< Stand-in -d */
+  const char *faults; /**< Contents of the fault file */
+  int kills; /**< Non-zero to kill relays */
+};
+
+typedef struct phase_st Phase;
+
+/**
+ * A record of the stand-in's ids.dat.
+ */
+struct held_st {
+  uint64_t id;
+  uint32_t where; /**< 0 for a live part */
+  uint32_t bytes; /**< Bytes the live part added to live.dat */
+};
+
+typedef struct held_st Held;
+
+/**
+ * A buffer found in the store.
+ */
+struct piece_st {
+  uint64_t id;
+  uint64_t start; /**< Stream offset of its first byte */
+  uint32_t size; /**< Bytes of data */
+  int bad; /**< Non-zero if it failed its checksum or the pattern */
+};
+
+typedef struct piece_st Piece;
+
+/**
+ * Counts shared with the writer.
+ */
+struct source_st {
+  volatile uint64_t written; /**< Bytes written to the data source */
+};
+
+typedef struct source_st Source;
+
+static const Phase phases[] = {
+  { "baseline", 0, 0, 0, "", 0 },
+  { "handoff", 0, 0, 0, "fill_delay 5000\nseal_delay 5000\n", 0 },
+  { "server-errors", 30, 0, 0, "", 0 },
+  { "lost-acks", 0, 30, 0, "", 0 },
+  { "server-delay", 0, 0, 400, "", 0 },
+  { "relay-kills", 0, 0, 0, "fill_delay 2000\nseal_delay 2000\n", 1 },
+  { "sd-errors", 100, 0, 0, "spool_write 30\n", 0 },
+  { "recover", 0, 0, 0, "", 0 }
+};
+
+static const char *bin_dir = "bin"; /**< Where the client and stand-in are */
+static char work[512]; /**< Working directory */
+static int port = 18090; /**< Stand-in port */
+
+static void usage();
+static void prepare(int rate);
+static pid_t start_writer(Source *source, long rate);
+static pid_t start_standin(const Phase *p);
+static pid_t start_client(const char *source, const char *metrics,
+    int standby);
+static void set_faults(const char *faults);
+static int stop(pid_t pid, int sig, int timeout);
+static int kill_relay(pid_t client, unsigned *seed);
+static int spool_files();
+static uint64_t delivered();
+static double now_s();
+static int verify();
+static int read_pieces(Piece *pieces, int *n);
+static int add_piece(Piece *pieces, int *n, uint64_t id, const char *data,
+    uint32_t size, int bad);
+static int piece_order(const void *a, const void *b);
+static unsigned long metric(const char *file, const char *key);
+
+/**
+ * Main entrypoint into the stress tool.
+ */
+int main(int argc, char *argv[]) {
+  const char *dir = "/tmp/stress";
+  char path[1024], metrics[1024];
+  long rate = 1 << 20;
+  int seconds = 10, standby = 0, verify_only = 0, failed = 0, left;
+  unsigned seed = (unsigned) time(NULL ) ^ (unsigned) getpid();
+  pid_t writer, client, standin = -1;
+  Source *source;
+  size_t i;
+  int c;
+
+  while ((c = getopt(argc, argv, "b:d:p:t:r:SVh")) != -1) {
+    switch (c) {
+    case 'b':
+      bin_dir = optarg;
+      break;
+    case 'd':
+      dir = optarg;
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 't':
+      seconds = atoi(optarg);
+      break;
+    case 'r':
+      rate = atol(optarg);
+      break;
+    case 'S':
+      standby = 1;
+      break;
+    case 'V':
+      verify_only = 1;
+      break;
+    default:
+      usage();
+      exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  }
+  snprintf(work, sizeof work, "%s", dir);
+  crc32c_init();
+  if (verify_only)
+    exit(verify() == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+
+  signal(SIGPIPE, SIG_IGN );
+  prepare(rate);
+  source = (Source*) mmap(NULL, sizeof(Source), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (source == MAP_FAILED) {
+    perror("mmap");
+    exit(EXIT_FAILURE);
+  }
+  memset(source, 0, sizeof *source);
+  set_faults("");
+  snprintf(path, sizeof path, "%s/source", work);
+  snprintf(metrics, sizeof metrics, "%s/metrics", work);
+  writer = start_writer(source, rate);
+  client = start_client(path, metrics, standby);
+
+  for (i = 0; i < sizeof phases / sizeof phases[0] && !failed; ++i) {
+    const Phase *p = &phases[i];
+    int last = i == sizeof phases / sizeof phases[0] - 1, kills = 0;
+    double start = now_s(), next_kill = start + 1, elapsed;
+    uint64_t read_from = source->written, stored_from = delivered();
+    int status;
+
+    if (standin > 0)
+      stop(standin, SIGKILL, 5);
+    standin = start_standin(p);
+    set_faults(p->faults);
+    while ((elapsed = now_s() - start) < seconds
+        || (last && spool_files() > 0 && elapsed < 6 * seconds)) {
+      usleep(100000);
+      if (waitpid(client, &status, WNOHANG) == client) {
+        fprintf(stderr, "Client exited during %s\n", p->name);
+        failed = 1;
+        break;
+      }
+      if (p->kills && now_s() >= next_kill) {
+        kills += kill_relay(client, &seed);
+        next_kill = now_s() + 1 + rand_r(&seed) % 2000 / 1000.0;
+      }
+    }
+    elapsed = now_s() - start;
+    printf("phase %s seconds=%.1f source_Bps=%.0f delivered_Bps=%.0f "
+        "spool_files=%d kills=%d client=%s\n", p->name, elapsed,
+        (source->written - read_from) / elapsed,
+        (delivered() - stored_from) / elapsed, spool_files(), kills,
+        failed ? "exited" : "running");
+    fflush(stdout);
+  }
+
+  /* Stop the source first, so whatever the client read is all it gets */
+  stop(writer, SIGTERM, 5);
+  if (!failed && stop(client, SIGTERM, STOP_TIMEOUT) < 0) {
+    fprintf(stderr, "Client did not stop in %d s\n", STOP_TIMEOUT);
+    failed = 1;
+  }
+
+  /* Upload what was spooled on the way out */
+  snprintf(path, sizeof path, "%s/idle", work);
+  snprintf(metrics, sizeof metrics, "%s/flush.metrics", work);
+  client = start_client(path, metrics, 0);
+  for (i = 0, left = spool_files(); left > 0 && i < STOP_TIMEOUT * 10; ++i) {
+    usleep(100000);
+    if (spool_files() < left) {
+      left = spool_files();
+      i = 0; /* as long as it keeps going */
+    }
+  }
+  stop(client, SIGTERM, STOP_TIMEOUT);
+  stop(standin, SIGTERM, 5);
+  printf("flush spool_files=%d\n", spool_files());
+
+  munmap(source, sizeof *source);
+  if (verify() < 0 || failed)
+    exit(EXIT_FAILURE);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Prints the usage of the stress tool.
+ */
+static void usage() {
+  fprintf(stderr, "Usage: stress [-b <dir>] [-d <dir>] [-p <port>] "
+      "[-t <seconds>] [-r <rate>] [-S] [-V]\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "  -b DIR   directory of x86_client and x86_standin "
+      "(default bin)\n");
+  fprintf(stderr, "  -d DIR   working directory, emptied first "
+      "(default /tmp/stress)\n");
+  fprintf(stderr, "  -p PORT  stand-in port (default 18090)\n");
+  fprintf(stderr, "  -t SEC   length of each phase (default 10)\n");
+  fprintf(stderr, "  -r RATE  source bytes per second, 0 for as fast as "
+      "the client reads (default 1048576)\n");
+  fprintf(stderr, "  -S       run the client with a standby relay\n");
+  fprintf(stderr, "  -V       only check the store of an earlier run\n");
+}
+
+/**
+ * Empties the working directory and creates the FIFOs, spool, store and
+ * client configuration in it.
+ */
+static void prepare(int rate) {
+  char path[2048];
+  FILE *f;
+
+  snprintf(path, sizeof path, "rm -rf '%s' && mkdir -p '%s/spool' '%s/store'",
+      work, work, work);
+  if (system(path) != 0) {
+    fprintf(stderr, "Cannot prepare %s\n", work);
+    exit(EXIT_FAILURE);
+  }
+  snprintf(path, sizeof path, "%s/source", work);
+  if (mkfifo(path, 0644) < 0) {
+    perror("mkfifo");
+    exit(EXIT_FAILURE);
+  }
+  snprintf(path, sizeof path, "%s/idle", work);
+  if (mkfifo(path, 0644) < 0) {
+    perror("mkfifo");
+    exit(EXIT_FAILURE);
+  }
+
+  /* Small reads and buffers, so that buffers change hands often */
+  snprintf(path, sizeof path, "%s/client.conf", work);
+  if ((f = fopen(path, "w")) == NULL ) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  fprintf(f, "read_size = 16384\n");
+  fprintf(f, "read_wait_us = %d\n", rate > 0 ? 2000 : 0);
+  fprintf(f, "buffer_capacity = 65536\n");
+  fprintf(f, "retry_wait_ms = 200\n");
+  fprintf(f, "compact_files = 0\n");
+  fprintf(f, "live_codec = 3\n");
+  fprintf(f, "server = http://127.0.0.1:%d/\n", port);
+  fclose(f);
+}
+
+/**
+ * Forks the writer, which feeds the pattern to the data source.
+ *
+ * @param rate Bytes per second, 0 for as fast as it is read
+ */
+static pid_t start_writer(Source *source, long rate) {
+  char path[1024];
+  uint32_t chunk[WRITE_CHUNK / 4];
+  uint64_t word = 0;
+  double start;
+  pid_t pid;
+  int fd, i;
+
+  if ((pid = fork()) != 0)
+    return pid;
+
+  signal(SIGPIPE, SIG_DFL );
+  snprintf(path, sizeof path, "%s/source", work);
+  if ((fd = open(path, O_WRONLY)) < 0) {
+    perror(path);
+    _exit(EXIT_FAILURE);
+  }
+  start = now_s();
+  while (1) {
+    const char *p = (const char*) chunk;
+    size_t left = sizeof chunk;
+    ssize_t n;
+
+    for (i = 0; i < WRITE_CHUNK / 4; ++i)
+      chunk[i] = htole32((uint32_t) (word + i) * PATTERN_STEP);
+    while (left > 0) {
+      if ((n = write(fd, p, left)) < 0) {
+        if (errno == EINTR)
+          continue;
+        _exit(EXIT_SUCCESS); /* the client has gone */
+      }
+      p += n;
+      left -= n;
+      source->written += n;
+    }
+    word += WRITE_CHUNK / 4;
+    if (rate > 0) {
+      double due = start + (double) source->written / rate - now_s();
+      if (due > 0)
+        usleep(due * 1000000);
+    }
+  }
+}
+
+/**
+ * Starts the stand-in with a phase's options.
+ */
+static pid_t start_standin(const Phase *p) {
+  char prog[1024], store[1024], log[1024], port_s[16], fail[16], drop[16],
+      delay[16];
+  pid_t pid;
+  int fd;
+
+  snprintf(prog, sizeof prog, "%s/x86_standin", bin_dir);
+  snprintf(store, sizeof store, "%s/store", work);
+  snprintf(log, sizeof log, "%s/standin.log", work);
+  snprintf(port_s, sizeof port_s, "%d", port);
+  snprintf(fail, sizeof fail, "%d", p->fail_pct);
+  snprintf(drop, sizeof drop, "%d", p->drop_pct);
+  snprintf(delay, sizeof delay, "%d", p->delay_ms);
+  if ((pid = fork()) != 0) {
+    usleep(200000); /* time to listen */
+    return pid;
+  }
+  if ((fd = open(log, O_WRONLY | O_CREAT | O_APPEND, 0644)) >= 0) {
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    close(fd);
+  }
+  execl(prog, prog, "-p", port_s, "-o", store, "-f", fail, "-a", drop, "-d",
+      delay, (char*) NULL );
+  perror(prog);
+  _exit(EXIT_FAILURE);
+}
+
+/**
+ * Starts the client on a data source, with the faults file set.
+ */
+static pid_t start_client(const char *source, const char *metrics,
+    int standby) {
+  char prog[1024], spool[1024], conf[1024], log[1024], faults[1024];
+  pid_t pid;
+  int fd;
+
+  snprintf(prog, sizeof prog, "%s/x86_client", bin_dir);
+  snprintf(spool, sizeof spool, "%s/spool", work);
+  snprintf(conf, sizeof conf, "%s/client.conf", work);
+  snprintf(log, sizeof log, "%s/client.log", work);
+  snprintf(faults, sizeof faults, "%s/faults", work);
+  if ((pid = fork()) != 0)
+    return pid;
+  setenv(FAULT_ENV, faults, 1);
+  if ((fd = open(log, O_WRONLY | O_CREAT | O_APPEND, 0644)) >= 0) {
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    close(fd);
+  }
+  if (standby)
+    execl(prog, prog, "-d", source, "-e", spool, "-C", conf, "-m", metrics,
+        "-S", (char*) NULL );
+  else
+    execl(prog, prog, "-d", source, "-e", spool, "-C", conf, "-m", metrics,
+        (char*) NULL );
+  perror(prog);
+  _exit(EXIT_FAILURE);
+}
+
+/**
+ * Replaces the fault file, which the client rereads within
+ * #FAULT_CHECK_MS.
+ */
+static void set_faults(const char *faults) {
+  char path[1024], tmp[1024];
+  FILE *f;
+
+  snprintf(path, sizeof path, "%s/faults", work);
+  snprintf(tmp, sizeof tmp, "%s/faults.new", work);
+  if ((f = fopen(tmp, "w")) == NULL ) {
+    perror(tmp);
+    return;
+  }
+  fputs(faults, f);
+  fclose(f);
+  if (rename(tmp, path) < 0)
+    perror(path);
+}
+
+/**
+ * Sends a process a signal and waits for it, killing it after a timeout.
+ *
+ * @return 0 if it exited in time, -1 if it had to be killed
+ */
+static int stop(pid_t pid, int sig, int timeout) {
+  int i, status;
+
+  kill(pid, sig);
+  for (i = 0; i < timeout * 10; ++i) {
+    if (waitpid(pid, &status, WNOHANG) == pid)
+      return 0;
+    usleep(100000);
+  }
+  kill(pid, SIGKILL);
+  waitpid(pid, &status, 0);
+  return -1;
+}
+
+/**
+ * Kills one of the client's children, the relay or a standby, with SIGKILL.
+ *
+ * @return 1 if one was killed, 0 otherwise
+ */
+static int kill_relay(pid_t client, unsigned *seed) {
+  pid_t children[8];
+  char path[300], line[512], *p;
+  struct dirent *entry;
+  int n = 0, ppid;
+  DIR *proc;
+  FILE *f;
+
+  if ((proc = opendir("/proc")) == NULL )
+    return 0;
+  while ((entry = readdir(proc)) != NULL && n < 8) {
+    if (entry->d_name[0] < '0' || entry->d_name[0] > '9')
+      continue;
+    snprintf(path, sizeof path, "/proc/%s/stat", entry->d_name);
+    if ((f = fopen(path, "r")) == NULL )
+      continue;
+    /* The command may hold spaces; the parent follows its closing paren */
+    if (fgets(line, sizeof line, f) != NULL
+        && (p = strrchr(line, ')')) != NULL
+        && sscanf(p + 1, " %*c %d", &ppid) == 1 && ppid == client)
+      children[n++] = atoi(entry->d_name);
+    fclose(f);
+  }
+  closedir(proc);
+  if (n == 0)
+    return 0;
+  return kill(children[rand_r(seed) % n], SIGKILL) == 0;
+}
+
+/**
+ * Counts the dump files left in the spool.
+ */
+static int spool_files() {
+  char path[1024];
+  struct dirent *entry;
+  int n = 0;
+  DIR *dir;
+
+  snprintf(path, sizeof path, "%s/spool", work);
+  if ((dir = opendir(path)) == NULL )
+    return -1;
+  while ((entry = readdir(dir)) != NULL )
+    if (strncmp(entry->d_name, "client-", 7) == 0)
+      ++n;
+  closedir(dir);
+  return n;
+}
+
+/**
+ * Counts the bytes of data in the store: live.dat and the dump files, not
+ * those set aside as duplicates.
+ */
+static uint64_t delivered() {
+  char path[1024];
+  struct dirent *entry;
+  struct stat st;
+  uint64_t total = 0;
+  size_t size;
+  DIR *dir;
+  int fd;
+
+  snprintf(path, sizeof path, "%s/store/live.dat", work);
+  if (stat(path, &st) == 0)
+    total += st.st_size;
+  snprintf(path, sizeof path, "%s/store", work);
+  if ((dir = opendir(path)) == NULL )
+    return total;
+  while ((entry = readdir(dir)) != NULL ) {
+    size_t len = strlen(entry->d_name);
+    if (strncmp(entry->d_name, "client-dump_", 12) != 0 || len < 4
+        || strcmp(entry->d_name + len - 4, ".dat") != 0)
+      continue;
+    snprintf(path, sizeof path, "%s/store/%s", work, entry->d_name);
+    if ((fd = open(path, O_RDONLY)) < 0)
+      continue;
+    if (pread(fd, &size, sizeof size, offsetof(Buffer, size)) == sizeof size)
+      total += size;
+    close(fd);
+  }
+  closedir(dir);
+  return total;
+}
+
+/**
+ * Gets the time in seconds.
+ */
+static double now_s() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Checks that the store holds every byte read exactly once, and prints the
+ * counts.
+ *
+ * @return 0 if it does, -1 otherwise
+ */
+static int verify() {
+  char path[1024];
+  Piece *pieces;
+  uint64_t bytes = 0;
+  unsigned long missing = 0, duplicates = 0, gaps = 0, corrupt = 0, dropped;
+  int n = 0, i, ok;
+
+  if ((pieces = (Piece*) malloc(MAX_PIECES * sizeof(Piece))) == NULL ) {
+    perror("malloc");
+    return -1;
+  }
+  if (read_pieces(pieces, &n) < 0) {
+    free(pieces);
+    return -1;
+  }
+  qsort(pieces, n, sizeof(Piece), &piece_order);
+
+  for (i = 0; i < n; ++i) {
+    const Piece *p = &pieces[i], *prev = i > 0 ? &pieces[i - 1] : NULL;
+    bytes += p->size;
+    if (p->bad) {
+      ++corrupt;
+      continue;
+    }
+    if (prev == NULL || prev->id >> 32 != p->id >> 32) {
+      missing += (p->id & 0xffffffff) - 1; /* the first of a run */
+      continue;
+    }
+    if (prev->id == p->id)
+      ++duplicates;
+    else if (prev->id + 1 < p->id)
+      missing += p->id - prev->id - 1;
+    else if (!prev->bad && prev->start + prev->size != p->start) {
+      fprintf(stderr, "Buffer %016" PRIx64 " starts at %" PRIu64
+          ", %" PRId64 " bytes after the one before it ended\n", p->id,
+          p->start, (int64_t) (p->start - prev->start - prev->size));
+      ++gaps;
+    }
+  }
+
+  snprintf(path, sizeof path, "%s/metrics", work);
+  dropped = metric(path, "dropped");
+  snprintf(path, sizeof path, "%s/flush.metrics", work);
+  dropped += metric(path, "dropped");
+  ok = n > 0 && duplicates == 0 && gaps == 0 && corrupt == 0
+      && missing <= dropped && spool_files() <= 0;
+  printf("verify buffers=%d bytes=%" PRIu64 " missing=%lu duplicates=%lu "
+      "gaps=%lu corrupt=%lu dropped=%lu spool_files=%d result=%s\n", n, bytes,
+      missing, duplicates, gaps, corrupt, dropped, spool_files(),
+      ok ? "ok" : "FAIL");
+  free(pieces);
+  return ok ? 0 : -1;
+}
+
+/**
+ * Reads the buffers in the store: live.dat, split by the live records of
+ * ids.dat, and the dump files.
+ */
+static int read_pieces(Piece *pieces, int *n) {
+  char path[1024];
+  struct dirent *entry;
+  Buffer *b;
+  Held h;
+  FILE *ids, *live;
+  DIR *dir;
+  int fd;
+
+  if ((b = (Buffer*) malloc(sizeof(Buffer))) == NULL ) {
+    perror("malloc");
+    return -1;
+  }
+  snprintf(path, sizeof path, "%s/store/ids.dat", work);
+  ids = fopen(path, "r");
+  snprintf(path, sizeof path, "%s/store/live.dat", work);
+  live = fopen(path, "r");
+  while (ids != NULL && live != NULL && fread(&h, sizeof h, 1, ids) == 1) {
+    if (h.where != 0)
+      continue;
+    if (h.bytes > sizeof b->data || fread(b->data, 1, h.bytes, live)
+        != h.bytes) {
+      fprintf(stderr, "live.dat is shorter than ids.dat accounts for\n");
+      break;
+    }
+    if (add_piece(pieces, n, h.id, b->data, h.bytes, 0) < 0)
+      break;
+  }
+  if (live != NULL && fgetc(live) != EOF)
+    fprintf(stderr, "live.dat holds more than ids.dat accounts for\n");
+  if (ids != NULL )
+    fclose(ids);
+  if (live != NULL )
+    fclose(live);
+
+  snprintf(path, sizeof path, "%s/store", work);
+  if ((dir = opendir(path)) == NULL ) {
+    perror(path);
+    free(b);
+    return -1;
+  }
+  while ((entry = readdir(dir)) != NULL ) {
+    size_t len = strlen(entry->d_name);
+    ssize_t got;
+    if (strncmp(entry->d_name, "client-dump_", 12) != 0 || len < 4
+        || strcmp(entry->d_name + len - 4, ".dat") != 0)
+      continue;
+    snprintf(path, sizeof path, "%s/store/%s", work, entry->d_name);
+    if ((fd = open(path, O_RDONLY)) < 0)
+      continue;
+    got = read(fd, b, sizeof(Buffer));
+    close(fd);
+    if (got != sizeof(Buffer) || b->size > sizeof b->data) {
+      fprintf(stderr, "%s is cut short\n", entry->d_name);
+      add_piece(pieces, n, got >= (ssize_t) offsetof(Buffer, data) ? b->id : 0,
+          NULL, 0, 1);
+      continue;
+    }
+    if (add_piece(pieces, n, b->id, b->data, b->size,
+        crc32c(0, b->data, b->size) != b->crc) < 0)
+      break;
+  }
+  closedir(dir);
+  free(b);
+  return 0;
+}
+
+/**
+ * Adds a buffer, finding where in the stream its data came from.
+ */
+static int add_piece(Piece *pieces, int *n, uint64_t id, const char *data,
+    uint32_t size, int bad) {
+  Piece *p;
+  uint32_t word, i;
+  int shift;
+
+  if (*n == MAX_PIECES) {
+    fprintf(stderr, "More than %d buffers\n", MAX_PIECES);
+    return -1;
+  }
+  p = &pieces[(*n)++];
+  p->id = id;
+  p->size = size;
+  p->start = 0;
+  p->bad = bad || size < 8;
+  if (p->bad)
+    return 0;
+
+  /* The buffer may start part way into a word */
+  for (shift = 0; shift < 4; ++shift) {
+    memcpy(&word, data + shift, 4);
+    p->start = (uint64_t) (le32toh(word) * PATTERN_INVERSE) * 4 - shift;
+    for (i = shift; i + 4 <= size; i += 4) {
+      memcpy(&word, data + i, 4);
+      if (le32toh(word) != (uint32_t) ((p->start + i) / 4) * PATTERN_STEP)
+        break;
+    }
+    if (i + 4 > size)
+      return 0;
+  }
+  fprintf(stderr, "Buffer %016" PRIx64 " does not follow the pattern\n", id);
+  p->bad = 1;
+  return 0;
+}
+
+/** Orders buffers by id */
+static int piece_order(const void *a, const void *b) {
+  uint64_t x = ((const Piece*) a)->id, y = ((const Piece*) b)->id;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Reads a count from the occupancy line of a metrics snapshot.
+ *
+ * @return The count, or 0 if there is none
+ */
+static unsigned long metric(const char *file, const char *key) {
+  char line[2048], *p;
+  size_t len = strlen(key);
+  unsigned long value = 0;
+  FILE *f;
+
+  if ((f = fopen(file, "r")) == NULL )
+    return 0;
+  while (fgets(line, sizeof line, f) != NULL )
+    if (strncmp(line, "occupancy ", 10) == 0)
+      for (p = strchr(line, ' '); p != NULL ; p = strchr(p + 1, ' '))
+        if (strncmp(p + 1, key, len) == 0 && p[len + 1] == '=')
+          value = strtoul(p + len + 2, NULL, 10);
+  fclose(f);
+  return value;
+}
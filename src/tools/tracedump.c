@@ -0,0 +1,155 @@
+/**
+ * @file tracedump.c
+ * Decodes a binary trace recorded by the client.
+ *
+ * The trace file (see trace.h) holds the most recent events recorded by the
+ * consumer and relay. tracedump prints them oldest first, one per line, with
+ * the time since the trace was created, or with -s a summary of each kind of
+ * event. It may be run while the client is still recording; records being
+ * written at that moment are skipped.
+ *
+ * @authors Larson, Patrick; Pickett, Cameron
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../shared/trace.h"
+
+/**
+ * How to print one kind of event.
+ */
+struct event_fmt_st {
+  const char *name; /**< Name of the event */
+  char who; /**< C for the consumer, R for the relay */
+  const char *fmt; /**< printf format of the two arguments */
+};
+
+static const struct event_fmt_st formats[TRACE_EVENTS] = {
+  [TRACE_READ] = { "read", 'C', "%llu bytes, buffer at %llu" },
+  [TRACE_SWITCH] = { "switch", 'C', "to buffer %llu with %llu bytes" },
+  [TRACE_DUMP] = { "dump", 'C', "buffer %llu, %llu since notify" },
+  [TRACE_UPLOAD] = { "upload", 'R', "%llu bytes in %llu us" },
+  [TRACE_UPLOAD_FAIL] = { "upload-fail", 'R', "curl error %llu after %llu us" },
+  [TRACE_RELEASE] = { "release", 'R', "buffer %llu, frame %llu" },
+  [TRACE_FRAME] = { "frame", 'R', "seq %llu, %llu bytes" },
+  [TRACE_ACK] = { "ack", 'R', "seq %llu, %llu in flight" },
+  [TRACE_BATCH] = { "batch", 'R', "%llu files, %llu bytes" },
+  [TRACE_CRC_ERROR] = { "crc-error", 'R', "buffer %lld, crc %08llx" },
+  [TRACE_OVERFLOW_WARN] = { "overflow", 'C', "in %lld ms, %llu bytes held" },
+  [TRACE_SPOOL] = { "spool", 'R', "buffer %llu, overflow in %lld ms" },
+  [TRACE_FAILOVER] = { "failover", 'R', "%llu buffers reclaimed in %llu us" },
+  [TRACE_COMPACT] = { "compact", 'R', "%llu dump files into %llu bytes" },
+  [TRACE_RESYNC] = { "resync", 'R', "after seq %lld, %llu packets found" },
+  [TRACE_CODEC] = { "codec", 'R', "codec %lld at %llu bytes/s buffered" },
+  [TRACE_BATCH_SIZE] = { "batch-size", 'R', "%lld buffers, rtt %llu us" },
+};
+
+static void usage();
+
+/**
+ * Main entrypoint into the trace decoder.
+ */
+int main(int argc, char *argv[]) {
+  unsigned long count[TRACE_EVENTS] = { 0 };
+  unsigned long long sum_a[TRACE_EVENTS] = { 0 }, sum_b[TRACE_EVENTS] = { 0 };
+  unsigned long long max_b[TRACE_EVENTS] = { 0 };
+  TraceHeader *h;
+  TraceRecord *ring;
+  FILE *in;
+  long size;
+  uint32_t first, i;
+  unsigned long skipped = 0;
+  int summary = 0, c, e;
+
+  while ((c = getopt(argc, argv, "sh")) != -1) {
+    switch (c) {
+    case 's':
+      summary = 1;
+      break;
+    default:
+      usage();
+      exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  }
+  if (optind != argc - 1) {
+    usage();
+    exit(EXIT_FAILURE);
+  }
+
+  if ((in = fopen(argv[optind], "rb")) == NULL ) {
+    perror("tracedump: fopen");
+    exit(EXIT_FAILURE);
+  }
+  fseek(in, 0, SEEK_END);
+  size = ftell(in);
+  rewind(in);
+  if (size < (long) sizeof(TraceHeader) || (h = malloc(size)) == NULL
+      || fread(h, 1, size, in) != (size_t) size) {
+    fprintf(stderr, "tracedump: could not read %s\n", argv[optind]);
+    exit(EXIT_FAILURE);
+  }
+  fclose(in);
+  if (h->magic != TRACE_MAGIC || h->version != TRACE_VERSION
+      || h->record_size != sizeof(TraceRecord)
+      || (h->records & (h->records - 1)) != 0
+      || size < (long) (sizeof(TraceHeader) + h->records * sizeof(TraceRecord))) {
+    fprintf(stderr, "tracedump: %s is not a trace\n", argv[optind]);
+    exit(EXIT_FAILURE);
+  }
+  ring = (TraceRecord*) (h + 1);
+
+  {
+    time_t start = h->start_real / 1000000000;
+    char when[64];
+    strftime(when, sizeof when, "%Y-%m-%d %H:%M:%S", localtime(&start));
+    printf("# trace started %s, %u events recorded\n", when, h->head);
+  }
+
+  first = h->head > h->records ? h->head - h->records : 0;
+  for (i = first; i != h->head; ++i) {
+    TraceRecord *rec = &ring[i & (h->records - 1)];
+    e = rec->event;
+    if (rec->seq != i + 1 || e <= 0 || e >= TRACE_EVENTS) {
+      ++skipped;
+      continue;
+    }
+    ++count[e];
+    sum_a[e] += rec->a;
+    sum_b[e] += rec->b;
+    if (rec->b > max_b[e])
+      max_b[e] = rec->b;
+    if (summary)
+      continue;
+    printf("%12.6f %c %5u %-11s ", (rec->time - h->start_mono) / 1e9,
+        formats[e].who, rec->pid, formats[e].name);
+    printf(formats[e].fmt, (unsigned long long) rec->a,
+        (unsigned long long) rec->b);
+    putchar('\n');
+  }
+
+  if (first > 0)
+    printf("# %u older events overwritten\n", first);
+  if (skipped > 0)
+    printf("# %lu events incomplete or overwritten while reading\n", skipped);
+  if (summary) {
+    printf("# %-11s %10s %16s %16s %12s\n", "event", "count", "sum a", "sum b",
+        "max b");
+    for (e = 1; e < TRACE_EVENTS; ++e)
+      if (count[e] > 0)
+        printf("  %-11s %10lu %16llu %16llu %12llu\n", formats[e].name,
+            count[e], sum_a[e], sum_b[e], max_b[e]);
+  }
+  free(h);
+  return EXIT_SUCCESS;
+}
+
+/** Print out help message */
+static void usage() {
+  fprintf(stderr, "Usage: tracedump [-s] <trace>\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "  -s  print a summary of each kind of event instead\n");
+}